@@ -27,6 +27,8 @@ MEDIA_FILE_TYPE_ENUM = {
     "WAV": MediaFileType.WAV,
     "MP3": MediaFileType.MP3,
     "FLAC": MediaFileType.FLAC,
+    "AAC": MediaFileType.AAC,
+    "PCM": MediaFileType.PCM,
 }
 
 
@@ -56,6 +56,10 @@ const char *media_player_file_type_to_string(MediaFileType file_type) {
       return "MP3";
     case MediaFileType::WAV:
       return "WAV";
+    case MediaFileType::AAC:
+      return "AAC";
+    case MediaFileType::PCM:
+      return "PCM";
     default:
       return "unknonw";
   }
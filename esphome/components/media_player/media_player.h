@@ -32,6 +32,8 @@ enum class MediaFileType : uint8_t {
   WAV,
   MP3,
   FLAC,
+  AAC,
+  PCM,  // Headerless 16 bit stereo audio at the media player's output sample rate, rendered at compile time
 };
 const char *media_player_file_type_to_string(MediaFileType file_type);
 
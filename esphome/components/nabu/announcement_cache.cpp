@@ -0,0 +1,130 @@
+#ifdef USE_ESP_IDF
+
+#include "announcement_cache.h"
+
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+// Initial buffer size for a recording; doubled whenever it fills
+static const size_t INITIAL_RECORDING_CAPACITY = 16 * 1024;
+
+CachedAnnouncement::CachedAnnouncement(const std::string &url, size_t max_length) {
+  this->url_ = url;
+  this->max_length_ = max_length;
+}
+
+CachedAnnouncement::~CachedAnnouncement() { this->free_buffer_(); }
+
+void CachedAnnouncement::append(const uint8_t *data, size_t length) {
+  if (this->overflowed_ || (length == 0)) {
+    return;
+  }
+
+  size_t required = this->length_ + length;
+  if (required > this->max_length_) {
+    this->overflowed_ = true;
+    this->free_buffer_();
+    return;
+  }
+
+  if (required > this->capacity_) {
+    size_t capacity = std::max(this->capacity_ * 2, INITIAL_RECORDING_CAPACITY);
+    capacity = std::min(std::max(capacity, required), this->max_length_);
+    if (!this->reallocate_(capacity)) {
+      this->overflowed_ = true;
+      this->free_buffer_();
+      return;
+    }
+  }
+
+  std::memcpy(this->data_ + this->length_, data, length);
+  this->length_ += length;
+}
+
+void CachedAnnouncement::shrink_to_fit() {
+  if (!this->overflowed_ && (this->capacity_ > this->length_)) {
+    // If the smaller allocation fails, the larger buffer is kept
+    this->reallocate_(this->length_);
+  }
+}
+
+bool CachedAnnouncement::reallocate_(size_t capacity) {
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  uint8_t *data = allocator.allocate(capacity);
+  if (data == nullptr) {
+    return false;
+  }
+
+  if (this->data_ != nullptr) {
+    std::memcpy(data, this->data_, this->length_);
+    allocator.deallocate(this->data_, this->capacity_);
+  }
+
+  this->data_ = data;
+  this->capacity_ = capacity;
+  return true;
+}
+
+void CachedAnnouncement::free_buffer_() {
+  if (this->data_ != nullptr) {
+    ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->data_, this->capacity_);
+    this->data_ = nullptr;
+  }
+  this->length_ = 0;
+  this->capacity_ = 0;
+}
+
+std::shared_ptr<const CachedAnnouncement> AnnouncementCache::find(const std::string &url) {
+  for (auto it = this->entries_.begin(); it != this->entries_.end(); ++it) {
+    if ((*it)->get_url() == url) {
+      // Move to the front of the list
+      this->entries_.splice(this->entries_.begin(), this->entries_, it);
+      ++this->hits_;
+      return this->entries_.front();
+    }
+  }
+
+  ++this->misses_;
+  return nullptr;
+}
+
+void AnnouncementCache::insert(std::unique_ptr<CachedAnnouncement> announcement) {
+  if ((announcement == nullptr) || !announcement->is_complete() || (announcement->get_length() == 0)) {
+    return;
+  }
+
+  announcement->shrink_to_fit();
+  size_t required = announcement->get_capacity();
+  if (required > this->max_size_) {
+    return;
+  }
+
+  // Replace an existing entry for the same url
+  for (auto it = this->entries_.begin(); it != this->entries_.end(); ++it) {
+    if ((*it)->get_url() == announcement->get_url()) {
+      this->size_ -= (*it)->get_capacity();
+      this->entries_.erase(it);
+      break;
+    }
+  }
+
+  // Evict the least recently used announcements. Any still playing are freed once their playback finishes.
+  while (this->size_ + required > this->max_size_) {
+    this->size_ -= this->entries_.back()->get_capacity();
+    this->entries_.pop_back();
+  }
+
+  this->size_ += required;
+  this->entries_.push_front(std::move(announcement));
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+
+namespace esphome {
+namespace nabu {
+
+// Audio of a played announcement, already converted to the mixer's format (stereo, at the output sample rate and bits
+// per sample). Stored in PSRAM.
+class CachedAnnouncement {
+ public:
+  /// @param url the announcement's url, used as the cache key
+  /// @param max_length the most bytes of audio to record; longer announcements aren't cached
+  CachedAnnouncement(const std::string &url, size_t max_length);
+  ~CachedAnnouncement();
+
+  /// @brief Appends audio, growing the buffer as needed. Once the audio doesn't fit (or the buffer can't grow), the
+  /// recording is incomplete and the buffer is freed.
+  void append(const uint8_t *data, size_t length);
+
+  /// @brief Reallocates the buffer to exactly fit the recorded audio
+  void shrink_to_fit();
+
+  /// @brief Whether all appended audio was recorded
+  bool is_complete() const { return !this->overflowed_; }
+
+  const std::string &get_url() const { return this->url_; }
+  const uint8_t *get_data() const { return this->data_; }
+  size_t get_length() const { return this->length_; }
+  /// @brief Bytes of PSRAM used by the buffer
+  size_t get_capacity() const { return this->capacity_; }
+
+ protected:
+  /// @brief Moves the audio to a newly allocated buffer
+  /// @return true if successful, false if the allocation failed
+  bool reallocate_(size_t capacity);
+
+  void free_buffer_();
+
+  std::string url_;
+
+  uint8_t *data_{nullptr};
+  size_t length_{0};
+  size_t capacity_{0};
+  size_t max_length_;
+
+  bool overflowed_{false};
+};
+
+// Least recently used cache of announcements, keyed by url. Repeated announcements (timer finished, error messages,
+// etc.) are played straight from the cache without reading, decoding, or resampling them again. Only accessed from the
+// main loop.
+class AnnouncementCache {
+ public:
+  /// @param max_size the most bytes of PSRAM used by all cached announcements
+  explicit AnnouncementCache(size_t max_size) : max_size_(max_size) {}
+
+  /// @brief Looks up an announcement and marks it as the most recently used. Counts the lookup as a hit or a miss.
+  /// @param url the announcement's url
+  /// @return shared_ptr to the announcement, or nullptr if it isn't cached. The audio stays valid while the
+  /// shared_ptr is held, even if the announcement is evicted.
+  std::shared_ptr<const CachedAnnouncement> find(const std::string &url);
+
+  /// @brief Adds a completely recorded announcement, evicting the least recently used ones to make room
+  void insert(std::unique_ptr<CachedAnnouncement> announcement);
+
+  size_t get_max_size() const { return this->max_size_; }
+  size_t get_size() const { return this->size_; }
+  size_t get_count() const { return this->entries_.size(); }
+  uint32_t get_hits() const { return this->hits_; }
+  uint32_t get_misses() const { return this->misses_; }
+
+ protected:
+  // Most recently used first
+  std::list<std::shared_ptr<const CachedAnnouncement>> entries_;
+
+  size_t max_size_;
+  size_t size_{0};
+
+  uint32_t hits_{0};
+  uint32_t misses_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,152 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_converter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+static const float F32_TO_S16_SCALE = 32768.0f;
+static const float F32_MAX_S16 = 32767.0f;
+static const float F32_MIN_S16 = -32768.0f;
+static const float F32_TO_S32_SCALE = 2147483648.0f;
+
+static inline uint32_t load_word(const uint8_t *data) {
+  // memcpy compiles to a single (unaligned) load and avoids strict aliasing issues
+  uint32_t word;
+  std::memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+static inline int16_t f32_to_s16(float sample) {
+  if (std::isnan(sample)) {
+    // std::min and std::max pass NaN through, and converting it to an integer is undefined
+    return 0;
+  }
+  float scaled = sample * F32_TO_S16_SCALE;
+  return static_cast<int16_t>(std::min(std::max(scaled, F32_MIN_S16), F32_MAX_S16));
+}
+
+static inline int32_t f32_to_s32(float sample) {
+  if (std::isnan(sample)) {
+    return 0;
+  }
+  // INT32_MAX isn't representable as a float, so clip before converting
+  float scaled = sample * F32_TO_S32_SCALE;
+  if (scaled >= F32_TO_S32_SCALE) {
+    return INT32_MAX;
+  }
+  if (scaled <= -F32_TO_S32_SCALE) {
+    return INT32_MIN;
+  }
+  return static_cast<int32_t>(scaled);
+}
+
+void convert_u8_to_s16(const uint8_t *__restrict input, int16_t *__restrict output, size_t samples) {
+  size_t i = 0;
+  for (; i + 4 <= samples; i += 4) {
+    // Flipping the top bit of each byte converts offset binary to two's complement
+    uint32_t word = load_word(input + i) ^ 0x80808080;
+    output[i] = static_cast<int16_t>((word & 0xFF) << 8);
+    output[i + 1] = static_cast<int16_t>(word & 0xFF00);
+    output[i + 2] = static_cast<int16_t>((word >> 8) & 0xFF00);
+    output[i + 3] = static_cast<int16_t>((word >> 16) & 0xFF00);
+  }
+  for (; i < samples; ++i) {
+    output[i] = static_cast<int16_t>((input[i] ^ 0x80) << 8);
+  }
+}
+
+void convert_s24_to_s16(const uint8_t *__restrict input, int16_t *__restrict output, size_t samples) {
+  size_t i = 0;
+  // Four packed 24 bit samples fit exactly in three 32 bit words. Keep the two most significant bytes of each sample.
+  //   word 0: [s0 lo][s0 mid][s0 hi][s1 lo]
+  //   word 1: [s1 mid][s1 hi][s2 lo][s2 mid]
+  //   word 2: [s2 hi][s3 lo][s3 mid][s3 hi]
+  for (; i + 4 <= samples; i += 4) {
+    const uint8_t *block = input + 3 * i;
+    uint32_t word0 = load_word(block);
+    uint32_t word1 = load_word(block + 4);
+    uint32_t word2 = load_word(block + 8);
+    output[i] = static_cast<int16_t>(word0 >> 8);
+    output[i + 1] = static_cast<int16_t>(word1);
+    output[i + 2] = static_cast<int16_t>((word1 >> 24) | (word2 << 8));
+    output[i + 3] = static_cast<int16_t>(word2 >> 16);
+  }
+  for (; i < samples; ++i) {
+    const uint8_t *sample = input + 3 * i;
+    output[i] = static_cast<int16_t>(sample[1] | (sample[2] << 8));
+  }
+}
+
+void convert_s32_to_s16(const uint8_t *__restrict input, int16_t *__restrict output, size_t samples) {
+  size_t i = 0;
+  for (; i + 4 <= samples; i += 4) {
+    output[i] = static_cast<int16_t>(load_word(input + 4 * i) >> 16);
+    output[i + 1] = static_cast<int16_t>(load_word(input + 4 * i + 4) >> 16);
+    output[i + 2] = static_cast<int16_t>(load_word(input + 4 * i + 8) >> 16);
+    output[i + 3] = static_cast<int16_t>(load_word(input + 4 * i + 12) >> 16);
+  }
+  for (; i < samples; ++i) {
+    output[i] = static_cast<int16_t>(load_word(input + 4 * i) >> 16);
+  }
+}
+
+void convert_f32_to_s16(const uint8_t *__restrict input, int16_t *__restrict output, size_t samples) {
+  size_t i = 0;
+  float block[4];
+  for (; i + 4 <= samples; i += 4) {
+    std::memcpy(block, input + 4 * i, sizeof(block));
+    output[i] = f32_to_s16(block[0]);
+    output[i + 1] = f32_to_s16(block[1]);
+    output[i + 2] = f32_to_s16(block[2]);
+    output[i + 3] = f32_to_s16(block[3]);
+  }
+  for (; i < samples; ++i) {
+    std::memcpy(block, input + 4 * i, sizeof(float));
+    output[i] = f32_to_s16(block[0]);
+  }
+}
+
+void convert_s24_to_s32(const uint8_t *__restrict input, int32_t *__restrict output, size_t samples) {
+  size_t i = 0;
+  // Same packing as convert_s24_to_s16, but each sample's three bytes become the top of the 32 bit sample
+  for (; i + 4 <= samples; i += 4) {
+    const uint8_t *block = input + 3 * i;
+    uint32_t word0 = load_word(block);
+    uint32_t word1 = load_word(block + 4);
+    uint32_t word2 = load_word(block + 8);
+    output[i] = static_cast<int32_t>(word0 << 8);
+    output[i + 1] = static_cast<int32_t>(((word0 >> 16) & 0xFF00) | (word1 << 16));
+    output[i + 2] = static_cast<int32_t>(((word1 >> 8) & 0xFFFF00) | (word2 << 24));
+    output[i + 3] = static_cast<int32_t>(word2 & 0xFFFFFF00);
+  }
+  for (; i < samples; ++i) {
+    const uint8_t *sample = input + 3 * i;
+    output[i] = static_cast<int32_t>((sample[0] << 8) | (sample[1] << 16) | (static_cast<uint32_t>(sample[2]) << 24));
+  }
+}
+
+void convert_f32_to_s32(const uint8_t *__restrict input, int32_t *__restrict output, size_t samples) {
+  size_t i = 0;
+  float block[4];
+  for (; i + 4 <= samples; i += 4) {
+    std::memcpy(block, input + 4 * i, sizeof(block));
+    output[i] = f32_to_s32(block[0]);
+    output[i + 1] = f32_to_s32(block[1]);
+    output[i + 2] = f32_to_s32(block[2]);
+    output[i + 3] = f32_to_s32(block[3]);
+  }
+  for (; i < samples; ++i) {
+    std::memcpy(block, input + 4 * i, sizeof(float));
+    output[i] = f32_to_s32(block[0]);
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nabu {
+
+// Converts the various PCM sample formats found in WAV files into the signed 16 bit samples used by the rest of the
+// pipeline, or into signed 32 bit samples when it runs at the higher precision. Each function processes four samples
+// per iteration using 32 bit word loads, which lets the compiler keep the loop body in registers and auto-vectorize it
+// on targets with SIMD support. The remaining samples are handled one at a time. Input buffers do not need to be
+// aligned. Samples are little endian.
+
+/// @brief Converts unsigned 8 bit PCM samples to signed 16 bit PCM samples
+/// @param input buffer holding the 8 bit samples
+/// @param output buffer to store the 16 bit samples; must not overlap the input buffer
+/// @param samples number of samples to convert
+void convert_u8_to_s16(const uint8_t *input, int16_t *output, size_t samples);
+
+/// @brief Converts packed (3 bytes per sample) signed 24 bit PCM samples to signed 16 bit PCM samples
+/// @param input buffer holding the 24 bit samples
+/// @param output buffer to store the 16 bit samples; must not overlap the input buffer
+/// @param samples number of samples to convert
+void convert_s24_to_s16(const uint8_t *input, int16_t *output, size_t samples);
+
+/// @brief Converts signed 32 bit PCM samples to signed 16 bit PCM samples
+/// @param input buffer holding the 32 bit samples
+/// @param output buffer to store the 16 bit samples; must not overlap the input buffer
+/// @param samples number of samples to convert
+void convert_s32_to_s16(const uint8_t *input, int16_t *output, size_t samples);
+
+/// @brief Converts 32 bit IEEE float PCM samples in the range [-1.0, 1.0] to signed 16 bit PCM samples. Out of range
+/// samples are clipped and NaN samples become silence.
+/// @param input buffer holding the float samples
+/// @param output buffer to store the 16 bit samples; must not overlap the input buffer
+/// @param samples number of samples to convert
+void convert_f32_to_s16(const uint8_t *input, int16_t *output, size_t samples);
+
+/// @brief Converts packed (3 bytes per sample) signed 24 bit PCM samples to signed 32 bit PCM samples
+/// @param input buffer holding the 24 bit samples
+/// @param output buffer to store the 32 bit samples; must not overlap the input buffer
+/// @param samples number of samples to convert
+void convert_s24_to_s32(const uint8_t *input, int32_t *output, size_t samples);
+
+/// @brief Converts 32 bit IEEE float PCM samples in the range [-1.0, 1.0] to signed 32 bit PCM samples. Out of range
+/// samples are clipped and NaN samples become silence.
+/// @param input buffer holding the float samples
+/// @param output buffer to store the 32 bit samples; must not overlap the input buffer
+/// @param samples number of samples to convert
+void convert_f32_to_s32(const uint8_t *input, int32_t *output, size_t samples);
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -2,40 +2,96 @@
 
 #include "audio_decoder.h"
 
-#include "mp3_decoder.h"
+#include "audio_converter.h"
 
-#include "esphome/core/ring_buffer.h"
+#include "mp3_decoder.h"
 
 namespace esphome {
 namespace nabu {
 
-static const size_t READ_WRITE_TIMEOUT_MS = 20;
+// An MP3 frame decodes to at most 1152 samples per channel
+static const size_t MAX_MP3_FRAME_OUTPUT_BYTES = 1152 * 2 * sizeof(int16_t);
+
+#ifdef USE_AUDIO_AAC_SUPPORT
+// An AAC frame decodes to 1024 samples per channel, doubled when HE-AAC's spectral band replication is used
+static const size_t MAX_AAC_FRAME_OUTPUT_BYTES = 2048 * 2 * sizeof(int16_t);
+static const size_t ADTS_HEADER_SIZE = 7;
+#endif
+
+// Frame header, CRC, and the largest side info block; MP3Decode parses these before checking the frame length
+static const size_t MP3_MIN_FRAME_HEADER_BYTES = 4 + 2 + 32;
+
+// Canonical WAV header used to resume a stream after seeking; the data chunk's size field is at the end
+static const size_t WAV_CANONICAL_HEADER_SIZE = 44;
+static const size_t WAV_DATA_SIZE_FIELD_OFFSET = 40;
+
+static const uint32_t MP3_TOC_ENTRIES = 100;
+static const uint32_t MP3_XING_FLAG_FRAMES = 0x01;
+static const uint32_t MP3_XING_FLAG_BYTES = 0x02;
+static const uint32_t MP3_XING_FLAG_TOC = 0x04;
+static const size_t MP3_VBRI_OFFSET = 4 + 32;  // The VBRI header always follows the MPEG 1 stereo side info
+static const size_t MP3_VBRI_TABLE_OFFSET = 26;
+
+static const uint16_t WAV_FORMAT_PCM = 0x0001;
+static const uint16_t WAV_FORMAT_IEEE_FLOAT = 0x0003;
+static const uint16_t WAV_FORMAT_EXTENSIBLE = 0xFFFE;
+
+static uint32_t read_be32(const uint8_t *data) {
+  return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static void write_le(uint8_t *data, uint32_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; ++i) {
+    data[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
 
-AudioDecoder::AudioDecoder(RingBuffer *input_ring_buffer, RingBuffer *output_ring_buffer, size_t internal_buffer_size) {
-  this->input_ring_buffer_ = input_ring_buffer;
-  this->output_ring_buffer_ = output_ring_buffer;
+// Walks the chunks of a parsed WAV header and returns the format tag stored in its fmt chunk. The wav_decoder library
+// doesn't expose the format tag, but it is needed to tell integer and IEEE float samples apart.
+static uint16_t find_wav_format_tag(const uint8_t *header, size_t header_length) {
+  size_t index = 12;  // Skip the RIFF chunk descriptor
+  while (index + 8 <= header_length) {
+    const uint8_t *chunk = header + index;
+    uint32_t chunk_size = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | (static_cast<uint32_t>(chunk[7]) << 24);
+
+    if ((std::memcmp(chunk, "fmt ", 4) == 0) && (index + 10 <= header_length)) {
+      uint16_t format_tag = chunk[8] | (chunk[9] << 8);
+      if ((format_tag == WAV_FORMAT_EXTENSIBLE) && (chunk_size >= 40) && (index + 34 <= header_length)) {
+        // The first two bytes of the sub format GUID hold the actual format tag
+        format_tag = chunk[32] | (chunk[33] << 8);
+      }
+      return format_tag;
+    }
+
+    index += 8 + chunk_size + (chunk_size & 1);  // Chunks are padded to an even size
+  }
+  return 0;
+}
+
+AudioDecoder::AudioDecoder(AudioPort *input_port, AudioPort *output_port, size_t internal_buffer_size) {
+  this->input_port_ = input_port;
+  this->output_port_ = output_port;
   this->internal_buffer_size_ = internal_buffer_size;
+  this->set_decode_batch_size(DEFAULT_DECODE_BATCH_SIZE);
 }
 
 AudioDecoder::~AudioDecoder() {
   ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
-  if (this->input_buffer_ != nullptr) {
-    allocator.deallocate(this->input_buffer_, this->internal_buffer_size_);
-  }
   if (this->output_buffer_ != nullptr) {
     allocator.deallocate(this->output_buffer_, this->internal_buffer_size_);
   }
 
-  if (this->flac_decoder_ != nullptr) {
-    this->flac_decoder_->free_buffers();
-    this->flac_decoder_.reset();  // Free the unique_ptr
-    this->flac_decoder_ = nullptr;
-  }
-
   if (this->media_file_type_ == media_player::MediaFileType::MP3) {
     MP3FreeDecoder(this->mp3_decoder_);
   }
 
+#ifdef USE_AUDIO_AAC_SUPPORT
+  if (this->aac_decoder_ != nullptr) {
+    AACFreeDecoder(this->aac_decoder_);
+    this->aac_decoder_ = nullptr;
+  }
+#endif
+
   if (this->wav_decoder_ != nullptr) {
     this->wav_decoder_.reset();  // Free the unique_ptr
     this->wav_decoder_ = nullptr;
@@ -51,26 +107,60 @@ esp_err_t AudioDecoder::start(media_player::MediaFileType media_file_type) {
 
   this->media_file_type_ = media_file_type;
 
-  this->input_buffer_current_ = this->input_buffer_;
-  this->input_buffer_length_ = 0;
+  if (!this->input_transfer_buffer_->is_external_data()) {
+    this->input_transfer_buffer_->clear_buffered_data();
+  }
+  this->input_bytes_needed_ = 0;
   this->output_buffer_current_ = this->output_buffer_;
   this->output_buffer_length_ = 0;
 
-  this->potentially_failed_count_ = 0;
   this->end_of_file_ = false;
+  this->flush_output_ = false;
+  this->pcm_passthrough_ = false;
+  this->output_sample_size_ = sizeof(int16_t);
+
+  this->rate_input_bytes_ = 0;
+  this->rate_output_bytes_ = 0;
+  this->wav_byte_rate_ = 0;
+
+  this->seek_index_.reset();
+  this->seek_index_ready_ = false;
+  if (this->stream_length_ > 0) {
+    this->seek_index_ = make_unique<SeekIndex>();
+  }
 
   switch (this->media_file_type_) {
     case media_player::MediaFileType::FLAC:
-      this->flac_decoder_ = make_unique<flac::FLACDecoder>(this->input_buffer_);
+      this->flac_decoder_ = make_unique<FLACDecoder>();
+      if (this->seek_index_ != nullptr) {
+        this->flac_decoder_->set_seek_point_callback([this](uint64_t sample_number, uint64_t offset) {
+          uint32_t sample_rate = this->flac_decoder_->get_sample_rate();
+          if (sample_rate > 0) {
+            this->seek_index_->add_point(sample_number * 1000 / sample_rate, offset);
+          }
+        });
+      }
       break;
     case media_player::MediaFileType::MP3:
       this->mp3_decoder_ = MP3InitDecoder();
       break;
     case media_player::MediaFileType::WAV:
-      this->wav_decoder_ = make_unique<wav_decoder::WAVDecoder>(&this->input_buffer_current_);
+      this->wav_decoder_ = make_unique<wav_decoder::WAVDecoder>(&this->wav_header_current_);
       this->wav_decoder_->reset();
       break;
+#ifdef USE_AUDIO_AAC_SUPPORT
+    case media_player::MediaFileType::AAC:
+      this->aac_decoder_ = AACInitDecoder();
+      if (this->aac_decoder_ == nullptr) {
+        return ESP_ERR_NO_MEM;
+      }
+      // The container is determined once the first bytes arrive
+      this->aac_container_ = AACContainer::UNKNOWN;
+      this->m4a_demuxer_.reset();
+      break;
+#endif
     case media_player::MediaFileType::NONE:
+    default:
       return ESP_ERR_NOT_SUPPORTED;
       break;
   }
@@ -78,203 +168,475 @@ esp_err_t AudioDecoder::start(media_player::MediaFileType media_file_type) {
   return ESP_OK;
 }
 
-AudioDecoderState AudioDecoder::decode(bool stop_gracefully) {
-  if (stop_gracefully) {
-    if (this->output_buffer_length_ == 0) {
-      // If the file decoder believes it the end of file
-      if (this->end_of_file_) {
-        return AudioDecoderState::FINISHED;
-      }
-      // If all the internal buffers are empty, the decoding is done
-      if ((this->input_ring_buffer_->available() == 0) && (this->input_buffer_length_ == 0)) {
-        return AudioDecoderState::FINISHED;
+AudioDecoderState AudioDecoder::decode(bool input_ended) {
+  while (true) {
+    if ((this->output_buffer_length_ > 0) &&
+        (this->flush_output_ || this->end_of_file_ || this->is_output_batch_full_())) {
+      // Have a batch of decoded data, write it to the output port
+      this->flush_output_ = true;
+
+      if (this->output_port_ == nullptr) {
+        // Hold the batch until the output port is set
+        return AudioDecoderState::DECODING;
       }
-    }
-  }
 
-  if (this->potentially_failed_count_ > 10) {
-    return AudioDecoderState::FAILED;
-  }
+      size_t bytes_written = this->output_port_->write(this->output_buffer_current_, this->output_buffer_length_);
+      NABU_LATENCY_TRACE(this->latency_tracer_, on_output(TraceStage::DECODER, bytes_written));
 
-  FileDecoderState state = FileDecoderState::MORE_TO_PROCESS;
+      this->output_buffer_length_ -= bytes_written;
+      this->output_buffer_current_ += bytes_written;
 
-  while (state == FileDecoderState::MORE_TO_PROCESS) {
-    if (this->output_buffer_length_ > 0) {
-      // Have decoded data, write it to the output ring buffer
+      if (this->output_buffer_length_ > 0) {
+        return AudioDecoderState::WAITING_FOR_SPACE;
+      }
 
-      size_t bytes_to_write = this->output_buffer_length_;
+      // The whole batch was written, start the next one at the beginning of the output buffer
+      this->flush_output_ = false;
+      this->output_buffer_current_ = this->output_buffer_;
+      continue;
+    }
 
-      if (bytes_to_write > 0) {
-        size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-            (void *) this->output_buffer_current_, bytes_to_write, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+    if (this->end_of_file_) {
+      return AudioDecoderState::FINISHED;
+    }
+    if (this->pcm_passthrough_) {
+      // The rest of the stream is PCM that the next stage reads directly from the input port
+      return AudioDecoderState::PASSTHROUGH;
+    }
 
-        this->output_buffer_length_ -= bytes_written;
-        this->output_buffer_current_ += bytes_written;
-      }
+    // Only refill once the decoder needs more input than it has. Refilling less often lets the transfer buffer consume
+    // most of its data before it has to move the remaining partial frame back to the start.
+    const size_t bytes_needed = std::max<size_t>(this->input_bytes_needed_, 1);
+    bool refill = this->input_transfer_buffer_->available() < bytes_needed;
+    if ((this->media_file_type_ == media_player::MediaFileType::FLAC) && this->audio_stream_info_.has_value() &&
+        (this->input_transfer_buffer_->available() < this->flac_decoder_->get_max_frame_size())) {
+      // Top up before a frame could be cut short; decoding a truncated FLAC frame only to redo it is expensive
+      refill = true;
+    }
+
+    if (refill) {
+      // A refill may only use the space after the buffered window; the next one moves the window to make more room
+      size_t bytes_read;
+      do {
+        bytes_read = this->input_transfer_buffer_->transfer_data_from_source();
+        NABU_LATENCY_TRACE(this->latency_tracer_, on_input(TraceStage::DECODER, bytes_read));
+      } while ((bytes_read > 0) && (this->input_transfer_buffer_->available() < bytes_needed));
+    }
 
+    size_t bytes_available = this->input_transfer_buffer_->available();
+    if (bytes_available < bytes_needed) {
       if (this->output_buffer_length_ > 0) {
-        // Output buffer still has decoded audio to write
-        return AudioDecoderState::DECODING;
+        // Write the partial batch instead of holding it while waiting for input
+        this->flush_output_ = true;
+        continue;
       }
-    } else {
-      // Decode more data
 
-      // Shift unread data in input buffer to start
-      if (this->input_buffer_length_ > 0) {
-        memmove(this->input_buffer_, this->input_buffer_current_, this->input_buffer_length_);
+      bool input_complete = this->input_transfer_buffer_->is_external_data() ||
+                            (input_ended && (this->input_port_->available() == 0));
+      if (input_complete) {
+        // Trailing bytes that don't form a frame, e.g., an ID3v1 tag or a truncated last frame, end a stream that
+        // already played; a stream without any audio failed
+        return ((bytes_available == 0) || this->audio_stream_info_.has_value()) ? AudioDecoderState::FINISHED
+                                                                                : AudioDecoderState::FAILED;
+      }
+      if (bytes_needed > this->input_transfer_buffer_->capacity()) {
+        // The input buffer can never hold enough data
+        return AudioDecoderState::FAILED;
       }
-      this->input_buffer_current_ = this->input_buffer_;
+      return AudioDecoderState::WAITING_FOR_INPUT;
+    }
 
-      // read in new ring buffer data to fill the remaining input buffer
-      size_t bytes_read = 0;
+    // Headers and metadata before the stream information don't count towards the byte rate, and WAV files have it in
+    // their header
+    bool measure_rate = this->audio_stream_info_.has_value() && (this->wav_byte_rate_ == 0);
+    size_t output_length_before = this->output_buffer_length_;
 
-      size_t bytes_to_read = this->internal_buffer_size_ - this->input_buffer_length_;
+    FileDecoderState state = FileDecoderState::FAILED;
+    switch (this->media_file_type_) {
+      case media_player::MediaFileType::FLAC:
+        state = this->decode_flac_();
+        break;
+      case media_player::MediaFileType::MP3:
+        state = this->decode_mp3_();
+        break;
+      case media_player::MediaFileType::WAV:
+        state = this->decode_wav_();
+        break;
+#ifdef USE_AUDIO_AAC_SUPPORT
+      case media_player::MediaFileType::AAC:
+        state = this->decode_aac_();
+        break;
+#endif
+      case media_player::MediaFileType::NONE:
+      default:
+        break;
+    }
 
-      if (bytes_to_read > 0) {
-        uint8_t *new_audio_data = this->input_buffer_ + this->input_buffer_length_;
-        bytes_read = this->input_ring_buffer_->read((void *) new_audio_data, bytes_to_read,
-                                                    pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+    if (measure_rate) {
+      // The decoders only consume input and append to the output buffer
+      this->rate_input_bytes_ += bytes_available - this->input_transfer_buffer_->available();
+      this->rate_output_bytes_ += this->output_buffer_length_ - output_length_before;
+    }
 
-        this->input_buffer_length_ += bytes_read;
-      }
+    switch (state) {
+      case FileDecoderState::MORE_TO_PROCESS:
+        this->input_bytes_needed_ = 0;
+        break;
+      case FileDecoderState::NEED_MORE_INPUT:
+        // The file decoder set how much buffered input it needs
+        break;
+      case FileDecoderState::END_OF_FILE:
+        this->end_of_file_ = true;
+        break;
+      case FileDecoderState::FAILED:
+        return AudioDecoderState::FAILED;
+    }
+  }
+}
 
-      if ((this->input_buffer_length_ == 0) || ((this->potentially_failed_count_ > 0) && (bytes_read == 0))) {
-        if ((this->input_buffer_length_ && stop_gracefully) || bytes_to_read == 0) {
-          // data in buffer won't change, don't try again
-          state = FileDecoderState::FAILED;
-        } else {
-          state = FileDecoderState::IDLE;
-        }
-      } else {
-        switch (this->media_file_type_) {
-          case media_player::MediaFileType::FLAC:
-            state = this->decode_flac_();
-            break;
-          case media_player::MediaFileType::MP3:
-            state = this->decode_mp3_();
-            break;
-          case media_player::MediaFileType::WAV:
-            state = this->decode_wav_();
-            break;
-          case media_player::MediaFileType::NONE:
-            state = FileDecoderState::IDLE;
-            break;
-        }
+size_t AudioDecoder::get_input_bytes_needed() const {
+  size_t bytes_needed = std::max<size_t>(this->input_bytes_needed_, 1);
+  size_t bytes_available = this->input_transfer_buffer_->available();
+  return (bytes_needed > bytes_available) ? (bytes_needed - bytes_available) : 0;
+}
+
+FileDecoderState AudioDecoder::need_input_(size_t bytes) {
+  // The file decoder couldn't continue with what is buffered, so it always needs at least one more byte
+  this->input_bytes_needed_ = std::max(bytes, this->input_transfer_buffer_->available() + 1);
+  return FileDecoderState::NEED_MORE_INPUT;
+}
+
+uint32_t AudioDecoder::get_encoded_byte_rate() const {
+  if (this->wav_byte_rate_ > 0) {
+    return this->wav_byte_rate_;
+  }
+  if (!this->audio_stream_info_.has_value() || (this->rate_output_bytes_ == 0)) {
+    return 0;
+  }
+
+  const audio::AudioStreamInfo &stream_info = this->audio_stream_info_.value();
+  uint64_t decoded_byte_rate =
+      static_cast<uint64_t>(stream_info.sample_rate) * stream_info.channels * stream_info.get_bytes_per_sample();
+  return static_cast<uint32_t>(this->rate_input_bytes_ * decoded_byte_rate / this->rate_output_bytes_);
+}
+
+std::unique_ptr<SeekIndex> AudioDecoder::release_seek_index() {
+  if (!this->seek_index_ready_) {
+    return nullptr;
+  }
+  this->seek_index_ready_ = false;
+  return std::move(this->seek_index_);
+}
+
+void AudioDecoder::set_decode_batch_size(size_t decode_batch_size) {
+  this->decode_batch_size_ = std::min(decode_batch_size, this->internal_buffer_size_);
+}
+
+bool AudioDecoder::is_output_batch_full_() {
+  if (this->output_buffer_length_ >= this->decode_batch_size_) {
+    return true;
+  }
+
+  // Worst case number of bytes the next decoded frame could add to the output buffer
+  size_t max_frame_bytes = 0;
+  switch (this->media_file_type_) {
+    case media_player::MediaFileType::FLAC:
+      if (this->audio_stream_info_.has_value()) {
+        max_frame_bytes = this->flac_decoder_->get_output_buffer_size() * this->output_sample_size_;
       }
-    }
-    if (state == FileDecoderState::POTENTIALLY_FAILED) {
-      ++this->potentially_failed_count_;
-    } else if (state == FileDecoderState::END_OF_FILE) {
-      this->end_of_file_ = true;
-    } else if (state == FileDecoderState::FAILED) {
-      return AudioDecoderState::FAILED;
-    } else if (state == FileDecoderState::MORE_TO_PROCESS) {
-      this->potentially_failed_count_ = 0;
-    }
+      break;
+    case media_player::MediaFileType::MP3:
+      max_frame_bytes = MAX_MP3_FRAME_OUTPUT_BYTES;
+      break;
+#ifdef USE_AUDIO_AAC_SUPPORT
+    case media_player::MediaFileType::AAC:
+      max_frame_bytes = MAX_AAC_FRAME_OUTPUT_BYTES;
+      break;
+#endif
+    default:
+      // WAV conversion fills whatever space is left
+      break;
   }
-  return AudioDecoderState::DECODING;
+
+  return (this->internal_buffer_size_ - this->output_buffer_length_) < std::max<size_t>(max_frame_bytes, 1);
+}
+
+void AudioDecoder::set_input_data(const uint8_t *data, size_t length) {
+  this->input_transfer_buffer_ = AudioSourceTransferBuffer::create_for_data(data, length);
 }
 
 esp_err_t AudioDecoder::allocate_buffers_() {
   ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
 
-  if (this->input_buffer_ == nullptr)
-    this->input_buffer_ = allocator.allocate(this->internal_buffer_size_);
+  if (this->input_transfer_buffer_ == nullptr) {
+    this->input_transfer_buffer_ = AudioSourceTransferBuffer::create(this->internal_buffer_size_);
+    if (this->input_transfer_buffer_ != nullptr) {
+      this->input_transfer_buffer_->set_source(this->input_port_);
+    }
+  }
 
   if (this->output_buffer_ == nullptr)
     this->output_buffer_ = allocator.allocate(this->internal_buffer_size_);
 
-  if ((this->input_buffer_ == nullptr) || (this->output_buffer_ == nullptr)) {
+  if ((this->input_transfer_buffer_ == nullptr) || (this->output_buffer_ == nullptr)) {
     return ESP_ERR_NO_MEM;
   }
 
   return ESP_OK;
 }
 
+void AudioDecoder::create_mp3_seek_index_(const uint8_t *frame, size_t frame_length, size_t frame_offset,
+                                          const MP3FrameInfo &frame_info) {
+  if ((this->seek_index_ == nullptr) || (this->stream_length_ <= frame_offset) || (frame_info.samprate <= 0)) {
+    return;
+  }
+
+  // Read the layout from the frame header, as the libhelix version enumeration differs between its ports
+  bool mpeg1 = ((frame[1] >> 3) & 0x03) == 0x03;
+  bool has_crc = (frame[1] & 0x01) == 0;
+  bool mono = (frame[3] >> 6) == 0x03;
+  uint32_t samples_per_frame = mpeg1 ? 1152 : 576;
+  size_t side_info_size = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+  size_t xing_offset = 4 + (has_crc ? 2 : 0) + side_info_size;
+
+  uint64_t audio_length = this->stream_length_ - frame_offset;
+  uint64_t duration_ms = 0;
+
+  if ((frame_length >= xing_offset + 8) &&
+      ((std::memcmp(frame + xing_offset, "Xing", 4) == 0) || (std::memcmp(frame + xing_offset, "Info", 4) == 0))) {
+    // Xing/Info header of a VBR or CBR file written by LAME and most other encoders
+    uint32_t flags = read_be32(frame + xing_offset + 4);
+    size_t index = xing_offset + 8;
+    uint32_t frames = 0;
+    if ((flags & MP3_XING_FLAG_FRAMES) && (index + 4 <= frame_length)) {
+      frames = read_be32(frame + index);
+      index += 4;
+    }
+    if ((flags & MP3_XING_FLAG_BYTES) && (index + 4 <= frame_length)) {
+      uint32_t bytes = read_be32(frame + index);
+      if (bytes > 0) {
+        audio_length = std::min<uint64_t>(audio_length, bytes);
+      }
+      index += 4;
+    }
+    duration_ms = static_cast<uint64_t>(frames) * samples_per_frame * 1000 / frame_info.samprate;
+
+    if ((flags & MP3_XING_FLAG_TOC) && (index + MP3_TOC_ENTRIES <= frame_length)) {
+      // Each entry is the position at that percentage of the duration, in 1/256ths of the audio length
+      for (uint32_t i = 1; i < MP3_TOC_ENTRIES; ++i) {
+        this->seek_index_->add_point(duration_ms * i / MP3_TOC_ENTRIES, audio_length * frame[index + i] / 256);
+      }
+    }
+  } else if ((frame_length >= MP3_VBRI_OFFSET + MP3_VBRI_TABLE_OFFSET) &&
+             (std::memcmp(frame + MP3_VBRI_OFFSET, "VBRI", 4) == 0)) {
+    // VBRI header written by the Fraunhofer encoder
+    const uint8_t *vbri = frame + MP3_VBRI_OFFSET;
+    uint32_t bytes = read_be32(vbri + 10);
+    uint32_t frames = read_be32(vbri + 14);
+    uint32_t entries = (vbri[18] << 8) | vbri[19];
+    uint32_t scale = (vbri[20] << 8) | vbri[21];
+    uint32_t entry_size = (vbri[22] << 8) | vbri[23];
+    uint32_t frames_per_entry = (vbri[24] << 8) | vbri[25];
+
+    if (bytes > 0) {
+      audio_length = std::min<uint64_t>(audio_length, bytes);
+    }
+    duration_ms = static_cast<uint64_t>(frames) * samples_per_frame * 1000 / frame_info.samprate;
+
+    const uint8_t *entry = vbri + MP3_VBRI_TABLE_OFFSET;
+    uint64_t offset = 0;
+    for (uint32_t i = 0; (i < entries) && (entry_size >= 1) && (entry_size <= 4) &&
+                         (entry + entry_size <= frame + frame_length);
+         ++i) {
+      uint32_t value = 0;
+      for (uint32_t byte = 0; byte < entry_size; ++byte) {
+        value = (value << 8) | entry[byte];
+      }
+      entry += entry_size;
+      offset += static_cast<uint64_t>(value) * scale;
+
+      uint64_t time_ms = static_cast<uint64_t>(i + 1) * frames_per_entry * samples_per_frame * 1000 /
+                         frame_info.samprate;
+      this->seek_index_->add_point(time_ms, offset);
+    }
+  } else if (frame_info.bitrate > 0) {
+    // Constant bit rate; positions are proportional to time
+    duration_ms = audio_length * 8 * 1000 / frame_info.bitrate;
+  }
+
+  if ((duration_ms > 0) && (duration_ms <= UINT32_MAX)) {
+    // Frames are self contained, so no header is needed to resume decoding
+    this->seek_index_->set_audio_data(frame_offset, audio_length, duration_ms);
+    this->seek_index_ready_ = true;
+  }
+}
+
+void AudioDecoder::create_wav_seek_index_(size_t audio_start) {
+  if ((this->seek_index_ == nullptr) || (this->wav_sample_format_ == WAVSampleFormat::UNSUPPORTED) ||
+      (this->stream_length_ <= audio_start)) {
+    return;
+  }
+
+  uint32_t channels = this->wav_decoder_->num_channels();
+  uint32_t sample_rate = this->wav_decoder_->sample_rate();
+  uint32_t bits_per_sample = this->wav_decoder_->bits_per_sample();
+  uint32_t block_align = channels * (bits_per_sample / 8);
+  uint32_t byte_rate = sample_rate * block_align;
+  if (byte_rate == 0) {
+    return;
+  }
+
+  // The original header may hold chunks that aren't needed to decode, so resume with a minimal header instead
+  uint8_t header[WAV_CANONICAL_HEADER_SIZE];
+  std::memcpy(header, "RIFF", 4);
+  write_le(header + 4, WAV_CANONICAL_HEADER_SIZE - 8 + this->wav_bytes_left_, 4);
+  std::memcpy(header + 8, "WAVEfmt ", 8);
+  write_le(header + 16, 16, 4);
+  write_le(header + 20, (this->wav_sample_format_ == WAVSampleFormat::F32) ? WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM,
+           2);
+  write_le(header + 22, channels, 2);
+  write_le(header + 24, sample_rate, 4);
+  write_le(header + 28, byte_rate, 4);
+  write_le(header + 32, block_align, 2);
+  write_le(header + 34, bits_per_sample, 2);
+  std::memcpy(header + 36, "data", 4);
+  write_le(header + WAV_DATA_SIZE_FIELD_OFFSET, this->wav_bytes_left_, 4);
+
+  uint64_t audio_length = std::min<uint64_t>(this->wav_bytes_left_, this->stream_length_ - audio_start);
+
+  this->seek_index_->set_header(header, WAV_CANONICAL_HEADER_SIZE, WAV_DATA_SIZE_FIELD_OFFSET);
+  this->seek_index_->set_alignment(block_align);
+  this->seek_index_->set_audio_data(audio_start, audio_length, audio_length * 1000 / byte_rate);
+  this->seek_index_ready_ = true;
+}
+
 FileDecoderState AudioDecoder::decode_flac_() {
   if (!this->audio_stream_info_.has_value()) {
     // Header hasn't been read
-    auto result = this->flac_decoder_->read_header(this->input_buffer_length_);
-
-    if (result == flac::FLAC_DECODER_HEADER_OUT_OF_DATA) {
-      return FileDecoderState::POTENTIALLY_FAILED;
+    size_t bytes_consumed = 0;
+    auto result = this->flac_decoder_->read_header(this->input_transfer_buffer_->get_buffer_start(),
+                                                   this->input_transfer_buffer_->available(), &bytes_consumed);
+    this->input_transfer_buffer_->decrease_buffer_length(bytes_consumed);
+
+    if (result == FLACDecoderResult::OUT_OF_DATA) {
+      // Large metadata blocks are skipped as they arrive, so more input is only needed once nothing was consumed
+      return (bytes_consumed > 0) ? FileDecoderState::MORE_TO_PROCESS
+                                  : this->need_input_(this->input_transfer_buffer_->available() + 1);
     }
 
-    if (result != flac::FLAC_DECODER_SUCCESS) {
+    if (result != FLACDecoderResult::SUCCESS) {
       // Couldn't read FLAC header
       return FileDecoderState::FAILED;
     }
 
-    size_t bytes_consumed = this->flac_decoder_->get_bytes_index();
-    this->input_buffer_current_ += bytes_consumed;
-    this->input_buffer_length_ = this->flac_decoder_->get_bytes_left();
+    if ((this->max_bits_per_sample_ >= 32) && (this->flac_decoder_->get_sample_depth() > 16)) {
+      // Keep the precision the 16 bit output would drop
+      this->output_sample_size_ = sizeof(int32_t);
+    }
 
     size_t flac_decoder_output_buffer_min_size = flac_decoder_->get_output_buffer_size();
-    if (this->internal_buffer_size_ < flac_decoder_output_buffer_min_size * sizeof(int16_t)) {
+    if (this->internal_buffer_size_ < flac_decoder_output_buffer_min_size * this->output_sample_size_) {
       // Output buffer is not big enough
       return FileDecoderState::FAILED;
     }
 
+    uint64_t total_samples = this->flac_decoder_->get_total_samples();
+    size_t audio_start = this->input_transfer_buffer_->get_bytes_consumed();
+    if ((this->seek_index_ != nullptr) && (total_samples > 0) && (this->stream_length_ > audio_start)) {
+      uint8_t header[FLAC_MINIMAL_HEADER_SIZE];
+      this->flac_decoder_->get_minimal_header(header);
+      this->seek_index_->set_header(header, FLAC_MINIMAL_HEADER_SIZE);
+      this->seek_index_->set_audio_data(audio_start, this->stream_length_ - audio_start,
+                                        total_samples * 1000 / this->flac_decoder_->get_sample_rate());
+      this->seek_index_ready_ = true;
+    }
+
     audio::AudioStreamInfo audio_stream_info;
     audio_stream_info.channels = this->flac_decoder_->get_num_channels();
     audio_stream_info.sample_rate = this->flac_decoder_->get_sample_rate();
-    audio_stream_info.bits_per_sample = this->flac_decoder_->get_sample_depth();
+    // The decoder scales every sample depth to the output sample size
+    audio_stream_info.bits_per_sample = 8 * this->output_sample_size_;
 
     this->audio_stream_info_ = audio_stream_info;
 
     return FileDecoderState::MORE_TO_PROCESS;
   }
 
+  // Append the decoded frame to the batch in the output buffer
+  size_t bytes_consumed = 0;
   uint32_t output_samples = 0;
-  auto result =
-      this->flac_decoder_->decode_frame(this->input_buffer_length_, (int16_t *) this->output_buffer_, &output_samples);
+  const uint8_t *input = this->input_transfer_buffer_->get_buffer_start();
+  size_t input_length = this->input_transfer_buffer_->available();
+  uint8_t *output = this->output_buffer_ + this->output_buffer_length_;
+  FLACDecoderResult result;
+  if (this->output_sample_size_ == sizeof(int32_t)) {
+    result = this->flac_decoder_->decode_frame(input, input_length, reinterpret_cast<int32_t *>(output),
+                                               &bytes_consumed, &output_samples);
+  } else {
+    result = this->flac_decoder_->decode_frame(input, input_length, reinterpret_cast<int16_t *>(output),
+                                               &bytes_consumed, &output_samples);
+  }
 
-  if (result == flac::FLAC_DECODER_ERROR_OUT_OF_DATA) {
-    // Not an issue, just needs more data that we'll get next time.
-    return FileDecoderState::POTENTIALLY_FAILED;
-  } else if (result > flac::FLAC_DECODER_ERROR_OUT_OF_DATA) {
-    // Corrupted frame, don't retry with current buffer content, wait for new sync
-    size_t bytes_consumed = this->flac_decoder_->get_bytes_index();
-    this->input_buffer_current_ += bytes_consumed;
-    this->input_buffer_length_ = this->flac_decoder_->get_bytes_left();
+  // Skipped bytes before a frame and corrupted frames are consumed too, so the next call searches for a new sync code
+  this->input_transfer_buffer_->decrease_buffer_length(bytes_consumed);
 
-    return FileDecoderState::POTENTIALLY_FAILED;
+  if (result == FLACDecoderResult::OUT_OF_DATA) {
+    // The frame continues past the buffered data
+    return this->need_input_(this->input_transfer_buffer_->available() + 1);
+  }
+  if ((result != FLACDecoderResult::SUCCESS) && (result != FLACDecoderResult::END_OF_STREAM)) {
+    // A corrupted frame was skipped, so decoding continues with the next one. An error that consumed nothing would
+    // only repeat.
+    return (bytes_consumed > 0) ? FileDecoderState::MORE_TO_PROCESS : FileDecoderState::FAILED;
   }
 
   // We have successfully decoded some input data and have new output data
-  size_t bytes_consumed = this->flac_decoder_->get_bytes_index();
-  this->input_buffer_current_ += bytes_consumed;
-  this->input_buffer_length_ = this->flac_decoder_->get_bytes_left();
+  this->output_buffer_length_ += output_samples * this->output_sample_size_;
 
-  this->output_buffer_current_ = this->output_buffer_;
-  this->output_buffer_length_ = output_samples * sizeof(int16_t);
-
-  if (result == flac::FLAC_DECODER_NO_MORE_FRAMES) {
+  if (result == FLACDecoderResult::END_OF_STREAM) {
     return FileDecoderState::END_OF_FILE;
   }
 
-  return FileDecoderState::IDLE;
+  return FileDecoderState::MORE_TO_PROCESS;
 }
 
 FileDecoderState AudioDecoder::decode_mp3_() {
   // Look for the next sync word
-  int32_t offset = MP3FindSyncWord(this->input_buffer_current_, this->input_buffer_length_);
+  int32_t offset =
+      MP3FindSyncWord(this->input_transfer_buffer_->get_buffer_start(), this->input_transfer_buffer_->available());
   if (offset < 0) {
-    // We may recover if we have more data
-    return FileDecoderState::POTENTIALLY_FAILED;
+    // The sync word may be in the data that hasn't arrived yet
+    return this->need_input_(this->input_transfer_buffer_->available() + 1);
   }
 
-  // Advance read pointer
-  this->input_buffer_current_ += offset;
-  this->input_buffer_length_ -= offset;
+  // Skip to the sync word
+  this->input_transfer_buffer_->decrease_buffer_length(offset);
 
-  int err = MP3Decode(this->mp3_decoder_, &this->input_buffer_current_, (int *) &this->input_buffer_length_,
-                      (int16_t *) this->output_buffer_, 0);
+  if (this->input_transfer_buffer_->available() < MP3_MIN_FRAME_HEADER_BYTES) {
+    // The frame continues past the buffered data
+    return this->need_input_(MP3_MIN_FRAME_HEADER_BYTES);
+  }
+
+  // Decode in place and append the decoded frame to the batch in the output buffer
+  uint8_t *frame = this->input_transfer_buffer_->get_buffer_start();
+  size_t frame_offset = this->input_transfer_buffer_->get_bytes_consumed();
+  uint8_t *input = frame;
+  int bytes_left = this->input_transfer_buffer_->available();
+  int err = MP3Decode(this->mp3_decoder_, &input, &bytes_left,
+                      (int16_t *) (this->output_buffer_ + this->output_buffer_length_), 0);
+
+  if (err == ERR_MP3_INDATA_UNDERFLOW) {
+    // The frame continues past the buffered data. Leave it in place so it is decoded again after the next refill.
+    return this->need_input_(this->input_transfer_buffer_->available() + 1);
+  }
+
+  size_t frame_length = this->input_transfer_buffer_->available() - bytes_left;
+  this->input_transfer_buffer_->decrease_buffer_length(frame_length);
   if (err) {
     switch (err) {
       case ERR_MP3_MAINDATA_UNDERFLOW:
-        // Not a problem. Next call to decode will provide more data.
-        return FileDecoderState::POTENTIALLY_FAILED;
+        // Not a problem. The frame's main data starts in a frame before the first one decoded; the next frame has it.
+        return FileDecoderState::MORE_TO_PROCESS;
         break;
       default:
         return FileDecoderState::FAILED;
@@ -285,8 +647,12 @@ FileDecoderState AudioDecoder::decode_mp3_() {
     MP3GetLastFrameInfo(this->mp3_decoder_, &mp3_frame_info);
     if (mp3_frame_info.outputSamps > 0) {
       int bytes_per_sample = (mp3_frame_info.bitsPerSample / 8);
-      this->output_buffer_length_ = mp3_frame_info.outputSamps * bytes_per_sample;
-      this->output_buffer_current_ = this->output_buffer_;
+      this->output_buffer_length_ += mp3_frame_info.outputSamps * bytes_per_sample;
+
+      if (!this->audio_stream_info_.has_value()) {
+        // The frame data is still intact; consuming it only moved the window
+        this->create_mp3_seek_index_(frame, frame_length, frame_offset, mp3_frame_info);
+      }
 
       audio::AudioStreamInfo stream_info;
       stream_info.channels = mp3_frame_info.nChans;
@@ -300,36 +666,79 @@ FileDecoderState AudioDecoder::decode_mp3_() {
 }
 
 FileDecoderState AudioDecoder::decode_wav_() {
-  if (!this->audio_stream_info_.has_value() && (this->input_buffer_length_ > 44)) {
-    // Header hasn't been processed
+  if (!this->audio_stream_info_.has_value() &&
+      (this->input_transfer_buffer_->available() > WAV_CANONICAL_HEADER_SIZE)) {
+    // Header hasn't been processed. Parse it from a local read position and only consume it once it is complete.
 
-    size_t original_buffer_length = this->input_buffer_length_;
+    uint8_t *header_start = this->input_transfer_buffer_->get_buffer_start();
+    uint8_t *header_end = this->input_transfer_buffer_->get_buffer_end();
+    this->wav_header_current_ = header_start;
 
     size_t wav_bytes_to_skip = this->wav_decoder_->bytes_to_skip();
     size_t wav_bytes_to_read = this->wav_decoder_->bytes_needed();
 
     bool header_finished = false;
     while (!header_finished) {
+      size_t header_bytes_left = header_end - this->wav_header_current_;
+      if ((wav_bytes_to_skip > header_bytes_left) || (wav_bytes_to_read > header_bytes_left - wav_bytes_to_skip)) {
+        // The header continues past the buffered data; start over once the rest of this chunk has arrived
+        size_t header_bytes_needed =
+            (this->wav_header_current_ - header_start) + wav_bytes_to_skip + wav_bytes_to_read;
+        this->wav_decoder_->reset();
+        return this->need_input_(header_bytes_needed);
+      }
+
       if (wav_bytes_to_skip > 0) {
         // Adjust pointer to skip the appropriate bytes
-        this->input_buffer_current_ += wav_bytes_to_skip;
-        this->input_buffer_length_ -= wav_bytes_to_skip;
+        this->wav_header_current_ += wav_bytes_to_skip;
         wav_bytes_to_skip = 0;
       } else if (wav_bytes_to_read > 0) {
         wav_decoder::WAVDecoderResult result = this->wav_decoder_->next();
-        this->input_buffer_current_ += wav_bytes_to_read;
-        this->input_buffer_length_ -= wav_bytes_to_read;
+        this->wav_header_current_ += wav_bytes_to_read;
 
         if (result == wav_decoder::WAV_DECODER_SUCCESS_IN_DATA) {
           // Header parsing is complete
+          size_t header_length = this->wav_header_current_ - header_start;
+
+          uint16_t format_tag = find_wav_format_tag(header_start, header_length);
+          uint16_t bits_per_sample = this->wav_decoder_->bits_per_sample();
+
+          this->wav_sample_format_ = WAVSampleFormat::UNSUPPORTED;
+          if (format_tag == WAV_FORMAT_PCM) {
+            if (bits_per_sample == 8) {
+              this->wav_sample_format_ = WAVSampleFormat::U8;
+            } else if (bits_per_sample == 16) {
+              this->wav_sample_format_ = WAVSampleFormat::S16;
+            } else if (bits_per_sample == 24) {
+              this->wav_sample_format_ = WAVSampleFormat::S24;
+            } else if (bits_per_sample == 32) {
+              this->wav_sample_format_ = WAVSampleFormat::S32;
+            }
+          } else if ((format_tag == WAV_FORMAT_IEEE_FLOAT) && (bits_per_sample == 32)) {
+            this->wav_sample_format_ = WAVSampleFormat::F32;
+          }
 
-          // Assume PCM
           audio::AudioStreamInfo audio_stream_info;
           audio_stream_info.channels = this->wav_decoder_->num_channels();
           audio_stream_info.sample_rate = this->wav_decoder_->sample_rate();
-          audio_stream_info.bits_per_sample = this->wav_decoder_->bits_per_sample();
+          if (this->wav_sample_format_ != WAVSampleFormat::UNSUPPORTED) {
+            // Supported formats are converted to 16 bits per sample, or to 32 bits if they are deeper than 16 bits and
+            // the decoder may output 32 bits
+            if ((this->max_bits_per_sample_ >= 32) && (bits_per_sample > 16)) {
+              this->output_sample_size_ = sizeof(int32_t);
+            }
+            audio_stream_info.bits_per_sample = 8 * this->output_sample_size_;
+          } else {
+            // Report the actual bits per sample so the pipeline can explain why it can't play the file
+            audio_stream_info.bits_per_sample = bits_per_sample;
+          }
           this->audio_stream_info_ = audio_stream_info;
+          // The stream may be passed through without being decoded, so take its byte rate from the header
+          this->wav_byte_rate_ =
+              audio_stream_info.sample_rate * audio_stream_info.channels * ((bits_per_sample + 7) / 8);
           this->wav_bytes_left_ = this->wav_decoder_->chunk_bytes_left();
+          this->input_transfer_buffer_->decrease_buffer_length(header_length);
+          this->create_wav_seek_index_(this->input_transfer_buffer_->get_bytes_consumed());
           header_finished = true;
         } else if (result == wav_decoder::WAV_DECODER_SUCCESS_NEXT) {
           // Continue parsing header
@@ -341,32 +750,215 @@ FileDecoderState AudioDecoder::decode_wav_() {
         }
       } else {
         // Something unexpected has happened
-        // Reset state and hope we have enough info next time
-        this->input_buffer_length_ = original_buffer_length;
-        this->input_buffer_current_ = this->input_buffer_;
-        return FileDecoderState::POTENTIALLY_FAILED;
+        // Reset state and hope we have enough info once more has arrived
+        this->wav_decoder_->reset();
+        return this->need_input_(this->input_transfer_buffer_->available() + 1);
       }
     }
   }
 
+  if (!this->audio_stream_info_.has_value()) {
+    // Need more data to start parsing the header
+    return this->need_input_(WAV_CANONICAL_HEADER_SIZE + 1);
+  }
+
+  if (this->wav_sample_format_ == WAVSampleFormat::UNSUPPORTED) {
+    // The stream information is reported first, so the pipeline can explain why it can't play the file
+    return FileDecoderState::FAILED;
+  }
+
   if (this->wav_bytes_left_ > 0) {
-    size_t bytes_to_write = std::min(this->wav_bytes_left_, this->input_buffer_length_);
-    bytes_to_write = std::min(bytes_to_write, this->internal_buffer_size_);
-    if (bytes_to_write > 0) {
-      std::memcpy(this->output_buffer_, this->input_buffer_current_, bytes_to_write);
-      this->input_buffer_current_ += bytes_to_write;
-      this->input_buffer_length_ -= bytes_to_write;
-      this->output_buffer_current_ = this->output_buffer_;
-      this->output_buffer_length_ = bytes_to_write;
-      this->wav_bytes_left_ -= bytes_to_write;
+    uint8_t *input = this->input_transfer_buffer_->get_buffer_start();
+    size_t bytes_available = std::min(this->wav_bytes_left_, this->input_transfer_buffer_->available());
+
+    if ((this->wav_sample_format_ == WAVSampleFormat::S16) ||
+        ((this->wav_sample_format_ == WAVSampleFormat::S32) && (this->output_sample_size_ == sizeof(int32_t)))) {
+      // The data is already in the pipeline's sample format. Write the buffered bytes straight from the input buffer
+      // instead of copying them to the output buffer.
+      this->flush_output_ = true;
+      this->output_buffer_current_ = input;
+      this->output_buffer_length_ = bytes_available;
+      this->input_transfer_buffer_->decrease_buffer_length(bytes_available);
+      this->wav_bytes_left_ -= bytes_available;
+
+      if (this->wav_bytes_left_ > 0) {
+        // Nothing else needs decoding, so the rest of the data chunk bypasses the decoder entirely
+        this->pcm_passthrough_ = true;
+      }
+
+      return FileDecoderState::MORE_TO_PROCESS;
+    }
+
+    size_t bytes_per_sample = this->wav_decoder_->bits_per_sample() / 8;
+    if (this->wav_bytes_left_ < bytes_per_sample) {
+      // Truncated final sample
+      return FileDecoderState::END_OF_FILE;
     }
 
-    return FileDecoderState::IDLE;
+    size_t samples_to_convert =
+        std::min(bytes_available / bytes_per_sample,
+                 (this->internal_buffer_size_ - this->output_buffer_length_) / this->output_sample_size_);
+
+    if (samples_to_convert > 0) {
+      // Append the converted samples to the batch in the output buffer
+      uint8_t *output = this->output_buffer_ + this->output_buffer_length_;
+      int16_t *output_s16 = reinterpret_cast<int16_t *>(output);
+      int32_t *output_s32 = reinterpret_cast<int32_t *>(output);
+      const bool wide_output = (this->output_sample_size_ == sizeof(int32_t));
+      switch (this->wav_sample_format_) {
+        case WAVSampleFormat::U8:
+          convert_u8_to_s16(input, output_s16, samples_to_convert);
+          break;
+        case WAVSampleFormat::S24:
+          if (wide_output) {
+            convert_s24_to_s32(input, output_s32, samples_to_convert);
+          } else {
+            convert_s24_to_s16(input, output_s16, samples_to_convert);
+          }
+          break;
+        case WAVSampleFormat::S32:
+          // 32 bit output passes the samples through above
+          convert_s32_to_s16(input, output_s16, samples_to_convert);
+          break;
+        case WAVSampleFormat::F32:
+          if (wide_output) {
+            convert_f32_to_s32(input, output_s32, samples_to_convert);
+          } else {
+            convert_f32_to_s16(input, output_s16, samples_to_convert);
+          }
+          break;
+        default:
+          return FileDecoderState::FAILED;
+      }
+
+      size_t bytes_converted = samples_to_convert * bytes_per_sample;
+      this->input_transfer_buffer_->decrease_buffer_length(bytes_converted);
+      this->output_buffer_length_ += samples_to_convert * this->output_sample_size_;
+      this->wav_bytes_left_ -= bytes_converted;
+
+      return FileDecoderState::MORE_TO_PROCESS;
+    }
+
+    // Only part of a sample is buffered
+    return this->need_input_(bytes_per_sample);
   }
 
   return FileDecoderState::END_OF_FILE;
 }
 
+#ifdef USE_AUDIO_AAC_SUPPORT
+FileDecoderState AudioDecoder::decode_aac_() {
+  if (this->aac_container_ == AACContainer::UNKNOWN) {
+    if (this->input_transfer_buffer_->available() < 8) {
+      return this->need_input_(8);
+    }
+
+    // MP4 files start with an ftyp box; anything else is treated as a stream of ADTS frames
+    if (std::memcmp(this->input_transfer_buffer_->get_buffer_start() + 4, "ftyp", 4) == 0) {
+      this->aac_container_ = AACContainer::M4A;
+      this->m4a_demuxer_ = make_unique<M4ADemuxer>();
+    } else {
+      this->aac_container_ = AACContainer::ADTS;
+    }
+  }
+
+  size_t frame_length = 0;
+
+  if (this->aac_container_ == AACContainer::M4A) {
+    size_t bytes_consumed = 0;
+    M4ADemuxerResult result = this->m4a_demuxer_->parse(this->input_transfer_buffer_->get_buffer_start(),
+                                                        this->input_transfer_buffer_->available(), &bytes_consumed);
+    this->input_transfer_buffer_->decrease_buffer_length(bytes_consumed);
+
+    switch (result) {
+      case M4ADemuxerResult::NEED_MORE_DATA:
+        return this->need_input_(this->input_transfer_buffer_->available() + 1);
+      case M4ADemuxerResult::CONTINUE:
+        return FileDecoderState::MORE_TO_PROCESS;
+      case M4ADemuxerResult::END_OF_STREAM:
+        return FileDecoderState::END_OF_FILE;
+      case M4ADemuxerResult::FAILED:
+        return FileDecoderState::FAILED;
+      case M4ADemuxerResult::SAMPLE_READY:
+        break;
+    }
+
+    if (!this->audio_stream_info_.has_value()) {
+      // MP4 stores raw AAC blocks without ADTS headers, so the decoder needs the track's configuration
+      AACFrameInfo frame_info{};
+      frame_info.nChans = this->m4a_demuxer_->get_channels();
+      frame_info.sampRateCore = this->m4a_demuxer_->get_sample_rate();
+      frame_info.profile = AAC_PROFILE_LC;
+      if (AACSetRawBlockParams(this->aac_decoder_, 0, &frame_info) != 0) {
+        return FileDecoderState::FAILED;
+      }
+    }
+
+    frame_length = this->m4a_demuxer_->get_sample_size();
+  } else {
+    // Look for the next sync word
+    int32_t offset =
+        AACFindSyncWord(this->input_transfer_buffer_->get_buffer_start(), this->input_transfer_buffer_->available());
+    if (offset < 0) {
+      // The sync word may be in the data that hasn't arrived yet
+      return this->need_input_(this->input_transfer_buffer_->available() + 1);
+    }
+
+    // Skip to the sync word
+    this->input_transfer_buffer_->decrease_buffer_length(offset);
+
+    if (this->input_transfer_buffer_->available() < ADTS_HEADER_SIZE) {
+      return this->need_input_(ADTS_HEADER_SIZE);
+    }
+
+    const uint8_t *header = this->input_transfer_buffer_->get_buffer_start();
+    frame_length = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+
+    if (frame_length < ADTS_HEADER_SIZE) {
+      // Not a real frame header, look for the next sync word
+      this->input_transfer_buffer_->decrease_buffer_length(1);
+      return FileDecoderState::MORE_TO_PROCESS;
+    }
+  }
+
+  if (this->input_transfer_buffer_->available() < frame_length) {
+    // The frame continues past the buffered data
+    return this->need_input_(frame_length);
+  }
+
+  // Decode the whole frame in place and append it to the batch in the output buffer
+  uint8_t *input = this->input_transfer_buffer_->get_buffer_start();
+  int bytes_left = frame_length;
+  int err = AACDecode(this->aac_decoder_, &input, &bytes_left,
+                      (int16_t *) (this->output_buffer_ + this->output_buffer_length_));
+
+  // The frame boundaries are known, so always move past the frame, even if it was corrupt
+  this->input_transfer_buffer_->decrease_buffer_length(frame_length);
+  if (this->aac_container_ == AACContainer::M4A) {
+    this->m4a_demuxer_->sample_consumed();
+  }
+
+  if (err) {
+    // Corrupted frame; it was skipped, so decoding continues with the next one
+    return FileDecoderState::MORE_TO_PROCESS;
+  }
+
+  AACFrameInfo aac_frame_info;
+  AACGetLastFrameInfo(this->aac_decoder_, &aac_frame_info);
+  if (aac_frame_info.outputSamps > 0) {
+    this->output_buffer_length_ += aac_frame_info.outputSamps * sizeof(int16_t);
+
+    audio::AudioStreamInfo stream_info;
+    stream_info.channels = aac_frame_info.nChans;
+    stream_info.sample_rate = aac_frame_info.sampRateOut;
+    stream_info.bits_per_sample = aac_frame_info.bitsPerSample;
+    this->audio_stream_info_ = stream_info;
+  }
+
+  return FileDecoderState::MORE_TO_PROCESS;
+}
+#endif
+
 }  // namespace nabu
 }  // namespace esphome
 
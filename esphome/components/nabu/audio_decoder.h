@@ -2,21 +2,37 @@
 
 #ifdef USE_ESP_IDF
 
-#include <flac_decoder.h>
 #include <wav_decoder.h>
 #include <mp3_decoder.h>
 
+#ifdef USE_AUDIO_AAC_SUPPORT
+#include <libhelix-aac/aacdec.h>
+
+#include "m4a_demuxer.h"
+#endif
+
+#include "audio_graph.h"
+#include "audio_transfer_buffer.h"
+#include "flac_decoder.h"
+#include "latency_tracer.h"
+#include "seek_index.h"
+
 #include "esphome/components/audio/audio.h"
 #include "esphome/components/media_player/media_player.h"
 
-#include "esphome/core/ring_buffer.h"
-
 namespace esphome {
 namespace nabu {
 
+// Bytes decoded before the output is written to the output port, unless configured otherwise. media_player.py uses
+// the same default.
+static const size_t DEFAULT_DECODE_BATCH_SIZE = 8192;
+
 enum class AudioDecoderState : uint8_t {
   INITIALIZED = 0,
   DECODING,
+  WAITING_FOR_INPUT,  // The buffered input isn't enough to continue; get_input_bytes_needed says how much more
+  WAITING_FOR_SPACE,  // The output port is full; get_unwritten_bytes says how much of the batch is left
+  PASSTHROUGH,  // The rest of the stream is already PCM; the next stage should read it from the input port
   FINISHED,
   FAILED,
 };
@@ -24,55 +40,171 @@ enum class AudioDecoderState : uint8_t {
 // Only used within the AudioDecoder class; conveys the state of the particular file type decoder
 enum class FileDecoderState : uint8_t {
   MORE_TO_PROCESS,
-  IDLE,
-  POTENTIALLY_FAILED,
+  NEED_MORE_INPUT,  // The decoder set input_bytes_needed_ to the buffered input it needs before it can continue
   FAILED,
   END_OF_FILE,
 };
 
+// Only used within the AudioDecoder class; the sample format of a WAV file's data chunk
+enum class WAVSampleFormat : uint8_t {
+  UNSUPPORTED = 0,
+  U8,
+  S16,
+  S24,
+  S32,
+  F32,
+};
+
+// Only used within the AudioDecoder class; the container an AAC stream is packaged in
+enum class AACContainer : uint8_t {
+  UNKNOWN = 0,
+  ADTS,
+  M4A,
+};
+
 class AudioDecoder {
  public:
-  AudioDecoder(esphome::RingBuffer *input_ring_buffer, esphome::RingBuffer *output_ring_buffer,
-               size_t internal_buffer_size);
+  AudioDecoder(AudioPort *input_port, AudioPort *output_port, size_t internal_buffer_size);
   ~AudioDecoder();
 
   esp_err_t start(media_player::MediaFileType media_file_type);
 
-  AudioDecoderState decode(bool stop_gracefully);
+  /// @brief Decodes buffered input and writes batches to the output port until it has to wait for either
+  /// @param input_ended true once the input port won't receive more data
+  /// @return AudioDecoderState
+  AudioDecoderState decode(bool input_ended);
 
   const optional<audio::AudioStreamInfo> &get_audio_stream_info() const { return this->audio_stream_info_; }
 
+  /// @brief Sets how many bytes of decoded audio to accumulate before writing to the output port. Decoding several
+  /// frames per write reduces the handoff overhead for formats with small frames. A partial batch is still written
+  /// whenever no more input is available.
+  /// @param decode_batch_size target batch size in bytes; limited to the internal buffer size
+  void set_decode_batch_size(size_t decode_batch_size);
+
+  /// @brief Sets the largest sample size the decoder outputs. With 32, streams deeper than 16 bits (FLAC, and 24 bit,
+  /// 32 bit, and float WAV) are decoded to 32 bit samples instead of being truncated. MP3 and AAC are always 16 bits.
+  /// Must be called before start.
+  /// @param max_bits_per_sample 16 or 32
+  void set_max_bits_per_sample(uint8_t max_bits_per_sample) { this->max_bits_per_sample_ = max_bits_per_sample; }
+
+  /// @brief Sets the total length of the encoded stream. If known, the decoder builds a seek index for FLAC, MP3, and
+  /// WAV streams while parsing their headers. Must be called before start.
+  /// @param stream_length length in bytes, or 0 if unknown (no seek index is built)
+  void set_stream_length(size_t stream_length) { this->stream_length_ = stream_length; }
+
+  /// @brief Decodes data that is already addressable, e.g., a file in the flash mapping, in place instead of reading
+  /// from the input port. Must be called before start.
+  /// @param data start of the encoded stream
+  /// @param length length of the encoded stream in bytes
+  void set_input_data(const uint8_t *data, size_t length);
+
+  /// @brief Sets the port the decoded audio is written to. Until one is set, the decoder holds the first batch, so the
+  /// port's format can be negotiated from the stream information first.
+  void set_output_port(AudioPort *output_port) { this->output_port_ = output_port; }
+
+#ifdef USE_NABU_LATENCY_TRACING
+  /// @brief Sets the tracer that records when chunks pass through this stage
+  void set_latency_tracer(LatencyTracer *latency_tracer) { this->latency_tracer_ = latency_tracer; }
+#endif
+
+  /// @brief Transfers ownership of the seek index once the stream's header has been parsed
+  /// @return unique_ptr to the seek index, or nullptr if it isn't ready or the stream isn't seekable
+  std::unique_ptr<SeekIndex> release_seek_index();
+
+  /// @brief Number of encoded bytes read from the input port that haven't been decoded yet
+  size_t get_buffered_bytes() const {
+    return (this->input_transfer_buffer_ != nullptr) ? this->input_transfer_buffer_->available() : 0;
+  }
+
+  /// @brief Number of bytes the input port must provide before decoding can continue after
+  /// AudioDecoderState::WAITING_FOR_INPUT
+  size_t get_input_bytes_needed() const;
+
+  /// @brief Number of decoded bytes still to be written after AudioDecoderState::WAITING_FOR_SPACE
+  size_t get_unwritten_bytes() const { return this->output_buffer_length_; }
+
+  /// @brief Encoded bytes per second of audio. Comes from the header for WAV files and from the input consumed for
+  /// the audio decoded so far otherwise.
+  /// @return the byte rate, or 0 until the first audio is decoded
+  uint32_t get_encoded_byte_rate() const;
+
+  /// @brief Number of PCM bytes remaining in the stream after decode returns AudioDecoderState::PASSTHROUGH. The
+  /// next stage should stop reading from the input port after this many bytes.
+  size_t get_pcm_passthrough_bytes() const { return this->wav_bytes_left_; }
+
  protected:
   esp_err_t allocate_buffers_();
 
+  /// @brief Determines if the output buffer batch is ready to write, either because it reached the batch size or
+  /// because another frame may not fit
+  bool is_output_batch_full_();
+
+  void create_mp3_seek_index_(const uint8_t *frame, size_t frame_length, size_t frame_offset,
+                              const MP3FrameInfo &frame_info);
+  void create_wav_seek_index_(size_t audio_start);
+
+  /// @brief Records that a file decoder can't continue until at least this many bytes are buffered
+  /// @return FileDecoderState::NEED_MORE_INPUT
+  FileDecoderState need_input_(size_t bytes);
+
   FileDecoderState decode_flac_();
   FileDecoderState decode_mp3_();
   FileDecoderState decode_wav_();
+#ifdef USE_AUDIO_AAC_SUPPORT
+  FileDecoderState decode_aac_();
+#endif
 
-  esphome::RingBuffer *input_ring_buffer_;
-  esphome::RingBuffer *output_ring_buffer_;
+  AudioPort *input_port_;
+  AudioPort *output_port_;
   size_t internal_buffer_size_;
 
-  uint8_t *input_buffer_{nullptr};
-  uint8_t *input_buffer_current_{nullptr};
-  size_t input_buffer_length_;
+#ifdef USE_NABU_LATENCY_TRACING
+  LatencyTracer *latency_tracer_{nullptr};
+#endif
+
+  // Sliding window over the encoded input; decoders consume it in place
+  std::unique_ptr<AudioSourceTransferBuffer> input_transfer_buffer_;
+  size_t input_bytes_needed_{0};  // Buffered input the file decoder needs before it can continue; 0 if it hasn't said
 
   uint8_t *output_buffer_{nullptr};
   uint8_t *output_buffer_current_{nullptr};
   size_t output_buffer_length_;
 
-  std::unique_ptr<flac::FLACDecoder> flac_decoder_;
+  size_t decode_batch_size_;
+  bool flush_output_{false};  // True while the current batch is being written to the output port
+
+  std::unique_ptr<FLACDecoder> flac_decoder_;
 
   HMP3Decoder mp3_decoder_;
 
   std::unique_ptr<wav_decoder::WAVDecoder> wav_decoder_;
-  size_t wav_bytes_left_;
+  uint8_t *wav_header_current_{nullptr};  // Read position the WAV header parser dereferences
+  size_t wav_bytes_left_{0};
+  WAVSampleFormat wav_sample_format_{WAVSampleFormat::UNSUPPORTED};
+
+#ifdef USE_AUDIO_AAC_SUPPORT
+  HAACDecoder aac_decoder_{nullptr};
+  AACContainer aac_container_{AACContainer::UNKNOWN};
+  std::unique_ptr<M4ADemuxer> m4a_demuxer_;
+#endif
+
+  size_t stream_length_{0};
+  std::unique_ptr<SeekIndex> seek_index_;
+  bool seek_index_ready_{false};
 
   media_player::MediaFileType media_file_type_{media_player::MediaFileType::NONE};
   optional<audio::AudioStreamInfo> audio_stream_info_{};
+  uint8_t max_bits_per_sample_{16};
+  size_t output_sample_size_{sizeof(int16_t)};  // Size of a decoded sample; set with the stream information
+
+  // Encoded input consumed and audio produced since the stream information was found, for the encoded byte rate
+  uint64_t rate_input_bytes_{0};
+  uint64_t rate_output_bytes_{0};
+  uint32_t wav_byte_rate_{0};
 
-  size_t potentially_failed_count_{0};
   bool end_of_file_{false};
+  bool pcm_passthrough_{false};
 };
 }  // namespace nabu
 }  // namespace esphome
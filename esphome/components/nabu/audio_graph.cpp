@@ -0,0 +1,877 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_graph.h"
+
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+enum EventGroupBits : uint32_t {
+  // Stops the running stages; set by stop() or when a stage fails, cleared by stop() once every stage finished
+  GRAPH_COMMAND_STOP = (1 << 0),
+
+  // One bit per task. A port the task's stages use moved data, ended, or was closed, so a waiting stage should try
+  // again; set by the stage on the other side of the port, cleared by the task before it steps its stages
+  TASK_COMMAND_WAKE_FIRST = (1 << 1),
+
+  // The following have one bit per stage
+  // Start the stage; set by start() or once the stage's inputs are negotiated, cleared by the stage's task
+  STAGE_COMMAND_START_FIRST = (TASK_COMMAND_WAKE_FIRST << MAX_GRAPH_TASKS),
+  // The stage isn't running or waiting to start; cleared when its start is scheduled, set by the stage's task
+  STAGE_MESSAGE_FINISHED_FIRST = (STAGE_COMMAND_START_FIRST << MAX_GRAPH_STAGES),
+  // The stage failed; set by the stage's task or by stop() if it timed out, cleared by stop() and take_stage_failure()
+  STAGE_MESSAGE_FAILED_FIRST = (STAGE_MESSAGE_FINISHED_FIRST << MAX_GRAPH_STAGES),
+  // Run the stage's idle work; set by request_idle_work(), cleared by the stage's task once it is done or the stage
+  // starts instead
+  STAGE_COMMAND_IDLE_WORK_FIRST = (STAGE_MESSAGE_FAILED_FIRST << MAX_GRAPH_STAGES),
+
+  // Only 24 bits are valid for the event group
+  ALL_BITS = (STAGE_COMMAND_IDLE_WORK_FIRST << MAX_GRAPH_STAGES) - 1,
+};
+static_assert(ALL_BITS <= 0x00ffffff, "Too many stages and tasks for the event group");
+
+static EventBits_t stage_bit(EventGroupBits first, size_t stage) { return static_cast<EventBits_t>(first) << stage; }
+
+PortFormat PortFormat::encoded(media_player::MediaFileType file_type) {
+  PortFormat format;
+  format.data_type = PortDataType::ENCODED;
+  format.file_type = file_type;
+  return format;
+}
+
+PortFormat PortFormat::pcm(const audio::AudioStreamInfo &stream_info) {
+  PortFormat format;
+  format.data_type = PortDataType::PCM;
+  format.stream_info = stream_info;
+  return format;
+}
+
+size_t PortFormat::get_frame_size() const {
+  if (this->data_type != PortDataType::PCM) {
+    return 1;
+  }
+  return this->stream_info.channels * this->stream_info.get_bytes_per_sample();
+}
+
+size_t PortFormat::get_byte_rate() const {
+  if (this->data_type != PortDataType::PCM) {
+    return 0;
+  }
+  return this->stream_info.sample_rate * this->get_frame_size();
+}
+
+PortConstraint PortConstraint::encoded() {
+  PortConstraint constraint;
+  constraint.data_type = PortDataType::ENCODED;
+  return constraint;
+}
+
+PortConstraint PortConstraint::pcm(uint8_t bits_per_sample, uint8_t min_channels, uint8_t max_channels,
+                                   uint32_t sample_rate) {
+  PortConstraint constraint;
+  constraint.data_type = PortDataType::PCM;
+  constraint.bits_per_sample = bits_per_sample;
+  constraint.min_channels = min_channels;
+  constraint.max_channels = max_channels;
+  constraint.sample_rate = sample_rate;
+  return constraint;
+}
+
+FormatMismatch PortConstraint::check(const PortFormat &format) const {
+  if ((format.data_type == PortDataType::NONE) ||
+      ((this->data_type != PortDataType::NONE) && (format.data_type != this->data_type))) {
+    return FormatMismatch::DATA_TYPE;
+  }
+  if (format.data_type != PortDataType::PCM) {
+    return FormatMismatch::NONE;
+  }
+
+  const audio::AudioStreamInfo &stream_info = format.stream_info;
+  if ((this->bits_per_sample > 0) && (stream_info.bits_per_sample != this->bits_per_sample) &&
+      (stream_info.bits_per_sample != this->wide_bits_per_sample)) {
+    return FormatMismatch::BITS_PER_SAMPLE;
+  }
+  if ((stream_info.channels == 0) || ((this->min_channels > 0) && (stream_info.channels < this->min_channels)) ||
+      ((this->max_channels > 0) && (stream_info.channels > this->max_channels))) {
+    return FormatMismatch::CHANNELS;
+  }
+  if ((this->sample_rate > 0) && (stream_info.sample_rate != this->sample_rate)) {
+    return FormatMismatch::SAMPLE_RATE;
+  }
+  return FormatMismatch::NONE;
+}
+
+bool PortConstraint::get_fixed_format(PortFormat &format) const {
+  if ((this->data_type != PortDataType::PCM) || (this->bits_per_sample == 0) || (this->wide_bits_per_sample > 0) ||
+      (this->max_channels == 0) || (this->min_channels != this->max_channels) || (this->sample_rate == 0)) {
+    return false;
+  }
+
+  audio::AudioStreamInfo stream_info;
+  stream_info.bits_per_sample = this->bits_per_sample;
+  stream_info.channels = this->max_channels;
+  stream_info.sample_rate = this->sample_rate;
+  format = PortFormat::pcm(stream_info);
+  return true;
+}
+
+StageAwait StageAwait::ready() { return StageAwait(); }
+
+StageAwait StageAwait::input(size_t input, size_t bytes) {
+  StageAwait await;
+  await.kind = Kind::INPUT;
+  await.port = input;
+  await.value = bytes;
+  return await;
+}
+
+StageAwait StageAwait::output(size_t output, size_t bytes) {
+  StageAwait await;
+  await.kind = Kind::OUTPUT;
+  await.port = output;
+  await.value = bytes;
+  return await;
+}
+
+StageAwait StageAwait::poll(uint32_t timeout_ms) {
+  StageAwait await;
+  await.kind = Kind::POLL;
+  await.value = timeout_ms;
+  return await;
+}
+
+StageAwait StageAwait::finished() {
+  StageAwait await;
+  await.kind = Kind::FINISHED;
+  return await;
+}
+
+StageAwait StageAwait::failed() {
+  StageAwait await;
+  await.kind = Kind::FAILED;
+  return await;
+}
+
+void AudioPort::set_buffer_duration(uint32_t duration_ms, size_t min_size, size_t max_size) {
+  this->buffer_duration_ms_ = duration_ms;
+  this->min_buffer_size_ = min_size;
+  this->max_buffer_size_ = max_size;
+}
+
+esp_err_t AudioPort::allocate(size_t size) {
+  if ((this->ring_buffer_ != nullptr) && (this->get_buffer_size() == size)) {
+    return ESP_OK;
+  }
+
+  this->release();
+
+  this->ring_buffer_ = RingBuffer::create(size);
+  if (this->ring_buffer_ == nullptr) {
+    return ESP_ERR_NO_MEM;
+  }
+  this->buffer_size_.store(size, std::memory_order_relaxed);
+
+  return ESP_OK;
+}
+
+void AudioPort::release() {
+  this->ring_buffer_.reset();
+  this->buffer_size_.store(0, std::memory_order_relaxed);
+}
+
+void AudioPort::reset() {
+  if (this->ring_buffer_ != nullptr) {
+    this->ring_buffer_->reset();
+  }
+  this->offer_read_ = this->offer_length_;
+  // The writer may be waiting for space
+  this->wake_writer_();
+}
+
+size_t AudioPort::write(const void *data, size_t length) {
+  if (this->is_closed()) {
+    // The reader doesn't need the rest of the stream
+    return length;
+  }
+
+  if (this->direct_) {
+    // The data is the rest of the previous offer, so whatever the reader took of it is written
+    size_t bytes_written = std::min(this->offer_read_, length);
+    this->offer_data_ = static_cast<const uint8_t *>(data) + bytes_written;
+    this->offer_length_ = length - bytes_written;
+    this->offer_read_ = 0;
+    return bytes_written;
+  }
+
+  if ((this->ring_buffer_ == nullptr) || (length == 0)) {
+    return 0;
+  }
+
+  size_t bytes_written = this->ring_buffer_->write_without_replacement((void *) data, length, 0);
+  if (bytes_written > 0) {
+    this->wake_reader_();
+  }
+  return bytes_written;
+}
+
+size_t AudioPort::free() const {
+  if (this->direct_) {
+    // A new offer can be made once the reader took all of the previous one
+    return (this->offer_read_ >= this->offer_length_) ? SIZE_MAX : 0;
+  }
+  return (this->ring_buffer_ != nullptr) ? this->ring_buffer_->free() : 0;
+}
+
+void AudioPort::splice(AudioPort *source, size_t length) {
+  if (length == 0) {
+    source->close();
+    return;
+  }
+  this->splice_source_ = source;
+  this->splice_bytes_left_ = length;
+  // This port's reader reads the source from now on, so the source's writer has to wake it instead
+  source->reader_.store(this->reader_.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+size_t AudioPort::read(void *data, size_t length) {
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+  size_t bytes_read = 0;
+
+  if (this->direct_) {
+    bytes_read = std::min(length, this->offer_length_ - this->offer_read_);
+    if (bytes_read > 0) {
+      std::memcpy(bytes, this->offer_data_ + this->offer_read_, bytes_read);
+      this->offer_read_ += bytes_read;
+    }
+  } else if (this->ring_buffer_ != nullptr) {
+    bytes_read = this->ring_buffer_->read((void *) bytes, length, 0);
+    if (bytes_read > 0) {
+      this->wake_writer_();
+    }
+  }
+
+  if (bytes_read < length) {
+    bytes_read += this->read_spliced_(bytes + bytes_read, length - bytes_read);
+  }
+
+  return bytes_read;
+}
+
+size_t AudioPort::read_spliced_(uint8_t *data, size_t length) {
+  // Checking the end first guarantees the writer's last data is in the buffer, and that data comes first
+  if (!this->is_ended() || (this->splice_source_ == nullptr) || (this->buffered_() > 0)) {
+    return 0;
+  }
+
+  size_t bytes_read = this->splice_source_->read(data, std::min(length, this->splice_bytes_left_));
+  this->splice_bytes_left_ -= bytes_read;
+  if (this->splice_bytes_left_ == 0) {
+    // Whatever follows in the source isn't part of the stream
+    this->splice_source_->close();
+    this->splice_source_ = nullptr;
+  }
+  return bytes_read;
+}
+
+size_t AudioPort::available() const {
+  size_t bytes = this->buffered_();
+  if (this->is_ended() && (this->splice_source_ != nullptr)) {
+    bytes += std::min(this->splice_source_->available(), this->splice_bytes_left_);
+  }
+  return bytes;
+}
+
+size_t AudioPort::buffered_() const {
+  if (this->direct_) {
+    return this->offer_length_ - this->offer_read_;
+  }
+  return (this->ring_buffer_ != nullptr) ? this->ring_buffer_->available() : 0;
+}
+
+const uint8_t *AudioPort::peek(size_t &length) const {
+  length = 0;
+  if (!this->direct_ || (this->offer_read_ >= this->offer_length_)) {
+    return nullptr;
+  }
+  length = this->offer_length_ - this->offer_read_;
+  return this->offer_data_ + this->offer_read_;
+}
+
+void AudioPort::consume(size_t length) {
+  length = std::min(length, this->offer_length_ - this->offer_read_);
+  this->offer_read_ += length;
+}
+
+bool AudioPort::is_finished() const {
+  if (!this->is_ended() || (this->buffered_() > 0)) {
+    return false;
+  }
+  return (this->splice_source_ == nullptr) || this->splice_source_->is_finished();
+}
+
+bool AudioPort::can_read_(size_t bytes) const {
+  if (this->is_ended()) {
+    return true;
+  }
+  // A full port can't take more data, and the writer of a direct port only offers one buffer at a time
+  size_t limit = this->direct_ ? 1 : this->get_buffer_size();
+  return this->available() >= std::max<size_t>(std::min(bytes, limit), 1);
+}
+
+bool AudioPort::can_write_(size_t bytes) const {
+  if (this->is_closed()) {
+    return true;
+  }
+  // A direct port takes a new offer of any size once the previous one was read
+  size_t limit = this->direct_ ? 1 : this->get_buffer_size();
+  return this->free() >= std::max<size_t>(std::min(bytes, limit), 1);
+}
+
+void AudioPort::close() {
+  this->closed_.store(true, std::memory_order_release);
+  this->wake_writer_();
+}
+
+esp_err_t AudioPort::set_format_(const PortFormat &format) {
+  if (!this->direct_ && (this->buffer_duration_ms_ > 0)) {
+    size_t size = format.get_byte_rate() * this->buffer_duration_ms_ / 1000;
+    size = clamp<size_t>(size, this->min_buffer_size_, this->max_buffer_size_);
+    esp_err_t err = this->allocate(size);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+
+  this->format_ = format;
+  this->negotiated_.store(true, std::memory_order_release);
+  return ESP_OK;
+}
+
+void AudioPort::end_() {
+  this->ended_.store(true, std::memory_order_release);
+  this->wake_reader_();
+}
+
+bool AudioPort::is_drained_() const {
+  // A splice is drained by the source's writer
+  return this->is_closed() || (this->buffered_() == 0);
+}
+
+void AudioPort::reset_stream_() {
+  this->format_ = PortFormat();
+  this->negotiated_.store(false, std::memory_order_relaxed);
+  this->ended_.store(false, std::memory_order_relaxed);
+  this->closed_.store(false, std::memory_order_relaxed);
+  this->splice_source_ = nullptr;
+  this->splice_bytes_left_ = 0;
+  this->offer_data_ = nullptr;
+  this->offer_length_ = 0;
+  this->offer_read_ = 0;
+}
+
+void AudioPort::wake_reader_() {
+  AudioStage *reader = this->reader_.load(std::memory_order_acquire);
+  if ((reader != nullptr) && !reader->shares_task_with_(this->writer_.load(std::memory_order_acquire))) {
+    reader->wake();
+  }
+}
+
+void AudioPort::wake_writer_() {
+  AudioStage *writer = this->writer_.load(std::memory_order_acquire);
+  if ((writer != nullptr) && !writer->shares_task_with_(this->reader_.load(std::memory_order_acquire))) {
+    writer->wake();
+  }
+}
+
+void AudioStage::wake() {
+  if (this->graph_ != nullptr) {
+    this->graph_->wake_task_(this->task_);
+  }
+}
+
+bool AudioStage::shares_task_with_(const AudioStage *other) const {
+  return (other != nullptr) && (other->graph_ == this->graph_) && (other->task_ == this->task_);
+}
+
+esp_err_t AudioStage::set_output_format_(size_t output, const PortFormat &format, FormatMismatch *mismatch) {
+  AudioPort *port = this->outputs_[output];
+
+  FormatMismatch format_mismatch = port->get_constraint().check(format);
+  if (mismatch != nullptr) {
+    *mismatch = format_mismatch;
+  }
+  if (format_mismatch != FormatMismatch::NONE) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  esp_err_t err = port->set_format_(format);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  // A reader in another graph, like the mixer, runs on its own schedule
+  AudioStage *reader = port->reader_.load(std::memory_order_acquire);
+  if ((reader != nullptr) && (reader->graph_ == this->graph_)) {
+    this->graph_->start_when_ready_(reader);
+  }
+  return ESP_OK;
+}
+
+uint8_t AudioGraph::add_task(const char *name_suffix, uint32_t stack_size) {
+  Task &task = this->tasks_[this->task_count_];
+  task.graph = this;
+  task.index = this->task_count_;
+  task.name_suffix = name_suffix;
+  task.stack_size = stack_size;
+  return this->task_count_++;
+}
+
+void AudioGraph::add_stage(AudioStage *stage, uint8_t task) {
+  stage->graph_ = this;
+  stage->index_ = this->stage_count_;
+  stage->task_ = task;
+  this->stages_[this->stage_count_++] = stage;
+}
+
+void AudioGraph::connect_output(AudioStage *stage, size_t output, AudioPort *port) {
+  stage->outputs_[output] = port;
+  port->writer_.store(stage, std::memory_order_release);
+}
+
+void AudioGraph::connect_input(AudioStage *stage, size_t input, AudioPort *port, bool required) {
+  stage->inputs_[input] = port;
+  if (required) {
+    stage->required_inputs_ |= (1 << input);
+  } else {
+    stage->required_inputs_ &= ~(1 << input);
+  }
+  port->reader_.store(stage, std::memory_order_release);
+}
+
+esp_err_t AudioGraph::create_tasks(const std::string &name, UBaseType_t priority) {
+  for (size_t i = 0; i < this->task_count_; ++i) {
+    Task &task = this->tasks_[i];
+    if (task.stack == nullptr)
+      task.stack = (StackType_t *) malloc(task.stack_size);
+
+    if (task.stack == nullptr) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  if (this->event_group_ == nullptr) {
+    this->event_group_ = xEventGroupCreate();
+    if (this->event_group_ == nullptr) {
+      return ESP_ERR_NO_MEM;
+    }
+    // No stage has started yet
+    xEventGroupSetBits(this->event_group_, this->get_finished_bits_());
+  }
+
+  for (size_t i = 0; i < this->task_count_; ++i) {
+    Task &task = this->tasks_[i];
+    if (task.handle == nullptr) {
+      task.handle = xTaskCreateStatic(AudioGraph::task_, (name + task.name_suffix).c_str(), task.stack_size,
+                                      (void *) &task, priority, task.stack, &task.tcb);
+    }
+
+    if (task.handle == nullptr) {
+      return ESP_FAIL;
+    }
+  }
+
+  return ESP_OK;
+}
+
+void AudioGraph::delete_tasks() {
+  for (size_t i = 0; i < this->task_count_; ++i) {
+    if (this->tasks_[i].handle != nullptr) {
+      vTaskDelete(this->tasks_[i].handle);
+      this->tasks_[i].handle = nullptr;
+    }
+  }
+
+  if (this->event_group_ != nullptr) {
+    // Abandoned stages no longer run, and nothing is pending
+    EventBits_t finished_bits = this->get_finished_bits_();
+    xEventGroupClearBits(this->event_group_, ALL_BITS & ~finished_bits);
+    xEventGroupSetBits(this->event_group_, finished_bits);
+  }
+}
+
+void AudioGraph::release_task_stacks() {
+  if (this->has_tasks()) {
+    return;
+  }
+
+  for (size_t i = 0; i < this->task_count_; ++i) {
+    if (this->tasks_[i].stack != nullptr) {
+      free(this->tasks_[i].stack);
+      this->tasks_[i].stack = nullptr;
+    }
+  }
+}
+
+esp_err_t AudioGraph::start() {
+  if (!this->has_tasks() || !this->is_idle()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  for (size_t i = 0; i < this->stage_count_; ++i) {
+    if (this->stages_[i]->required_inputs_ == 0) {
+      this->schedule_start_(this->stages_[i]);
+    }
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t AudioGraph::stop(uint32_t timeout_ms) {
+  if (this->event_group_ == nullptr) {
+    return ESP_OK;
+  }
+
+  const EventBits_t finished_bits = this->get_finished_bits_();
+
+  // Waiting stages block on the event group, so the stop command wakes them immediately
+  xEventGroupSetBits(this->event_group_, GRAPH_COMMAND_STOP);
+
+  EventBits_t event_bits = xEventGroupWaitBits(this->event_group_,
+                                               finished_bits,               // Bit message to read
+                                               pdFALSE,                     // Clear the bits on exit
+                                               pdTRUE,                      // Wait for all the bits,
+                                               pdMS_TO_TICKS(timeout_ms));  // Duration to block/wait
+
+  if ((event_bits & finished_bits) != finished_bits) {
+    // Stages that didn't stop in time count as failed
+    for (size_t i = 0; i < this->stage_count_; ++i) {
+      if (!(event_bits & stage_bit(STAGE_MESSAGE_FINISHED_FIRST, i))) {
+        xEventGroupSetBits(this->event_group_, stage_bit(STAGE_MESSAGE_FAILED_FIRST, i));
+      }
+    }
+    return ESP_ERR_TIMEOUT;
+  }
+
+  // The next stream starts without a format, end, or splice
+  for (size_t i = 0; i < this->stage_count_; ++i) {
+    for (AudioPort *port : this->stages_[i]->outputs_) {
+      if (port != nullptr) {
+        port->reset_stream_();
+      }
+    }
+  }
+
+  EventBits_t failed_bits = 0;
+  for (size_t i = 0; i < this->stage_count_; ++i) {
+    failed_bits |= stage_bit(STAGE_MESSAGE_FAILED_FIRST, i);
+  }
+  xEventGroupClearBits(this->event_group_, GRAPH_COMMAND_STOP | failed_bits);
+
+  return ESP_OK;
+}
+
+bool AudioGraph::is_idle() const {
+  if (this->event_group_ == nullptr) {
+    return true;
+  }
+  const EventBits_t finished_bits = this->get_finished_bits_();
+  return (xEventGroupGetBits(this->event_group_) & finished_bits) == finished_bits;
+}
+
+bool AudioGraph::is_stopping() const {
+  return (this->event_group_ != nullptr) && (xEventGroupGetBits(this->event_group_) & GRAPH_COMMAND_STOP);
+}
+
+bool AudioGraph::is_stage_finished(const AudioStage *stage) const {
+  return (this->event_group_ == nullptr) ||
+         (xEventGroupGetBits(this->event_group_) & stage_bit(STAGE_MESSAGE_FINISHED_FIRST, stage->index_));
+}
+
+bool AudioGraph::has_stage_failed(const AudioStage *stage) const {
+  return (this->event_group_ != nullptr) &&
+         (xEventGroupGetBits(this->event_group_) & stage_bit(STAGE_MESSAGE_FAILED_FIRST, stage->index_));
+}
+
+bool AudioGraph::take_stage_failure(const AudioStage *stage) {
+  if (!this->has_stage_failed(stage)) {
+    return false;
+  }
+  xEventGroupClearBits(this->event_group_, stage_bit(STAGE_MESSAGE_FAILED_FIRST, stage->index_));
+  return true;
+}
+
+bool AudioGraph::request_idle_work(AudioStage *stage) {
+  if ((this->event_group_ == nullptr) || this->is_idle_work_pending(stage)) {
+    return false;
+  }
+  xEventGroupSetBits(this->event_group_, stage_bit(STAGE_COMMAND_IDLE_WORK_FIRST, stage->index_));
+  return true;
+}
+
+bool AudioGraph::is_idle_work_pending(const AudioStage *stage) const {
+  return (this->event_group_ != nullptr) &&
+         (xEventGroupGetBits(this->event_group_) & stage_bit(STAGE_COMMAND_IDLE_WORK_FIRST, stage->index_));
+}
+
+void AudioGraph::suspend_tasks() {
+  for (size_t i = 0; i < this->task_count_; ++i) {
+    if (this->tasks_[i].handle != nullptr) {
+      vTaskSuspend(this->tasks_[i].handle);
+    }
+  }
+}
+
+void AudioGraph::resume_tasks() {
+  for (size_t i = 0; i < this->task_count_; ++i) {
+    if (this->tasks_[i].handle != nullptr) {
+      vTaskResume(this->tasks_[i].handle);
+    }
+  }
+}
+
+size_t AudioGraph::get_memory_usage() const {
+  size_t bytes = 0;
+  for (size_t i = 0; i < this->task_count_; ++i) {
+    if (this->tasks_[i].stack != nullptr)
+      bytes += this->tasks_[i].stack_size;
+  }
+  return bytes;
+}
+
+void AudioGraph::start_when_ready_(AudioStage *stage) {
+  for (size_t i = 0; i < MAX_STAGE_PORTS; ++i) {
+    if ((stage->required_inputs_ & (1 << i)) && !stage->inputs_[i]->has_format_()) {
+      return;
+    }
+  }
+  this->schedule_start_(stage);
+}
+
+void AudioGraph::schedule_start_(AudioStage *stage) {
+  // The stage no longer counts as finished from the moment its start is scheduled
+  xEventGroupClearBits(this->event_group_, stage_bit(STAGE_MESSAGE_FINISHED_FIRST, stage->index_));
+  xEventGroupSetBits(this->event_group_, stage_bit(STAGE_COMMAND_START_FIRST, stage->index_));
+}
+
+void AudioGraph::wake_task_(uint8_t task) {
+  if (this->event_group_ != nullptr) {
+    xEventGroupSetBits(this->event_group_, static_cast<EventBits_t>(TASK_COMMAND_WAKE_FIRST) << task);
+  }
+}
+
+bool AudioGraph::is_resumable_(const AudioStage *stage, const StageAwait &await, bool woken,
+                               TickType_t poll_elapsed) const {
+  switch (await.kind) {
+    case StageAwait::Kind::INPUT:
+      return stage->inputs_[await.port]->can_read_(await.value);
+    case StageAwait::Kind::OUTPUT:
+      return stage->outputs_[await.port]->can_write_(await.value);
+    case StageAwait::Kind::POLL:
+      return woken || (poll_elapsed >= pdMS_TO_TICKS(await.value));
+    default:
+      return true;
+  }
+}
+
+bool AudioGraph::is_drained_(const AudioStage *stage) const {
+  for (const AudioPort *port : stage->outputs_) {
+    if ((port != nullptr) && !port->is_drained_()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+EventBits_t AudioGraph::get_finished_bits_() const {
+  EventBits_t finished_bits = 0;
+  for (size_t i = 0; i < this->stage_count_; ++i) {
+    finished_bits |= stage_bit(STAGE_MESSAGE_FINISHED_FIRST, i);
+  }
+  return finished_bits;
+}
+
+void AudioGraph::task_(void *params) {
+  Task *task = (Task *) params;
+  task->graph->run_task_(*task);
+}
+
+void AudioGraph::run_task_(Task &task) {
+  enum class StageState : uint8_t {
+    IDLE,
+    RUNNING,
+    DRAINING,  // Finished, but its readers haven't taken all of its output yet
+  };
+  std::array<StageState, MAX_GRAPH_STAGES> states{};
+  // What each running stage waits for, and when it last stepped for a poll's timeout
+  std::array<StageAwait, MAX_GRAPH_STAGES> awaits{};
+  std::array<TickType_t, MAX_GRAPH_STAGES> stepped_ticks{};
+  size_t active_count = 0;
+  // Whether a port the task's stages use may have moved data since the last round, which resumes polling stages
+  bool woken = true;
+
+  const EventBits_t wake_bit = static_cast<EventBits_t>(TASK_COMMAND_WAKE_FIRST) << task.index;
+  EventBits_t start_bits = 0;
+  EventBits_t idle_work_bits = 0;
+  for (size_t i = 0; i < this->stage_count_; ++i) {
+    if (this->stages_[i]->task_ == task.index) {
+      start_bits |= stage_bit(STAGE_COMMAND_START_FIRST, i);
+      idle_work_bits |= stage_bit(STAGE_COMMAND_IDLE_WORK_FIRST, i);
+    }
+  }
+
+  while (true) {
+    if (active_count == 0) {
+      // Wait until one of the task's stages starts or its idle work is requested
+      xEventGroupWaitBits(this->event_group_, start_bits | idle_work_bits, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
+
+    for (size_t i = 0; i < this->stage_count_; ++i) {
+      AudioStage *stage = this->stages_[i];
+      if ((stage->task_ != task.index) || (states[i] != StageState::IDLE)) {
+        continue;
+      }
+
+      const EventBits_t start_bit = stage_bit(STAGE_COMMAND_START_FIRST, i);
+      const EventBits_t idle_work_bit = stage_bit(STAGE_COMMAND_IDLE_WORK_FIRST, i);
+      const EventBits_t finished_bit = stage_bit(STAGE_MESSAGE_FINISHED_FIRST, i);
+
+      // xEventGroupClearBits returns the bits from before they were cleared
+      EventBits_t event_bits = xEventGroupClearBits(this->event_group_, start_bit);
+      if (event_bits & start_bit) {
+        // Starting supersedes the idle work
+        xEventGroupClearBits(this->event_group_, idle_work_bit);
+
+        if (event_bits & GRAPH_COMMAND_STOP) {
+          // Stopped before it started
+          xEventGroupSetBits(this->event_group_, finished_bit);
+        } else if (stage->start() != ESP_OK) {
+          stage->finish();
+          xEventGroupSetBits(this->event_group_, stage_bit(STAGE_MESSAGE_FAILED_FIRST, i) | GRAPH_COMMAND_STOP);
+          xEventGroupSetBits(this->event_group_, finished_bit);
+        } else {
+          states[i] = StageState::RUNNING;
+          awaits[i] = StageAwait::ready();
+          ++active_count;
+        }
+      } else if ((active_count == 0) && (event_bits & idle_work_bit)) {
+        // The stage stays finished, so the graph remains idle during the idle work, which may block the task
+        stage->run_idle_work();
+        xEventGroupClearBits(this->event_group_, idle_work_bit);
+      }
+    }
+
+    if (active_count == 0) {
+      continue;
+    }
+
+    // Cleared before the steps, so a port that moves data while they run ends the wait below right away
+    xEventGroupClearBits(this->event_group_, wake_bit);
+
+    bool progressed = false;
+    for (size_t i = 0; i < this->stage_count_; ++i) {
+      AudioStage *stage = this->stages_[i];
+      if ((stage->task_ != task.index) || (states[i] == StageState::IDLE)) {
+        continue;
+      }
+
+      const EventBits_t finished_bit = stage_bit(STAGE_MESSAGE_FINISHED_FIRST, i);
+
+      // Checked before every step, as a stage that failed earlier in the round may have freed data a later stage in
+      // the task still points at
+      if (xEventGroupGetBits(this->event_group_) & GRAPH_COMMAND_STOP) {
+        if (states[i] == StageState::RUNNING) {
+          stage->finish();
+        }
+        states[i] = StageState::IDLE;
+        --active_count;
+        xEventGroupSetBits(this->event_group_, finished_bit);
+        continue;
+      }
+
+      const TickType_t now = xTaskGetTickCount();
+      if ((states[i] == StageState::RUNNING) && this->is_resumable_(stage, awaits[i], woken, now - stepped_ticks[i])) {
+        awaits[i] = stage->step();
+        stepped_ticks[i] = now;
+
+        switch (awaits[i].kind) {
+          case StageAwait::Kind::READY:
+            progressed = true;
+            break;
+          case StageAwait::Kind::INPUT:
+          case StageAwait::Kind::OUTPUT:
+          case StageAwait::Kind::POLL:
+            break;
+          case StageAwait::Kind::FINISHED:
+            stage->finish();
+            for (AudioPort *port : stage->outputs_) {
+              if (port != nullptr) {
+                port->end_();
+              }
+            }
+            states[i] = StageState::DRAINING;
+            progressed = true;
+            break;
+          case StageAwait::Kind::FAILED:
+            stage->finish();
+            xEventGroupSetBits(this->event_group_, stage_bit(STAGE_MESSAGE_FAILED_FIRST, i) | GRAPH_COMMAND_STOP);
+            states[i] = StageState::IDLE;
+            --active_count;
+            xEventGroupSetBits(this->event_group_, finished_bit);
+            progressed = true;
+            break;
+        }
+      }
+
+      if ((states[i] == StageState::DRAINING) && this->is_drained_(stage)) {
+        states[i] = StageState::IDLE;
+        --active_count;
+        xEventGroupSetBits(this->event_group_, finished_bit);
+        progressed = true;
+      }
+    }
+
+    woken = progressed;
+    if ((active_count == 0) || progressed) {
+      continue;
+    }
+
+    // Ports between stages in the same task don't wake it, so a step may have met another stage's await, or drained
+    // a finished stage, without anything waking the task. Otherwise sleep until the earliest poll's timeout.
+    const TickType_t now = xTaskGetTickCount();
+    TickType_t wait_ticks = portMAX_DELAY;
+    bool resumable = false;
+    for (size_t i = 0; i < this->stage_count_; ++i) {
+      AudioStage *stage = this->stages_[i];
+      if ((stage->task_ != task.index) || (states[i] == StageState::IDLE)) {
+        continue;
+      }
+      if (states[i] == StageState::DRAINING) {
+        resumable = resumable || this->is_drained_(stage);
+        continue;
+      }
+
+      const TickType_t elapsed = now - stepped_ticks[i];
+      resumable = resumable || this->is_resumable_(stage, awaits[i], false, elapsed);
+      if (awaits[i].kind == StageAwait::Kind::POLL) {
+        const TickType_t timeout = pdMS_TO_TICKS(awaits[i].value);
+        wait_ticks = std::min(wait_ticks, (elapsed < timeout) ? (timeout - elapsed) : 0);
+      }
+    }
+
+    if (!resumable) {
+      // A port moving data, a stage being woken or starting, a stop, or a poll's timeout ends the wait
+      EventBits_t event_bits = xEventGroupWaitBits(this->event_group_, wake_bit | start_bits | GRAPH_COMMAND_STOP,
+                                                   pdFALSE, pdFALSE, wait_ticks);
+      woken = (event_bits & wake_bit) != 0;
+    }
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
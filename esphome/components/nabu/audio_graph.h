@@ -0,0 +1,440 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "esphome/components/audio/audio.h"
+#include "esphome/components/media_player/media_player.h"
+
+#include "esphome/core/ring_buffer.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace esphome {
+namespace nabu {
+
+// A small audio graph: stages connected by typed ports, scheduled on a few FreeRTOS tasks.
+//  - A port carries one stream from the stage that writes it to the stage that reads it. Its reader sets a constraint
+//    on the formats it accepts, and its writer negotiates the stream's format before writing: the format is checked
+//    against the constraint, the port's buffer is sized for it, and the reader is started once all its required
+//    inputs have a format.
+//  - A port is either a ring buffer, or a direct handoff between two stages in the same task, where the reader reads
+//    the writer's data in place. Ports never block; a stage that can't move data returns what it waits for, e.g., a
+//    number of input bytes, and the task only steps it again once that holds.
+//  - Once a stage finishes, its outputs end. The stage only counts as finished once its readers took all of the data,
+//    and a reader can close its input to tell the writer it doesn't need the rest.
+//  - Any number of stages share a task; the task steps its running stages in the order they were added.
+//  - The reader of a port may be in another graph, e.g., the mixer reads the ports the pipelines write to.
+
+class AudioGraph;
+class AudioStage;
+
+enum class PortDataType : uint8_t {
+  NONE = 0,  // Not negotiated yet
+  ENCODED,   // The bytes of a media file; the file type says which
+  PCM,       // Interleaved samples described by the stream info
+};
+
+struct PortFormat {
+  PortDataType data_type{PortDataType::NONE};
+  media_player::MediaFileType file_type{media_player::MediaFileType::NONE};
+  audio::AudioStreamInfo stream_info{};
+
+  static PortFormat encoded(media_player::MediaFileType file_type);
+  static PortFormat pcm(const audio::AudioStreamInfo &stream_info);
+
+  /// @brief Size of a PCM frame in bytes, or 1 for encoded data
+  size_t get_frame_size() const;
+
+  /// @brief Bytes per second of PCM audio, or 0 for encoded data
+  size_t get_byte_rate() const;
+};
+
+// Which part of a format a port's constraint rejected
+enum class FormatMismatch : uint8_t {
+  NONE = 0,
+  DATA_TYPE,
+  BITS_PER_SAMPLE,
+  CHANNELS,
+  SAMPLE_RATE,
+};
+
+// The formats a port's reader accepts. Fields that are 0 (or NONE) accept any value.
+struct PortConstraint {
+  PortDataType data_type{PortDataType::NONE};
+  uint8_t bits_per_sample{0};
+  uint8_t wide_bits_per_sample{0};  // A second accepted sample size, for readers that also take higher precision audio
+  uint8_t min_channels{0};
+  uint8_t max_channels{0};
+  uint32_t sample_rate{0};
+
+  static PortConstraint encoded();
+  static PortConstraint pcm(uint8_t bits_per_sample, uint8_t min_channels, uint8_t max_channels,
+                            uint32_t sample_rate = 0);
+
+  /// @brief Checks a format against the constraint
+  /// @return FormatMismatch::NONE if the format is accepted, or the first part that isn't
+  FormatMismatch check(const PortFormat &format) const;
+
+  /// @brief Gets the only PCM format the constraint accepts
+  /// @param format set to the format
+  /// @return false if the constraint accepts more than one format. A wide sample size is never fixed.
+  bool get_fixed_format(PortFormat &format) const;
+};
+
+class AudioPort {
+ public:
+  /// @brief Sets the formats the port's reader accepts. Only call while neither stage runs.
+  void set_constraint(const PortConstraint &constraint) { this->constraint_ = constraint; }
+  const PortConstraint &get_constraint() const { return this->constraint_; }
+
+  /// @brief Has the writer size the buffer for a duration of audio in the negotiated format, instead of using the
+  /// buffer allocated with ``allocate``. Only call while neither stage runs.
+  /// @param duration_ms duration of PCM audio the buffer holds
+  /// @param min_size lower bound on the buffer size in bytes
+  /// @param max_size upper bound on the buffer size in bytes
+  void set_buffer_duration(uint32_t duration_ms, size_t min_size, size_t max_size);
+
+  /// @brief Makes the port a direct handoff between two stages in the same task, without a buffer. A write offers the
+  /// writer's data, the reader reads it in place, and the next write reports how much of it was read. The writer must
+  /// leave the data it offered unchanged until then. Only call while neither stage runs.
+  void set_direct(bool direct) { this->direct_ = direct; }
+  bool is_direct() const { return this->direct_; }
+
+  /// @brief Allocates the port's ring buffer, replacing it if it has a different size. Only call while neither stage
+  /// runs.
+  /// @param size size of the ring buffer in bytes
+  /// @return ESP_OK if successful or ESP_ERR_NO_MEM otherwise
+  esp_err_t allocate(size_t size);
+
+  /// @brief Frees the port's ring buffer. Only call while neither stage runs.
+  void release();
+
+  /// @brief Bytes allocated for the port's ring buffer. Safe to call from any task.
+  size_t get_buffer_size() const { return this->buffer_size_.load(std::memory_order_relaxed); }
+
+  /// @brief Discards the buffered data and wakes the writer. Only the reader may call this while the writer runs.
+  void reset();
+
+  // Writer side
+
+  /// @brief Writes as much of the data as fits without blocking, and wakes the reader. Writes to a closed port are
+  /// dropped.
+  /// @return number of bytes written; for a direct port, the number of bytes of the previous offer that were read
+  size_t write(const void *data, size_t length);
+
+  /// @brief Bytes that can be written without blocking
+  size_t free() const;
+
+  /// @brief Whether the reader closed the port, so the writer can stop
+  bool is_closed() const { return this->closed_.load(std::memory_order_acquire); }
+
+  /// @brief Has the reader continue with another port's data once it read everything written to this port. The
+  /// source's reader stops after the given number of bytes and closes the source. Used to hand off the rest of a
+  /// stream without copying it, e.g., the PCM after a WAV header. Only call before the writer finishes.
+  /// @param source port to continue with; its reader must be this port's writer, and becomes this port's reader
+  /// @param length number of bytes to read from the source
+  void splice(AudioPort *source, size_t length);
+
+  // Reader side
+
+  /// @brief Reads up to length bytes without blocking, and wakes the writer
+  /// @return number of bytes read
+  size_t read(void *data, size_t length);
+
+  /// @brief Bytes that can be read without blocking
+  size_t available() const;
+
+  /// @brief Gets the unread part of a direct port's offer, so it can be used in place
+  /// @param length set to the length of the unread data in bytes
+  /// @return start of the unread data, or nullptr if there is none or the port isn't direct
+  const uint8_t *peek(size_t &length) const;
+
+  /// @brief Marks bytes at the start of a direct port's offer as read
+  void consume(size_t length);
+
+  /// @brief Whether the writer has written all of the stream
+  bool is_ended() const { return this->ended_.load(std::memory_order_acquire); }
+
+  /// @brief Whether the writer has written all of the stream, and all of it was read
+  bool is_finished() const;
+
+  /// @brief The negotiated format; only valid once the reading stage has started
+  const PortFormat &get_format() const { return this->format_; }
+
+  /// @brief Tells the writer the rest of the stream isn't needed
+  void close();
+
+ protected:
+  friend class AudioGraph;
+  friend class AudioStage;
+
+  /// @brief Sets the negotiated format and sizes the buffer for it if the port holds a duration of audio
+  esp_err_t set_format_(const PortFormat &format);
+  bool has_format_() const { return this->negotiated_.load(std::memory_order_acquire); }
+
+  /// @brief Marks the end of the stream and wakes the reader
+  void end_();
+
+  /// @brief Whether everything the writer wrote was read, or the reader closed the port
+  bool is_drained_() const;
+
+  /// @brief Clears the stream's format, end, close, splice, and offer. Only call while the writer isn't running.
+  void reset_stream_();
+
+  /// @brief Whether the reader can read the bytes, or the stream ended
+  bool can_read_(size_t bytes) const;
+
+  /// @brief Whether the writer can write the bytes, or as many as the buffer holds, or the reader closed the port
+  bool can_write_(size_t bytes) const;
+
+  /// @brief Reads from the spliced source once the port's own data is drained
+  size_t read_spliced_(uint8_t *data, size_t length);
+
+  /// @brief Bytes in the ring buffer or the unread part of the offer, not counting the splice
+  size_t buffered_() const;
+
+  /// @brief Wakes the stage on the other side, unless it shares the task with this side
+  void wake_reader_();
+  void wake_writer_();
+
+  std::unique_ptr<RingBuffer> ring_buffer_;
+  std::atomic<size_t> buffer_size_{0};
+
+  PortConstraint constraint_;
+  PortFormat format_;
+  std::atomic<bool> negotiated_{false};
+
+  uint32_t buffer_duration_ms_{0};
+  size_t min_buffer_size_{0};
+  size_t max_buffer_size_{0};
+
+  bool direct_{false};
+  // The direct port's offer; only used by the two stages, which share a task
+  const uint8_t *offer_data_{nullptr};
+  size_t offer_length_{0};
+  size_t offer_read_{0};
+
+  // The stages on either side; set while the graphs are stopped and read by the other side to wake it
+  std::atomic<AudioStage *> writer_{nullptr};
+  std::atomic<AudioStage *> reader_{nullptr};
+
+  std::atomic<bool> ended_{false};   // Set by the writer's graph once the writer finished
+  std::atomic<bool> closed_{false};  // Set by the reader
+
+  // Published to the reader by ended_; afterwards only used by the reader
+  AudioPort *splice_source_{nullptr};
+  size_t splice_bytes_left_{0};
+};
+
+// What a stage waits for before it steps again. Every step returns one, which suspends the stage until its condition
+// holds. The stage only keeps its position in the stream between steps; the graph decides when stepping it again is
+// worthwhile, so a stage never spins on a port that can't move data, and any number of suspended stages share a task.
+struct StageAwait {
+  enum class Kind : uint8_t {
+    READY,     // Step again right away
+    INPUT,     // Until an input has the bytes to read, or as many as its buffer holds, or its writer ended it
+    OUTPUT,    // Until an output has room for the bytes, or as many as its buffer holds, or its reader closed it
+    POLL,      // Until a port the task's stages use moves data, the stage is woken, or the timeout elapses
+    FINISHED,  // Done with the stream; its outputs end
+    FAILED,    // Stops the graph
+  };
+
+  Kind kind{Kind::READY};
+  uint8_t port{0};    // Index of the input or output
+  uint32_t value{0};  // Bytes for INPUT and OUTPUT, milliseconds for POLL
+
+  static StageAwait ready();
+  static StageAwait input(size_t input, size_t bytes);
+  static StageAwait output(size_t output, size_t bytes);
+  static StageAwait poll(uint32_t timeout_ms);
+  static StageAwait finished();
+  static StageAwait failed();
+};
+
+// Number of inputs and outputs a stage can have
+static const size_t MAX_STAGE_PORTS = 3;
+
+class AudioStage {
+ public:
+  virtual ~AudioStage() = default;
+
+  /// @brief Sets up the stage for a stream. Runs in the stage's task once the graph starts, for a stage without
+  /// required inputs, or once all its required inputs have a format.
+  /// @return ESP_OK, or an error that fails the stage and stops the graph
+  virtual esp_err_t start() = 0;
+
+  /// @brief Moves the next block of data. Runs in the stage's task once the previous step's await holds, until the
+  /// stage finishes or fails, or the graph stops.
+  /// @return what the stage waits for before its next step
+  virtual StageAwait step() = 0;
+
+  /// @brief Releases what the stage set up for the stream. Runs in the stage's task after every start, once the
+  /// stage finished, failed, or was stopped.
+  virtual void finish() {}
+
+  /// @brief Optional work requested with ``AudioGraph::request_idle_work``. Runs in the stage's task while no stage in
+  /// the task is running.
+  virtual void run_idle_work() {}
+
+  AudioPort *get_input(size_t input) const { return this->inputs_[input]; }
+  AudioPort *get_output(size_t output) const { return this->outputs_[output]; }
+
+  /// @brief Wakes the stage's task, so a polling stage steps again. Safe to call from any task.
+  void wake();
+
+ protected:
+  friend class AudioGraph;
+  friend class AudioPort;
+
+  /// @brief Negotiates an output's format: checks it against the port's constraint, sizes the port's buffer, and
+  /// starts the port's reader once all its required inputs have a format. Only call from start or step.
+  /// @param output index of the output
+  /// @param format the stream's format
+  /// @param mismatch set to the part of the format the constraint rejected, if given
+  /// @return ESP_OK, ESP_ERR_NOT_SUPPORTED if the reader doesn't accept the format, or ESP_ERR_NO_MEM
+  esp_err_t set_output_format_(size_t output, const PortFormat &format, FormatMismatch *mismatch = nullptr);
+
+  /// @brief Whether the stage shares a task with another stage, so waking it is unnecessary
+  bool shares_task_with_(const AudioStage *other) const;
+
+  AudioGraph *graph_{nullptr};
+  uint8_t index_{0};
+  uint8_t task_{0};
+  std::array<AudioPort *, MAX_STAGE_PORTS> inputs_{};
+  std::array<AudioPort *, MAX_STAGE_PORTS> outputs_{};
+  uint8_t required_inputs_{0};  // Bit mask of the inputs that need a format before the stage starts
+};
+
+// Number of stages and tasks a graph can have; the event group has a few bits for each
+static const size_t MAX_GRAPH_STAGES = 4;
+static const size_t MAX_GRAPH_TASKS = 4;
+
+class AudioGraph {
+ public:
+  /// @brief Adds a task for stages to run in. Only call before ``create_tasks``.
+  /// @param name_suffix appended to the name given to ``create_tasks``
+  /// @param stack_size stack size in bytes
+  /// @return the task's index
+  uint8_t add_task(const char *name_suffix, uint32_t stack_size);
+
+  /// @brief Adds a stage that runs in a task. Only call before ``create_tasks``.
+  void add_stage(AudioStage *stage, uint8_t task);
+
+  /// @brief Makes a stage the writer of a port. Only call while the graph is idle.
+  void connect_output(AudioStage *stage, size_t output, AudioPort *port);
+
+  /// @brief Makes a stage the reader of a port. Only call while the graph is idle.
+  /// @param required whether the stage waits for the input's format before it starts. Stages without required inputs
+  /// start with the graph.
+  void connect_input(AudioStage *stage, size_t input, AudioPort *port, bool required = true);
+
+  /// @brief Allocates the task stacks and event group and creates the tasks if they don't exist yet
+  /// @param name FreeRTOS task name; each task appends its suffix
+  /// @param priority FreeRTOS task priority
+  /// @return ESP_OK if successful, ESP_ERR_NO_MEM, or ESP_FAIL if a task couldn't be created
+  esp_err_t create_tasks(const std::string &name, UBaseType_t priority);
+
+  /// @brief Deletes the tasks. Stages that were still running are abandoned without finishing.
+  void delete_tasks();
+
+  /// @brief Frees the task stacks. Only has an effect once the tasks are deleted.
+  void release_task_stacks();
+
+  bool has_tasks() const { return (this->task_count_ > 0) && (this->tasks_[0].handle != nullptr); }
+
+  /// @brief Starts the stages without required inputs; the others start as their inputs are negotiated
+  /// @return ESP_OK, or ESP_ERR_INVALID_STATE if the tasks don't exist or the graph isn't idle
+  esp_err_t start();
+
+  /// @brief Stops the running stages and waits until they finished, then resets the streams of the ports the stages
+  /// write to and clears the failures. Stages that don't finish in time are marked as failed instead.
+  /// @param timeout_ms how long to wait
+  /// @return ESP_OK if successful or ESP_ERR_TIMEOUT otherwise
+  esp_err_t stop(uint32_t timeout_ms);
+
+  /// @brief Whether no stage is running or waiting to start
+  bool is_idle() const;
+
+  /// @brief Whether the graph was told to stop or a stage failed
+  bool is_stopping() const;
+
+  /// @brief Whether a stage isn't running or waiting to start
+  bool is_stage_finished(const AudioStage *stage) const;
+
+  /// @brief Whether a stage failed since the graph last stopped
+  bool has_stage_failed(const AudioStage *stage) const;
+
+  /// @brief Whether a stage failed since the last call; clears the failure
+  bool take_stage_failure(const AudioStage *stage);
+
+  /// @brief Asks a stage's task to run the stage's idle work once no stage in it is running
+  /// @return false if the idle work is already pending
+  bool request_idle_work(AudioStage *stage);
+
+  /// @brief Whether a stage's idle work was requested and hasn't completed
+  bool is_idle_work_pending(const AudioStage *stage) const;
+
+  void suspend_tasks();
+  void resume_tasks();
+
+  /// @brief Bytes allocated for the task stacks
+  size_t get_memory_usage() const;
+
+ protected:
+  friend class AudioStage;
+
+  struct Task {
+    AudioGraph *graph{nullptr};
+    uint8_t index{0};
+    const char *name_suffix{""};
+    uint32_t stack_size{0};
+    TaskHandle_t handle{nullptr};
+    StaticTask_t tcb;
+    StackType_t *stack{nullptr};
+  };
+
+  static void task_(void *params);
+
+  /// @brief Starts and steps the task's stages; never returns
+  void run_task_(Task &task);
+
+  /// @brief Starts the stage once all its required inputs have a format
+  void start_when_ready_(AudioStage *stage);
+
+  /// @brief Clears the stage's finished bit and sets its start bit
+  void schedule_start_(AudioStage *stage);
+
+  /// @brief Sets the bit that wakes a task
+  void wake_task_(uint8_t task);
+
+  /// @brief Whether a running stage's await holds, so it can step again
+  /// @param woken whether a port the task's stages use moved data since the stage last stepped
+  /// @param poll_elapsed ticks since the stage last stepped, for a poll's timeout
+  bool is_resumable_(const AudioStage *stage, const StageAwait &await, bool woken, TickType_t poll_elapsed) const;
+
+  /// @brief Whether every output of a finished stage was read completely or closed
+  bool is_drained_(const AudioStage *stage) const;
+
+  EventBits_t get_finished_bits_() const;
+
+  EventGroupHandle_t event_group_{nullptr};
+
+  // The tasks point at their entry, so the array never moves
+  std::array<Task, MAX_GRAPH_TASKS> tasks_;
+  size_t task_count_{0};
+
+  std::array<AudioStage *, MAX_GRAPH_STAGES> stages_{};
+  size_t stage_count_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
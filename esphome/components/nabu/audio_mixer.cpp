@@ -2,23 +2,78 @@
 
 #include "audio_mixer.h"
 
-#include <dsp.h>
-
 #include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
 
 namespace esphome {
 namespace nabu {
 
+// The buffers cover a fixed duration at the output sample rate, up to the size needed at 48 kHz
 static const size_t INPUT_RING_BUFFER_SAMPLES = 24000;
+static const uint32_t INPUT_RING_BUFFER_DURATION_MS = 250;
 static const size_t OUTPUT_BUFFER_SAMPLES = 8192;
+static const uint32_t OUTPUT_BUFFER_DURATION_MS = 85;
 static const size_t QUEUE_COUNT = 20;
 
 static const uint32_t TASK_STACK_SIZE = 3072;
 static const size_t TASK_DELAY_MS = 25;
 
-static const int16_t MAX_AUDIO_SAMPLE_VALUE = INT16_MAX;
-static const int16_t MIN_AUDIO_SAMPLE_VALUE = INT16_MIN;
+void StreamFade::fade_to(int32_t new_target, size_t transition_samples) {
+  this->target = new_target;
+  if (transition_samples == 0) {
+    this->gain = new_target;
+    this->step = 0;
+  } else {
+    this->step = (new_target - this->gain) / static_cast<int32_t>(std::min<size_t>(transition_samples, INT32_MAX));
+    if (this->step == 0) {
+      this->step = (new_target > this->gain) ? 1 : -1;
+    }
+  }
+}
+
+size_t StreamFade::samples_until_held() const {
+  if ((this->target != 0) || (this->gain == 0)) {
+    return SIZE_MAX;
+  }
+  int64_t steps = (static_cast<int64_t>(this->gain) - this->step - 1) / -static_cast<int64_t>(this->step);
+  return static_cast<size_t>((steps + 1) & ~static_cast<int64_t>(1));
+}
+
+template<typename T> void StreamFade::apply(T *samples, size_t samples_to_fade) {
+  if ((this->gain == FADE_UNITY_GAIN) && (this->target == FADE_UNITY_GAIN)) {
+    return;
+  }
+  for (size_t i = 0; i < samples_to_fade; ++i) {
+    if (this->gain != this->target) {
+      this->gain += this->step;
+      if ((this->step > 0) ? (this->gain > this->target) : (this->gain < this->target)) {
+        this->gain = this->target;
+      }
+    }
+    samples[i] = SampleTraits<T>::apply_gain(samples[i], this->gain >> 16);
+  }
+}
+
+AudioMixer::AudioMixer() {
+  uint8_t task = this->graph_.add_task("", TASK_STACK_SIZE);
+  this->graph_.add_stage(&this->stage_, task);
+
+  // None of the streams has to be playing for the mixer to run
+  for (uint8_t i = 0; i < MEDIA_INPUT_COUNT; ++i) {
+    this->graph_.connect_input(&this->stage_, i, &this->media_ports_[i], false);
+  }
+  this->graph_.connect_input(&this->stage_, MEDIA_INPUT_COUNT, &this->announcement_port_, false);
+}
+
+BaseType_t AudioMixer::send_command(CommandEvent *command, TickType_t ticks_to_wait) {
+  if (!this->graph_.has_tasks()) {
+    return pdFALSE;
+  }
+  BaseType_t result = xQueueSend(this->command_queue_, command, ticks_to_wait);
+  // The stage may be waiting for audio or for the speaker
+  this->stage_.wake();
+  return result;
+}
 
 esp_err_t AudioMixer::start(speaker::Speaker *speaker, const std::string &task_name, UBaseType_t priority) {
   esp_err_t err = this->allocate_buffers_();
@@ -27,354 +82,466 @@ esp_err_t AudioMixer::start(speaker::Speaker *speaker, const std::string &task_n
     return err;
   }
 
-  if (this->task_handle_ == nullptr) {
-    this->task_handle_ = xTaskCreateStatic(AudioMixer::audio_mixer_task_, task_name.c_str(), TASK_STACK_SIZE,
-                                           (void *) this, priority, this->stack_buffer_, &this->task_stack_);
-  }
+  this->speaker_ = speaker;
 
-  if (this->task_handle_ == nullptr) {
-    return ESP_FAIL;
+  bool running = this->graph_.has_tasks();
+  err = this->graph_.create_tasks(task_name, priority);
+  if ((err == ESP_OK) && !running) {
+    err = this->graph_.start();
   }
 
-  this->speaker_ = speaker;
-
-  return ESP_OK;
+  return err;
 }
 
 void AudioMixer::stop() {
-  vTaskDelete(this->task_handle_);
-  this->task_handle_ = nullptr;
+  this->graph_.delete_tasks();
 
   xQueueReset(this->event_queue_);
   xQueueReset(this->command_queue_);
 }
 
-void AudioMixer::suspend_task() {
-  if (this->task_handle_ != nullptr) {
-    vTaskSuspend(this->task_handle_);
+void AudioMixer::release_buffers() {
+  if (this->graph_.has_tasks()) {
+    return;
+  }
+
+  for (auto &media_port : this->media_ports_) {
+    media_port.release();
   }
+  this->announcement_port_.release();
+
+  this->graph_.release_task_stacks();
 }
 
-void AudioMixer::resume_task() {
-  if (this->task_handle_ != nullptr) {
-    vTaskResume(task_handle_);
+size_t AudioMixer::get_memory_usage() const {
+  size_t bytes = this->graph_.get_memory_usage() + this->announcement_port_.get_buffer_size();
+  for (const auto &media_port : this->media_ports_) {
+    bytes += media_port.get_buffer_size();
   }
+  if (this->graph_.has_tasks())
+    bytes += 3 * this->get_output_buffer_samples_() * this->get_sample_size_();  // The stage's work buffers
+  return bytes;
 }
 
-void AudioMixer::audio_mixer_task_(void *params) {
-  AudioMixer *this_mixer = (AudioMixer *) params;
+size_t AudioMixer::get_input_ring_buffer_size_() const {
+  size_t samples = this->sample_rate_ * 2 * INPUT_RING_BUFFER_DURATION_MS / 1000;
+  return std::min(samples, INPUT_RING_BUFFER_SAMPLES) * this->get_sample_size_();
+}
 
-  TaskEvent event;
-  CommandEvent command_event;
+size_t AudioMixer::get_output_buffer_samples_() const {
+  // Whole stereo frames
+  size_t samples = (this->sample_rate_ * 2 * OUTPUT_BUFFER_DURATION_MS / 1000) & ~static_cast<size_t>(1);
+  return std::min(samples, OUTPUT_BUFFER_SAMPLES);
+}
 
-  ExternalRAMAllocator<int16_t> allocator(ExternalRAMAllocator<int16_t>::ALLOW_FAILURE);
-  int16_t *media_buffer = allocator.allocate(OUTPUT_BUFFER_SAMPLES);
-  int16_t *announcement_buffer = allocator.allocate(OUTPUT_BUFFER_SAMPLES);
-  int16_t *combination_buffer = allocator.allocate(OUTPUT_BUFFER_SAMPLES);
+void AudioMixer::suspend_task() { this->graph_.suspend_tasks(); }
 
-  int16_t *combination_buffer_current = combination_buffer;
-  size_t combination_buffer_length = 0;
+void AudioMixer::resume_task() { this->graph_.resume_tasks(); }
 
-  if ((media_buffer == nullptr) || (announcement_buffer == nullptr)) {
-    event.type = EventType::WARNING;
-    event.err = ESP_ERR_NO_MEM;
-    xQueueSend(this_mixer->event_queue_, &event, portMAX_DELAY);
+esp_err_t AudioMixer::allocate_media_input(uint8_t media_input) {
+  AudioPort &media_port = this->media_ports_[media_input];
+  if (media_port.get_buffer_size() == 0)
+    media_port.allocate(this->get_input_ring_buffer_size_());
 
-    event.type = EventType::STOPPED;
-    event.err = ESP_OK;
-    xQueueSend(this_mixer->event_queue_, &event, portMAX_DELAY);
+  if (media_port.get_buffer_size() == 0) {
+    return ESP_ERR_NO_MEM;
+  }
 
-    while (true) {
-      delay(TASK_DELAY_MS);
+  return ESP_OK;
+}
+
+esp_err_t AudioMixer::allocate_buffers_() {
+  if (!this->graph_.has_tasks()) {
+    // The pipelines negotiate their output format against this, so they convert the audio to the mixer's format
+    PortConstraint constraint = PortConstraint::pcm(this->bits_per_sample_, 2, 2, this->sample_rate_);
+    for (auto &media_port : this->media_ports_) {
+      media_port.set_constraint(constraint);
     }
+    this->announcement_port_.set_constraint(constraint);
+  }
 
-    return;
+  if (this->announcement_port_.get_buffer_size() == 0)
+    this->announcement_port_.allocate(this->get_input_ring_buffer_size_());
+
+  if ((this->announcement_port_.get_buffer_size() == 0) || (this->allocate_media_input(0) != ESP_OK)) {
+    return ESP_ERR_NO_MEM;
   }
 
-  // Handles media stream pausing
-  bool transfer_media = true;
-
-  // Parameters to control the ducking dB reduction and its transitions
-  // There is a built in negative sign; e.g., reducing by 5 dB is changing the gain by -5 dB
-  int8_t target_ducking_db_reduction = 0;
-  int8_t current_ducking_db_reduction = 0;
-
-  // Each step represents a change in 1 dB. Positive 1 means the dB reduction is increasing. Negative 1 means the dB
-  // reduction is decreasing.
-  int8_t db_change_per_ducking_step = 1;
-
-  size_t ducking_transition_samples_remaining = 0;
-  size_t samples_per_ducking_step = 0;
-
-  event.type = EventType::STARTED;
-  xQueueSend(this_mixer->event_queue_, &event, portMAX_DELAY);
-
-  while (true) {
-    if (xQueueReceive(this_mixer->command_queue_, &command_event, 0) == pdTRUE) {
-      if (command_event.command == CommandEventType::STOP) {
-        break;
-      } else if (command_event.command == CommandEventType::DUCK) {
-        if (target_ducking_db_reduction != command_event.decibel_reduction) {
-          current_ducking_db_reduction = target_ducking_db_reduction;
-
-          target_ducking_db_reduction = command_event.decibel_reduction;
-
-          uint8_t total_ducking_steps = 0;
-          if (target_ducking_db_reduction > current_ducking_db_reduction) {
-            // The dB reduction level is increasing (which results in quieter audio)
-            total_ducking_steps = target_ducking_db_reduction - current_ducking_db_reduction - 1;
-            db_change_per_ducking_step = 1;
-          } else {
-            // The dB reduction level is decreasing (which results in louder audio)
-            total_ducking_steps = current_ducking_db_reduction - target_ducking_db_reduction - 1;
-            db_change_per_ducking_step = -1;
-          }
-          if (total_ducking_steps > 0) {
-            ducking_transition_samples_remaining = command_event.transition_samples;
-
-            samples_per_ducking_step = ducking_transition_samples_remaining / total_ducking_steps;
-          } else {
-            ducking_transition_samples_remaining = 0;
-          }
-        }
-      } else if (command_event.command == CommandEventType::PAUSE_MEDIA) {
-        transfer_media = false;
-      } else if (command_event.command == CommandEventType::RESUME_MEDIA) {
-        transfer_media = true;
-      } else if (command_event.command == CommandEventType::CLEAR_MEDIA) {
-        this_mixer->media_ring_buffer_->reset();
-      } else if (command_event.command == CommandEventType::CLEAR_ANNOUNCEMENT) {
-        this_mixer->announcement_ring_buffer_->reset();
-      }
+  if (this->event_queue_ == nullptr)
+    this->event_queue_ = xQueueCreate(QUEUE_COUNT, sizeof(TaskEvent));
+
+  if (this->command_queue_ == nullptr)
+    this->command_queue_ = xQueueCreate(QUEUE_COUNT, sizeof(CommandEvent));
+
+  if ((this->event_queue_ == nullptr) || (this->command_queue_ == nullptr)) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+void AudioMixer::reset_ports_() {
+  for (auto &media_port : this->media_ports_) {
+    media_port.reset();
+  }
+  this->announcement_port_.reset();
+}
+
+void MixerStage::send_event_(EventType type, esp_err_t err) {
+  TaskEvent event;
+  event.type = type;
+  event.err = err;
+  xQueueSend(this->mixer_->event_queue_, &event, portMAX_DELAY);
+}
+
+esp_err_t MixerStage::start() {
+  this->output_buffer_samples_ = this->mixer_->get_output_buffer_samples_();
+  this->sample_size_ = this->mixer_->get_sample_size_();
+  if (this->sample_size_ == sizeof(int32_t)) {
+    this->mix_block_kernel_ = &MixerStage::mix_block_<int32_t>;
+  } else {
+    this->mix_block_kernel_ = &MixerStage::mix_block_<int16_t>;
+  }
+
+  const size_t buffer_size = this->output_buffer_samples_ * this->sample_size_;
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  this->media_buffer_ = allocator.allocate(buffer_size);
+  this->announcement_buffer_ = allocator.allocate(buffer_size);
+  this->combination_buffer_ = allocator.allocate(buffer_size);
+
+  if ((this->media_buffer_ == nullptr) || (this->announcement_buffer_ == nullptr) ||
+      (this->combination_buffer_ == nullptr)) {
+    this->send_event_(EventType::WARNING, ESP_ERR_NO_MEM);
+    return ESP_ERR_NO_MEM;
+  }
+  this->combination_buffer_length_ = 0;
+
+  this->transfer_media_ = true;
+  this->active_media_input_ = 0;
+  this->queued_media_input_.reset();
+
+  this->target_ducking_db_reduction_ = 0;
+  this->current_ducking_db_reduction_ = 0;
+  this->db_change_per_ducking_step_ = 1;
+  this->ducking_transition_samples_remaining_ = 0;
+  this->samples_per_ducking_step_ = 0;
+
+  this->announcement_file_current_ = nullptr;
+  this->announcement_file_remaining_ = 0;
+  this->announcement_file_playing_ = false;
+
+  for (auto &media_fade : this->media_fades_) {
+    media_fade.reset();
+  }
+  this->announcement_fade_.reset();
+
+  this->send_event_(EventType::STARTED);
+
+  return ESP_OK;
+}
+
+void MixerStage::finish() {
+  this->send_event_(EventType::STOPPING);
+
+  this->mixer_->reset_ports_();
+
+  const size_t buffer_size = this->output_buffer_samples_ * this->sample_size_;
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  if (this->media_buffer_ != nullptr) {
+    allocator.deallocate(this->media_buffer_, buffer_size);
+    this->media_buffer_ = nullptr;
+  }
+  if (this->announcement_buffer_ != nullptr) {
+    allocator.deallocate(this->announcement_buffer_, buffer_size);
+    this->announcement_buffer_ = nullptr;
+  }
+  if (this->combination_buffer_ != nullptr) {
+    allocator.deallocate(this->combination_buffer_, buffer_size);
+    this->combination_buffer_ = nullptr;
+  }
+
+  this->send_event_(EventType::STOPPED);
+}
+
+bool MixerStage::handle_command_(const CommandEvent &command_event) {
+  AudioPort *announcement_port = this->get_input(MEDIA_INPUT_COUNT);
+
+  if ((command_event.command == CommandEventType::STOP) ||
+      (command_event.command == CommandEventType::CLEAR_ANNOUNCEMENT) ||
+      (command_event.command == CommandEventType::PLAY_ANNOUNCEMENT_FILE)) {
+    if (this->announcement_file_playing_) {
+      this->announcement_file_playing_ = false;
+      this->announcement_file_remaining_ = 0;
+      this->send_event_(EventType::ANNOUNCEMENT_FILE_FINISHED);
     }
+  }
+
+  if (command_event.command == CommandEventType::STOP) {
+    return false;
+  } else if (command_event.command == CommandEventType::DUCK) {
+    if (this->target_ducking_db_reduction_ != command_event.decibel_reduction) {
+      this->current_ducking_db_reduction_ = this->target_ducking_db_reduction_;
 
-    if (combination_buffer_length > 0) {
-      size_t output_bytes_written = this_mixer->speaker_->play((uint8_t *) combination_buffer,
-                                                               combination_buffer_length, pdMS_TO_TICKS(TASK_DELAY_MS));
-      combination_buffer_length -= output_bytes_written;
-      if ((combination_buffer_length > 0) && (output_bytes_written > 0)) {
-        memmove(combination_buffer, combination_buffer + output_bytes_written / sizeof(int16_t),
-                combination_buffer_length);
+      this->target_ducking_db_reduction_ = command_event.decibel_reduction;
+
+      uint8_t total_ducking_steps = 0;
+      if (this->target_ducking_db_reduction_ > this->current_ducking_db_reduction_) {
+        // The dB reduction level is increasing (which results in quieter audio)
+        total_ducking_steps = this->target_ducking_db_reduction_ - this->current_ducking_db_reduction_ - 1;
+        this->db_change_per_ducking_step_ = 1;
+      } else {
+        // The dB reduction level is decreasing (which results in louder audio)
+        total_ducking_steps = this->current_ducking_db_reduction_ - this->target_ducking_db_reduction_ - 1;
+        this->db_change_per_ducking_step_ = -1;
       }
-    } else {
-      size_t media_available = this_mixer->media_ring_buffer_->available();
-      size_t announcement_available = this_mixer->announcement_ring_buffer_->available();
-
-      if (media_available * transfer_media + announcement_available > 0) {
-        size_t bytes_to_read = OUTPUT_BUFFER_SAMPLES * sizeof(int16_t);
-
-        if (media_available * transfer_media > 0) {
-          bytes_to_read = std::min(bytes_to_read, media_available);
-        }
-
-        if (announcement_available > 0) {
-          bytes_to_read = std::min(bytes_to_read, announcement_available);
-        }
-
-        if (bytes_to_read > 0) {
-          size_t media_bytes_read = 0;
-          if (media_available * transfer_media > 0) {
-            media_bytes_read = this_mixer->media_ring_buffer_->read((void *) media_buffer, bytes_to_read, 0);
-            if (media_bytes_read > 0) {
-              size_t samples_read = media_bytes_read / sizeof(int16_t);
-              if (ducking_transition_samples_remaining > 0) {
-                // Ducking level is still transitioning
-
-                size_t samples_left = ducking_transition_samples_remaining;
-
-                // There may be more than one step worth of samples to duck in the buffers, so manage positions
-                int16_t *current_media_buffer = media_buffer;
-
-                size_t samples_left_in_step = samples_left % samples_per_ducking_step;
-                if (samples_left_in_step == 0) {
-                  // Start of a new ducking step
-
-                  current_ducking_db_reduction += db_change_per_ducking_step;
-                  samples_left_in_step = samples_per_ducking_step;
-                }
-                size_t samples_left_to_duck = std::min(samples_left_in_step, samples_read);
-
-                size_t total_samples_ducked = 0;
-
-                while (samples_left_to_duck > 0) {
-                  // Ensure we only point to valid index in the Q15 scaling factor table
-                  uint8_t safe_db_reduction_index =
-                      clamp<uint8_t>(current_ducking_db_reduction, 0, decibel_reduction_table.size() - 1);
-
-                  int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
-                  this_mixer->scale_audio_samples_(current_media_buffer, current_media_buffer, q15_scale_factor,
-                                                   samples_left_to_duck);
-
-                  current_media_buffer += samples_left_to_duck;
-
-                  samples_read -= samples_left_to_duck;
-                  samples_left -= samples_left_to_duck;
-
-                  total_samples_ducked += samples_left_to_duck;
-
-                  samples_left_in_step = samples_left % samples_per_ducking_step;
-                  if (samples_left_in_step == 0) {
-                    // Start of a new step
-
-                    current_ducking_db_reduction += db_change_per_ducking_step;
-                    samples_left_in_step = samples_per_ducking_step;
-                  }
-                  samples_left_to_duck = std::min(samples_left_in_step, samples_read);
-                }
-              } else if (target_ducking_db_reduction > 0) {
-                // We still need to apply a ducking scaling, but we are done transitioning
-
-                uint8_t safe_db_reduction_index =
-                    clamp<uint8_t>(target_ducking_db_reduction, 0, decibel_reduction_table.size() - 1);
-
-                int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
-                this_mixer->scale_audio_samples_(media_buffer, media_buffer, q15_scale_factor, samples_read);
-              }
-            }
-          }
-
-          size_t announcement_bytes_read = 0;
-          if (announcement_available > 0) {
-            announcement_bytes_read =
-                this_mixer->announcement_ring_buffer_->read((void *) announcement_buffer, bytes_to_read, 0);
-          }
-
-          if ((media_bytes_read > 0) && (announcement_bytes_read > 0)) {
-            // We have both a media and an announcement stream, so mix them together
-
-            size_t samples_read = bytes_to_read / sizeof(int16_t);
-
-            this_mixer->mix_audio_samples_without_clipping_(media_buffer, announcement_buffer, combination_buffer,
-                                                            samples_read);
-
-            combination_buffer_length = samples_read * sizeof(int16_t);
-          } else if (media_bytes_read > 0) {
-            memcpy(combination_buffer, media_buffer, media_bytes_read);
-            combination_buffer_length = media_bytes_read;
-          } else if (announcement_bytes_read > 0) {
-            memcpy(combination_buffer, announcement_buffer, announcement_bytes_read);
-            combination_buffer_length = announcement_bytes_read;
-          }
-
-          size_t samples_written = combination_buffer_length / sizeof(int16_t);
-          if (ducking_transition_samples_remaining > 0) {
-            ducking_transition_samples_remaining -= std::min(samples_written, ducking_transition_samples_remaining);
-          }
-        }
+      if (total_ducking_steps > 0) {
+        this->ducking_transition_samples_remaining_ = command_event.transition_samples;
+
+        this->samples_per_ducking_step_ = this->ducking_transition_samples_remaining_ / total_ducking_steps;
       } else {
-        // No audio data available in either buffer
+        this->ducking_transition_samples_remaining_ = 0;
+      }
+    }
+  } else if (command_event.command == CommandEventType::PAUSE_MEDIA) {
+    this->transfer_media_ = false;
+  } else if (command_event.command == CommandEventType::RESUME_MEDIA) {
+    this->transfer_media_ = true;
+  } else if (command_event.command == CommandEventType::CLEAR_MEDIA) {
+    this->get_input(command_event.media_input)->reset();
+    this->media_fades_[command_event.media_input].reset();
+    if (this->queued_media_input_.has_value() && (this->queued_media_input_.value() == command_event.media_input)) {
+      this->queued_media_input_.reset();
+    }
+  } else if (command_event.command == CommandEventType::CLEAR_ANNOUNCEMENT) {
+    announcement_port->reset();
+    this->announcement_fade_.reset();
+  } else if (command_event.command == CommandEventType::FADE_OUT_MEDIA) {
+    this->media_fades_[command_event.media_input].fade_to(0, command_event.transition_samples);
+  } else if (command_event.command == CommandEventType::FADE_IN_MEDIA) {
+    this->media_fades_[command_event.media_input].fade_to(FADE_UNITY_GAIN, command_event.transition_samples);
+  } else if (command_event.command == CommandEventType::START_MEDIA_INPUT) {
+    this->active_media_input_ = command_event.media_input;
+    this->queued_media_input_.reset();
+  } else if (command_event.command == CommandEventType::QUEUE_MEDIA_INPUT) {
+    this->queued_media_input_ = command_event.media_input;
+  } else if (command_event.command == CommandEventType::FADE_OUT_ANNOUNCEMENT) {
+    this->announcement_fade_.fade_to(0, command_event.transition_samples);
+  } else if (command_event.command == CommandEventType::FADE_IN_ANNOUNCEMENT) {
+    this->announcement_fade_.fade_to(FADE_UNITY_GAIN, command_event.transition_samples);
+  } else if (command_event.command == CommandEventType::PLAY_ANNOUNCEMENT_FILE) {
+    announcement_port->reset();
+    this->announcement_file_current_ = command_event.media_file->data;
+    // Only whole stereo frames are played
+    const size_t frame_size = 2 * this->sample_size_;
+    this->announcement_file_remaining_ =
+        command_event.media_file->length - command_event.media_file->length % frame_size;
+    this->announcement_file_playing_ = true;
+  }
+
+  return true;
+}
 
-        delay(TASK_DELAY_MS);
+template<typename T> void MixerStage::duck_media_(T *samples, size_t samples_read) {
+  if (this->ducking_transition_samples_remaining_ > 0) {
+    // Ducking level is still transitioning
+
+    size_t samples_left = this->ducking_transition_samples_remaining_;
+
+    // There may be more than one step worth of samples to duck in the buffers, so manage positions
+    T *current_media_buffer = samples;
+
+    size_t samples_left_in_step = samples_left % this->samples_per_ducking_step_;
+    if (samples_left_in_step == 0) {
+      // Start of a new ducking step
+
+      this->current_ducking_db_reduction_ += this->db_change_per_ducking_step_;
+      samples_left_in_step = this->samples_per_ducking_step_;
+    }
+    size_t samples_left_to_duck = std::min(samples_left_in_step, samples_read);
+
+    while (samples_left_to_duck > 0) {
+      // Ensure we only point to valid index in the Q15 scaling factor table
+      uint8_t safe_db_reduction_index =
+          clamp<uint8_t>(this->current_ducking_db_reduction_, 0, decibel_reduction_table.size() - 1);
+
+      int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
+      scale_samples(current_media_buffer, current_media_buffer, q15_scale_factor, samples_left_to_duck);
+
+      current_media_buffer += samples_left_to_duck;
+
+      samples_read -= samples_left_to_duck;
+      samples_left -= samples_left_to_duck;
+
+      samples_left_in_step = samples_left % this->samples_per_ducking_step_;
+      if (samples_left_in_step == 0) {
+        // Start of a new step
+
+        this->current_ducking_db_reduction_ += this->db_change_per_ducking_step_;
+        samples_left_in_step = this->samples_per_ducking_step_;
       }
+      samples_left_to_duck = std::min(samples_left_in_step, samples_read);
     }
+  } else if (this->target_ducking_db_reduction_ > 0) {
+    // We still need to apply a ducking scaling, but we are done transitioning
+
+    uint8_t safe_db_reduction_index =
+        clamp<uint8_t>(this->target_ducking_db_reduction_, 0, decibel_reduction_table.size() - 1);
+
+    int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
+    scale_samples(samples, samples, q15_scale_factor, samples_read);
   }
+}
 
-  event.type = EventType::STOPPING;
-  xQueueSend(this_mixer->event_queue_, &event, portMAX_DELAY);
+template<typename T>
+void MixerStage::mix_block_(StreamFade &media_fade, size_t media_bytes_read, size_t announcement_bytes_read) {
+  T *media_samples = reinterpret_cast<T *>(this->media_buffer_);
+  T *announcement_samples = reinterpret_cast<T *>(this->announcement_buffer_);
 
-  this_mixer->reset_ring_buffers_();
-  allocator.deallocate(media_buffer, OUTPUT_BUFFER_SAMPLES);
-  allocator.deallocate(announcement_buffer, OUTPUT_BUFFER_SAMPLES);
-  allocator.deallocate(combination_buffer, OUTPUT_BUFFER_SAMPLES);
+  if (media_bytes_read > 0) {
+    size_t samples_read = media_bytes_read / sizeof(T);
+    media_fade.apply(media_samples, samples_read);
+    this->duck_media_(media_samples, samples_read);
+  }
+  if ((announcement_bytes_read > 0) && !this->announcement_file_playing_) {
+    this->announcement_fade_.apply(announcement_samples, announcement_bytes_read / sizeof(T));
+  }
+
+  if ((media_bytes_read > 0) && (announcement_bytes_read > 0)) {
+    // We have both a media and an announcement stream, so mix them together
 
-  event.type = EventType::STOPPED;
-  xQueueSend(this_mixer->event_queue_, &event, portMAX_DELAY);
+    size_t samples_read = std::min(media_bytes_read, announcement_bytes_read) / sizeof(T);
 
-  while (true) {
-    delay(TASK_DELAY_MS);
+    mix_samples_without_clipping(media_samples, announcement_samples, reinterpret_cast<T *>(this->combination_buffer_),
+                                 samples_read);
+
+    this->combination_buffer_length_ = samples_read * sizeof(T);
+  } else if (media_bytes_read > 0) {
+    memcpy(this->combination_buffer_, this->media_buffer_, media_bytes_read);
+    this->combination_buffer_length_ = media_bytes_read;
+  } else if (announcement_bytes_read > 0) {
+    memcpy(this->combination_buffer_, this->announcement_buffer_, announcement_bytes_read);
+    this->combination_buffer_length_ = announcement_bytes_read;
   }
 }
 
-esp_err_t AudioMixer::allocate_buffers_() {
-  if (this->media_ring_buffer_ == nullptr)
-    this->media_ring_buffer_ = RingBuffer::create(INPUT_RING_BUFFER_SAMPLES * sizeof(int16_t));
+StageAwait MixerStage::step() {
+  AudioMixer *mixer = this->mixer_;
 
-  if (this->announcement_ring_buffer_ == nullptr)
-    this->announcement_ring_buffer_ = RingBuffer::create(INPUT_RING_BUFFER_SAMPLES * sizeof(int16_t));
+  CommandEvent command_event;
+  while (xQueueReceive(mixer->command_queue_, &command_event, 0) == pdTRUE) {
+    if (!this->handle_command_(command_event)) {
+      return StageAwait::finished();
+    }
+  }
 
-  if ((this->announcement_ring_buffer_ == nullptr) || (this->media_ring_buffer_ == nullptr)) {
-    return ESP_ERR_NO_MEM;
+  if (this->combination_buffer_length_ > 0) {
+    // Blocks until the speaker takes some of the audio, so the stage steps again right away
+    size_t output_bytes_written = mixer->speaker_->play((uint8_t *) this->combination_buffer_,
+                                                        this->combination_buffer_length_, pdMS_TO_TICKS(TASK_DELAY_MS));
+    this->combination_buffer_length_ -= output_bytes_written;
+#ifdef USE_NABU_LATENCY_TRACING
+    if (this->media_in_combination_) {
+      NABU_LATENCY_TRACE(mixer->media_latency_tracers_[this->active_media_input_],
+                         on_output(TraceStage::MIXER, output_bytes_written));
+    }
+    if (this->announcement_in_combination_) {
+      NABU_LATENCY_TRACE(mixer->announcement_latency_tracer_, on_output(TraceStage::MIXER, output_bytes_written));
+    }
+#endif
+    if ((this->combination_buffer_length_ > 0) && (output_bytes_written > 0)) {
+      memmove(this->combination_buffer_, this->combination_buffer_ + output_bytes_written,
+              this->combination_buffer_length_);
+    }
+    return StageAwait::ready();
   }
 
-  if (this->stack_buffer_ == nullptr)
-    this->stack_buffer_ = (StackType_t *) malloc(TASK_STACK_SIZE);
+  AudioPort *media_port = this->get_input(this->active_media_input_);
+  if (this->queued_media_input_.has_value() && media_port->is_ended() && (media_port->available() == 0)) {
+    // Every sample of the active stream was mixed, so the queued stream continues in the same output block
+    this->active_media_input_ = this->queued_media_input_.value();
+    this->queued_media_input_.reset();
+    media_port = this->get_input(this->active_media_input_);
+    this->send_event_(EventType::MEDIA_INPUT_SWITCHED);
+  }
+  StreamFade &media_fade = this->media_fades_[this->active_media_input_];
+  AudioPort *announcement_port = this->get_input(MEDIA_INPUT_COUNT);
 
-  if (this->stack_buffer_ == nullptr) {
-    return ESP_ERR_NO_MEM;
+  size_t media_available = 0;
+  if (this->transfer_media_ && !media_fade.is_held()) {
+    media_available = media_port->available();
+  }
+  size_t announcement_available = 0;
+  if (this->announcement_file_playing_) {
+    announcement_available = this->announcement_file_remaining_;
+  } else if (!this->announcement_fade_.is_held()) {
+    announcement_available = announcement_port->available();
   }
 
-  if (this->event_queue_ == nullptr)
-    this->event_queue_ = xQueueCreate(QUEUE_COUNT, sizeof(TaskEvent));
+  if (media_available + announcement_available == 0) {
+    // Writing to either port wakes the stage
+    return StageAwait::poll(TASK_DELAY_MS);
+  }
 
-  if (this->command_queue_ == nullptr)
-    this->command_queue_ = xQueueCreate(QUEUE_COUNT, sizeof(CommandEvent));
+  // Stop reading a fading stream exactly where its fade out completes
+  size_t samples_to_read = this->output_buffer_samples_;
+  if (media_available > 0) {
+    samples_to_read = std::min(samples_to_read, media_fade.samples_until_held());
+  }
+  if ((announcement_available > 0) && !this->announcement_file_playing_) {
+    samples_to_read = std::min(samples_to_read, this->announcement_fade_.samples_until_held());
+  }
+  size_t bytes_to_read = samples_to_read * this->sample_size_;
 
-  if ((this->event_queue_ == nullptr) || (this->command_queue_ == nullptr)) {
-    return ESP_ERR_NO_MEM;
+  if (media_available > 0) {
+    bytes_to_read = std::min(bytes_to_read, media_available);
   }
 
-  return ESP_OK;
-}
+  if (announcement_available > 0) {
+    bytes_to_read = std::min(bytes_to_read, announcement_available);
+  }
 
-void AudioMixer::reset_ring_buffers_() {
-  this->media_ring_buffer_->reset();
-  this->announcement_ring_buffer_->reset();
-}
+  if (bytes_to_read == 0) {
+    return StageAwait::poll(TASK_DELAY_MS);
+  }
 
-void AudioMixer::mix_audio_samples_without_clipping_(int16_t *media_buffer, int16_t *announcement_buffer,
-                                                     int16_t *combination_buffer, size_t samples_to_mix) {
-  // We first test adding the two clips samples together and check for any clipping
-  // We want the announcement volume to be consistent, regardless if media is playing or not
-  // If there is clipping, we determine what factor we need to multiply that media sample by to avoid it
-  // We take the smallest factor necessary for all the samples so the media volume is consistent on this batch
-  // of samples
-  // Note: This may not be the best approach. Adding 2 audio samples together makes both sound louder, even if
-  // we are not clipping. As a result, the mixed announcement will sound louder (by around 3dB if the audio
-  // streams are independent?) than if it were by itself.
-
-  int16_t q15_scaling_factor = MAX_AUDIO_SAMPLE_VALUE;
-
-  for (int i = 0; i < samples_to_mix; ++i) {
-    int32_t added_sample = static_cast<int32_t>(media_buffer[i]) + static_cast<int32_t>(announcement_buffer[i]);
-
-    if ((added_sample > MAX_AUDIO_SAMPLE_VALUE) || (added_sample < MIN_AUDIO_SAMPLE_VALUE)) {
-      // The largest magnitude the media sample can be to avoid clipping (converted to Q30 fixed point)
-      int32_t q30_media_sample_safe_max =
-          static_cast<int32_t>(std::abs(MIN_AUDIO_SAMPLE_VALUE) - std::abs(announcement_buffer[i])) << 15;
-
-      // Actual media sample value (Q15 number stored in an int32 for future division)
-      int32_t media_sample_value = abs(media_buffer[i]);
-
-      // Calculation to perform the Q15 division for media_sample_safe_max/media_sample_value
-      // Reference: https://sestevenson.wordpress.com/2010/09/20/fixed-point-division-2/ (accessed August 15,
-      // 2024)
-      int16_t necessary_q15_factor = static_cast<int16_t>(q30_media_sample_safe_max / media_sample_value);
-      // Take the minimum scaling factor (the smaller the factor, the more it needs to be scaled down)
-      q15_scaling_factor = std::min(necessary_q15_factor, q15_scaling_factor);
-    } else {
-      // Store the combined samples in the combination buffer. If we do not need to scale, then the samples are already
-      // mixed.
-      combination_buffer[i] = added_sample;
-    }
+  size_t media_bytes_read = 0;
+  if (media_available > 0) {
+    // Wakes the stage writing to the port, as there is space for more audio
+    media_bytes_read = media_port->read((void *) this->media_buffer_, bytes_to_read);
+    NABU_LATENCY_TRACE(mixer->media_latency_tracers_[this->active_media_input_],
+                       on_input(TraceStage::MIXER, media_bytes_read));
   }
 
-  if (q15_scaling_factor < MAX_AUDIO_SAMPLE_VALUE) {
-    // Need to scale to avoid clipping
+  size_t announcement_bytes_read = 0;
+  if (this->announcement_file_playing_ && (announcement_available > 0)) {
+    memcpy(this->announcement_buffer_, this->announcement_file_current_, bytes_to_read);
+    this->announcement_file_current_ += bytes_to_read;
+    this->announcement_file_remaining_ -= bytes_to_read;
+    announcement_bytes_read = bytes_to_read;
+  } else if (announcement_available > 0) {
+    announcement_bytes_read = announcement_port->read((void *) this->announcement_buffer_, bytes_to_read);
+    NABU_LATENCY_TRACE(mixer->announcement_latency_tracer_, on_input(TraceStage::MIXER, announcement_bytes_read));
+  }
 
-    this->scale_audio_samples_(media_buffer, media_buffer, q15_scaling_factor, samples_to_mix);
+#ifdef USE_NABU_LATENCY_TRACING
+  this->media_in_combination_ = (media_bytes_read > 0);
+  this->announcement_in_combination_ = (announcement_bytes_read > 0) && !this->announcement_file_playing_;
+#endif
 
-    // Mix both stream by adding them together with no bitshift
-    // The dsps_add functions have the following inputs:
-    // (buffer 1, buffer 2, output buffer, number of samples, buffer 1 step, buffer 2 step, output, buffer step,
-    // bitshift)
-    dsps_add_s16(media_buffer, announcement_buffer, combination_buffer, samples_to_mix, 1, 1, 1, 0);
+  (this->*mix_block_kernel_)(media_fade, media_bytes_read, announcement_bytes_read);
+
+  if (this->announcement_file_playing_ && (this->announcement_file_remaining_ == 0)) {
+    this->announcement_file_playing_ = false;
+    this->send_event_(EventType::ANNOUNCEMENT_FILE_FINISHED);
+  }
+
+  size_t samples_written = this->combination_buffer_length_ / this->sample_size_;
+  if (this->ducking_transition_samples_remaining_ > 0) {
+    this->ducking_transition_samples_remaining_ -=
+        std::min(samples_written, this->ducking_transition_samples_remaining_);
   }
-}
 
-void AudioMixer::scale_audio_samples_(int16_t *audio_samples, int16_t *output_buffer, int16_t scale_factor,
-                                      size_t samples_to_scale) {
-  // Scale the audio samples and store them in the output buffer
-  dsps_mulc_s16(audio_samples, output_buffer, samples_to_scale, scale_factor, 1, 1);
+  return StageAwait::ready();
 }
 
 }  // namespace nabu
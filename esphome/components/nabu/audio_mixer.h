@@ -2,16 +2,22 @@
 
 #ifdef USE_ESP_IDF
 
+#include "audio_graph.h"
+#include "latency_tracer.h"
+#include "sample_kernels.h"
+
 #include "esphome/components/media_player/media_player.h"
 #include "esphome/components/speaker/speaker.h"
 
 #include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
-#include "esphome/core/ring_buffer.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 
+#include <array>
+#include <atomic>
+
 namespace esphome {
 namespace nabu {
 
@@ -22,15 +28,28 @@ namespace nabu {
 //  - The announcement stream is intended for TTS reponses or various beeps/sound effects
 //    - Unable to duck
 //    - Unable to pause
-//  - Each stream has a corresponding input ring buffer. Retrieved via the `get_media_ring_buffer` and
-//    `get_announcement_ring_buffer` functions
+//  - Each stream has a corresponding input port, which the pipelines write to from their own audio graphs. Retrieved
+//    via the `get_media_port` and `get_announcement_port` functions. The ports only accept stereo audio at the output
+//    sample rate and bits per sample. Reading from a port wakes the pipeline stage that writes to it, and writing to a
+//    port wakes the mixer.
+//  - Either stream can be faded out and held while its pipeline rebuffers. A held stream isn't read, so it resumes
+//    exactly where it faded out. Clearing a stream releases the hold.
+//  - The media stream has two inputs, so the next track can be decoded while the current one plays. Once the active
+//    input's stream has ended and the mixer has read all of it, a queued input takes over with the next sample. The
+//    second input's ring buffer is only allocated once it is used.
+//  - Pre-rendered announcement files are read directly from flash in place of the announcement port, so they start
+//    playing with the next mixed block. Send them with the PLAY_ANNOUNCEMENT_FILE command.
 //  - The mixed audio is sent to the configured speaker component.
-//  - The mixer runs as a FreeRTOS task
-//    - The task reports its state using the TaskEvent queue. Regularly call the  `read_event` function to obtain the
+//  - The mixer runs as a single stage in its own audio graph with one FreeRTOS task
+//    - The stage reports its state using the TaskEvent queue. Regularly call the  `read_event` function to obtain the
 //      current state
-//    - Commands are sent to the task using a the CommandEvent queue. Use the `send_command` function to do so.
+//    - Commands are sent to the stage using a the CommandEvent queue. Use the `send_command` function to do so.
 //    - Use the `start` function to initiate. The `stop` function deletes the task, but be sure to send a STOP command
 //      first to avoid memory leaks.
+//  - The buffers are sized for the output sample rate and bits per sample set with `set_sample_rate` and
+//    `set_bits_per_sample`. They are allocated by `start`, and `release_buffers` frees them once the task is stopped.
+//  - The fading, ducking, and mixing kernels are instantiated for 16 bit and 32 bit samples, and the stage picks the
+//    ones for the output bits per sample when it starts.
 
 enum class EventType : uint8_t {
   STARTING = 0,
@@ -39,6 +58,9 @@ enum class EventType : uint8_t {
   IDLE,
   STOPPING,
   STOPPED,
+  ANNOUNCEMENT_FILE_FINISHED,  // Sent once for each PLAY_ANNOUNCEMENT_FILE command, whether it ended, was replaced, or
+                               // was cleared
+  MEDIA_INPUT_SWITCHED,        // The queued media input became the active one
   WARNING = 255,
 };
 
@@ -55,6 +77,13 @@ enum class CommandEventType : uint8_t {
   RESUME_MEDIA,        // Resumes the media stream
   CLEAR_MEDIA,         // Resets the media ring buffer
   CLEAR_ANNOUNCEMENT,  // Resets the announcement ring buffer
+  PLAY_ANNOUNCEMENT_FILE,  // Plays a pre-rendered (PCM type) media file as the announcement stream
+  FADE_OUT_MEDIA,          // Fades the media stream out over transition_samples, then holds it
+  FADE_IN_MEDIA,           // Fades a held media stream back in over transition_samples
+  FADE_OUT_ANNOUNCEMENT,   // Fades the announcement stream out over transition_samples, then holds it
+  FADE_IN_ANNOUNCEMENT,    // Fades a held announcement stream back in over transition_samples
+  START_MEDIA_INPUT,       // Plays media_input as the media stream right away, dropping any queued input
+  QUEUE_MEDIA_INPUT,       // Plays media_input once the active media input has ended and was read completely
 };
 
 // Used to send commands to the mixer task
@@ -62,8 +91,13 @@ struct CommandEvent {
   CommandEventType command;
   uint8_t decibel_reduction;
   size_t transition_samples = 0;
+  const media_player::MediaFile *media_file = nullptr;
+  uint8_t media_input = 0;  // For the media stream's CLEAR, FADE, START, and QUEUE commands
 };
 
+// Number of media inputs; one plays while the other holds the next track
+static const uint8_t MEDIA_INPUT_COUNT = 2;
+
 // Gives the Q15 fixed point scaling factor to reduce by 0 dB, 1dB, ..., 50 dB
 // dB to PCM scaling factor formula: floating_point_scale_factor = 2^(-db/6.014)
 // float to Q15 fixed point formula: q15_scale_factor = floating_point_scale_factor * 2^(15)
@@ -72,15 +106,117 @@ static const std::vector<int16_t> decibel_reduction_table = {
     4619,  4116,  3668,  3269,  2913,  2596,  2313,  2061,  1837,  1637,  1459,  1300, 1158, 1032, 920,  820,  731,
     651,   580,   517,   461,   411,   366,   326,   291,   259,   231,   206,   183,  163,  146,  130,  116,  103};
 
+// Q15 unity gain, scaled by 2^16 so the per sample steps of long fades don't round to zero
+static const int32_t FADE_UNITY_GAIN = static_cast<int32_t>(Q15_UNITY_GAIN) << 16;
+
+// Linear gain ramp applied to a stream while it fades out for a rebuffer or back in afterwards
+struct StreamFade {
+  int32_t gain{FADE_UNITY_GAIN};
+  int32_t target{FADE_UNITY_GAIN};
+  int32_t step{0};
+
+  void fade_to(int32_t new_target, size_t transition_samples);
+
+  void reset() { this->fade_to(FADE_UNITY_GAIN, 0); }
+
+  /// @brief Whether the stream faded out completely and shouldn't be read
+  bool is_held() const { return (this->gain == 0) && (this->target == 0); }
+
+  /// @brief Number of samples until a fade out completes (rounded up to whole stereo frames), or SIZE_MAX if the
+  /// stream isn't fading out
+  size_t samples_until_held() const;
+
+  template<typename T> void apply(T *samples, size_t samples_to_fade);
+};
+
+class AudioMixer;
+
+// The mixer's only stage. Its inputs are the media ports followed by the announcement port; none of them are required,
+// so the stage starts with the graph and runs until it receives a STOP command.
+class MixerStage : public AudioStage {
+ public:
+  explicit MixerStage(AudioMixer *mixer) : mixer_(mixer) {}
+
+  esp_err_t start() override;
+  StageAwait step() override;
+  void finish() override;
+
+ protected:
+  /// @brief Applies a command from the command queue
+  /// @return false if the command stops the mixer
+  bool handle_command_(const CommandEvent &command_event);
+
+  /// @brief Ducks the media audio in place, continuing a ducking transition if one is in progress
+  template<typename T> void duck_media_(T *samples, size_t samples_read);
+
+  /// @brief Fades and ducks the samples read into the media and announcement buffers, then mixes them into the
+  /// combination buffer
+  /// @param media_fade fade of the active media input
+  /// @param media_bytes_read bytes in the media buffer
+  /// @param announcement_bytes_read bytes in the announcement buffer
+  template<typename T>
+  void mix_block_(StreamFade &media_fade, size_t media_bytes_read, size_t announcement_bytes_read);
+
+  /// @brief Sends an event to the mixer's event queue
+  void send_event_(EventType type, esp_err_t err = ESP_OK);
+
+  AudioMixer *mixer_;
+
+  size_t output_buffer_samples_{0};
+  size_t sample_size_{sizeof(int16_t)};
+  uint8_t *media_buffer_{nullptr};
+  uint8_t *announcement_buffer_{nullptr};
+  uint8_t *combination_buffer_{nullptr};
+  size_t combination_buffer_length_{0};
+
+  // mix_block_ instantiated for the output sample type
+  void (MixerStage::*mix_block_kernel_)(StreamFade &, size_t, size_t){nullptr};
+
+  // Handles media stream pausing
+  bool transfer_media_{true};
+
+  // The media input being played, and the one that takes over once it has ended
+  uint8_t active_media_input_{0};
+  optional<uint8_t> queued_media_input_{};
+
+  // Parameters to control the ducking dB reduction and its transitions
+  // There is a built in negative sign; e.g., reducing by 5 dB is changing the gain by -5 dB
+  int8_t target_ducking_db_reduction_{0};
+  int8_t current_ducking_db_reduction_{0};
+
+  // Each step represents a change in 1 dB. Positive 1 means the dB reduction is increasing. Negative 1 means the dB
+  // reduction is decreasing.
+  int8_t db_change_per_ducking_step_{1};
+
+  size_t ducking_transition_samples_remaining_{0};
+  size_t samples_per_ducking_step_{0};
+
+  // Pre-rendered announcement file that is read in place of the announcement port
+  const uint8_t *announcement_file_current_{nullptr};
+  size_t announcement_file_remaining_{0};
+  bool announcement_file_playing_{false};
+
+  // Faded out while the stream's pipeline rebuffers
+  std::array<StreamFade, MEDIA_INPUT_COUNT> media_fades_;
+  StreamFade announcement_fade_;
+
+#ifdef USE_NABU_LATENCY_TRACING
+  // Whether the combination buffer holds audio from each stream's port
+  bool media_in_combination_{false};
+  bool announcement_in_combination_{false};
+#endif
+};
+
 class AudioMixer {
  public:
-  /// @brief Sends a CommandEvent to the command queue
+  AudioMixer();
+
+  /// @brief Sends a CommandEvent to the command queue and wakes the mixer. Commands are dropped while the task isn't
+  /// running, as its state starts fresh anyway.
   /// @param command Pointer to CommandEvent object to be sent
   /// @param ticks_to_wait The number of FreeRTOS ticks to wait for an event to appear on the queue. Defaults to 0.
   /// @return pdTRUE if successful, pdFALSE otherwises
-  BaseType_t send_command(CommandEvent *command, TickType_t ticks_to_wait = portMAX_DELAY) {
-    return xQueueSend(this->command_queue_, command, ticks_to_wait);
-  }
+  BaseType_t send_command(CommandEvent *command, TickType_t ticks_to_wait = portMAX_DELAY);
 
   /// @brief Reads a TaskEvent from the event queue indicating its current status
   /// @param event Pointer to TaskEvent object to store the event in
@@ -100,13 +236,46 @@ class AudioMixer {
   /// @brief Stops the mixer task and clears the queues
   void stop();
 
-  /// @brief Retrieves the media stream's ring buffer pointer
-  /// @return pointer to media ring buffer
-  RingBuffer *get_media_ring_buffer() { return this->media_ring_buffer_.get(); }
+  /// @brief Allocates the ring buffer of a media input's port if it doesn't have one yet. The first input's is
+  /// allocated by `start`.
+  /// @return ESP_OK if successful or ESP_ERR_NO_MEM otherwise
+  esp_err_t allocate_media_input(uint8_t media_input);
+
+  /// @brief Frees the input ports' ring buffers and the task stack. Only has an effect after `stop`; the next `start`
+  /// allocates them again.
+  void release_buffers();
+
+  /// @brief Sets the sample rate of the mixed audio, which sizes the buffers. Only takes effect on the next `start`
+  /// after the buffers were released.
+  void set_sample_rate(uint32_t sample_rate) { this->sample_rate_ = sample_rate; }
+
+  /// @brief Sets the bits per sample of the mixed audio (16 or 32), which sizes the buffers. Only takes effect on the
+  /// next `start` after the buffers were released.
+  void set_bits_per_sample(uint8_t bits_per_sample) { this->bits_per_sample_ = bits_per_sample; }
+  uint8_t get_bits_per_sample() const { return this->bits_per_sample_; }
+
+  /// @brief Whether the mixer task exists
+  bool is_running() const { return this->graph_.has_tasks(); }
+
+  /// @brief Bytes currently allocated for the ports, the task stack, and the stage's work buffers
+  size_t get_memory_usage() const;
+
+  /// @brief Retrieves a media input's port, which a media pipeline writes to
+  AudioPort *get_media_port(uint8_t media_input = 0) { return &this->media_ports_[media_input]; }
 
-  /// @brief Retrieves the announcement stream's ring buffer pointer
-  /// @return pointer to announcement ring buffer
-  RingBuffer *get_announcement_ring_buffer() { return this->announcement_ring_buffer_.get(); }
+  /// @brief Retrieves the announcement stream's port, which the announcement pipeline writes to
+  AudioPort *get_announcement_port() { return &this->announcement_port_; }
+
+#ifdef USE_NABU_LATENCY_TRACING
+  /// @brief Sets the tracer that records when a media input's audio reaches the speaker
+  void set_media_latency_tracer(LatencyTracer *latency_tracer, uint8_t media_input = 0) {
+    this->media_latency_tracers_[media_input] = latency_tracer;
+  }
+  /// @brief Sets the tracer that records when the announcement stream's audio reaches the speaker
+  void set_announcement_latency_tracer(LatencyTracer *latency_tracer) {
+    this->announcement_latency_tracer_ = latency_tracer;
+  }
+#endif
 
   /// @brief Suspends the mixer task
   void suspend_task();
@@ -114,44 +283,45 @@ class AudioMixer {
   void resume_task();
 
  protected:
-  /// @brief Allocates the ring buffers, task stack, and queues
+  friend class MixerStage;
+
+  /// @brief Allocates the ports' ring buffers, task stack, and queues
   /// @return ESP_OK if successful or an error otherwise
   esp_err_t allocate_buffers_();
 
-  /// @brief Resets the media and anouncement ring buffers
-  void reset_ring_buffers_();
-
-  /// @brief Mixes the media and announcement samples. If the resulting audio clips, the media samples are first scaled.
-  /// @param media_buffer buffer for media samples
-  /// @param announcement_buffer buffer for announcement samples
-  /// @param combination_buffer buffer for the mixed samples
-  /// @param samples_to_mix number of samples in the media and annoucnement buffers to mix together
-  void mix_audio_samples_without_clipping_(int16_t *media_buffer, int16_t *announcement_buffer,
-                                           int16_t *combination_buffer, size_t samples_to_mix);
-
-  /// @brief Scales audio samples. Scales in place when audio_samples == output_buffer.
-  /// @param audio_samples PCM int16 audio samples
-  /// @param output_buffer Buffer to store the scaled samples
-  /// @param scale_factor Q15 fixed point scaling factor
-  /// @param samples_to_scale Number of samples to scale
-  void scale_audio_samples_(int16_t *audio_samples, int16_t *output_buffer, int16_t scale_factor,
-                            size_t samples_to_scale);
-
-  static void audio_mixer_task_(void *params);
-  TaskHandle_t task_handle_{nullptr};
-  StaticTask_t task_stack_;
-  StackType_t *stack_buffer_{nullptr};
-
-  // Reports events from the mixer task
+  /// @brief Resets the media and anouncement ports
+  void reset_ports_();
+
+  /// @brief Size of each input port's ring buffer in bytes for the sample rate
+  size_t get_input_ring_buffer_size_() const;
+
+  /// @brief Number of samples in each of the stage's work buffers for the sample rate
+  size_t get_output_buffer_samples_() const;
+
+  /// @brief Size of a sample in bytes for the bits per sample
+  size_t get_sample_size_() const { return this->bits_per_sample_ / 8; }
+
+  AudioGraph graph_;
+  MixerStage stage_{this};
+
+  // Reports events from the mixer stage
   QueueHandle_t event_queue_;
 
-  // Stores commands to send the mixer task
+  // Stores commands to send the mixer stage
   QueueHandle_t command_queue_;
 
   speaker::Speaker *speaker_{nullptr};
 
-  std::unique_ptr<RingBuffer> media_ring_buffer_;
-  std::unique_ptr<RingBuffer> announcement_ring_buffer_;
+  uint32_t sample_rate_{48000};
+  uint8_t bits_per_sample_{16};
+
+  std::array<AudioPort, MEDIA_INPUT_COUNT> media_ports_;
+  AudioPort announcement_port_;
+
+#ifdef USE_NABU_LATENCY_TRACING
+  std::array<LatencyTracer *, MEDIA_INPUT_COUNT> media_latency_tracers_{};
+  LatencyTracer *announcement_latency_tracer_{nullptr};
+#endif
 };
 }  // namespace nabu
 }  // namespace esphome
@@ -10,57 +10,42 @@ namespace nabu {
 
 static const size_t FILE_BUFFER_SIZE = 32 * 1024;
 static const size_t FILE_RING_BUFFER_SIZE = 64 * 1024;
+// Local files are already in flash, so the reader only needs a small buffer to hand them to the decoder
+static const size_t LOCAL_FILE_RING_BUFFER_SIZE = 16 * 1024;
+// The decoded ring buffer holds this much audio in the stream's format, up to BUFFER_SIZE_SAMPLES samples of the
+// mixer's size
+static const uint32_t DECODED_RING_BUFFER_DURATION_MS = 340;
 static const size_t BUFFER_SIZE_SAMPLES = 32768;
-static const size_t BUFFER_SIZE_BYTES = BUFFER_SIZE_SAMPLES * sizeof(int16_t);
 
 static const uint32_t READER_TASK_STACK_SIZE = 5 * 1024;
 static const uint32_t DECODER_TASK_STACK_SIZE = 3 * 1024;
 static const uint32_t RESAMPLER_TASK_STACK_SIZE = 3 * 1024;
+// The stages run one at a time, so the cooperative task needs the reader's stack plus room for the scheduling loop
+static const uint32_t PIPELINE_TASK_STACK_SIZE = READER_TASK_STACK_SIZE + 1024;
+
+// How long the reader waits before reading again after the network had no data. Every other stage waits on a port,
+// which wakes it once the stage on the other side moved enough data.
+static const uint32_t READER_RETRY_MS = 20;
 
 static const size_t INFO_ERROR_QUEUE_COUNT = 5;
 
+// Length of the fades when a url stream stalls and when it resumes
+static const uint32_t REBUFFER_FADE_MS = 100;
+
 static const char *const TAG = "nabu_media_player.pipeline";
 
-enum EventGroupBits : uint32_t {
-  // The stop() function clears all unfinished bits
-  // MESSAGE_* bits are only set by their respective tasks
-
-  // Stops all activity in the pipeline elements and set by stop() or by each task
-  PIPELINE_COMMAND_STOP = (1 << 0),
-
-  // Read audio from an HTTP source; cleared by reader task and set by start(uri,...)
-  READER_COMMAND_INIT_HTTP = (1 << 4),
-  // Read audio from an audio file from the flash; cleared by reader task and set by start(media_file,...)
-  READER_COMMAND_INIT_FILE = (1 << 5),
-
-  // Audio file type is read after checking it is supported; cleared by decoder task
-  READER_MESSAGE_LOADED_MEDIA_TYPE = (1 << 6),
-  // Reader is done (either through a failure or just end of the stream); cleared by reader task
-  READER_MESSAGE_FINISHED = (1 << 7),
-  // Error reading the file; cleared by get_state()
-  READER_MESSAGE_ERROR = (1 << 8),
-
-  // Decoder has determined the stream information; cleared by resampler
-  DECODER_MESSAGE_LOADED_STREAM_INFO = (1 << 11),
-  // Decoder is done (either through a faiilure or the end of the stream); cleared by decoder task
-  DECODER_MESSAGE_FINISHED = (1 << 12),
-  // Error decoding the file; cleared by get_state() by decoder task
-  DECODER_MESSAGE_ERROR = (1 << 13),
-
-  // Resampler is done (either through a failure or the end of the stream); cleared by resampler task
-  RESAMPLER_MESSAGE_FINISHED = (1 << 17),
-  // Error resampling the file; cleared by get_state()
-  RESAMPLER_MESSAGE_ERROR = (1 << 18),
-
-  // Cleared by respective tasks
-  FINISHED_BITS = READER_MESSAGE_FINISHED | DECODER_MESSAGE_FINISHED | RESAMPLER_MESSAGE_FINISHED,
-  UNFINISHED_BITS = ~(FINISHED_BITS | 0xff000000),  // Only 24 bits are valid for the event group, so make sure first 8
-                                                    // bits of uint32 are not set; cleared by stop()
-};
-
-AudioPipeline::AudioPipeline(AudioMixer *mixer, AudioPipelineType pipeline_type) {
+AudioPipeline::AudioPipeline(AudioMixer *mixer, AudioPipelineType pipeline_type, uint8_t media_input) {
   this->mixer_ = mixer;
   this->pipeline_type_ = pipeline_type;
+  this->media_input_ = media_input;
+  this->decode_batch_size_ = DEFAULT_DECODE_BATCH_SIZE;
+#ifdef USE_NABU_LATENCY_TRACING
+  if (pipeline_type == AudioPipelineType::MEDIA) {
+    mixer->set_media_latency_tracer(&this->latency_tracer_, media_input);
+  } else {
+    mixer->set_announcement_latency_tracer(&this->latency_tracer_);
+  }
+#endif
 }
 
 esp_err_t AudioPipeline::start(const std::string &uri, uint32_t target_sample_rate, const std::string &task_name,
@@ -69,7 +54,29 @@ esp_err_t AudioPipeline::start(const std::string &uri, uint32_t target_sample_ra
 
   if (err == ESP_OK) {
     this->current_uri_ = uri;
-    xEventGroupSetBits(this->event_group_, READER_COMMAND_INIT_HTTP);
+    this->current_media_file_ = nullptr;
+
+    if (this->announcement_cache_ != nullptr) {
+      this->cached_announcement_ = this->announcement_cache_->find(uri);
+      if (this->cached_announcement_ != nullptr) {
+        ESP_LOGD(TAG, "Playing cached audio (%" PRIu32 " hits, %" PRIu32 " misses)",
+                 this->announcement_cache_->get_hits(), this->announcement_cache_->get_misses());
+        this->cached_media_file_.data = this->cached_announcement_->get_data();
+        this->cached_media_file_.length = this->cached_announcement_->get_length();
+        this->cached_media_file_.file_type = media_player::MediaFileType::NONE;
+        return this->start_stream_(ReaderSource::CACHE);
+      }
+
+      this->recording_ = make_unique<CachedAnnouncement>(uri, this->announcement_cache_->get_max_size());
+    }
+
+    err = this->raw_port_.allocate(FILE_RING_BUFFER_SIZE);
+    if (err != ESP_OK) {
+      return err;
+    }
+
+    this->start_buffering_();
+    err = this->start_stream_(ReaderSource::HTTP);
   }
 
   return err;
@@ -81,87 +88,218 @@ esp_err_t AudioPipeline::start(media_player::MediaFile *media_file, uint32_t tar
 
   if (err == ESP_OK) {
     this->current_media_file_ = media_file;
-    xEventGroupSetBits(this->event_group_, READER_COMMAND_INIT_FILE);
+    this->current_uri_.clear();
+    if (media_file->file_type == media_player::MediaFileType::PCM) {
+      // Pre-rendered at compile time in the mixer's format
+      this->cached_media_file_ = *media_file;
+      return this->start_stream_(ReaderSource::CACHE);
+    }
+    this->direct_input_data_ = media_file->data;
+    this->direct_input_length_ = media_file->length;
+    err = this->start_stream_(ReaderSource::FILE);
   }
 
   return err;
 }
 
-esp_err_t AudioPipeline::allocate_buffers_() {
-  if (this->raw_file_ring_buffer_ == nullptr)
-    this->raw_file_ring_buffer_ = RingBuffer::create(FILE_RING_BUFFER_SIZE);
+void AudioPipeline::configure_graph_() {
+  if (this->graph_configured_) {
+    // The tasks may already point at their stages
+    return;
+  }
+  this->graph_configured_ = true;
+
+  uint8_t reader_task;
+  uint8_t decoder_task;
+  uint8_t resampler_task;
+  if (this->task_mode_ == AudioPipelineTaskMode::COOPERATIVE) {
+    reader_task = this->graph_.add_task("_pipeline", PIPELINE_TASK_STACK_SIZE);
+    decoder_task = reader_task;
+    resampler_task = reader_task;
+  } else {
+    reader_task = this->graph_.add_task("_read", READER_TASK_STACK_SIZE);
+    decoder_task = this->graph_.add_task("_decode", DECODER_TASK_STACK_SIZE);
+    resampler_task = decoder_task;
+    if (!this->fused_decode_resample_) {
+      resampler_task = this->graph_.add_task("_resample", RESAMPLER_TASK_STACK_SIZE);
+    }
+  }
+
+  // In the order the data flows through them, so a task sharing several stages steps them in that order
+  this->graph_.add_stage(&this->reader_stage_, reader_task);
+  this->graph_.add_stage(&this->decoder_stage_, decoder_task);
+  this->graph_.add_stage(&this->resampler_stage_, resampler_task);
+
+  this->raw_port_.set_constraint(PortConstraint::encoded());
+  // The resampler handles 16 bit mono or stereo audio at any sample rate, and 32 bit audio too if the mixer keeps that
+  // precision
+  PortConstraint decoded_constraint = PortConstraint::pcm(16, 1, 2);
+  if (this->mixer_->get_bits_per_sample() == 32) {
+    decoded_constraint.wide_bits_per_sample = 32;
+  }
+  this->decoded_port_.set_constraint(decoded_constraint);
+  // The resampler takes the decoder's batches directly, so there is no decoded ring buffer
+  this->decoded_port_.set_direct(this->fused_decode_resample_);
+}
 
-  if (this->decoded_ring_buffer_ == nullptr)
-    this->decoded_ring_buffer_ = RingBuffer::create(BUFFER_SIZE_BYTES);
+void AudioPipeline::connect_stages_(ReaderSource source) {
+  if (source == ReaderSource::CACHE) {
+    // Already in the mixer's format; the decoder and resampler never get a format, so they don't start
+    this->graph_.connect_output(&this->reader_stage_, 0, this->get_mixer_port_());
+    return;
+  }
 
-  if ((this->raw_file_ring_buffer_ == nullptr) || (this->decoded_ring_buffer_ == nullptr)) {
-    return ESP_ERR_NO_MEM;
+  if (!this->decoded_port_.is_direct()) {
+    // Sized for the stream's format once the decoder negotiates it
+    this->decoded_port_.set_buffer_duration(DECODED_RING_BUFFER_DURATION_MS, this->decode_batch_size_,
+                                            BUFFER_SIZE_SAMPLES * this->mixer_->get_bits_per_sample() / 8);
   }
 
-  if (this->read_task_stack_buffer_ == nullptr)
-    this->read_task_stack_buffer_ = (StackType_t *) malloc(READER_TASK_STACK_SIZE);
+  this->graph_.connect_output(&this->reader_stage_, 0, &this->raw_port_);
+  this->graph_.connect_input(&this->decoder_stage_, 0, &this->raw_port_);
+  this->graph_.connect_output(&this->decoder_stage_, 0, &this->decoded_port_);
+  this->graph_.connect_input(&this->resampler_stage_, 0, &this->decoded_port_);
+  this->graph_.connect_output(&this->resampler_stage_, 0, this->get_mixer_port_());
+}
 
-  if (this->decode_task_stack_buffer_ == nullptr)
-    this->decode_task_stack_buffer_ = (StackType_t *) malloc(DECODER_TASK_STACK_SIZE);
+esp_err_t AudioPipeline::create_tasks_(const std::string &task_name, UBaseType_t priority) {
+  this->configure_graph_();
 
-  if (this->resample_task_stack_buffer_ == nullptr)
-    this->resample_task_stack_buffer_ = (StackType_t *) malloc(RESAMPLER_TASK_STACK_SIZE);
+  if (this->info_error_queue_ == nullptr)
+    this->info_error_queue_ = xQueueCreate(INFO_ERROR_QUEUE_COUNT, sizeof(InfoErrorEvent));
 
-  if ((this->read_task_stack_buffer_ == nullptr) || (this->decode_task_stack_buffer_ == nullptr) ||
-      (this->resample_task_stack_buffer_ == nullptr)) {
+  if (this->info_error_queue_ == nullptr)
     return ESP_ERR_NO_MEM;
+
+  return this->graph_.create_tasks(task_name, priority);
+}
+
+void AudioPipeline::release_buffers() {
+  // Only release the buffers once every stage has finished and no new stream is waiting to start
+  if (!this->graph_.is_idle()) {
+    return;
   }
 
-  if (this->event_group_ == nullptr)
-    this->event_group_ = xEventGroupCreate();
+  this->raw_port_.release();
+  this->decoded_port_.release();
+}
 
-  if (this->event_group_ == nullptr) {
-    return ESP_ERR_NO_MEM;
+size_t AudioPipeline::get_memory_usage() const {
+  return this->raw_port_.get_buffer_size() + this->decoded_port_.get_buffer_size() + this->graph_.get_memory_usage();
+}
+
+esp_err_t AudioPipeline::warm_up(const std::string &uri, const std::string &task_name, UBaseType_t priority) {
+  esp_err_t err = this->create_tasks_(task_name, priority);
+  if (err != ESP_OK) {
+    return err;
   }
 
-  if (this->info_error_queue_ == nullptr)
-    this->info_error_queue_ = xQueueCreate(INFO_ERROR_QUEUE_COUNT, sizeof(InfoErrorEvent));
+  // Most announcements are url streams
+  err = this->raw_port_.allocate(FILE_RING_BUFFER_SIZE);
+  if (err != ESP_OK) {
+    return err;
+  }
 
-  if (this->info_error_queue_ == nullptr)
-    return ESP_ERR_NO_MEM;
+  // The url can't change while the reader's task may be using it
+  if ((this->connection_pool_ != nullptr) && !uri.empty() &&
+      !this->graph_.is_idle_work_pending(&this->reader_stage_)) {
+    this->preconnect_uri_ = uri;
+    this->graph_.request_idle_work(&this->reader_stage_);
+  }
 
   return ESP_OK;
 }
 
 esp_err_t AudioPipeline::common_start_(uint32_t target_sample_rate, const std::string &task_name,
                                        UBaseType_t priority) {
-  esp_err_t err = this->allocate_buffers_();
+  esp_err_t err = this->create_tasks_(task_name, priority);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  this->target_sample_rate_ = target_sample_rate;
+
+  err = this->stop();
+
+  // Drop the previous stream's seek index, including one still in the queue
+  this->process_info_error_queue_();
+  this->seek_index_.reset();
+  this->create_seek_index_ = true;
+  this->start_offset_ = 0;
+
+  if (!this->stream_title_.empty()) {
+    this->stream_title_.clear();
+    this->stream_title_changed_ = true;
+  }
+
+  this->cached_announcement_.reset();
+  this->recording_.reset();
+
+  this->monitor_buffering_ = false;
+  this->direct_input_data_ = nullptr;
+  this->direct_input_length_ = 0;
+
+  return err;
+}
+
+esp_err_t AudioPipeline::start_stream_(ReaderSource source) {
+  this->reader_source_ = source;
+  this->connect_stages_(source);
+  this->trace_stream_start_(source);
+  return this->graph_.start();
+}
+
+esp_err_t AudioPipeline::seek(uint32_t time_ms) {
+  SeekTarget target;
+  if ((this->seek_index_ == nullptr) || !this->seek_index_->find(time_ms, target)) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  esp_err_t err = this->stop();
   if (err != ESP_OK) {
     return err;
   }
 
-  if (this->read_task_handle_ == nullptr) {
-    this->read_task_handle_ =
-        xTaskCreateStatic(AudioPipeline::read_task_, (task_name + "_read").c_str(), READER_TASK_STACK_SIZE,
-                          (void *) this, priority, this->read_task_stack_buffer_, &this->read_task_stack_);
+  // The decoder reads the stream's header before the data from the new position
+  std::vector<uint8_t> header = this->seek_index_->create_header(target);
+
+  if (this->current_media_file_ == nullptr) {
+    err = this->raw_port_.allocate(FILE_RING_BUFFER_SIZE);
+  } else if (!header.empty()) {
+    err = this->raw_port_.allocate(std::max(LOCAL_FILE_RING_BUFFER_SIZE, 2 * header.size()));
   }
-  if (this->decode_task_handle_ == nullptr) {
-    this->decode_task_handle_ =
-        xTaskCreateStatic(AudioPipeline::decode_task_, (task_name + "_decode").c_str(), DECODER_TASK_STACK_SIZE,
-                          (void *) this, priority, this->decode_task_stack_buffer_, &this->decode_task_stack_);
+  if (err != ESP_OK) {
+    return err;
   }
-  if (this->resample_task_handle_ == nullptr) {
-    this->resample_task_handle_ =
-        xTaskCreateStatic(AudioPipeline::resample_task_, (task_name + "_resample").c_str(), RESAMPLER_TASK_STACK_SIZE,
-                          (void *) this, priority, this->resample_task_stack_buffer_, &this->resample_task_stack_);
+
+  if (!header.empty()) {
+    this->raw_port_.write(header.data(), header.size());
   }
 
-  if ((this->read_task_handle_ == nullptr) || (this->decode_task_handle_ == nullptr) ||
-      (this->resample_task_handle_ == nullptr)) {
-    return ESP_FAIL;
+  if ((this->current_media_file_ != nullptr) && header.empty()) {
+    this->direct_input_data_ = this->current_media_file_->data + target.byte_offset;
+    this->direct_input_length_ = this->current_media_file_->length - target.byte_offset;
+  } else {
+    // The decoder needs the header and the data contiguously, so the reader copies the file after the header
+    this->direct_input_data_ = nullptr;
+    this->direct_input_length_ = 0;
   }
 
-  this->target_sample_rate_ = target_sample_rate;
+  this->start_offset_ = target.byte_offset;
+  this->create_seek_index_ = false;
+  this->recording_.reset();  // Only complete streams are cached
+
+  ESP_LOGD(TAG, "Seeking to %" PRIu32 " ms at byte %zu", target.time_ms, this->start_offset_);
+
+  if (this->current_media_file_ != nullptr) {
+    return this->start_stream_(ReaderSource::FILE);
+  }
 
-  return this->stop();
+  this->start_buffering_();
+  return this->start_stream_(ReaderSource::HTTP);
 }
 
-AudioPipelineState AudioPipeline::get_state() {
+void AudioPipeline::process_info_error_queue_() {
   InfoErrorEvent event;
   if (this->info_error_queue_ != nullptr) {
     while (xQueueReceive(this->info_error_queue_, &event, 0)) {
@@ -174,6 +312,13 @@ AudioPipelineState AudioPipeline::get_state() {
                      media_player::media_player_file_type_to_string(event.file_type.value()));
           }
 
+          if (event.stream_title.has_value()) {
+            std::unique_ptr<std::string> stream_title(event.stream_title.value());
+            ESP_LOGD(TAG, "Stream title: %s", stream_title->c_str());
+            this->stream_title_ = *stream_title;
+            this->stream_title_changed_ = true;
+          }
+
           break;
         case InfoErrorSource::DECODER:
           if (event.err.has_value()) {
@@ -186,13 +331,19 @@ AudioPipelineState AudioPipeline::get_state() {
                      event.audio_stream_info.value().bits_per_sample);
           }
 
+          if (event.seek_index.has_value()) {
+            this->seek_index_.reset(event.seek_index.value());
+            ESP_LOGD(TAG, "Stream is seekable with a duration of %" PRIu32 " ms", this->seek_index_->get_duration_ms());
+          }
+
           if (event.decoding_err.has_value()) {
             switch (event.decoding_err.value()) {
               case DecodingError::FAILED_HEADER:
                 ESP_LOGE(TAG, "Failed to parse the file's header.");
                 break;
               case DecodingError::INCOMPATIBLE_BITS_PER_SAMPLE:
-                ESP_LOGE(TAG, "Incompatible bits per sample. Only 16 bits per sample is supported");
+                ESP_LOGE(TAG, "Incompatible bits per sample. Only 16 bits per sample is supported, or 8, 24, and 32 bit "
+                              "PCM for WAV files.");
                 break;
               case DecodingError::INCOMPATIBLE_CHANNELS:
                 ESP_LOGE(TAG, "Incompatible number of channels. Only 1 or 2 channel audio is supported.");
@@ -211,331 +362,484 @@ AudioPipelineState AudioPipeline::get_state() {
               ESP_LOGD(TAG, "Converting mono channel audio to stereo channel audio");
             }
           }
+
+          if (event.recorded_announcement.has_value()) {
+            std::unique_ptr<CachedAnnouncement> recorded_announcement(event.recorded_announcement.value());
+            if (this->announcement_cache_ != nullptr) {
+              this->announcement_cache_->insert(std::move(recorded_announcement));
+              ESP_LOGD(TAG, "Announcement cache holds %zu streams using %zu bytes",
+                       this->announcement_cache_->get_count(), this->announcement_cache_->get_size());
+            }
+          }
           break;
       }
     }
   }
+}
+
+AudioPipelineState AudioPipeline::get_state() {
+  this->process_info_error_queue_();
 
-  EventBits_t event_bits = xEventGroupGetBits(this->event_group_);
-  if (!this->read_task_handle_ && !this->decode_task_handle_ && !this->resample_task_handle_) {
+  if (!this->graph_.has_tasks()) {
     return AudioPipelineState::STOPPED;
   }
 
-  if ((event_bits & READER_MESSAGE_ERROR)) {
-    xEventGroupClearBits(this->event_group_, READER_MESSAGE_ERROR);
+  bool idle = this->graph_.is_idle();
+
+#ifdef USE_NABU_LATENCY_TRACING
+  if (this->latency_report_pending_ && idle) {
+    this->latency_report_pending_ = false;
+    this->latency_tracer_.log_report(this->pipeline_type_ == AudioPipelineType::MEDIA ? "Media" : "Announcement");
+  }
+#endif
+
+  if (this->graph_.take_stage_failure(&this->reader_stage_)) {
     return AudioPipelineState::ERROR_READING;
   }
 
-  if ((event_bits & DECODER_MESSAGE_ERROR)) {
-    xEventGroupClearBits(this->event_group_, DECODER_MESSAGE_ERROR);
+  if (this->graph_.take_stage_failure(&this->decoder_stage_)) {
     return AudioPipelineState::ERROR_DECODING;
   }
 
-  if ((event_bits & RESAMPLER_MESSAGE_ERROR)) {
-    xEventGroupClearBits(this->event_group_, RESAMPLER_MESSAGE_ERROR);
+  if (this->graph_.take_stage_failure(&this->resampler_stage_)) {
     return AudioPipelineState::ERROR_RESAMPLING;
   }
 
-  if ((event_bits & READER_MESSAGE_FINISHED) && (event_bits & DECODER_MESSAGE_FINISHED) &&
-      (event_bits & RESAMPLER_MESSAGE_FINISHED)) {
+  // A stream that hasn't reached the reader yet, e.g., while it finishes preconnecting, isn't stopped
+  if (idle) {
     return AudioPipelineState::STOPPED;
   }
 
+  if (this->monitor_buffering_) {
+    this->update_buffering_();
+    if (this->rebuffer_controller_.get_state() != BufferingState::PLAYING) {
+      return AudioPipelineState::REBUFFERING;
+    }
+  }
+
   return AudioPipelineState::PLAYING;
 }
 
-esp_err_t AudioPipeline::stop() {
-  xEventGroupSetBits(this->event_group_, PIPELINE_COMMAND_STOP);
+bool AudioPipeline::is_read_complete() const {
+  // The reader's output ends once it finished, and stays ended until the graph stops
+  const AudioPort *reader_output = this->reader_stage_.get_output(0);
+  return (reader_output != nullptr) && reader_output->is_ended() && !this->graph_.is_stopping() &&
+         !this->graph_.has_stage_failed(&this->reader_stage_);
+}
 
-  uint32_t event_group_bits = xEventGroupWaitBits(this->event_group_,
-                                                  FINISHED_BITS,        // Bit message to read
-                                                  pdFALSE,              // Clear the bits on exit
-                                                  pdTRUE,               // Wait for all the bits,
-                                                  pdMS_TO_TICKS(300));  // Duration to block/wait
+void AudioPipeline::trace_stream_start_(ReaderSource source) {
+#ifdef USE_NABU_LATENCY_TRACING
+  if (source == ReaderSource::CACHE) {
+    // Mixer-ready audio goes from the reader straight to the mixer
+    this->latency_tracer_.start_stream(TraceStage::READER, true);
+  } else if ((source == ReaderSource::FILE) && (this->direct_input_data_ != nullptr)) {
+    // The decoder reads local files in place, so their chunks start in the decoder
+    this->latency_tracer_.start_stream(TraceStage::DECODER);
+  } else {
+    this->latency_tracer_.start_stream(TraceStage::READER);
+  }
+  this->latency_report_pending_ = true;
+#endif
+}
+
+void AudioPipeline::start_buffering_() {
+  this->monitor_buffering_ = true;
+  this->bytes_received_.store(0, std::memory_order_relaxed);
+  this->decoder_buffered_bytes_.store(0, std::memory_order_relaxed);
+  this->encoded_byte_rate_.store(0, std::memory_order_relaxed);
+  this->rebuffer_controller_.start(FILE_RING_BUFFER_SIZE + FILE_BUFFER_SIZE, millis());
 
-  if (!(event_group_bits & READER_MESSAGE_FINISHED)) {
-    // Reader failed to stop
-    xEventGroupSetBits(this->event_group_, EventGroupBits::READER_MESSAGE_ERROR);
+  // Hold the stream until enough is buffered
+  this->send_fade_command_(false, 0);
+}
+
+void AudioPipeline::update_buffering_() {
+  size_t buffered_bytes = this->raw_port_.available() + this->decoder_buffered_bytes_.load(std::memory_order_relaxed);
+
+  size_t bytes_received = this->bytes_received_.load(std::memory_order_relaxed);
+  // The reader's output only ends once it has finished, but a stream that fails to open never received any data
+  bool input_finished = this->raw_port_.is_ended() && (bytes_received > 0);
+
+  this->rebuffer_controller_.set_stream_byte_rate(this->encoded_byte_rate_.load(std::memory_order_relaxed));
+  switch (this->rebuffer_controller_.update(buffered_bytes, bytes_received, input_finished, millis())) {
+    case BufferingEvent::START:
+      ESP_LOGD(TAG, "Buffered %zu bytes, starting playback", buffered_bytes);
+      this->send_fade_command_(true, 0);
+      break;
+    case BufferingEvent::STALL:
+      ESP_LOGW(TAG, "Stream stalled with %zu bytes buffered, rebuffering", buffered_bytes);
+      this->send_fade_command_(false, REBUFFER_FADE_MS);
+      break;
+    case BufferingEvent::RESUME:
+      ESP_LOGD(TAG, "Buffered %zu bytes, resuming playback (%" PRIu32 " rebuffers taking %" PRIu32 " ms)",
+               buffered_bytes, this->get_rebuffer_count(), this->get_rebuffer_duration_ms());
+      this->send_fade_command_(true, REBUFFER_FADE_MS);
+      break;
+    case BufferingEvent::NONE:
+      break;
   }
-  if (!(event_group_bits & DECODER_MESSAGE_FINISHED)) {
-    // Ddecoder failed to stop
-    xEventGroupSetBits(this->event_group_, EventGroupBits::DECODER_MESSAGE_ERROR);
+}
+
+void AudioPipeline::send_fade_command_(bool fade_in, uint32_t duration_ms) {
+  CommandEvent command_event;
+  if (this->pipeline_type_ == AudioPipelineType::MEDIA) {
+    command_event.command = fade_in ? CommandEventType::FADE_IN_MEDIA : CommandEventType::FADE_OUT_MEDIA;
+    command_event.media_input = this->media_input_;
+  } else {
+    command_event.command = fade_in ? CommandEventType::FADE_IN_ANNOUNCEMENT : CommandEventType::FADE_OUT_ANNOUNCEMENT;
   }
-  if (!(event_group_bits & RESAMPLER_MESSAGE_FINISHED)) {
-    // Resampler failed to stop
-    xEventGroupSetBits(this->event_group_, EventGroupBits::RESAMPLER_MESSAGE_ERROR);
+  // The mixer's audio is stereo
+  command_event.transition_samples = duration_ms * this->target_sample_rate_ / 1000 * 2;
+  this->mixer_->send_command(&command_event);
+}
+
+esp_err_t AudioPipeline::stop() {
+  bool running = !this->graph_.is_idle();
+  uint32_t stop_start_ms = millis();
+
+  // Stages that don't stop in time are reported as failed by get_state()
+  esp_err_t err = this->graph_.stop(300);
+  if (err != ESP_OK) {
+    return err;
   }
 
-  if ((event_group_bits & FINISHED_BITS) != FINISHED_BITS) {
-    // Not all bits were set, so it timed out
-    return ESP_ERR_TIMEOUT;
+  if (running) {
+    ESP_LOGV(TAG, "Stages stopped in %" PRIu32 " ms", millis() - stop_start_ms);
   }
 
-  // Clear the ring buffer in the mixer; avoids playing incorrect audio when starting a new file while paused
+  // Clear the port in the mixer; avoids playing incorrect audio when starting a new file while paused
   CommandEvent command_event;
   if (this->pipeline_type_ == AudioPipelineType::MEDIA) {
     command_event.command = CommandEventType::CLEAR_MEDIA;
+    command_event.media_input = this->media_input_;
   } else {
     command_event.command = CommandEventType::CLEAR_ANNOUNCEMENT;
   }
   this->mixer_->send_command(&command_event);
 
-  xEventGroupClearBits(this->event_group_, UNFINISHED_BITS);
   this->reset_ring_buffers();
 
   return ESP_OK;
 }
 
-void AudioPipeline::reset_ring_buffers() {
-  this->raw_file_ring_buffer_->reset();
-  this->decoded_ring_buffer_->reset();
-}
-
-void AudioPipeline::suspend_tasks() {
-  if (this->read_task_handle_ != nullptr) {
-    vTaskSuspend(this->read_task_handle_);
-  }
-  if (this->decode_task_handle_ != nullptr) {
-    vTaskSuspend(this->decode_task_handle_);
-  }
-  if (this->resample_task_handle_ != nullptr) {
-    vTaskSuspend(this->resample_task_handle_);
+bool AudioPipeline::get_new_stream_title(std::string &title) {
+  if (!this->stream_title_changed_) {
+    return false;
   }
+  this->stream_title_changed_ = false;
+  title = this->stream_title_;
+  return true;
 }
 
-void AudioPipeline::resume_tasks() {
-  if (this->read_task_handle_ != nullptr) {
-    vTaskResume(this->read_task_handle_);
-  }
-  if (this->decode_task_handle_ != nullptr) {
-    vTaskResume(this->decode_task_handle_);
-  }
-  if (this->resample_task_handle_ != nullptr) {
-    vTaskResume(this->resample_task_handle_);
-  }
+void AudioPipeline::reset_ring_buffers() {
+  this->raw_port_.reset();
+  this->decoded_port_.reset();
 }
 
-void AudioPipeline::read_task_(void *params) {
-  AudioPipeline *this_pipeline = (AudioPipeline *) params;
-
-  while (true) {
-    xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::READER_MESSAGE_FINISHED);
+void AudioPipeline::suspend_tasks() { this->graph_.suspend_tasks(); }
 
-    // Wait until the pipeline notifies us the source of the media file
-    EventBits_t event_bits =
-        xEventGroupWaitBits(this_pipeline->event_group_,
-                            READER_COMMAND_INIT_FILE | READER_COMMAND_INIT_HTTP,  // Bit message to read
-                            pdTRUE,                                               // Clear the bit on exit
-                            pdFALSE,                                              // Wait for all the bits,
-                            portMAX_DELAY);                                       // Block indefinitely until bit is set
+void AudioPipeline::resume_tasks() { this->graph_.resume_tasks(); }
 
-    xEventGroupClearBits(this_pipeline->event_group_, EventGroupBits::READER_MESSAGE_FINISHED);
+AudioPort *AudioPipeline::get_mixer_port_() {
+  if (this->pipeline_type_ == AudioPipelineType::MEDIA) {
+    return this->mixer_->get_media_port(this->media_input_);
+  }
+  return this->mixer_->get_announcement_port();
+}
 
-    {
-      InfoErrorEvent event;
-      event.source = InfoErrorSource::READER;
-      esp_err_t err = ESP_OK;
+void ReaderStage::run_idle_work() {
+  AudioPipeline *pipeline = this->pipeline_;
+  AudioReader reader(nullptr, 0);
+  reader.set_connection_pool(pipeline->connection_pool_);
+  esp_err_t err = reader.preconnect(pipeline->preconnect_uri_);
+  if (err != ESP_OK) {
+    // Only a missed optimization; the stream opens its own connection
+    ESP_LOGW(TAG, "Unable to preconnect to %s: %s", pipeline->preconnect_uri_.c_str(), esp_err_to_name(err));
+  }
+}
 
-      AudioReader reader = AudioReader(this_pipeline->raw_file_ring_buffer_.get(), FILE_BUFFER_SIZE);
+esp_err_t ReaderStage::start() {
+  AudioPipeline *pipeline = this->pipeline_;
+  AudioPort *output = this->get_output(0);
 
-      if (event_bits & READER_COMMAND_INIT_FILE) {
-        err = reader.start(this_pipeline->current_media_file_, this_pipeline->current_media_file_type_);
-      } else {
-        err = reader.start(this_pipeline->current_uri_, this_pipeline->current_media_file_type_);
-      }
-      if (err != ESP_OK) {
-        // Send specific error message
-        event.err = err;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-
-        // Setting up the reader failed, stop the pipeline
-        xEventGroupSetBits(this_pipeline->event_group_,
-                           EventGroupBits::READER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-      } else {
-        // Send the file type to the pipeline
-        event.file_type = this_pipeline->current_media_file_type_;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-
-        // Inform the decoder that the media type is available
-        xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::READER_MESSAGE_LOADED_MEDIA_TYPE);
-      }
+  InfoErrorEvent event;
+  event.source = InfoErrorSource::READER;
+  esp_err_t err = ESP_OK;
+
+  const ReaderSource source = pipeline->reader_source_;
+  // Local files are decoded in place from the flash mapping, so there is nothing to read
+  bool direct = (source == ReaderSource::FILE) && (pipeline->direct_input_data_ != nullptr);
+
+  if (!direct) {
+    this->reader_ = make_unique<AudioReader>(output, FILE_BUFFER_SIZE);
+    this->reader_->set_connection_pool(pipeline->connection_pool_);
+#ifdef USE_NABU_LATENCY_TRACING
+    this->reader_->set_latency_tracer(&pipeline->latency_tracer_);
+#endif
+  }
 
-      while (true) {
-        event_bits = xEventGroupGetBits(this_pipeline->event_group_);
+  if (source == ReaderSource::CACHE) {
+    err = this->reader_->start(&pipeline->cached_media_file_, pipeline->current_media_file_type_);
+  } else if (direct) {
+    pipeline->current_media_file_type_ = pipeline->current_media_file_->file_type;
+  } else if (source == ReaderSource::FILE) {
+    err = this->reader_->start(pipeline->current_media_file_, pipeline->current_media_file_type_,
+                               pipeline->start_offset_);
+  } else {
+    err = this->reader_->start(pipeline->current_uri_, pipeline->current_media_file_type_, pipeline->start_offset_);
+  }
+  // Set before the output's format, which starts the decoder
+  pipeline->stream_length_ = direct ? pipeline->current_media_file_->length : this->reader_->get_stream_length();
 
-        if (event_bits & PIPELINE_COMMAND_STOP) {
-          break;
-        }
+  if (err == ESP_OK) {
+    PortFormat format = PortFormat::encoded(pipeline->current_media_file_type_);
+    if ((source == ReaderSource::CACHE) && !output->get_constraint().get_fixed_format(format)) {
+      // Cached audio is only written to the mixer, which accepts a single format
+      err = ESP_ERR_INVALID_STATE;
+    } else {
+      err = this->set_output_format_(0, format);
+    }
+  }
 
-        AudioReaderState reader_state = reader.read();
+  if (err != ESP_OK) {
+    // Send specific error message
+    event.err = err;
+    xQueueSend(pipeline->info_error_queue_, &event, portMAX_DELAY);
+    return err;
+  }
 
-        if (reader_state == AudioReaderState::FINISHED) {
-          break;
-        } else if (reader_state == AudioReaderState::FAILED) {
-          xEventGroupSetBits(this_pipeline->event_group_,
-                             EventGroupBits::READER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          break;
-        }
-      }
-    }
+  if (source != ReaderSource::CACHE) {
+    // Send the file type to the pipeline
+    event.file_type = pipeline->current_media_file_type_;
+    xQueueSend(pipeline->info_error_queue_, &event, portMAX_DELAY);
   }
+
+  return ESP_OK;
 }
 
-void AudioPipeline::decode_task_(void *params) {
-  AudioPipeline *this_pipeline = (AudioPipeline *) params;
+StageAwait ReaderStage::step() {
+  if ((this->reader_ == nullptr) || this->get_output(0)->is_closed()) {
+    // The decoder has the whole file in place, or doesn't need the rest of it, e.g., data after a WAV file's audio
+    return StageAwait::finished();
+  }
 
-  while (true) {
-    xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::DECODER_MESSAGE_FINISHED);
+  AudioPipeline *pipeline = this->pipeline_;
 
-    // Wait until the reader notifies us that the media type is available
-    EventBits_t event_bits = xEventGroupWaitBits(this_pipeline->event_group_,
-                                                 READER_MESSAGE_LOADED_MEDIA_TYPE,  // Bit message to read
-                                                 pdTRUE,                            // Clear the bit on exit
-                                                 pdFALSE,                           // Wait for all the bits,
-                                                 portMAX_DELAY);  // Block indefinitely until bit is set
+  AudioReaderState reader_state = this->reader_->read();
+  pipeline->bytes_received_.store(this->reader_->get_bytes_read(), std::memory_order_relaxed);
 
-    xEventGroupClearBits(this_pipeline->event_group_, EventGroupBits::DECODER_MESSAGE_FINISHED);
+  std::unique_ptr<std::string> stream_title = this->reader_->release_stream_title();
+  if (stream_title != nullptr) {
+    InfoErrorEvent title_event;
+    title_event.source = InfoErrorSource::READER;
+    title_event.stream_title = stream_title.release();
+    xQueueSend(pipeline->info_error_queue_, &title_event, portMAX_DELAY);
+  }
 
-    {
-      InfoErrorEvent event;
-      event.source = InfoErrorSource::DECODER;
+  switch (reader_state) {
+    case AudioReaderState::WAITING_FOR_DATA:
+      return StageAwait::poll(READER_RETRY_MS);
+    case AudioReaderState::WAITING_FOR_SPACE:
+      return StageAwait::output(0, this->reader_->get_unwritten_bytes());
+    case AudioReaderState::FINISHED:
+      return StageAwait::finished();
+    case AudioReaderState::FAILED:
+      return StageAwait::failed();
+    default:
+      return StageAwait::ready();
+  }
+}
 
-      std::unique_ptr<AudioDecoder> decoder = make_unique<AudioDecoder>(
-          this_pipeline->raw_file_ring_buffer_.get(), this_pipeline->decoded_ring_buffer_.get(), FILE_BUFFER_SIZE);
-      esp_err_t err = decoder->start(this_pipeline->current_media_file_type_);
+void ReaderStage::finish() { this->reader_.reset(); }
 
-      if (err != ESP_OK) {
-        // Send specific error message
-        event.err = err;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
+esp_err_t DecoderStage::start() {
+  AudioPipeline *pipeline = this->pipeline_;
+  AudioPort *input = this->get_input(0);
 
-        // Setting up the decoder failed, stop the pipeline
-        xEventGroupSetBits(this_pipeline->event_group_,
-                           EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-      }
+  // The output port is set once the decoder finds the stream's format; until then it holds its first batch
+  this->decoder_ = make_unique<AudioDecoder>(input, nullptr, FILE_BUFFER_SIZE);
+  this->decoder_->set_decode_batch_size(pipeline->decode_batch_size_);
+  // Hi-res streams keep their precision if the mixer does
+  this->decoder_->set_max_bits_per_sample(pipeline->mixer_->get_bits_per_sample());
+#ifdef USE_NABU_LATENCY_TRACING
+  this->decoder_->set_latency_tracer(&pipeline->latency_tracer_);
+#endif
+  this->decoder_->set_stream_length(pipeline->create_seek_index_ ? pipeline->stream_length_ : 0);
+  if (pipeline->direct_input_data_ != nullptr) {
+    this->decoder_->set_input_data(pipeline->direct_input_data_, pipeline->direct_input_length_);
+  }
+  this->has_stream_info_ = false;
 
-      bool has_stream_info = false;
+  esp_err_t err = this->decoder_->start(input->get_format().file_type);
 
-      while (true) {
-        event_bits = xEventGroupGetBits(this_pipeline->event_group_);
+  if (err != ESP_OK) {
+    // Send specific error message
+    InfoErrorEvent event;
+    event.source = InfoErrorSource::DECODER;
+    event.err = err;
+    xQueueSend(pipeline->info_error_queue_, &event, portMAX_DELAY);
+  }
 
-        if (event_bits & PIPELINE_COMMAND_STOP) {
-          break;
-        }
+  return err;
+}
 
-        // Stop gracefully if the reader has finished
-        AudioDecoderState decoder_state = decoder->decode(event_bits & READER_MESSAGE_FINISHED);
+esp_err_t DecoderStage::negotiate_output_() {
+  AudioPipeline *pipeline = this->pipeline_;
 
-        if (decoder_state == AudioDecoderState::FINISHED) {
-          break;
-        } else if (decoder_state == AudioDecoderState::FAILED) {
-          if (!has_stream_info) {
-            event.decoding_err = DecodingError::FAILED_HEADER;
-            xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-          }
-          xEventGroupSetBits(this_pipeline->event_group_,
-                             EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          break;
-        }
-
-        if (!has_stream_info && decoder->get_audio_stream_info().has_value()) {
-          has_stream_info = true;
-
-          this_pipeline->current_audio_stream_info_ = decoder->get_audio_stream_info().value();
-
-          // Send the stream information to the pipeline
-          event.audio_stream_info = this_pipeline->current_audio_stream_info_;
-
-          if (this_pipeline->current_audio_stream_info_.bits_per_sample != 16) {
-            // Error state, incompatible bits per sample
-            event.decoding_err = DecodingError::INCOMPATIBLE_BITS_PER_SAMPLE;
-            xEventGroupSetBits(this_pipeline->event_group_,
-                               EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          } else if ((this_pipeline->current_audio_stream_info_.channels > 2)) {
-            // Error state, incompatible number of channels
-            event.decoding_err = DecodingError::INCOMPATIBLE_CHANNELS;
-            xEventGroupSetBits(this_pipeline->event_group_,
-                               EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          } else {
-            // Inform the resampler that the stream information is available
-            xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::DECODER_MESSAGE_LOADED_STREAM_INFO);
-          }
+  this->has_stream_info_ = true;
+  pipeline->current_audio_stream_info_ = this->decoder_->get_audio_stream_info().value();
 
-          xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-        }
-      }
-    }
+  // Send the stream information to the pipeline
+  InfoErrorEvent event;
+  event.source = InfoErrorSource::DECODER;
+  event.audio_stream_info = pipeline->current_audio_stream_info_;
+
+  // Sizes the decoded port's ring buffer for the format and starts the resampler
+  FormatMismatch mismatch = FormatMismatch::NONE;
+  esp_err_t err = this->set_output_format_(0, PortFormat::pcm(pipeline->current_audio_stream_info_), &mismatch);
+  if (mismatch == FormatMismatch::BITS_PER_SAMPLE) {
+    event.decoding_err = DecodingError::INCOMPATIBLE_BITS_PER_SAMPLE;
+  } else if (mismatch == FormatMismatch::CHANNELS) {
+    event.decoding_err = DecodingError::INCOMPATIBLE_CHANNELS;
+  } else if (err != ESP_OK) {
+    event.err = err;
+  } else {
+    this->decoder_->set_output_port(this->get_output(0));
   }
-}
 
-void AudioPipeline::resample_task_(void *params) {
-  AudioPipeline *this_pipeline = (AudioPipeline *) params;
+  xQueueSend(pipeline->info_error_queue_, &event, portMAX_DELAY);
 
-  while (true) {
-    xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::RESAMPLER_MESSAGE_FINISHED);
+  return err;
+}
 
-    // Wait until the decoder notifies us that the stream information is available
-    EventBits_t event_bits = xEventGroupWaitBits(this_pipeline->event_group_,
-                                                 DECODER_MESSAGE_LOADED_STREAM_INFO,  // Bit message to read
-                                                 pdTRUE,                              // Clear the bit on exit
-                                                 pdFALSE,                             // Wait for all the bits,
-                                                 portMAX_DELAY);  // Block indefinitely until bit is set
+StageAwait DecoderStage::step() {
+  AudioPipeline *pipeline = this->pipeline_;
+  AudioPort *input = this->get_input(0);
+  AudioPort *output = this->get_output(0);
 
-    xEventGroupClearBits(this_pipeline->event_group_, EventGroupBits::RESAMPLER_MESSAGE_FINISHED);
+  AudioDecoderState decoder_state = this->decoder_->decode(input->is_ended());
+  pipeline->decoder_buffered_bytes_.store(this->decoder_->get_buffered_bytes(), std::memory_order_relaxed);
+  pipeline->encoded_byte_rate_.store(this->decoder_->get_encoded_byte_rate(), std::memory_order_relaxed);
 
-    {
-      InfoErrorEvent event;
-      event.source = InfoErrorSource::RESAMPLER;
+  // Negotiated before handling the state, as a WAV file hands off its PCM right after its header
+  bool found_stream_info = !this->has_stream_info_ && this->decoder_->get_audio_stream_info().has_value();
+  if (found_stream_info && (this->negotiate_output_() != ESP_OK)) {
+    return StageAwait::failed();
+  }
 
-      RingBuffer *output_ring_buffer = nullptr;
+  std::unique_ptr<SeekIndex> seek_index = this->decoder_->release_seek_index();
+  if (seek_index != nullptr) {
+    InfoErrorEvent seek_index_event;
+    seek_index_event.source = InfoErrorSource::DECODER;
+    seek_index_event.seek_index = seek_index.release();
+    xQueueSend(pipeline->info_error_queue_, &seek_index_event, portMAX_DELAY);
+  }
 
-      if (this_pipeline->pipeline_type_ == AudioPipelineType::MEDIA) {
-        output_ring_buffer = this_pipeline->mixer_->get_media_ring_buffer();
-      } else {
-        output_ring_buffer = this_pipeline->mixer_->get_announcement_ring_buffer();
+  switch (decoder_state) {
+    case AudioDecoderState::WAITING_FOR_INPUT:
+      return StageAwait::input(0, this->decoder_->get_input_bytes_needed());
+    case AudioDecoderState::WAITING_FOR_SPACE:
+      return StageAwait::output(0, this->decoder_->get_unwritten_bytes());
+    case AudioDecoderState::FINISHED:
+      // The decoder may finish before the end of the file, e.g., at the end of a WAV file's data chunk; the reader
+      // stops once it sees the rest isn't needed
+      input->close();
+      return StageAwait::finished();
+    case AudioDecoderState::PASSTHROUGH:
+      // Nothing left to decode; the resampler reads the remaining PCM straight from the raw file port
+      pipeline->decoder_buffered_bytes_.store(0, std::memory_order_relaxed);
+      output->splice(input, this->decoder_->get_pcm_passthrough_bytes());
+      return StageAwait::finished();
+    case AudioDecoderState::FAILED:
+      if (!this->has_stream_info_) {
+        InfoErrorEvent event;
+        event.source = InfoErrorSource::DECODER;
+        event.decoding_err = DecodingError::FAILED_HEADER;
+        xQueueSend(pipeline->info_error_queue_, &event, portMAX_DELAY);
       }
+      return StageAwait::failed();
+    default:
+      return StageAwait::ready();
+  }
+}
 
-      AudioResampler resampler =
-          AudioResampler(this_pipeline->decoded_ring_buffer_.get(), output_ring_buffer, BUFFER_SIZE_SAMPLES);
+void DecoderStage::finish() { this->decoder_.reset(); }
 
-      esp_err_t err = resampler.start(this_pipeline->current_audio_stream_info_, this_pipeline->target_sample_rate_,
-                                      this_pipeline->current_resample_info_);
+esp_err_t ResamplerStage::start() {
+  AudioPipeline *pipeline = this->pipeline_;
+  AudioPort *input = this->get_input(0);
+  AudioPort *output = this->get_output(0);
 
-      if (err != ESP_OK) {
-        // Send specific error message
-        event.err = err;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
+  InfoErrorEvent event;
+  event.source = InfoErrorSource::RESAMPLER;
 
-        // Setting up the resampler failed, stop the pipeline
-        xEventGroupSetBits(this_pipeline->event_group_,
-                           EventGroupBits::RESAMPLER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-      } else {
-        event.resample_info = this_pipeline->current_resample_info_;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-      }
+  this->resampler_ = make_unique<AudioResampler>(input, output, BUFFER_SIZE_SAMPLES);
+#ifdef USE_NABU_LATENCY_TRACING
+  this->resampler_->set_latency_tracer(&pipeline->latency_tracer_);
+#endif
 
-      while (true) {
-        event_bits = xEventGroupGetBits(this_pipeline->event_group_);
+  CachedAnnouncement *recording = pipeline->recording_.get();
+  this->recording_ = recording;
+  if (recording != nullptr) {
+    this->resampler_->set_output_callback(
+        [recording](const uint8_t *data, size_t length) { recording->append(data, length); });
+  }
 
-        if (event_bits & PIPELINE_COMMAND_STOP) {
-          break;
-        }
+  // The mixer only accepts its own format, so that is what the resampler converts to
+  PortFormat output_format;
+  esp_err_t err = ESP_ERR_INVALID_STATE;
+  if (output->get_constraint().get_fixed_format(output_format)) {
+    audio::AudioStreamInfo stream_info = input->get_format().stream_info;
+    err = this->resampler_->start(stream_info, output_format.stream_info.sample_rate,
+                                  output_format.stream_info.bits_per_sample, pipeline->current_resample_info_);
+  }
+  if (err == ESP_OK) {
+    err = this->set_output_format_(0, output_format);
+  }
 
-        // Stop gracefully if the decoder is done
-        AudioResamplerState resampler_state = resampler.resample(event_bits & DECODER_MESSAGE_FINISHED);
+  if (err != ESP_OK) {
+    // Send specific error message
+    event.err = err;
+  } else {
+    event.resample_info = pipeline->current_resample_info_;
+  }
+  xQueueSend(pipeline->info_error_queue_, &event, portMAX_DELAY);
 
-        if (resampler_state == AudioResamplerState::FINISHED) {
-          break;
-        } else if (resampler_state == AudioResamplerState::FAILED) {
-          xEventGroupSetBits(this_pipeline->event_group_,
-                             EventGroupBits::RESAMPLER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          break;
-        }
+  return err;
+}
+
+StageAwait ResamplerStage::step() {
+  AudioPort *input = this->get_input(0);
+
+  // Stop gracefully once the stage feeding the resampler is done and all of its audio was read
+  AudioResamplerState resampler_state = this->resampler_->resample(input->is_finished());
+
+  switch (resampler_state) {
+    case AudioResamplerState::WAITING_FOR_INPUT:
+      return StageAwait::input(0, this->resampler_->get_input_bytes_needed());
+    case AudioResamplerState::WAITING_FOR_SPACE:
+      return StageAwait::output(0, this->resampler_->get_unwritten_bytes());
+    case AudioResamplerState::FINISHED:
+      if ((this->recording_ != nullptr) && this->recording_->is_complete()) {
+        // The whole stream played, so the pipeline can cache it
+        InfoErrorEvent recording_event;
+        recording_event.source = InfoErrorSource::RESAMPLER;
+        recording_event.recorded_announcement = this->pipeline_->recording_.release();
+        xQueueSend(this->pipeline_->info_error_queue_, &recording_event, portMAX_DELAY);
       }
-    }
+      return StageAwait::finished();
+    case AudioResamplerState::FAILED:
+      return StageAwait::failed();
+    default:
+      return StageAwait::ready();
   }
 }
 
+void ResamplerStage::finish() {
+  this->resampler_.reset();
+  this->recording_ = nullptr;
+}
+
 }  // namespace nabu
 }  // namespace esphome
 #endif
@@ -2,22 +2,26 @@
 
 #ifdef USE_ESP_IDF
 
+#include "announcement_cache.h"
+#include "audio_graph.h"
 #include "audio_reader.h"
 #include "audio_decoder.h"
 #include "audio_resampler.h"
 #include "audio_mixer.h"
+#include "rebuffer_controller.h"
 
 #include "esphome/components/audio/audio.h"
 #include "esphome/components/media_player/media_player.h"
 
 #include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
-#include "esphome/core/ring_buffer.h"
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/event_groups.h>
 #include <freertos/queue.h>
 
+#include <array>
+#include <atomic>
+
 namespace esphome {
 namespace nabu {
 
@@ -26,8 +30,21 @@ enum class AudioPipelineType : uint8_t {
   ANNOUNCEMENT,
 };
 
+enum class AudioPipelineTaskMode : uint8_t {
+  THREE_TASKS,  // Each stage of the pipeline runs in its own task
+  COOPERATIVE,  // One task runs whichever stages have work in turn; less stack and fewer context switches
+};
+
+// Where the reader stage gets the stream from
+enum class ReaderSource : uint8_t {
+  CACHE,  // Mixer-ready audio (cached or pre-rendered) that is written directly to the mixer
+  HTTP,   // An HTTP url
+  FILE,   // An audio file in the flash
+};
+
 enum class AudioPipelineState : uint8_t {
   PLAYING,
+  REBUFFERING,  // Waiting for a url stream to buffer before starting or resuming; the mixer holds the stream
   STOPPED,
   ERROR_READING,
   ERROR_DECODING,
@@ -54,11 +71,78 @@ struct InfoErrorEvent {
   optional<audio::AudioStreamInfo> audio_stream_info;
   optional<ResampleInfo> resample_info;
   optional<DecodingError> decoding_err;
+  optional<SeekIndex *> seek_index;                       // Ownership is transferred to the pipeline
+  optional<CachedAnnouncement *> recorded_announcement;  // Ownership is transferred to the pipeline
+  optional<std::string *> stream_title;                  // Ownership is transferred to the pipeline
+};
+
+class AudioPipeline;
+
+// Reads the stream from its source into the raw file port, or straight into the mixer's port for mixer-ready audio
+class ReaderStage : public AudioStage {
+ public:
+  explicit ReaderStage(AudioPipeline *pipeline) : pipeline_(pipeline) {}
+
+  esp_err_t start() override;
+  StageAwait step() override;
+  void finish() override;
+
+  /// @brief Opens a connection to the pipeline's preconnect url and hands it to the connection pool
+  void run_idle_work() override;
+
+ protected:
+  AudioPipeline *pipeline_;
+  std::unique_ptr<AudioReader> reader_;  // nullptr for local files the decoder reads in place
+};
+
+// Decodes the raw file port into the decoded port. Negotiates the decoded port's format once the decoder finds the
+// stream information, which starts the resampler stage.
+class DecoderStage : public AudioStage {
+ public:
+  explicit DecoderStage(AudioPipeline *pipeline) : pipeline_(pipeline) {}
+
+  esp_err_t start() override;
+  StageAwait step() override;
+  void finish() override;
+
+ protected:
+  /// @brief Negotiates the decoded port's format and reports the stream information to the pipeline
+  /// @return ESP_OK, or an error if the resampler can't take the decoded audio
+  esp_err_t negotiate_output_();
+
+  AudioPipeline *pipeline_;
+  std::unique_ptr<AudioDecoder> decoder_;
+  bool has_stream_info_{false};
 };
 
+// Converts the decoded port into the mixer's format and writes it to the mixer's port
+class ResamplerStage : public AudioStage {
+ public:
+  explicit ResamplerStage(AudioPipeline *pipeline) : pipeline_(pipeline) {}
+
+  esp_err_t start() override;
+  StageAwait step() override;
+  void finish() override;
+
+ protected:
+  AudioPipeline *pipeline_;
+  std::unique_ptr<AudioResampler> resampler_;
+  CachedAnnouncement *recording_{nullptr};
+};
+
+// Plays a stream through a small audio graph that writes to one of the mixer's input ports:
+//  - The reader stage writes the encoded stream to the raw file port; the decoder stage decodes it into the decoded
+//    port; the resampler stage converts it to the mixer's format and writes it to the mixer's port.
+//  - Each port's format is negotiated by the stage writing it, so the decoder and resampler start once the stream's
+//    file type and audio format are known. Mixer-ready audio is written directly to the mixer's port by the reader.
+//  - The stages run in their own tasks, or cooperatively in one task. With fused decoding and resampling, the decoded
+//    port is a direct handoff between the decoder and resampler in one task, without a buffer.
 class AudioPipeline {
  public:
-  AudioPipeline(AudioMixer *mixer, AudioPipelineType pipeline_type);
+  /// @param mixer the mixer the pipeline's audio is written to
+  /// @param pipeline_type which of the mixer's streams the pipeline feeds
+  /// @param media_input which of the media stream's inputs a media pipeline writes to
+  AudioPipeline(AudioMixer *mixer, AudioPipelineType pipeline_type, uint8_t media_input = 0);
 
   /// @brief Starts an audio pipeline given a media url
   /// @param uri media file url
@@ -78,26 +162,108 @@ class AudioPipeline {
   esp_err_t start(media_player::MediaFile *media_file, uint32_t target_sample_rate, const std::string &task_name,
                   UBaseType_t priority = 1);
 
-  /// @brief Stops the pipeline. Sends a stop signal to each task (if running) and clears the ring buffers.
-  /// @return ESP_OK if successful or ESP_ERR_TIMEOUT if the tasks did not indicate they stopped
+  /// @brief Gets the pipeline ready for a stream that is expected soon: creates the tasks, allocates the raw file
+  /// port's ring buffer for a url stream, and has the reader's task open a connection to the url's host for the
+  /// connection pool. Starting a stream while the reader is still connecting waits for the connection.
+  /// @param uri url to open the connection with; empty to skip it. Ignored without a connection pool.
+  /// @param task_name FreeRTOS task name
+  /// @param priority FreeRTOS task priority
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t warm_up(const std::string &uri, const std::string &task_name, UBaseType_t priority = 1);
+
+  /// @brief Stops the pipeline's graph and clears the ports
+  /// @return ESP_OK if successful or ESP_ERR_TIMEOUT if the stages did not indicate they stopped
   esp_err_t stop();
 
-  /// @brief Gets the state of the audio pipeline based on the info_error_queue_ and event_group_
+  /// @brief Restarts the current stream at a different position. Requires the stream's seek index, which the decoder
+  /// builds from the container's index or bit rate when the stream's length is known. URL streams are reopened with an
+  /// HTTP Range request.
+  /// @param time_ms desired playback position; limited to the stream's duration
+  /// @return ESP_OK if successful, ESP_ERR_NOT_SUPPORTED if the current stream isn't seekable, or an error from stop()
+  esp_err_t seek(uint32_t time_ms);
+
+  /// @brief Gets the state of the audio pipeline based on the info_error_queue_ and the graph
   /// @return AudioPipelineState
   AudioPipelineState get_state();
 
-  /// @brief Resets the ring buffers, discarding any existing data
+  /// @brief Whether the reader has read the whole stream, so only buffered audio is left to play
+  bool is_read_complete() const;
+
+  /// @brief The mixer media input this pipeline writes to
+  uint8_t get_media_input() const { return this->media_input_; }
+
+  /// @brief Gets the title an internet radio stream sent in its ICY metadata, if it changed since the last call
+  /// @param title set to the new title; empty once a new stream starts
+  /// @return true if the title changed
+  bool get_new_stream_title(std::string &title);
+
+  /// @brief Resets the ports' ring buffers, discarding any existing data
   void reset_ring_buffers();
 
+  /// @brief Frees the raw file and decoded ports' ring buffers. Does nothing unless the pipeline is stopped. The next
+  /// stream allocates them again, sized for its source and format.
+  void release_buffers();
+
+  /// @brief Bytes currently allocated for the ring buffers and task stacks
+  size_t get_memory_usage() const;
+
+  /// @brief Sets how many bytes of decoded audio the decoder accumulates before writing to its output port
+  void set_decode_batch_size(size_t decode_batch_size) { this->decode_batch_size_ = decode_batch_size; }
+
+  /// @brief Sets the cache for url streams. Cached streams are written directly to the mixer by the reader stage,
+  /// skipping the decoder and resampler. Uncached streams are recorded and added to the cache if they play to the end.
+  void set_announcement_cache(AnnouncementCache *announcement_cache) { this->announcement_cache_ = announcement_cache; }
+
+  /// @brief Sets how much audio url streams buffer before they start playing and before they resume after a stall.
+  /// The resume watermark adapts to the observed throughput.
+  /// @param start_ms milliseconds of audio to buffer before starting; 0 disables buffering
+  /// @param resume_ms milliseconds of audio to buffer before resuming
+  void set_buffer_watermarks(uint32_t start_ms, uint32_t resume_ms) {
+    this->rebuffer_controller_.set_watermarks(start_ms, resume_ms);
+  }
+
+  /// @brief Number of times a url stream stalled and rebuffered
+  uint32_t get_rebuffer_count() const { return this->rebuffer_controller_.get_rebuffer_count(); }
+  /// @brief Total milliseconds url streams spent rebuffering after a stall
+  uint32_t get_rebuffer_duration_ms() const { return this->rebuffer_controller_.get_rebuffer_duration_ms(millis()); }
+
+  /// @brief Sets the pool of idle http connections the reader stage reuses for url streams
+  void set_connection_pool(HTTPConnectionPool *connection_pool) { this->connection_pool_ = connection_pool; }
+
+  /// @brief Sets whether the reader, decoder, and resampler run in separate tasks or cooperatively in one task. In the
+  /// cooperative mode, a network read that blocks also holds up the decoder and resampler, so the mixer's buffer has to
+  /// cover it. Must be set before the pipeline first starts.
+  void set_task_mode(AudioPipelineTaskMode task_mode) { this->task_mode_ = task_mode; }
+
+  /// @brief Sets whether the resampler runs in the decoder's task and takes the decoder's batches directly instead of
+  /// reading them from a decoded ring buffer. Streams already in the mixer's format are passed straight through to the
+  /// mixer's port. Saves the decoded ring buffer and a copy of every sample, but the decoder and resampler no longer
+  /// run in parallel. Must be set before the pipeline first starts.
+  void set_fused_decode_resample(bool fused_decode_resample) { this->fused_decode_resample_ = fused_decode_resample; }
+
   /// @brief Suspends any running tasks
   void suspend_tasks();
   /// @brief Resumes any running tasks
   void resume_tasks();
 
  protected:
-  /// @brief Allocates the ring buffers, event group, and info error queue.
-  /// @return ESP_OK if successful or ESP_ERR_NO_MEM if it is unable to allocate all parts
-  esp_err_t allocate_buffers_();
+  friend class ReaderStage;
+  friend class DecoderStage;
+  friend class ResamplerStage;
+
+  /// @brief Adds the tasks and stages to the graph on first use, for the task mode, and sets the ports' formats
+  void configure_graph_();
+
+  /// @brief Connects the stages for a stream from the source. Mixer-ready audio goes from the reader straight to the
+  /// mixer's port. Only call while the graph is idle.
+  void connect_stages_(ReaderSource source);
+
+  /// @brief Allocates the task stacks and info error queue and creates the tasks if they don't exist yet. The ports'
+  /// ring buffers are allocated once the stream needs them.
+  /// @param task_name FreeRTOS task name
+  /// @param priority FreeRTOS task priority
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t create_tasks_(const std::string &task_name, UBaseType_t priority);
 
   /// @brief Common start code for the pipeline, regardless if the source is a file or url.
   /// @param target_sample_rate the desired sample rate of the audio stream
@@ -106,45 +272,104 @@ class AudioPipeline {
   /// @return ESP_OK if successful or an appropriate error if not
   esp_err_t common_start_(uint32_t target_sample_rate, const std::string &task_name, UBaseType_t priority);
 
-  // Pointer to the media player's mixer object. The resample task feeds the appropriate ring buffer directly
+  /// @brief Connects the stages for the source and starts the graph
+  /// @return ESP_OK if successful or an error from the graph otherwise
+  esp_err_t start_stream_(ReaderSource source);
+
+  /// @brief Logs the info and errors sent by the stages and takes ownership of the seek index and stream title
+  void process_info_error_queue_();
+
+  /// @brief Holds the stream in the mixer and starts monitoring how much of it is buffered
+  void start_buffering_();
+
+  /// @brief Fades the stream out in the mixer when its buffer runs low and back in once it refills
+  void update_buffering_();
+
+  /// @brief Starts tracing the latency of the stream the reader is about to be started for. Does nothing unless
+  /// latency tracing is enabled.
+  /// @param source where the reader gets the stream from
+  void trace_stream_start_(ReaderSource source);
+
+  /// @brief Gets the mixer's input port for this pipeline's stream
+  AudioPort *get_mixer_port_();
+
+  /// @brief Sends a fade command for this pipeline's stream to the mixer
+  /// @param fade_in true to fade in, false to fade out and hold the stream
+  /// @param duration_ms length of the fade
+  void send_fade_command_(bool fade_in, uint32_t duration_ms);
+
+  // Pointer to the media player's mixer object. The last stage writes to the appropriate port directly
   AudioMixer *mixer_;
 
   std::string current_uri_{};
   media_player::MediaFile *current_media_file_{nullptr};
+  // The part of a local file the decoder reads in place, skipping the reader and raw_port_; nullptr for url streams
+  // and for seeks that need a header written to the port first
+  const uint8_t *direct_input_data_{nullptr};
+  size_t direct_input_length_{0};
 
+  // Set before the graph starts and only read by the stages while it runs
+  ReaderSource reader_source_{ReaderSource::HTTP};
   media_player::MediaFileType current_media_file_type_;
   audio::AudioStreamInfo current_audio_stream_info_;
   ResampleInfo current_resample_info_;
   uint32_t target_sample_rate_;
 
+  size_t decode_batch_size_;
+
+  // Total length of the current stream in bytes (0 if unknown); set by the reader stage
+  size_t stream_length_{0};
+  // Byte offset the reader starts at; non-zero when seeking
+  size_t start_offset_{0};
+  // Whether the decoder builds a seek index; only needed when the stream starts from the beginning
+  bool create_seek_index_{true};
+  std::unique_ptr<SeekIndex> seek_index_;
+
+  std::string stream_title_{};
+  bool stream_title_changed_{false};
+
+  AnnouncementCache *announcement_cache_{nullptr};
+  HTTPConnectionPool *connection_pool_{nullptr};
+  // Only written while the reader stage's idle work isn't pending
+  std::string preconnect_uri_{};
+  // Holds the cached audio while it plays, even if the cache evicts it
+  std::shared_ptr<const CachedAnnouncement> cached_announcement_;
+  media_player::MediaFile cached_media_file_{};
+  // Records the resampler's output for the cache; released to the pipeline once the stream played to the end
+  std::unique_ptr<CachedAnnouncement> recording_;
+
+  RebufferController rebuffer_controller_;
+  bool monitor_buffering_{false};  // True while a url stream is read over the network
+  // Encoded bytes the reader stage has received and the decoder stage holds but hasn't decoded. Written by the stages
+  // and read by the main loop; they only feed heuristics, so relaxed ordering is enough.
+  std::atomic<size_t> bytes_received_{0};
+  std::atomic<size_t> decoder_buffered_bytes_{0};
+  std::atomic<uint32_t> encoded_byte_rate_{0};  // The decoder's encoded bytes per second of audio; 0 until known
+
+#ifdef USE_NABU_LATENCY_TRACING
+  LatencyTracer latency_tracer_;
+  bool latency_report_pending_{false};  // Set while a traced stream plays; its report is logged once it stops
+#endif
+
   AudioPipelineType pipeline_type_;
+  uint8_t media_input_{0};
+  AudioPipelineTaskMode task_mode_{AudioPipelineTaskMode::THREE_TASKS};
+  bool fused_decode_resample_{false};
 
-  std::unique_ptr<RingBuffer> raw_file_ring_buffer_;
-  std::unique_ptr<RingBuffer> decoded_ring_buffer_;
+  // Receives detailed info (file type, stream info, resampling info) or specific errors from the stages
+  QueueHandle_t info_error_queue_{nullptr};
 
-  // Handles basic control/state of the three tasks
-  EventGroupHandle_t event_group_{nullptr};
+  AudioGraph graph_;
+  bool graph_configured_{false};
 
-  // Receives detailed info (file type, stream info, resampling info) or specific errors from the three tasks
-  QueueHandle_t info_error_queue_{nullptr};
+  ReaderStage reader_stage_{this};
+  DecoderStage decoder_stage_{this};
+  ResamplerStage resampler_stage_{this};
 
-  // Handles reading the media file from flash or a url
-  static void read_task_(void *params);
-  TaskHandle_t read_task_handle_{nullptr};
-  StaticTask_t read_task_stack_;
-  StackType_t *read_task_stack_buffer_{nullptr};
-
-  // Decodes the media file into PCM audio
-  static void decode_task_(void *params);
-  TaskHandle_t decode_task_handle_{nullptr};
-  StaticTask_t decode_task_stack_;
-  StackType_t *decode_task_stack_buffer_{nullptr};
-
-  // Resamples the audio to match the specified target sample rate. Converts mono audio to stereo audio if necessary.
-  static void resample_task_(void *params);
-  TaskHandle_t resample_task_handle_{nullptr};
-  StaticTask_t resample_task_stack_;
-  StackType_t *resample_task_stack_buffer_{nullptr};
+  // Only allocated for sources and formats that need them; released when the media player is idle. The decoded port
+  // sizes its ring buffer for the stream's format once the decoder negotiates it.
+  AudioPort raw_port_;
+  AudioPort decoded_port_;
 };
 
 }  // namespace nabu
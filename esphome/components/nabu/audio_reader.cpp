@@ -2,7 +2,13 @@
 
 #include "audio_reader.h"
 
-#include "esphome/core/ring_buffer.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
 
 #if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
 #include "esp_crt_bundle.h"
@@ -11,13 +17,84 @@
 namespace esphome {
 namespace nabu {
 
-static const size_t READ_WRITE_TIMEOUT_MS = 20;
+static const int HTTP_STATUS_PARTIAL_CONTENT = 206;
+
+// How long the http read can go without receiving data before throwing an error. The pipeline rebuffers through
+// shorter stalls.
+static const uint32_t NO_DATA_READ_TIMEOUT_MS = 30000;
+
+// Bytes needed to detect a stream's format from its first bytes
+static const size_t FILE_TYPE_DETECTION_SIZE = 12;
 
-// The number of times the http read times out with no data before throwing an error
-static const size_t ERROR_COUNT_NO_DATA_READ_TIMEOUT = 50;
+static media_player::MediaFileType get_file_type_from_url(const std::string &url) {
+  // Ignore the query string, e.g., a token appended to the file name
+  std::string path = url.substr(0, url.find('?'));
+
+  if (str_endswith(path, ".wav")) {
+    return media_player::MediaFileType::WAV;
+  } else if (str_endswith(path, ".mp3")) {
+    return media_player::MediaFileType::MP3;
+  } else if (str_endswith(path, ".flac")) {
+    return media_player::MediaFileType::FLAC;
+#ifdef USE_AUDIO_AAC_SUPPORT
+  } else if (str_endswith(path, ".aac") || str_endswith(path, ".m4a")) {
+    return media_player::MediaFileType::AAC;
+#endif
+  }
+  return media_player::MediaFileType::NONE;
+}
 
-AudioReader::AudioReader(esphome::RingBuffer *output_ring_buffer, size_t transfer_buffer_size) {
-  this->output_ring_buffer_ = output_ring_buffer;
+static media_player::MediaFileType get_file_type_from_content_type(const std::string &content_type) {
+  // Drop parameters, e.g., "audio/mpeg; charset=utf-8"
+  std::string mime_type = str_lower_case(content_type.substr(0, content_type.find(';')));
+  mime_type.erase(mime_type.find_last_not_of(' ') + 1);
+
+  if ((mime_type == "audio/wav") || (mime_type == "audio/x-wav") || (mime_type == "audio/wave")) {
+    return media_player::MediaFileType::WAV;
+  } else if ((mime_type == "audio/mpeg") || (mime_type == "audio/mp3")) {
+    return media_player::MediaFileType::MP3;
+  } else if ((mime_type == "audio/flac") || (mime_type == "audio/x-flac")) {
+    return media_player::MediaFileType::FLAC;
+#ifdef USE_AUDIO_AAC_SUPPORT
+  } else if ((mime_type == "audio/aac") || (mime_type == "audio/aacp") || (mime_type == "audio/x-aac") ||
+             (mime_type == "audio/mp4")) {
+    return media_player::MediaFileType::AAC;
+#endif
+  }
+  return media_player::MediaFileType::NONE;
+}
+
+static media_player::MediaFileType get_file_type_from_data(const uint8_t *data, size_t length) {
+  if (length < FILE_TYPE_DETECTION_SIZE) {
+    return media_player::MediaFileType::NONE;
+  }
+
+  if (memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WAVE", 4) == 0) {
+    return media_player::MediaFileType::WAV;
+  } else if (memcmp(data, "fLaC", 4) == 0) {
+    return media_player::MediaFileType::FLAC;
+  } else if (memcmp(data, "ID3", 3) == 0) {
+    return media_player::MediaFileType::MP3;
+  } else if ((data[0] == 0xFF) && ((data[1] & 0xE0) == 0xE0)) {
+    // Frame sync; MPEG audio has a non-zero layer, while ADTS (AAC) always has layer 0
+#ifdef USE_AUDIO_AAC_SUPPORT
+    if ((data[1] & 0x06) == 0) {
+      return media_player::MediaFileType::AAC;
+    }
+#endif
+    if ((data[1] & 0x06) != 0) {
+      return media_player::MediaFileType::MP3;
+    }
+#ifdef USE_AUDIO_AAC_SUPPORT
+  } else if (memcmp(data + 4, "ftyp", 4) == 0) {
+    return media_player::MediaFileType::AAC;
+#endif
+  }
+  return media_player::MediaFileType::NONE;
+}
+
+AudioReader::AudioReader(AudioPort *output_port, size_t transfer_buffer_size) {
+  this->output_port_ = output_port;
   this->transfer_buffer_size_ = transfer_buffer_size;
 }
 
@@ -41,24 +118,26 @@ esp_err_t AudioReader::allocate_buffers_() {
   return ESP_OK;
 }
 
-esp_err_t AudioReader::start(media_player::MediaFile *media_file, media_player::MediaFileType &file_type) {
+esp_err_t AudioReader::start(media_player::MediaFile *media_file, media_player::MediaFileType &file_type,
+                             size_t start_offset) {
   file_type = media_player::MediaFileType::NONE;
 
-  esp_err_t err = this->allocate_buffers_();
-  if (err != ESP_OK) {
-    return err;
+  // Files are written to the port straight from flash, so they don't need the transfer buffer
+  if (start_offset > media_file->length) {
+    return ESP_ERR_INVALID_ARG;
   }
 
   this->current_media_file_ = media_file;
 
-  this->transfer_buffer_current_ = media_file->data;
-  this->transfer_buffer_length_ = media_file->length;
+  this->transfer_buffer_current_ = media_file->data + start_offset;
+  this->transfer_buffer_length_ = media_file->length - start_offset;
+  this->stream_length_ = media_file->length;
   file_type = media_file->file_type;
 
   return ESP_OK;
 }
 
-esp_err_t AudioReader::start(const std::string &uri, media_player::MediaFileType &file_type) {
+esp_err_t AudioReader::start(const std::string &uri, media_player::MediaFileType &file_type, size_t start_offset) {
   file_type = media_player::MediaFileType::NONE;
 
   esp_err_t err = this->allocate_buffers_();
@@ -72,35 +151,39 @@ esp_err_t AudioReader::start(const std::string &uri, media_player::MediaFileType
     return ESP_ERR_INVALID_ARG;
   }
 
-  esp_http_client_config_t client_config = {};
-
-  client_config.url = uri.c_str();
-  client_config.cert_pem = nullptr;
-  client_config.disable_auto_redirect = false;
-  client_config.max_redirection_count = 10;
-  client_config.buffer_size = 512;
-  client_config.keep_alive_enable = true;
-  client_config.timeout_ms = 5000;  // Doesn't raise an error if exceeded in esp-idf v4.4, it just prevents the
-                                    // http_client_read command from blocking for too long
-
-#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
-  if (uri.find("https:") != std::string::npos) {
-    client_config.crt_bundle_attach = esp_crt_bundle_attach;
+  PooledClientType pooled_client_type = PooledClientType::NONE;
+  if (this->connection_pool_ != nullptr) {
+    this->client_ = this->connection_pool_->acquire(uri, pooled_client_type);
   }
-#endif
 
-  this->client_ = esp_http_client_init(&client_config);
-
-  if (this->client_ == nullptr) {
-    return ESP_FAIL;
+  int content_length = 0;
+  err = this->open_connection_(uri, start_offset, pooled_client_type, content_length);
+  if ((err != ESP_OK) && (pooled_client_type != PooledClientType::NONE)) {
+    // The server probably closed the idle connection or rejected the saved session, so retry with a new client
+    err = this->open_connection_(uri, start_offset, PooledClientType::NONE, content_length);
   }
-
-  if ((err = esp_http_client_open(this->client_, 0)) != ESP_OK) {
-    this->cleanup_connection_();
+  if (err != ESP_OK) {
     return err;
   }
 
-  int content_length = esp_http_client_fetch_headers(this->client_);
+  this->bytes_to_skip_ = 0;
+  this->stream_length_ = 0;
+  if ((start_offset > 0) && (esp_http_client_get_status_code(this->client_) != HTTP_STATUS_PARTIAL_CONTENT)) {
+    // The server sent the whole file
+    this->bytes_to_skip_ = start_offset;
+    start_offset = 0;
+  }
+  if (content_length > 0) {
+    this->stream_length_ = content_length + start_offset;
+  }
+
+  this->transfer_buffer_current_ = this->transfer_buffer_;
+  this->transfer_buffer_length_ = 0;
+  this->last_data_read_ms_ = millis();
+
+  this->icy_audio_bytes_left_ = this->icy_metaint_;
+  this->icy_metadata_bytes_left_ = 0;
+  this->icy_in_metadata_ = false;
 
   char url[500];
   err = esp_http_client_get_url(this->client_, url, 500);
@@ -109,23 +192,142 @@ esp_err_t AudioReader::start(const std::string &uri, media_player::MediaFileType
     return err;
   }
 
-  std::string url_string = url;
+  // Internet radio urls usually have no extension, so fall back to the Content-Type and then to the first bytes
+  file_type = get_file_type_from_url(url);
+  if (file_type == media_player::MediaFileType::NONE) {
+    file_type = get_file_type_from_content_type(this->content_type_);
+  }
+  if (file_type == media_player::MediaFileType::NONE) {
+    while ((this->transfer_buffer_length_ < FILE_TYPE_DETECTION_SIZE) &&
+           !esp_http_client_is_complete_data_received(this->client_) &&
+           (millis() - this->last_data_read_ms_ < NO_DATA_READ_TIMEOUT_MS)) {
+      if (this->read_block_() < 0) {
+        this->destroy_connection_();
+        return ESP_FAIL;
+      }
+    }
 
-  if (str_endswith(url_string, ".wav")) {
-    file_type = media_player::MediaFileType::WAV;
-  } else if (str_endswith(url_string, ".mp3")) {
-    file_type = media_player::MediaFileType::MP3;
-  } else if (str_endswith(url_string, ".flac")) {
-    file_type = media_player::MediaFileType::FLAC;
-  } else {
-    file_type = media_player::MediaFileType::NONE;
+    size_t detection_length = this->transfer_buffer_length_;
+    if (this->icy_metaint_ > 0) {
+      detection_length = std::min(detection_length, this->icy_audio_bytes_left_);
+    }
+    file_type = get_file_type_from_data(this->transfer_buffer_current_, detection_length);
+  }
+
+  if (file_type == media_player::MediaFileType::NONE) {
     this->cleanup_connection_();
     return ESP_ERR_NOT_SUPPORTED;
   }
 
-  this->transfer_buffer_current_ = this->transfer_buffer_;
-  this->transfer_buffer_length_ = 0;
-  this->no_data_read_count_ = 0;
+  return ESP_OK;
+}
+
+esp_err_t AudioReader::preconnect(const std::string &uri) {
+  if (this->connection_pool_ == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  this->cleanup_connection_();
+
+  PooledClientType pooled_client_type = PooledClientType::NONE;
+  this->client_ = this->connection_pool_->acquire(uri, pooled_client_type);
+  if (pooled_client_type == PooledClientType::CONNECTION) {
+    // Already connected
+    this->connection_pool_->release(this->client_, true);
+    this->client_ = nullptr;
+    return ESP_OK;
+  }
+
+  int content_length = 0;
+  esp_err_t err = this->open_connection_(uri, 0, pooled_client_type, content_length, HTTP_METHOD_HEAD);
+  if ((err != ESP_OK) && (pooled_client_type != PooledClientType::NONE)) {
+    err = this->open_connection_(uri, 0, PooledClientType::NONE, content_length, HTTP_METHOD_HEAD);
+  }
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  // A HEAD response ends with its headers, so the connection is ready for the next request even though the client
+  // doesn't count the response as completely received
+  esp_http_client_set_user_data(this->client_, nullptr);
+  this->connection_pool_->release(this->client_, true);
+  this->client_ = nullptr;
+
+  return ESP_OK;
+}
+
+esp_err_t AudioReader::open_connection_(const std::string &uri, size_t start_offset,
+                                        PooledClientType pooled_client_type, int &content_length,
+                                        esp_http_client_method_t method) {
+  if (pooled_client_type == PooledClientType::NONE) {
+    esp_http_client_config_t client_config = {};
+
+    client_config.url = uri.c_str();
+    client_config.cert_pem = nullptr;
+    client_config.disable_auto_redirect = false;
+    client_config.max_redirection_count = 10;
+    client_config.buffer_size = 512;
+    client_config.keep_alive_enable = true;
+    client_config.timeout_ms = 5000;  // Doesn't raise an error if exceeded in esp-idf v4.4, it just prevents the
+                                      // http_client_read command from blocking for too long
+
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+    if (uri.find("https:") != std::string::npos) {
+      client_config.crt_bundle_attach = esp_crt_bundle_attach;
+    }
+#endif
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    // Keep the TLS session so the connection pool can resume it after the connection closes
+    client_config.save_client_session = true;
+#endif
+
+    client_config.event_handler = &AudioReader::http_event_handler_;
+
+    this->client_ = esp_http_client_init(&client_config);
+
+    if (this->client_ == nullptr) {
+      return ESP_FAIL;
+    }
+  }
+
+  if (start_offset > 0) {
+    std::string range = "bytes=" + to_string(start_offset) + "-";
+    esp_http_client_set_header(this->client_, "Range", range.c_str());
+  } else {
+    // A reused client keeps the headers of its previous request
+    esp_http_client_delete_header(this->client_, "Range");
+  }
+
+  // A reused client keeps the method of its previous request too
+  esp_http_client_set_method(this->client_, method);
+
+  // Ask Shoutcast and Icecast servers to interleave the stream title with the audio
+  esp_http_client_set_header(this->client_, "Icy-MetaData", "1");
+
+  // Set on every request, as clients from the pool were opened by another reader
+  esp_http_client_set_user_data(this->client_, this);
+  this->content_type_.clear();
+  this->icy_metaint_ = 0;
+
+  uint32_t open_start_ms = millis();
+  esp_err_t err = esp_http_client_open(this->client_, 0);
+  if (err != ESP_OK) {
+    this->destroy_connection_();
+    return err;
+  }
+  uint32_t open_time_ms = millis() - open_start_ms;
+
+  content_length = esp_http_client_fetch_headers(this->client_);
+
+  if (esp_http_client_get_status_code(this->client_) <= 0) {
+    // No response, e.g., the server closed the connection
+    this->destroy_connection_();
+    return ESP_FAIL;
+  }
+
+  if (this->connection_pool_ != nullptr) {
+    this->connection_pool_->record_open_time(open_time_ms, pooled_client_type, uri);
+  }
 
   return ESP_OK;
 }
@@ -142,61 +344,173 @@ AudioReaderState AudioReader::read() {
 
 AudioReaderState AudioReader::file_read_() {
   if (this->transfer_buffer_length_ > 0) {
-    size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-        (void *) this->transfer_buffer_current_, this->transfer_buffer_length_, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+    size_t bytes_written = this->output_port_->write(this->transfer_buffer_current_, this->transfer_buffer_length_);
+    NABU_LATENCY_TRACE(this->latency_tracer_, on_output(TraceStage::READER, bytes_written));
     this->transfer_buffer_length_ -= bytes_written;
     this->transfer_buffer_current_ += bytes_written;
+    this->bytes_read_ += bytes_written;
 
-    return AudioReaderState::READING;
+    return (this->transfer_buffer_length_ > 0) ? AudioReaderState::WAITING_FOR_SPACE : AudioReaderState::READING;
   }
   return AudioReaderState::FINISHED;
 }
 
 AudioReaderState AudioReader::http_read_() {
-  if (this->transfer_buffer_length_ > 0) {
-    size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-        (void *) this->transfer_buffer_, this->transfer_buffer_length_, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+  bool timed_out = false;
+  if ((this->transfer_buffer_length_ == 0) && !esp_http_client_is_complete_data_received(this->client_)) {
+    // Only read once the previous block is completely written, so the unwritten data never has to be moved
+    int received_len = this->read_block_();
+
+    if (received_len < 0) {
+      // HTTP read error
+      this->destroy_connection_();
+      return AudioReaderState::FAILED;
+    } else if (received_len == 0) {
+      // Read timed out
+      if (millis() - this->last_data_read_ms_ >= NO_DATA_READ_TIMEOUT_MS) {
+        // No data for too long, so the http read has failed
+        this->destroy_connection_();
+        return AudioReaderState::FAILED;
+      }
+      timed_out = true;
+    }
+  }
+
+  while (this->transfer_buffer_length_ > 0) {
+    if ((this->icy_metaint_ > 0) && (this->icy_audio_bytes_left_ == 0)) {
+      this->read_icy_metadata_();
+      continue;
+    }
+
+    // Write the audio up to the next metadata block straight from the transfer buffer
+    size_t audio_length = this->transfer_buffer_length_;
+    if (this->icy_metaint_ > 0) {
+      audio_length = std::min(audio_length, this->icy_audio_bytes_left_);
+    }
+
+    size_t bytes_written = this->output_port_->write(this->transfer_buffer_current_, audio_length);
+    NABU_LATENCY_TRACE(this->latency_tracer_, on_output(TraceStage::READER, bytes_written));
     this->transfer_buffer_length_ -= bytes_written;
+    this->transfer_buffer_current_ += bytes_written;
+    this->bytes_read_ += bytes_written;
+    if (this->icy_metaint_ > 0) {
+      this->icy_audio_bytes_left_ -= bytes_written;
+    }
 
-    // Shift remaining data to the start of the transfer buffer
-    memmove(this->transfer_buffer_, this->transfer_buffer_ + bytes_written, this->transfer_buffer_length_);
+    if (bytes_written < audio_length) {
+      // The port is full
+      break;
+    }
   }
 
-  if (esp_http_client_is_complete_data_received(this->client_)) {
-    if (this->transfer_buffer_length_ == 0) {
-      this->cleanup_connection_();
-      return AudioReaderState::FINISHED;
+  // Endless streams never complete; chunked streams complete once the final chunk is read
+  if ((this->transfer_buffer_length_ == 0) && esp_http_client_is_complete_data_received(this->client_)) {
+    this->cleanup_connection_();
+    return AudioReaderState::FINISHED;
+  }
+
+  if (this->transfer_buffer_length_ > 0) {
+    // Only the port filling up stops the writes early
+    return AudioReaderState::WAITING_FOR_SPACE;
+  }
+  return timed_out ? AudioReaderState::WAITING_FOR_DATA : AudioReaderState::READING;
+}
+
+int AudioReader::read_block_() {
+  if (this->transfer_buffer_length_ == 0) {
+    this->transfer_buffer_current_ = this->transfer_buffer_;
+  }
+
+  size_t write_offset = (this->transfer_buffer_current_ - this->transfer_buffer_) + this->transfer_buffer_length_;
+  int received_len = esp_http_client_read(this->client_, (char *) this->transfer_buffer_ + write_offset,
+                                          this->transfer_buffer_size_ - write_offset);
+
+  if (received_len > 0) {
+    this->transfer_buffer_length_ += received_len;
+    this->last_data_read_ms_ = millis();
+
+    if (this->bytes_to_skip_ > 0) {
+      size_t skipped = std::min<size_t>(this->bytes_to_skip_, this->transfer_buffer_length_);
+      this->transfer_buffer_current_ += skipped;
+      this->transfer_buffer_length_ -= skipped;
+      this->bytes_to_skip_ -= skipped;
     }
-  } else {
-    size_t bytes_to_read = this->transfer_buffer_size_ - this->transfer_buffer_length_;
-    int received_len = esp_http_client_read(
-        this->client_, (char *) this->transfer_buffer_ + this->transfer_buffer_length_, bytes_to_read);
-
-    if (received_len > 0) {
-      this->transfer_buffer_length_ += received_len;
-      this->no_data_read_count_ = 0;
-    } else if (received_len < 0) {
-      // HTTP read error
-      this->cleanup_connection_();
-      return AudioReaderState::FAILED;
-    } else {
-      if (bytes_to_read > 0) {
-        // Read timed out
-        ++this->no_data_read_count_;
-        if (this->no_data_read_count_ >= ERROR_COUNT_NO_DATA_READ_TIMEOUT) {
-          // Timed out with no data read too many times, so the http read has failed
-          this->cleanup_connection_();
-          return AudioReaderState::FAILED;
-        }
-        vTaskDelay(pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
-      }
+  }
+
+  return received_len;
+}
+
+void AudioReader::read_icy_metadata_() {
+  if (!this->icy_in_metadata_) {
+    // Each block starts with its length in units of 16 bytes; it's usually 0 unless the title changed
+    this->icy_metadata_bytes_left_ = *this->transfer_buffer_current_ * 16;
+    ++this->transfer_buffer_current_;
+    --this->transfer_buffer_length_;
+    this->icy_metadata_.clear();
+    this->icy_in_metadata_ = true;
+  }
+
+  size_t metadata_length = std::min(this->icy_metadata_bytes_left_, this->transfer_buffer_length_);
+  this->icy_metadata_.append((const char *) this->transfer_buffer_current_, metadata_length);
+  this->transfer_buffer_current_ += metadata_length;
+  this->transfer_buffer_length_ -= metadata_length;
+  this->icy_metadata_bytes_left_ -= metadata_length;
+
+  if (this->icy_metadata_bytes_left_ == 0) {
+    this->icy_in_metadata_ = false;
+    this->icy_audio_bytes_left_ = this->icy_metaint_;
+    this->parse_icy_metadata_();
+  }
+}
+
+void AudioReader::parse_icy_metadata_() {
+  // Metadata looks like "StreamTitle='Artist - Title';StreamUrl='';" padded with null bytes
+  static const char *const TITLE_START = "StreamTitle='";
+  size_t title_start = this->icy_metadata_.find(TITLE_START);
+  if (title_start == std::string::npos) {
+    return;
+  }
+  title_start += strlen(TITLE_START);
+
+  size_t title_end = this->icy_metadata_.find("';", title_start);
+  if (title_end == std::string::npos) {
+    title_end = this->icy_metadata_.rfind('\'');
+    if ((title_end == std::string::npos) || (title_end < title_start)) {
+      return;
     }
   }
 
-  return AudioReaderState::READING;
+  std::string title = this->icy_metadata_.substr(title_start, title_end - title_start);
+  if (title != this->stream_title_) {
+    this->stream_title_ = title;
+    this->new_stream_title_ = make_unique<std::string>(title);
+  }
+}
+
+esp_err_t AudioReader::http_event_handler_(esp_http_client_event_t *evt) {
+  AudioReader *this_reader = (AudioReader *) evt->user_data;
+  if ((evt->event_id == HTTP_EVENT_ON_HEADER) && (this_reader != nullptr)) {
+    if (strcasecmp(evt->header_key, "Content-Type") == 0) {
+      this_reader->content_type_ = evt->header_value;
+    } else if (strcasecmp(evt->header_key, "icy-metaint") == 0) {
+      this_reader->icy_metaint_ = strtoul(evt->header_value, nullptr, 10);
+    }
+  }
+  return ESP_OK;
 }
 
 void AudioReader::cleanup_connection_() {
+  if ((this->client_ != nullptr) && (this->connection_pool_ != nullptr)) {
+    // A partially read response closes the connection, but the pool may still keep the client's TLS session
+    esp_http_client_set_user_data(this->client_, nullptr);
+    this->connection_pool_->release(this->client_, esp_http_client_is_complete_data_received(this->client_));
+    this->client_ = nullptr;
+  } else {
+    this->destroy_connection_();
+  }
+}
+
+void AudioReader::destroy_connection_() {
   if (this->client_ != nullptr) {
     esp_http_client_close(this->client_);
     esp_http_client_cleanup(this->client_);
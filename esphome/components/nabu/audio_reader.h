@@ -2,49 +2,146 @@
 
 #ifdef USE_ESP_IDF
 
+#include "audio_graph.h"
+#include "http_connection_pool.h"
+#include "latency_tracer.h"
+
 #include "esphome/components/media_player/media_player.h"
-#include "esphome/core/ring_buffer.h"
 
 #include <esp_http_client.h>
 
+#include <memory>
+#include <string>
+
 namespace esphome {
 namespace nabu {
 
 enum class AudioReaderState : uint8_t {
   READING = 0,
+  WAITING_FOR_DATA,   // Nothing arrived before the client's timeout
+  WAITING_FOR_SPACE,  // The output port is full; the unwritten bytes are written once it has room
   FINISHED,
   FAILED,
 };
 
 class AudioReader {
  public:
-  AudioReader(esphome::RingBuffer *output_ring_buffer, size_t transfer_buffer_size);
+  AudioReader(AudioPort *output_port, size_t transfer_buffer_size);
   ~AudioReader();
 
-  esp_err_t start(const std::string &uri, media_player::MediaFileType &file_type);
-  esp_err_t start(media_player::MediaFile *media_file, media_player::MediaFileType &file_type);
-
+  /// @brief Starts reading a file or an endless stream over HTTP
+  /// @param uri url of the file
+  /// @param file_type set to the file's type based on its extension, the response's Content-Type, or its first bytes
+  /// @param start_offset byte offset to start reading from. Requested with a Range header; if the server ignores it,
+  /// the skipped bytes are downloaded and discarded.
+  /// @return ESP_OK if successful, an esp_err_t error code otherwise
+  esp_err_t start(const std::string &uri, media_player::MediaFileType &file_type, size_t start_offset = 0);
+  esp_err_t start(media_player::MediaFile *media_file, media_player::MediaFileType &file_type,
+                  size_t start_offset = 0);
+
+  /// @brief Reads the next block of the file or response and writes as much of it as fits to the output port, without
+  /// waiting for the port. Reading from the network blocks until the client's timeout.
   AudioReaderState read();
 
+  /// @brief Opens a connection to the url's host and hands it to the connection pool, so the next request to the host
+  /// skips the TCP and TLS handshakes. Sends a HEAD request, so no body is downloaded. Blocks until the connection is
+  /// ready.
+  /// @param uri url to request; any path on the host works, as only the connection is kept
+  /// @return ESP_OK if the pool has a connection to the host, ESP_ERR_INVALID_STATE if there is no pool, or an
+  /// esp_err_t error code otherwise
+  esp_err_t preconnect(const std::string &uri);
+
+#ifdef USE_NABU_LATENCY_TRACING
+  /// @brief Sets the tracer that records when chunks pass through this stage
+  void set_latency_tracer(LatencyTracer *latency_tracer) { this->latency_tracer_ = latency_tracer; }
+#endif
+
+  /// @brief Sets the pool that http connections are taken from and returned to once the file is completely read
+  void set_connection_pool(HTTPConnectionPool *connection_pool) { this->connection_pool_ = connection_pool; }
+
+  /// @brief Total length of the file in bytes, including any bytes before the start offset
+  /// @return the length, or 0 if the server didn't report it
+  size_t get_stream_length() const { return this->stream_length_; }
+
+  /// @brief Total bytes written to the output port since the reader started
+  size_t get_bytes_read() const { return this->bytes_read_; }
+
+  /// @brief Bytes read from the file or response that weren't written to the output port yet
+  size_t get_unwritten_bytes() const { return this->transfer_buffer_length_; }
+
+  /// @brief Takes the stream title parsed from ICY metadata since the last call
+  /// @return the new title, or nullptr if it hasn't changed
+  std::unique_ptr<std::string> release_stream_title() { return std::move(this->new_stream_title_); }
+
  protected:
   esp_err_t allocate_buffers_();
 
   AudioReaderState file_read_();
   AudioReaderState http_read_();
 
+  /// @brief Creates the client if necessary, sends the request, and reads the response headers. Destroys the client
+  /// if it fails.
+  /// @param uri url of the file
+  /// @param start_offset byte offset to request the file from
+  /// @param pooled_client_type whether client_ came from the pool, either still connected or with a saved TLS session
+  /// @param content_length set to the response's content length
+  /// @param method request method; a preconnect only needs the headers
+  /// @return ESP_OK if successful, an esp_err_t error code otherwise
+  esp_err_t open_connection_(const std::string &uri, size_t start_offset, PooledClientType pooled_client_type,
+                             int &content_length, esp_http_client_method_t method = HTTP_METHOD_GET);
+
+  /// @brief Reads the next block of the response after the data not yet written to the output port
+  /// @return the number of bytes received, 0 if the read timed out, or a negative value on error
+  int read_block_();
+
+  /// @brief Consumes ICY metadata at the start of the transfer buffer. A block may span several reads.
+  void read_icy_metadata_();
+  /// @brief Extracts the StreamTitle from a complete metadata block
+  void parse_icy_metadata_();
+
+  /// @brief Captures the response headers that identify the stream's format and ICY metadata interval
+  static esp_err_t http_event_handler_(esp_http_client_event_t *evt);
+
+  /// @brief Returns the client to the connection pool, which keeps the connection if its response was completely
+  /// read and otherwise only its TLS session. Destroys the client if there is no pool.
   void cleanup_connection_();
+  /// @brief Closes and frees the client
+  void destroy_connection_();
 
-  esphome::RingBuffer *output_ring_buffer_;
+  AudioPort *output_port_;
+
+#ifdef USE_NABU_LATENCY_TRACING
+  LatencyTracer *latency_tracer_{nullptr};
+#endif
 
   size_t transfer_buffer_length_;  // Amount of data currently stored in transfer buffer (in bytes)
   size_t transfer_buffer_size_;    // Capacity of transfer buffer (in bytes)
 
-  ssize_t no_data_read_count_;
+  uint32_t last_data_read_ms_{0};
 
+  size_t bytes_read_{0};  // Total bytes written to the output port
+
+  size_t stream_length_{0};
+  size_t bytes_to_skip_{0};  // Bytes to discard before the start offset if the server doesn't support ranges
+
+  // Only allocated for http streams; files are written straight from flash
   uint8_t *transfer_buffer_{nullptr};
+  // Start of the data not yet written to the output port, either in the transfer buffer or in the file
   const uint8_t *transfer_buffer_current_{nullptr};
 
+  // Response headers captured by the http event handler
+  std::string content_type_{};
+  size_t icy_metaint_{0};  // Bytes of audio between ICY metadata blocks; 0 if the stream has no metadata
+
+  size_t icy_audio_bytes_left_{0};     // Audio bytes before the next metadata block
+  size_t icy_metadata_bytes_left_{0};  // Bytes left in the metadata block being read
+  bool icy_in_metadata_{false};
+  std::string icy_metadata_{};
+  std::string stream_title_{};
+  std::unique_ptr<std::string> new_stream_title_;
+
   esp_http_client_handle_t client_{nullptr};
+  HTTPConnectionPool *connection_pool_{nullptr};
 
   media_player::MediaFile *current_media_file_{nullptr};
 };
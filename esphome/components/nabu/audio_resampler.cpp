@@ -2,7 +2,8 @@
 
 #include "audio_resampler.h"
 
-#include "esphome/core/ring_buffer.h"
+#include "sample_kernels.h"
+
 #include "esphome/core/helpers.h"
 
 namespace esphome {
@@ -12,28 +13,42 @@ static const size_t NUM_TAPS = 32;
 static const size_t NUM_FILTERS = 32;
 static const bool USE_PRE_POST_FILTER = true;
 
-// These output parameters are currently hardcoded in the elements further down the pipeline (mixer and speaker)
+// The output channels are hardcoded in the elements further down the pipeline (mixer and speaker)
 static const uint8_t OUTPUT_CHANNELS = 2;
-static const uint8_t OUTPUT_BITS_PER_SAMPLE = 16;
 
-static const size_t READ_WRITE_TIMEOUT_MS = 20;
+// Sample conversion kernels for each pair of sample types, picked once in start so the per sample loops don't branch
+// on the format
+template<typename In, typename Out> static void convert_kernel(const uint8_t *input, uint8_t *output, size_t samples) {
+  convert_samples(reinterpret_cast<const In *>(input), reinterpret_cast<Out *>(output), samples);
+}
 
-AudioResampler::AudioResampler(RingBuffer *input_ring_buffer, RingBuffer *output_ring_buffer,
-                               size_t internal_buffer_samples) {
-  this->input_ring_buffer_ = input_ring_buffer;
-  this->output_ring_buffer_ = output_ring_buffer;
+template<typename T> static void mono_to_stereo_kernel(uint8_t *samples, size_t frames) {
+  mono_to_stereo(reinterpret_cast<T *>(samples), frames);
+}
+
+static size_t get_sample_size(uint8_t bits_per_sample) {
+  switch (bits_per_sample) {
+    case 16:
+      return sizeof(int16_t);
+    case 32:
+      return sizeof(int32_t);
+    default:
+      return 0;
+  }
+}
+
+AudioResampler::AudioResampler(AudioPort *input_port, AudioPort *output_port, size_t internal_buffer_samples) {
+  this->input_port_ = input_port;
+  this->output_port_ = output_port;
   this->internal_buffer_samples_ = internal_buffer_samples;
 }
 
 AudioResampler::~AudioResampler() {
-  ExternalRAMAllocator<int16_t> int16_allocator(ExternalRAMAllocator<int16_t>::ALLOW_FAILURE);
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
   ExternalRAMAllocator<float> float_allocator(ExternalRAMAllocator<float>::ALLOW_FAILURE);
 
-  if (this->input_buffer_ != nullptr) {
-    int16_allocator.deallocate(this->input_buffer_, this->internal_buffer_samples_);
-  }
   if (this->output_buffer_ != nullptr) {
-    int16_allocator.deallocate(this->output_buffer_, this->internal_buffer_samples_);
+    allocator.deallocate(this->output_buffer_, this->internal_buffer_samples_ * this->output_sample_size_);
   }
   if (this->float_input_buffer_ != nullptr) {
     float_allocator.deallocate(this->float_input_buffer_, this->internal_buffer_samples_);
@@ -47,14 +62,32 @@ AudioResampler::~AudioResampler() {
   }
 }
 
+template<typename In, typename Out> void AudioResampler::select_kernels_() {
+  this->input_to_float_ = convert_kernel<In, float>;
+  this->float_to_output_ = convert_kernel<float, Out>;
+  this->input_to_output_ = convert_kernel<In, Out>;
+  this->mono_to_stereo_ = mono_to_stereo_kernel<Out>;
+}
+
 esp_err_t AudioResampler::allocate_buffers_() {
-  ExternalRAMAllocator<int16_t> int16_allocator(ExternalRAMAllocator<int16_t>::ALLOW_FAILURE);
-  ExternalRAMAllocator<float> float_allocator(ExternalRAMAllocator<float>::ALLOW_FAILURE);
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
 
-  if (this->input_buffer_ == nullptr)
-    this->input_buffer_ = int16_allocator.allocate(this->internal_buffer_samples_);
+  if (this->input_transfer_buffer_ == nullptr) {
+    this->input_transfer_buffer_ =
+        AudioSourceTransferBuffer::create(this->internal_buffer_samples_ * this->input_sample_size_);
+  }
   if (this->output_buffer_ == nullptr)
-    this->output_buffer_ = int16_allocator.allocate(this->internal_buffer_samples_);
+    this->output_buffer_ = allocator.allocate(this->internal_buffer_samples_ * this->output_sample_size_);
+
+  if ((this->input_transfer_buffer_ == nullptr) || (this->output_buffer_ == nullptr)) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t AudioResampler::allocate_float_buffers_() {
+  ExternalRAMAllocator<float> float_allocator(ExternalRAMAllocator<float>::ALLOW_FAILURE);
 
   if (this->float_input_buffer_ == nullptr)
     this->float_input_buffer_ = float_allocator.allocate(this->internal_buffer_samples_);
@@ -62,8 +95,7 @@ esp_err_t AudioResampler::allocate_buffers_() {
   if (this->float_output_buffer_ == nullptr)
     this->float_output_buffer_ = float_allocator.allocate(this->internal_buffer_samples_);
 
-  if ((this->input_buffer_ == nullptr) || (this->output_buffer_ == nullptr) || (this->float_input_buffer_ == nullptr) ||
-      (this->float_output_buffer_ == nullptr)) {
+  if ((this->float_input_buffer_ == nullptr) || (this->float_output_buffer_ == nullptr)) {
     return ESP_ERR_NO_MEM;
   }
 
@@ -71,7 +103,30 @@ esp_err_t AudioResampler::allocate_buffers_() {
 }
 
 esp_err_t AudioResampler::start(audio::AudioStreamInfo &stream_info, uint32_t target_sample_rate,
-                                ResampleInfo &resample_info) {
+                                uint8_t target_bits_per_sample, ResampleInfo &resample_info) {
+  resample_info.mono_to_stereo = (stream_info.channels != 2);
+
+  this->input_sample_size_ = get_sample_size(stream_info.bits_per_sample);
+  this->output_sample_size_ = get_sample_size(target_bits_per_sample);
+  if ((stream_info.channels > OUTPUT_CHANNELS) || (this->input_sample_size_ == 0) || (this->output_sample_size_ == 0)) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  if (this->input_sample_size_ == sizeof(int16_t)) {
+    if (this->output_sample_size_ == sizeof(int16_t)) {
+      this->select_kernels_<int16_t, int16_t>();
+    } else {
+      this->select_kernels_<int16_t, int32_t>();
+    }
+  } else {
+    if (this->output_sample_size_ == sizeof(int16_t)) {
+      this->select_kernels_<int32_t, int16_t>();
+    } else {
+      this->select_kernels_<int32_t, int32_t>();
+    }
+  }
+
+  // The buffers are sized by the sample sizes, so they are allocated once those are known
   esp_err_t err = this->allocate_buffers_();
   if (err != ESP_OK) {
     return err;
@@ -79,21 +134,12 @@ esp_err_t AudioResampler::start(audio::AudioStreamInfo &stream_info, uint32_t ta
 
   this->stream_info_ = stream_info;
 
-  this->input_buffer_current_ = this->input_buffer_;
-  this->input_buffer_length_ = 0;
-  this->float_input_buffer_current_ = this->float_input_buffer_;
-  this->float_input_buffer_length_ = 0;
+  this->input_transfer_buffer_->set_source(this->input_port_);
+  this->input_transfer_buffer_->clear_buffered_data();
 
   this->output_buffer_current_ = this->output_buffer_;
   this->output_buffer_length_ = 0;
-  this->float_output_buffer_current_ = this->float_output_buffer_;
-  this->float_output_buffer_length_ = 0;
-
-  resample_info.mono_to_stereo = (stream_info.channels != 2);
-
-  if ((stream_info.channels > OUTPUT_CHANNELS) || (stream_info_.bits_per_sample != OUTPUT_BITS_PER_SAMPLE)) {
-    return ESP_ERR_NOT_SUPPORTED;
-  }
+  this->consume_input_on_write_ = false;
 
   if (stream_info.channels > 0) {
     this->channel_factor_ = 2 / stream_info.channels;
@@ -104,6 +150,12 @@ esp_err_t AudioResampler::start(audio::AudioStreamInfo &stream_info, uint32_t ta
 
     resample_info.resample = true;
 
+    // Only converting the sample rate needs the float buffers, which are larger than the others
+    err = this->allocate_float_buffers_();
+    if (err != ESP_OK) {
+      return err;
+    }
+
     this->sample_ratio_ = static_cast<float>(target_sample_rate) / static_cast<float>(stream_info.sample_rate);
 
     if (this->sample_ratio_ < 1.0) {
@@ -154,41 +206,97 @@ esp_err_t AudioResampler::start(audio::AudioStreamInfo &stream_info, uint32_t ta
   }
 
   this->resample_info_ = resample_info;
+  this->passthrough_ = !resample_info.resample && !resample_info.mono_to_stereo &&
+                       (this->input_sample_size_ == this->output_sample_size_);
   return ESP_OK;
 }
 
-AudioResamplerState AudioResampler::resample(bool stop_gracefully) {
-  if (stop_gracefully) {
-    if ((this->input_ring_buffer_->available() == 0) && (this->output_ring_buffer_->available() == 0) &&
-        (this->input_buffer_length_ == 0) && (this->output_buffer_length_ == 0)) {
+size_t AudioResampler::refill_input_(size_t max_bytes) {
+  size_t bytes_read = this->input_transfer_buffer_->transfer_data_from_source(max_bytes);
+  NABU_LATENCY_TRACE(this->latency_tracer_, on_input(TraceStage::RESAMPLER, bytes_read));
+  return bytes_read;
+}
+
+AudioResamplerState AudioResampler::resample(bool input_finished) {
+  const size_t bytes_per_frame = this->stream_info_.channels * this->input_sample_size_;
+
+  if (this->output_buffer_length_ == 0) {
+    // A partial frame left in the input buffer can never be processed, so it doesn't keep the resampler running. The
+    // graph waits for the output port to be read before the stage counts as finished.
+    if (input_finished && (this->input_transfer_buffer_->available() < bytes_per_frame)) {
       return AudioResamplerState::FINISHED;
     }
+
+    if (!this->convert_input_(bytes_per_frame)) {
+      return AudioResamplerState::WAITING_FOR_INPUT;
+    }
   }
 
+  // Hand all of the converted block to the output port before converting more
+  this->write_output_();
   if (this->output_buffer_length_ > 0) {
-    size_t bytes_to_write = this->output_buffer_length_;
+    return AudioResamplerState::WAITING_FOR_SPACE;
+  }
+
+  return AudioResamplerState::RESAMPLING;
+}
+
+size_t AudioResampler::get_input_bytes_needed() const {
+  // At least the rest of the next whole frame
+  const size_t bytes_per_frame = this->stream_info_.channels * this->input_sample_size_;
+  size_t bytes_available = this->input_transfer_buffer_->available();
+  return (bytes_available / bytes_per_frame + 1) * bytes_per_frame - bytes_available;
+}
 
-    if (bytes_to_write > 0) {
-      size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-          (void *) this->output_buffer_current_, bytes_to_write, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+void AudioResampler::write_output_() {
+  size_t bytes_written = this->output_port_->write(this->output_buffer_current_, this->output_buffer_length_);
+  NABU_LATENCY_TRACE(this->latency_tracer_, on_output(TraceStage::RESAMPLER, bytes_written));
 
-      this->output_buffer_current_ += bytes_written / sizeof(int16_t);
-      this->output_buffer_length_ -= bytes_written;
-    }
+  if ((bytes_written > 0) && this->output_callback_) {
+    this->output_callback_(this->output_buffer_current_, bytes_written);
+  }
 
-    return AudioResamplerState::RESAMPLING;
+  if (this->consume_input_on_write_) {
+    // The input's writer may reuse the offer's memory once it is consumed, so only consume what was copied
+    this->input_port_->consume(bytes_written);
+    NABU_LATENCY_TRACE(this->latency_tracer_, on_input(TraceStage::RESAMPLER, bytes_written));
   }
 
-  // Copy audio data directly to output_buffer if resampling isn't required
-  if (!this->resample_info_.resample && !this->resample_info_.mono_to_stereo) {
-    size_t bytes_read =
-        this->input_ring_buffer_->read((void *) this->output_buffer_, this->internal_buffer_samples_ * sizeof(int16_t),
-                                       pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+  this->output_buffer_current_ += bytes_written;
+  this->output_buffer_length_ -= bytes_written;
+  if (this->output_buffer_length_ == 0) {
+    this->consume_input_on_write_ = false;
+  }
+}
 
-    this->output_buffer_current_ = this->output_buffer_;
-    this->output_buffer_length_ += bytes_read;
+bool AudioResampler::convert_input_(size_t bytes_per_frame) {
+  // Write audio data directly from the input if it is already in the output format
+  if (this->passthrough_) {
+    if (this->input_transfer_buffer_->available() == 0) {
+      // A direct input's offer is written straight to the output port without copying it to the input buffer first
+      size_t offer_length = 0;
+      const uint8_t *offer = this->input_port_->peek(offer_length);
+      offer_length -= offer_length % bytes_per_frame;
+      if (offer_length > 0) {
+        this->output_buffer_current_ = offer;
+        this->output_buffer_length_ = offer_length;
+        this->consume_input_on_write_ = true;
+        return true;
+      }
+    }
+
+    this->refill_input_(this->input_transfer_buffer_->free());
+
+    // A port read can end partway through a frame. Only whole frames are sent to the mixer; the partial frame
+    // stays in the input buffer until the rest of it arrives.
+    size_t bytes_available = this->input_transfer_buffer_->available();
+    size_t bytes_to_write = bytes_available - bytes_available % bytes_per_frame;
+
+    this->output_buffer_current_ = this->input_transfer_buffer_->get_buffer_start();
+    this->output_buffer_length_ = bytes_to_write;
+    this->input_transfer_buffer_->decrease_buffer_length(bytes_to_write);
 
-    return AudioResamplerState::RESAMPLING;
+    return this->output_buffer_length_ > 0;
   }
 
   //////
@@ -208,42 +316,33 @@ AudioResamplerState AudioResampler::resample(bool stop_gracefully) {
     max_input_samples /= upsampling_factor;
   }
 
-  // Move old data to the start of the buffer
-  if (this->input_buffer_length_ > 0) {
-    memmove((void *) this->input_buffer_, (void *) this->input_buffer_current_, this->input_buffer_length_);
+  // Append new data after the unprocessed samples
+  size_t max_input_bytes = max_input_samples * this->input_sample_size_;
+  if (this->input_transfer_buffer_->available() < max_input_bytes) {
+    this->refill_input_(max_input_bytes - this->input_transfer_buffer_->available());
   }
-  this->input_buffer_current_ = this->input_buffer_;
 
-  // Copy new data to the end of the of the buffer
-  size_t bytes_to_read = max_input_samples * sizeof(int16_t) - this->input_buffer_length_;
-
-  if (bytes_to_read > 0) {
-    int16_t *new_input_buffer_data = this->input_buffer_ + this->input_buffer_length_ / sizeof(int16_t);
-    size_t bytes_read = this->input_ring_buffer_->read((void *) new_input_buffer_data, bytes_to_read,
-                                                       pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
-
-    this->input_buffer_length_ += bytes_read;
+  size_t input_buffer_length = this->input_transfer_buffer_->available();
+  if (input_buffer_length == 0) {
+    return false;
   }
 
-  if (this->input_buffer_length_ == 0) {
-    return AudioResamplerState::RESAMPLING;
-  }
+  // Whole samples are always consumed, so the start of the window stays aligned for the kernels
+  const uint8_t *input_buffer = this->input_transfer_buffer_->get_buffer_start();
 
   if (this->resample_info_.resample) {
-    if (this->input_buffer_length_ > 0) {
-      // Samples are indiviudal int16 values. Frames include 1 sample for mono and 2 samples for stereo
+    if (input_buffer_length > 0) {
+      // Samples are indiviudal int16 or int32 values. Frames include 1 sample for mono and 2 samples for stereo
       // Be careful converting between bytes, samples, and frames!
-      // 1 sample = 2 bytes = sizeof(int16_t)
+      // 1 sample = input_sample_size_ bytes
       // if mono:
       //    1 frame = 1 sample
       // if stereo:
       //    1 frame = 2 samples (left and right)
 
-      size_t samples_read = this->input_buffer_length_ / sizeof(int16_t);
+      size_t samples_read = input_buffer_length / this->input_sample_size_;
 
-      for (int i = 0; i < samples_read; ++i) {
-        this->float_input_buffer_[i] = static_cast<float>(this->input_buffer_[i]) / 32768.0f;
-      }
+      this->input_to_float_(input_buffer, reinterpret_cast<uint8_t *>(this->float_input_buffer_), samples_read);
 
       size_t frames_read = samples_read / this->stream_info_.channels;
 
@@ -277,38 +376,33 @@ AudioResamplerState AudioResampler::resample(bool stop_gracefully) {
 
       size_t samples_generated = frames_generated * this->stream_info_.channels;
 
-      for (int i = 0; i < samples_generated; ++i) {
-        this->output_buffer_[i] = static_cast<int16_t>(this->float_output_buffer_[i] * 32767);
-      }
+      this->float_to_output_(reinterpret_cast<const uint8_t *>(this->float_output_buffer_), this->output_buffer_,
+                             samples_generated);
 
-      this->input_buffer_current_ += samples_used;
-      this->input_buffer_length_ -= samples_used * sizeof(int16_t);
+      this->input_transfer_buffer_->decrease_buffer_length(samples_used * this->input_sample_size_);
 
       this->output_buffer_current_ = this->output_buffer_;
-      this->output_buffer_length_ += samples_generated * sizeof(int16_t);
+      this->output_buffer_length_ += samples_generated * this->output_sample_size_;
     }
   } else {
-    size_t bytes_to_transfer =
-        std::min(this->internal_buffer_samples_ / this->channel_factor_ * sizeof(int16_t), this->input_buffer_length_);
-    std::memcpy((void *) this->output_buffer_, (void *) this->input_buffer_current_, bytes_to_transfer);
+    // Copies the samples, converting them to the output sample size
+    size_t max_bytes = this->internal_buffer_samples_ / this->channel_factor_ * this->input_sample_size_;
+    size_t frames_to_transfer = std::min(max_bytes, input_buffer_length) / bytes_per_frame;  // Only whole frames
+    size_t samples_to_transfer = frames_to_transfer * this->stream_info_.channels;
+    this->input_to_output_(input_buffer, this->output_buffer_, samples_to_transfer);
 
-    this->input_buffer_current_ += bytes_to_transfer / sizeof(int16_t);
-    this->input_buffer_length_ -= bytes_to_transfer;
+    this->input_transfer_buffer_->decrease_buffer_length(frames_to_transfer * bytes_per_frame);
 
     this->output_buffer_current_ = this->output_buffer_;
-    this->output_buffer_length_ += bytes_to_transfer;
+    this->output_buffer_length_ += samples_to_transfer * this->output_sample_size_;
   }
 
   if (this->resample_info_.mono_to_stereo) {
     // Convert mono to stereo
-    for (int i = this->output_buffer_length_ / (sizeof(int16_t)) - 1; i >= 0; --i) {
-      this->output_buffer_[2 * i] = this->output_buffer_[i];
-      this->output_buffer_[2 * i + 1] = this->output_buffer_[i];
-    }
-
+    this->mono_to_stereo_(this->output_buffer_, this->output_buffer_length_ / this->output_sample_size_);
     this->output_buffer_length_ *= 2;  // double the bytes for stereo samples
   }
-  return AudioResamplerState::RESAMPLING;
+  return this->output_buffer_length_ > 0;
 }
 
 }  // namespace nabu
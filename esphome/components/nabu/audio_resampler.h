@@ -5,8 +5,14 @@
 #include "biquad.h"
 #include "resampler.h"
 
+#include "audio_graph.h"
+#include "audio_transfer_buffer.h"
+#include "latency_tracer.h"
+
 #include "esphome/components/audio/audio.h"
-#include "esphome/core/ring_buffer.h"
+#include "esphome/core/helpers.h"
+
+#include <functional>
 
 namespace esphome {
 namespace nabu {
@@ -14,6 +20,8 @@ namespace nabu {
 enum class AudioResamplerState : uint8_t {
   INITIALIZED = 0,
   RESAMPLING,
+  WAITING_FOR_INPUT,  // Not enough input for a block; get_input_bytes_needed says how much more
+  WAITING_FOR_SPACE,  // The output port is full; get_unwritten_bytes says how much of the block is left
   FINISHED,
   FAILED,
 };
@@ -25,44 +33,105 @@ struct ResampleInfo {
 
 class AudioResampler {
  public:
-  AudioResampler(esphome::RingBuffer *input_ring_buffer, esphome::RingBuffer *output_ring_buffer,
-                 size_t internal_buffer_samples);
+  /// @param input_port port to read the audio from
+  /// @param output_port port the converted audio is written to
+  /// @param internal_buffer_samples size of the input and output buffers in samples
+  AudioResampler(AudioPort *input_port, AudioPort *output_port, size_t internal_buffer_samples);
   ~AudioResampler();
 
   /// @brief Sets up the various bits necessary to resample
-  /// @param stream_info the incoming sample rate, bits per sample, and number of channels
+  /// @param stream_info the incoming sample rate, bits per sample (16 or 32), and number of channels
   /// @param target_sample_rate the necessary sample rate to convert to
+  /// @param target_bits_per_sample the necessary bits per sample to convert to (16 or 32)
   /// @return ESP_OK if it is able to convert the incoming stream or an error otherwise
-  esp_err_t start(audio::AudioStreamInfo &stream_info, uint32_t target_sample_rate, ResampleInfo &resample_info);
+  esp_err_t start(audio::AudioStreamInfo &stream_info, uint32_t target_sample_rate, uint8_t target_bits_per_sample,
+                  ResampleInfo &resample_info);
+
+  /// @brief Converts the next block of the input and writes as much of it as fits to the output port, without waiting
+  /// for either port
+  /// @param input_finished whether the input port has ended and all of it was read
+  /// @return FINISHED once the input is finished and all of it was written
+  AudioResamplerState resample(bool input_finished);
+
+  /// @brief Number of bytes the input port must provide after AudioResamplerState::WAITING_FOR_INPUT
+  size_t get_input_bytes_needed() const;
 
-  AudioResamplerState resample(bool stop_gracefully);
+  /// @brief Number of converted bytes still to be written after AudioResamplerState::WAITING_FOR_SPACE
+  size_t get_unwritten_bytes() const { return this->output_buffer_length_; }
+
+#ifdef USE_NABU_LATENCY_TRACING
+  /// @brief Sets the tracer that records when chunks pass through this stage
+  void set_latency_tracer(LatencyTracer *latency_tracer) { this->latency_tracer_ = latency_tracer; }
+#endif
+
+  /// @brief Sets a callback that receives a copy of the audio written to the output port
+  /// @param callback called with a pointer to the written bytes and their length
+  void set_output_callback(std::function<void(const uint8_t *, size_t)> &&callback) {
+    this->output_callback_ = std::move(callback);
+  }
 
  protected:
-  esp_err_t allocate_buffers_();
+  // Converts samples between the formats picked in start; see sample_kernels.h
+  using SampleKernel = void (*)(const uint8_t *input, uint8_t *output, size_t samples);
+  using ExpandKernel = void (*)(uint8_t *samples, size_t frames);
 
-  esphome::RingBuffer *input_ring_buffer_;
-  esphome::RingBuffer *output_ring_buffer_;
+  /// @brief Points the kernels at the instantiations for the input and output sample types
+  template<typename In, typename Out> void select_kernels_();
+
+  esp_err_t allocate_buffers_();
+  /// @brief Allocates the buffers used for converting the sample rate
+  /// @return ESP_OK if successful or ESP_ERR_NO_MEM otherwise
+  esp_err_t allocate_float_buffers_();
+
+  /// @brief Refills the input transfer buffer from the input port
+  /// @param max_bytes maximum number of bytes to read
+  /// @return number of bytes read
+  size_t refill_input_(size_t max_bytes);
+
+  /// @brief Converts the next block of the input into the output buffer. Only call once the output buffer has been
+  /// written.
+  /// @param bytes_per_frame size of an input frame in bytes
+  /// @return true if there is converted audio to write
+  bool convert_input_(size_t bytes_per_frame);
+
+  /// @brief Writes as much of the output buffer as fits into the output port
+  void write_output_();
+
+  AudioPort *input_port_;
+  AudioPort *output_port_;
+  std::function<void(const uint8_t *, size_t)> output_callback_;
   size_t internal_buffer_samples_;
 
-  int16_t *input_buffer_{nullptr};
-  int16_t *input_buffer_current_{nullptr};
-  size_t input_buffer_length_;
+#ifdef USE_NABU_LATENCY_TRACING
+  LatencyTracer *latency_tracer_{nullptr};
+#endif
+
+  // Sliding window over the input samples; whole frames are consumed in place
+  std::unique_ptr<AudioSourceTransferBuffer> input_transfer_buffer_;
 
-  int16_t *output_buffer_{nullptr};
-  int16_t *output_buffer_current_{nullptr};
+  uint8_t *output_buffer_{nullptr};
+  const uint8_t *output_buffer_current_{nullptr};
   size_t output_buffer_length_;
+  // True while the output is written straight from a direct input port's offer, which is only consumed as the output
+  // port takes it
+  bool consume_input_on_write_{false};
 
   float *float_input_buffer_{nullptr};
-  float *float_input_buffer_current_{nullptr};
-  size_t float_input_buffer_length_;
-
   float *float_output_buffer_{nullptr};
-  float *float_output_buffer_current_{nullptr};
-  size_t float_output_buffer_length_;
 
   audio::AudioStreamInfo stream_info_;
   ResampleInfo resample_info_;
 
+  size_t input_sample_size_{sizeof(int16_t)};
+  size_t output_sample_size_{sizeof(int16_t)};
+  // Whether the input can be written to the output port unchanged
+  bool passthrough_{false};
+
+  SampleKernel input_to_float_{nullptr};
+  SampleKernel float_to_output_{nullptr};
+  SampleKernel input_to_output_{nullptr};
+  ExpandKernel mono_to_stereo_{nullptr};
+
   Resample *resampler_{nullptr};
 
   Biquad lowpass_[2][2];
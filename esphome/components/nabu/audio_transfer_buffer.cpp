@@ -0,0 +1,124 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_transfer_buffer.h"
+
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+std::unique_ptr<AudioSourceTransferBuffer> AudioSourceTransferBuffer::create(size_t buffer_size) {
+  std::unique_ptr<AudioSourceTransferBuffer> transfer_buffer = make_unique<AudioSourceTransferBuffer>();
+
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  transfer_buffer->buffer_ = allocator.allocate(buffer_size);
+
+  if (transfer_buffer->buffer_ == nullptr) {
+    return nullptr;
+  }
+
+  transfer_buffer->buffer_size_ = buffer_size;
+  transfer_buffer->clear_buffered_data();
+
+  return transfer_buffer;
+}
+
+std::unique_ptr<AudioSourceTransferBuffer> AudioSourceTransferBuffer::create_for_data(const uint8_t *data,
+                                                                                    size_t length) {
+  std::unique_ptr<AudioSourceTransferBuffer> transfer_buffer = make_unique<AudioSourceTransferBuffer>();
+
+  // Consumers only read the window, so the data is never written through this pointer
+  transfer_buffer->buffer_ = const_cast<uint8_t *>(data);
+  transfer_buffer->buffer_size_ = length;
+  transfer_buffer->owns_buffer_ = false;
+
+  transfer_buffer->data_start_ = transfer_buffer->buffer_;
+  transfer_buffer->buffer_length_ = length;
+
+  return transfer_buffer;
+}
+
+AudioSourceTransferBuffer::~AudioSourceTransferBuffer() {
+  if ((this->buffer_ != nullptr) && this->owns_buffer_) {
+    ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->buffer_, this->buffer_size_);
+    this->buffer_ = nullptr;
+  }
+}
+
+size_t AudioSourceTransferBuffer::transfer_data_from_source(size_t max_bytes) {
+  if ((this->source_ == nullptr) || !this->owns_buffer_) {
+    return 0;
+  }
+
+  size_t bytes_to_read = std::min(this->make_room_(), max_bytes);
+  if (bytes_to_read == 0) {
+    return 0;
+  }
+
+  size_t bytes_read = this->source_->read((void *) this->get_buffer_end(), bytes_to_read);
+  this->buffer_length_ += bytes_read;
+
+  return bytes_read;
+}
+
+size_t AudioSourceTransferBuffer::append(const uint8_t *data, size_t length) {
+  if (!this->owns_buffer_) {
+    return 0;
+  }
+
+  size_t bytes_to_copy = std::min(this->make_room_(), length);
+  if (bytes_to_copy > 0) {
+    std::memcpy(this->get_buffer_end(), data, bytes_to_copy);
+    this->buffer_length_ += bytes_to_copy;
+  }
+
+  return bytes_to_copy;
+}
+
+size_t AudioSourceTransferBuffer::make_room_() {
+  size_t space_in_front = this->data_start_ - this->buffer_;
+  size_t space_after = this->free() - space_in_front;
+
+  if (space_in_front > space_after) {
+    this->compact();
+    space_after = this->free();
+  }
+
+  return space_after;
+}
+
+void AudioSourceTransferBuffer::compact() {
+  if ((this->data_start_ != this->buffer_) && this->owns_buffer_) {
+    if (this->buffer_length_ > 0) {
+      memmove(this->buffer_, this->data_start_, this->buffer_length_);
+    }
+    this->data_start_ = this->buffer_;
+  }
+}
+
+void AudioSourceTransferBuffer::clear_buffered_data() {
+  this->data_start_ = this->buffer_;
+  this->buffer_length_ = 0;
+}
+
+void AudioSourceTransferBuffer::decrease_buffer_length(size_t bytes) {
+  bytes = std::min(bytes, this->buffer_length_);
+  this->buffer_length_ -= bytes;
+  this->bytes_consumed_ += bytes;
+
+  if (this->buffer_length_ == 0) {
+    // Nothing left to keep, so the next refill can use the whole buffer
+    this->data_start_ = this->buffer_;
+  } else {
+    this->data_start_ += bytes;
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,101 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "audio_graph.h"
+
+#include <memory>
+
+namespace esphome {
+namespace nabu {
+
+// A linear buffer that is refilled from an audio graph port. Consumers process the buffered data in place, starting at
+// ``get_buffer_start()``, and then call ``decrease_buffer_length`` to mark it as consumed. Consuming data moves the
+// start of the buffered window forward instead of shifting the remaining data.
+//  - New data is appended after the buffered window
+//  - The window is only moved back to the start of the buffer when more free space is in front of the window than
+//    behind it. A consumer that only refills once it can't make progress with the data it has therefore only ever
+//    moves a partial frame, rather than moving the whole buffer after every frame.
+class AudioSourceTransferBuffer {
+ public:
+  /// @brief Allocates a transfer buffer in external RAM, if available
+  /// @param buffer_size capacity of the buffer in bytes
+  /// @return unique_ptr to the transfer buffer, or nullptr if it could not be allocated
+  static std::unique_ptr<AudioSourceTransferBuffer> create(size_t buffer_size);
+
+  /// @brief Creates a transfer buffer over data that is already addressable, e.g., a file in the flash mapping. The
+  /// window starts out holding all the data, which consumers process in place. Nothing is allocated, copied, or ever
+  /// refilled, and the data must not be modified.
+  /// @param data start of the data
+  /// @param length length of the data in bytes
+  /// @return unique_ptr to the transfer buffer
+  static std::unique_ptr<AudioSourceTransferBuffer> create_for_data(const uint8_t *data, size_t length);
+
+  ~AudioSourceTransferBuffer();
+
+  /// @brief Sets the port that ``transfer_data_from_source`` reads from
+  void set_source(AudioPort *port) { this->source_ = port; }
+
+  /// @brief Reads the data the source port has into the free space after the buffered window, without blocking.
+  /// Moves the window to the start of the buffer first if there is more free space in front of it than after it.
+  /// @param max_bytes maximum number of bytes to read
+  /// @return number of bytes read
+  size_t transfer_data_from_source(size_t max_bytes = SIZE_MAX);
+
+  /// @brief Copies data into the free space after the buffered window, like ``transfer_data_from_source`` does for
+  /// data from the source port
+  /// @param data start of the data to copy
+  /// @param length length of the data in bytes
+  /// @return number of bytes copied
+  size_t append(const uint8_t *data, size_t length);
+
+  /// @brief Moves the buffered window to the start of the buffer. Only needed for consumers that require their input
+  /// to begin at a fixed address.
+  void compact();
+
+  /// @brief Discards all buffered data and moves the window to the start of the buffer
+  void clear_buffered_data();
+
+  /// @brief Marks bytes at the start of the buffered window as consumed
+  /// @param bytes number of bytes consumed
+  void decrease_buffer_length(size_t bytes);
+
+  uint8_t *get_buffer_start() const { return this->data_start_; }
+  uint8_t *get_buffer_end() const { return this->data_start_ + this->buffer_length_; }
+
+  /// @brief Number of buffered bytes that haven't been consumed
+  size_t available() const { return this->buffer_length_; }
+
+  /// @brief Total number of bytes that could be buffered after a refill, including space freed by a compaction
+  size_t free() const { return this->buffer_size_ - this->buffer_length_; }
+
+  size_t capacity() const { return this->buffer_size_; }
+
+  /// @brief Whether the buffer wraps data it doesn't own (see ``create_for_data``)
+  bool is_external_data() const { return !this->owns_buffer_; }
+
+  /// @brief Total number of bytes consumed since the buffer was created, i.e., the stream position of the buffer start
+  size_t get_bytes_consumed() const { return this->bytes_consumed_; }
+
+ protected:
+  uint8_t *buffer_{nullptr};
+  size_t buffer_size_{0};
+
+  uint8_t *data_start_{nullptr};
+  size_t buffer_length_{0};
+
+  size_t bytes_consumed_{0};
+
+  /// @brief Moves the window to the start of the buffer if there is more free space in front of it than after it
+  /// @return free space after the window in bytes
+  size_t make_room_();
+
+  bool owns_buffer_{true};
+
+  AudioPort *source_{nullptr};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,874 @@
+#ifdef USE_ESP_IDF
+
+#include "flac_decoder.h"
+
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+static const uint32_t STREAMINFO_SIZE = 34;
+static const uint32_t METADATA_BLOCK_HEADER_SIZE = 4;
+static const uint8_t METADATA_TYPE_STREAMINFO = 0;
+static const uint8_t METADATA_TYPE_SEEKTABLE = 3;
+
+static const uint32_t SEEK_POINT_SIZE = 18;
+static const uint64_t PLACEHOLDER_SEEK_POINT = UINT64_MAX;
+
+static const uint32_t MAX_CHANNELS = 8;
+static const uint32_t MAX_SAMPLE_DEPTH = 24;  // Side channels need one extra bit, which must still fit in 32 bits
+static const uint32_t MAX_LPC_ORDER = 32;
+static const uint32_t MAX_UNROLLED_LPC_ORDER = 12;
+
+// Channel assignments above the independent channel counts
+static const uint32_t CHANNELS_LEFT_SIDE = 8;
+static const uint32_t CHANNELS_SIDE_RIGHT = 9;
+static const uint32_t CHANNELS_MID_SIDE = 10;
+
+// CRC-8 with polynomial x^8 + x^2 + x + 1, protecting the frame header
+static uint8_t crc8(const uint8_t *data, size_t length) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// CRC-16 with polynomial x^16 + x^15 + x^2 + 1, protecting the whole frame. The table is built at compile time, so the
+// decoders of both pipelines can use it at the same time.
+static constexpr std::array<uint16_t, 256> make_crc16_table() {
+  std::array<uint16_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint16_t crc = i << 8;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : (crc << 1);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+static constexpr std::array<uint16_t, 256> CRC16_TABLE = make_crc16_table();
+
+static uint16_t crc16(const uint8_t *data, size_t length) {
+  uint16_t crc = 0;
+  for (size_t i = 0; i < length; ++i) {
+    crc = (crc << 8) ^ CRC16_TABLE[(crc >> 8) ^ data[i]];
+  }
+  return crc;
+}
+
+static uint32_t floor_log2(uint32_t value) { return 31 - __builtin_clz(value); }
+
+// Reads big endian bit fields. Reading past the end of the data returns zeros from then on and sets a flag, so callers
+// only need to check for running out of data once per subframe.
+class FLACBitReader {
+ public:
+  FLACBitReader(const uint8_t *data, size_t length) : data_(data), length_(length) {}
+
+  uint32_t read_bits(uint32_t bits) {
+    if (bits == 0) {
+      return 0;
+    }
+    if (this->cache_bits_ < bits) {
+      this->refill_();
+      if (this->cache_bits_ < bits) {
+        this->set_out_of_data_();
+        return 0;
+      }
+    }
+    uint32_t value = this->cache_ >> (64 - bits);
+    this->cache_ <<= bits;
+    this->cache_bits_ -= bits;
+    return value;
+  }
+
+  int32_t read_signed_bits(uint32_t bits) {
+    if (bits == 0) {
+      return 0;
+    }
+    uint32_t shift = 32 - bits;
+    return static_cast<int32_t>(this->read_bits(bits) << shift) >> shift;
+  }
+
+  /// @brief Counts the zero bits before the next one bit and consumes them along with the one bit
+  uint32_t read_unary() {
+    uint32_t count = 0;
+    while (this->cache_ == 0) {
+      // The bits below the cached ones are always zero, so none of the cached bits are set
+      count += this->cache_bits_;
+      this->cache_bits_ = 0;
+      this->refill_();
+      if (this->cache_bits_ == 0) {
+        this->set_out_of_data_();
+        return 0;
+      }
+    }
+    uint32_t zeros = __builtin_clzll(this->cache_);
+    this->cache_ <<= zeros;
+    this->cache_ <<= 1;
+    this->cache_bits_ -= zeros + 1;
+    return count + zeros;
+  }
+
+  /// @brief Reads a block of Rice coded residuals. Keeps the bit cache in locals for the tight loop.
+  /// @return false if it ran out of data
+  bool read_rice_signed_block(int32_t *output, uint32_t count, uint32_t parameter) {
+    uint64_t cache = this->cache_;
+    uint32_t cache_bits = this->cache_bits_;
+
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t quotient = 0;
+      while (cache == 0) {
+        quotient += cache_bits;
+        this->cache_ = 0;
+        this->cache_bits_ = 0;
+        this->refill_();
+        cache = this->cache_;
+        cache_bits = this->cache_bits_;
+        if (cache_bits == 0) {
+          this->set_out_of_data_();
+          return false;
+        }
+      }
+      uint32_t zeros = __builtin_clzll(cache);
+      quotient += zeros;
+      cache <<= zeros;
+      cache <<= 1;
+      cache_bits -= zeros + 1;
+
+      if (cache_bits < parameter) {
+        this->cache_ = cache;
+        this->cache_bits_ = cache_bits;
+        this->refill_();
+        cache = this->cache_;
+        cache_bits = this->cache_bits_;
+        if (cache_bits < parameter) {
+          this->set_out_of_data_();
+          return false;
+        }
+      }
+      uint32_t remainder = (parameter > 0) ? static_cast<uint32_t>(cache >> (64 - parameter)) : 0;
+      cache <<= parameter;
+      cache_bits -= parameter;
+
+      uint32_t folded = (quotient << parameter) | remainder;
+      output[i] = static_cast<int32_t>(folded >> 1) ^ -static_cast<int32_t>(folded & 1);
+    }
+
+    this->cache_ = cache;
+    this->cache_bits_ = cache_bits;
+    return true;
+  }
+
+  void align_to_byte() {
+    uint32_t extra_bits = this->cache_bits_ % 8;
+    this->cache_ <<= extra_bits;
+    this->cache_bits_ -= extra_bits;
+  }
+
+  /// @brief Number of bytes read so far, rounded up to a whole byte
+  size_t get_byte_position() const { return this->next_byte_ - this->cache_bits_ / 8; }
+
+  bool is_out_of_data() const { return this->out_of_data_; }
+
+ protected:
+  void set_out_of_data_() {
+    // Drop the remaining bits so later, shorter reads can't return misaligned data
+    this->cache_ = 0;
+    this->cache_bits_ = 0;
+    this->next_byte_ = this->length_;
+    this->out_of_data_ = true;
+  }
+
+  void refill_() {
+    if (this->length_ - this->next_byte_ >= sizeof(uint64_t)) {
+      // Load as many whole bytes as fit in the cache with a single unaligned read
+      uint64_t word;
+      std::memcpy(&word, this->data_ + this->next_byte_, sizeof(word));
+      word = __builtin_bswap64(word);
+
+      uint32_t bytes = (64 - this->cache_bits_) / 8;
+      if (bytes == 0) {
+        return;
+      }
+      uint32_t new_bits = bytes * 8;
+      uint32_t unused_bits = 64 - this->cache_bits_ - new_bits;
+      uint64_t mask = ~((uint64_t{1} << unused_bits) - 1);
+      this->cache_ |= (word >> this->cache_bits_) & mask;
+      this->cache_bits_ += new_bits;
+      this->next_byte_ += bytes;
+      return;
+    }
+
+    while ((this->cache_bits_ <= 56) && (this->next_byte_ < this->length_)) {
+      this->cache_ |= static_cast<uint64_t>(this->data_[this->next_byte_++]) << (56 - this->cache_bits_);
+      this->cache_bits_ += 8;
+    }
+  }
+
+  const uint8_t *data_;
+  size_t length_;
+  size_t next_byte_{0};
+
+  uint64_t cache_{0};  // Unread bits, aligned to the most significant bit; the bits below them are always zero
+  uint32_t cache_bits_{0};
+  bool out_of_data_{false};
+};
+
+// Prediction kernels. The block starts with the warm-up samples, followed by the residuals that are replaced in place
+// by the restored samples.
+
+static void restore_fixed(int32_t *samples, uint32_t block_size, uint32_t order) {
+  // The previous samples are carried in locals rather than reloaded from memory for every sample
+  switch (order) {
+    case 1: {
+      int32_t previous = samples[0];
+      for (uint32_t i = 1; i < block_size; ++i) {
+        previous += samples[i];
+        samples[i] = previous;
+      }
+      break;
+    }
+    case 2: {
+      int32_t p1 = samples[1], p2 = samples[0];
+      for (uint32_t i = 2; i < block_size; ++i) {
+        int32_t sample = samples[i] + 2 * p1 - p2;
+        samples[i] = sample;
+        p2 = p1;
+        p1 = sample;
+      }
+      break;
+    }
+    case 3: {
+      int32_t p1 = samples[2], p2 = samples[1], p3 = samples[0];
+      for (uint32_t i = 3; i < block_size; ++i) {
+        int32_t sample = samples[i] + 3 * (p1 - p2) + p3;
+        samples[i] = sample;
+        p3 = p2;
+        p2 = p1;
+        p1 = sample;
+      }
+      break;
+    }
+    case 4: {
+      int32_t p1 = samples[3], p2 = samples[2], p3 = samples[1], p4 = samples[0];
+      for (uint32_t i = 4; i < block_size; ++i) {
+        int32_t sample = samples[i] + 4 * (p1 + p3) - 6 * p2 - p4;
+        samples[i] = sample;
+        p4 = p3;
+        p3 = p2;
+        p2 = p1;
+        p1 = sample;
+      }
+      break;
+    }
+    default:
+      // Order 0 predicts silence, so the residuals are the samples
+      break;
+  }
+}
+
+// 32 bit accumulator with the order known at compile time, so the dot product is fully unrolled and the coefficients
+// stay in registers
+template<uint32_t ORDER>
+static void restore_lpc_unrolled(int32_t *samples, uint32_t block_size, const int32_t *coefficients, int32_t shift) {
+  int32_t coefs[ORDER];
+  std::copy(coefficients, coefficients + ORDER, coefs);
+
+  for (uint32_t i = ORDER; i < block_size; ++i) {
+    const int32_t *history = samples + i;
+    int32_t sum = 0;
+#pragma GCC unroll 12
+    for (uint32_t j = 0; j < ORDER; ++j) {
+      sum += coefs[j] * history[-1 - static_cast<int32_t>(j)];
+    }
+    samples[i] += sum >> shift;
+  }
+}
+
+// Portable fallback with a 32 bit accumulator for any order
+static void restore_lpc_32(int32_t *samples, uint32_t block_size, const int32_t *coefficients, uint32_t order,
+                           int32_t shift) {
+  for (uint32_t i = order; i < block_size; ++i) {
+    int32_t sum = 0;
+    for (uint32_t j = 0; j < order; ++j) {
+      sum += coefficients[j] * samples[i - 1 - j];
+    }
+    samples[i] += sum >> shift;
+  }
+}
+
+// Portable fallback for streams where the prediction could overflow 32 bits
+static void restore_lpc_64(int32_t *samples, uint32_t block_size, const int32_t *coefficients, uint32_t order,
+                           int32_t shift) {
+  for (uint32_t i = order; i < block_size; ++i) {
+    int64_t sum = 0;
+    for (uint32_t j = 0; j < order; ++j) {
+      sum += static_cast<int64_t>(coefficients[j]) * samples[i - 1 - j];
+    }
+    samples[i] += static_cast<int32_t>(sum >> shift);
+  }
+}
+
+using LPCKernel = void (*)(int32_t *, uint32_t, const int32_t *, int32_t);
+
+static const LPCKernel UNROLLED_LPC_KERNELS[MAX_UNROLLED_LPC_ORDER + 1] = {
+    nullptr,
+    restore_lpc_unrolled<1>,
+    restore_lpc_unrolled<2>,
+    restore_lpc_unrolled<3>,
+    restore_lpc_unrolled<4>,
+    restore_lpc_unrolled<5>,
+    restore_lpc_unrolled<6>,
+    restore_lpc_unrolled<7>,
+    restore_lpc_unrolled<8>,
+    restore_lpc_unrolled<9>,
+    restore_lpc_unrolled<10>,
+    restore_lpc_unrolled<11>,
+    restore_lpc_unrolled<12>,
+};
+
+// Channel decorrelation kernels, fused with interleaving into the output. They are instantiated for each output sample
+// type, and samples are scaled to the type's size by shifting right by output_shift bits; a negative shift shifts left
+// instead.
+
+template<typename T> static inline T scale_sample(int32_t sample, int32_t output_shift) {
+  if (output_shift >= 0) {
+    return static_cast<T>(sample >> output_shift);
+  }
+  return static_cast<T>(static_cast<uint32_t>(sample) << -output_shift);
+}
+
+template<typename T>
+static void interleave_channels(const int32_t *samples, uint32_t channels, T *output, uint32_t block_size,
+                                int32_t output_shift) {
+  for (uint32_t channel = 0; channel < channels; ++channel) {
+    const int32_t *channel_samples = samples + channel * block_size;
+    T *channel_output = output + channel;
+    for (uint32_t i = 0; i < block_size; ++i) {
+      channel_output[i * channels] = scale_sample<T>(channel_samples[i], output_shift);
+    }
+  }
+}
+
+template<typename T>
+static void interleave_stereo(const int32_t *left, const int32_t *right, T *output, uint32_t block_size,
+                              int32_t output_shift) {
+  for (uint32_t i = 0; i < block_size; ++i) {
+    output[2 * i] = scale_sample<T>(left[i], output_shift);
+    output[2 * i + 1] = scale_sample<T>(right[i], output_shift);
+  }
+}
+
+template<typename T>
+static void decorrelate_left_side(const int32_t *left, const int32_t *side, T *output, uint32_t block_size,
+                                  int32_t output_shift) {
+  for (uint32_t i = 0; i < block_size; ++i) {
+    output[2 * i] = scale_sample<T>(left[i], output_shift);
+    output[2 * i + 1] = scale_sample<T>(left[i] - side[i], output_shift);
+  }
+}
+
+template<typename T>
+static void decorrelate_side_right(const int32_t *side, const int32_t *right, T *output, uint32_t block_size,
+                                   int32_t output_shift) {
+  for (uint32_t i = 0; i < block_size; ++i) {
+    output[2 * i] = scale_sample<T>(side[i] + right[i], output_shift);
+    output[2 * i + 1] = scale_sample<T>(right[i], output_shift);
+  }
+}
+
+template<typename T>
+static void decorrelate_mid_side(const int32_t *mid, const int32_t *side, T *output, uint32_t block_size,
+                                 int32_t output_shift) {
+  for (uint32_t i = 0; i < block_size; ++i) {
+    // The side channel's lowest bit was dropped from the mid channel when encoding
+    int32_t side_sample = side[i];
+    int32_t mid_sample = mid[i] * 2 + (side_sample & 1);
+    output[2 * i] = scale_sample<T>((mid_sample + side_sample) >> 1, output_shift);
+    output[2 * i + 1] = scale_sample<T>((mid_sample - side_sample) >> 1, output_shift);
+  }
+}
+
+FLACDecoder::~FLACDecoder() { this->free_buffers_(); }
+
+void FLACDecoder::free_buffers_() {
+  if (this->block_samples_ != nullptr) {
+    ExternalRAMAllocator<int32_t> allocator(ExternalRAMAllocator<int32_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->block_samples_, this->block_samples_size_);
+    this->block_samples_ = nullptr;
+    this->block_samples_size_ = 0;
+  }
+}
+
+FLACDecoderResult FLACDecoder::read_header(const uint8_t *data, size_t length, size_t *bytes_consumed) {
+  size_t index = 0;
+  *bytes_consumed = 0;
+
+  if (!this->header_marker_read_) {
+    if (length < 4) {
+      return FLACDecoderResult::OUT_OF_DATA;
+    }
+    if (std::memcmp(data, "fLaC", 4) != 0) {
+      return FLACDecoderResult::ERROR_BAD_MAGIC_NUMBER;
+    }
+    index += 4;
+    this->header_marker_read_ = true;
+  }
+
+  while (true) {
+    if (this->seek_table_bytes_left_ > 0) {
+      while ((this->seek_table_bytes_left_ >= SEEK_POINT_SIZE) && (length - index >= SEEK_POINT_SIZE)) {
+        const uint8_t *point = data + index;
+        uint64_t sample_number = 0;
+        uint64_t offset = 0;
+        for (int i = 0; i < 8; ++i) {
+          sample_number = (sample_number << 8) | point[i];
+          offset = (offset << 8) | point[8 + i];
+        }
+        if (sample_number != PLACEHOLDER_SEEK_POINT) {
+          this->seek_point_callback_(sample_number, offset);
+        }
+        index += SEEK_POINT_SIZE;
+        this->seek_table_bytes_left_ -= SEEK_POINT_SIZE;
+      }
+
+      if (this->seek_table_bytes_left_ >= SEEK_POINT_SIZE) {
+        *bytes_consumed = index;
+        return FLACDecoderResult::OUT_OF_DATA;
+      }
+
+      // Skip any trailing bytes that don't make up a whole point
+      this->metadata_bytes_to_skip_ = this->seek_table_bytes_left_;
+      this->seek_table_bytes_left_ = 0;
+    }
+
+    if (this->metadata_bytes_to_skip_ > 0) {
+      uint32_t bytes_to_skip = std::min<size_t>(this->metadata_bytes_to_skip_, length - index);
+      index += bytes_to_skip;
+      this->metadata_bytes_to_skip_ -= bytes_to_skip;
+      if (this->metadata_bytes_to_skip_ > 0) {
+        *bytes_consumed = index;
+        return FLACDecoderResult::OUT_OF_DATA;
+      }
+    }
+
+    if (this->last_metadata_block_) {
+      break;
+    }
+
+    if (length - index < METADATA_BLOCK_HEADER_SIZE) {
+      *bytes_consumed = index;
+      return FLACDecoderResult::OUT_OF_DATA;
+    }
+
+    const uint8_t *block_header = data + index;
+    bool last_block = (block_header[0] & 0x80) != 0;
+    uint8_t block_type = block_header[0] & 0x7F;
+    uint32_t block_length = (block_header[1] << 16) | (block_header[2] << 8) | block_header[3];
+
+    if (block_type == METADATA_TYPE_STREAMINFO) {
+      if (block_length < STREAMINFO_SIZE) {
+        return FLACDecoderResult::ERROR_BAD_HEADER;
+      }
+      if (length - index < METADATA_BLOCK_HEADER_SIZE + STREAMINFO_SIZE) {
+        *bytes_consumed = index;
+        return FLACDecoderResult::OUT_OF_DATA;
+      }
+
+      const uint8_t *info = block_header + METADATA_BLOCK_HEADER_SIZE;
+      std::memcpy(this->stream_info_block_, info, STREAMINFO_SIZE);
+      this->min_block_size_ = (info[0] << 8) | info[1];
+      this->max_block_size_ = (info[2] << 8) | info[3];
+      this->max_frame_size_ = (info[7] << 16) | (info[8] << 8) | info[9];
+      this->sample_rate_ = (info[10] << 12) | (info[11] << 4) | (info[12] >> 4);
+      this->num_channels_ = ((info[12] >> 1) & 0x07) + 1;
+      this->sample_depth_ = (((info[12] & 0x01) << 4) | (info[13] >> 4)) + 1;
+      this->total_samples_ = (static_cast<uint64_t>(info[13] & 0x0F) << 32) | (info[14] << 24) | (info[15] << 16) |
+                             (info[16] << 8) | info[17];
+
+      index += METADATA_BLOCK_HEADER_SIZE + STREAMINFO_SIZE;
+      this->metadata_bytes_to_skip_ = block_length - STREAMINFO_SIZE;
+    } else if ((block_type == METADATA_TYPE_SEEKTABLE) && this->seek_point_callback_) {
+      index += METADATA_BLOCK_HEADER_SIZE;
+      this->seek_table_bytes_left_ = block_length;
+    } else {
+      // Other metadata isn't needed for playback
+      index += METADATA_BLOCK_HEADER_SIZE;
+      this->metadata_bytes_to_skip_ = block_length;
+    }
+
+    this->last_metadata_block_ = last_block;
+  }
+
+  *bytes_consumed = index;
+
+  if ((this->sample_rate_ == 0) || (this->max_block_size_ < 16)) {
+    // Missing or invalid STREAMINFO block
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+  if ((this->num_channels_ > MAX_CHANNELS) || (this->sample_depth_ > MAX_SAMPLE_DEPTH)) {
+    return FLACDecoderResult::ERROR_UNSUPPORTED;
+  }
+
+  this->free_buffers_();
+  this->block_samples_size_ = this->max_block_size_ * this->num_channels_;
+  ExternalRAMAllocator<int32_t> allocator(ExternalRAMAllocator<int32_t>::ALLOW_FAILURE);
+  this->block_samples_ = allocator.allocate(this->block_samples_size_);
+  if (this->block_samples_ == nullptr) {
+    this->block_samples_size_ = 0;
+    return FLACDecoderResult::ERROR_MEMORY_ALLOCATION;
+  }
+
+  this->samples_decoded_ = 0;
+  return FLACDecoderResult::SUCCESS;
+}
+
+void FLACDecoder::get_minimal_header(uint8_t *header) const {
+  std::memcpy(header, "fLaC", 4);
+  header[4] = 0x80 | METADATA_TYPE_STREAMINFO;  // Last metadata block
+  header[5] = 0;
+  header[6] = 0;
+  header[7] = STREAMINFO_SIZE;
+  std::memcpy(header + 8, this->stream_info_block_, STREAMINFO_SIZE);
+}
+
+FLACDecoderResult FLACDecoder::decode_subframes_(const uint8_t *data, size_t length, size_t *bytes_consumed,
+                                                 FrameInfo &frame_info) {
+  *bytes_consumed = 0;
+
+  if (this->block_samples_ == nullptr) {
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+
+  // Skip to the next frame sync code
+  size_t sync_offset = 0;
+  while ((sync_offset + 1 < length) && !((data[sync_offset] == 0xFF) && ((data[sync_offset + 1] & 0xFE) == 0xF8))) {
+    ++sync_offset;
+  }
+  *bytes_consumed = sync_offset;
+
+  const uint8_t *frame = data + sync_offset;
+  FLACBitReader reader(frame, length - sync_offset);
+
+  //////
+  // Frame header
+  //////
+
+  reader.read_bits(16);  // Sync code and blocking strategy
+  uint32_t block_size_code = reader.read_bits(4);
+  uint32_t sample_rate_code = reader.read_bits(4);
+  uint32_t channel_assignment = reader.read_bits(4);
+  uint32_t sample_size_code = reader.read_bits(3);
+  uint32_t reserved = reader.read_bits(1);
+
+  // Frame or sample number, UTF-8 coded
+  uint32_t first_byte = reader.read_bits(8);
+  uint32_t extra_bytes = 0;
+  while ((extra_bytes < 7) && (first_byte & (0x80 >> extra_bytes))) {
+    ++extra_bytes;
+  }
+  if (extra_bytes == 1 || extra_bytes == 7) {
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+  for (uint32_t i = 1; i < extra_bytes; ++i) {
+    reader.read_bits(8);
+  }
+
+  uint32_t block_size = 0;
+  if (block_size_code == 1) {
+    block_size = 192;
+  } else if ((block_size_code >= 2) && (block_size_code <= 5)) {
+    block_size = 576 << (block_size_code - 2);
+  } else if (block_size_code == 6) {
+    block_size = reader.read_bits(8) + 1;
+  } else if (block_size_code == 7) {
+    block_size = reader.read_bits(16) + 1;
+  } else if (block_size_code >= 8) {
+    block_size = 256 << (block_size_code - 8);
+  }
+
+  if (sample_rate_code == 12) {
+    reader.read_bits(8);
+  } else if ((sample_rate_code == 13) || (sample_rate_code == 14)) {
+    reader.read_bits(16);
+  }
+
+  uint32_t header_crc = reader.read_bits(8);
+
+  if (reader.is_out_of_data()) {
+    return FLACDecoderResult::OUT_OF_DATA;
+  }
+
+  if ((reserved != 0) || (block_size == 0) || (sample_rate_code == 15) ||
+      (crc8(frame, reader.get_byte_position() - 1) != header_crc)) {
+    // Not a frame header; skip past this sync code so the next call finds the following one
+    *bytes_consumed = sync_offset + 1;
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+
+  static const uint32_t SAMPLE_SIZES[] = {0, 8, 12, 0, 16, 20, 24, 32};
+  uint32_t bits_per_sample = (sample_size_code == 0) ? this->sample_depth_ : SAMPLE_SIZES[sample_size_code];
+  if ((bits_per_sample == 0) || (bits_per_sample > MAX_SAMPLE_DEPTH)) {
+    *bytes_consumed = sync_offset + 1;
+    return FLACDecoderResult::ERROR_UNSUPPORTED;
+  }
+
+  uint32_t channels = (channel_assignment < CHANNELS_LEFT_SIDE) ? channel_assignment + 1 : 2;
+  if ((channel_assignment > CHANNELS_MID_SIDE) || (channels != this->num_channels_) ||
+      (block_size > this->max_block_size_)) {
+    *bytes_consumed = sync_offset + 1;
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+
+  //////
+  // Subframes
+  //////
+
+  for (uint32_t channel = 0; channel < channels; ++channel) {
+    uint32_t channel_bits_per_sample = bits_per_sample;
+    if (((channel_assignment == CHANNELS_LEFT_SIDE) && (channel == 1)) ||
+        ((channel_assignment == CHANNELS_SIDE_RIGHT) && (channel == 0)) ||
+        ((channel_assignment == CHANNELS_MID_SIDE) && (channel == 1))) {
+      // The side channel needs an extra bit
+      ++channel_bits_per_sample;
+    }
+
+    FLACDecoderResult result = this->decode_subframe_(reader, block_size, channel_bits_per_sample,
+                                                      this->block_samples_ + channel * block_size);
+    if ((result == FLACDecoderResult::OUT_OF_DATA) || reader.is_out_of_data()) {
+      return FLACDecoderResult::OUT_OF_DATA;
+    }
+    if (result != FLACDecoderResult::SUCCESS) {
+      *bytes_consumed = sync_offset + 1;
+      return result;
+    }
+  }
+
+  //////
+  // Frame footer
+  //////
+
+  reader.align_to_byte();
+  uint32_t frame_crc = reader.read_bits(16);
+  if (reader.is_out_of_data()) {
+    return FLACDecoderResult::OUT_OF_DATA;
+  }
+
+  size_t frame_length = reader.get_byte_position();
+  if (crc16(frame, frame_length - 2) != frame_crc) {
+    *bytes_consumed = sync_offset + 1;
+    return FLACDecoderResult::ERROR_CRC_MISMATCH;
+  }
+
+  frame_info.channel_assignment = channel_assignment;
+  frame_info.channels = channels;
+  frame_info.bits_per_sample = bits_per_sample;
+  frame_info.block_size = block_size;
+  *bytes_consumed = sync_offset + frame_length;
+  return FLACDecoderResult::SUCCESS;
+}
+
+template<typename T>
+FLACDecoderResult FLACDecoder::decode_frame(const uint8_t *data, size_t length, T *output, size_t *bytes_consumed,
+                                            uint32_t *output_samples) {
+  *output_samples = 0;
+
+  FrameInfo frame_info;
+  FLACDecoderResult result = this->decode_subframes_(data, length, bytes_consumed, frame_info);
+  if (result != FLACDecoderResult::SUCCESS) {
+    return result;
+  }
+
+  //////
+  // Decorrelate and interleave the channels
+  //////
+
+  const uint32_t block_size = frame_info.block_size;
+  const int32_t *first = this->block_samples_;
+  const int32_t *second = this->block_samples_ + block_size;
+  int32_t output_shift = static_cast<int32_t>(frame_info.bits_per_sample) - static_cast<int32_t>(8 * sizeof(T));
+
+  switch (frame_info.channel_assignment) {
+    case CHANNELS_LEFT_SIDE:
+      decorrelate_left_side(first, second, output, block_size, output_shift);
+      break;
+    case CHANNELS_SIDE_RIGHT:
+      decorrelate_side_right(first, second, output, block_size, output_shift);
+      break;
+    case CHANNELS_MID_SIDE:
+      decorrelate_mid_side(first, second, output, block_size, output_shift);
+      break;
+    default:
+      if (frame_info.channels == 2) {
+        interleave_stereo(first, second, output, block_size, output_shift);
+      } else {
+        interleave_channels(this->block_samples_, frame_info.channels, output, block_size, output_shift);
+      }
+      break;
+  }
+
+  *output_samples = block_size * frame_info.channels;
+  this->samples_decoded_ += block_size;
+
+  if ((this->total_samples_ > 0) && (this->samples_decoded_ >= this->total_samples_)) {
+    return FLACDecoderResult::END_OF_STREAM;
+  }
+
+  return FLACDecoderResult::SUCCESS;
+}
+
+template FLACDecoderResult FLACDecoder::decode_frame<int16_t>(const uint8_t *data, size_t length, int16_t *output,
+                                                              size_t *bytes_consumed, uint32_t *output_samples);
+template FLACDecoderResult FLACDecoder::decode_frame<int32_t>(const uint8_t *data, size_t length, int32_t *output,
+                                                              size_t *bytes_consumed, uint32_t *output_samples);
+
+FLACDecoderResult FLACDecoder::decode_subframe_(FLACBitReader &reader, uint32_t block_size,
+                                                uint32_t bits_per_sample, int32_t *samples) {
+  if (reader.read_bits(1) != 0) {
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+  uint32_t type = reader.read_bits(6);
+
+  uint32_t wasted_bits = 0;
+  if (reader.read_bits(1)) {
+    wasted_bits = reader.read_unary() + 1;
+    if (wasted_bits >= bits_per_sample) {
+      return FLACDecoderResult::ERROR_BAD_HEADER;
+    }
+    bits_per_sample -= wasted_bits;
+  }
+
+  if (type == 0) {
+    // Constant
+    int32_t value = reader.read_signed_bits(bits_per_sample);
+    std::fill(samples, samples + block_size, value);
+  } else if (type == 1) {
+    // Verbatim
+    for (uint32_t i = 0; i < block_size; ++i) {
+      samples[i] = reader.read_signed_bits(bits_per_sample);
+    }
+  } else if ((type >= 8) && (type <= 12)) {
+    // Fixed predictor
+    uint32_t order = type & 0x07;
+    if (order > block_size) {
+      return FLACDecoderResult::ERROR_BAD_HEADER;
+    }
+    for (uint32_t i = 0; i < order; ++i) {
+      samples[i] = reader.read_signed_bits(bits_per_sample);
+    }
+
+    FLACDecoderResult result = this->decode_residual_(reader, block_size, order, samples);
+    if (result != FLACDecoderResult::SUCCESS) {
+      return result;
+    }
+
+    restore_fixed(samples, block_size, order);
+  } else if (type >= 32) {
+    // Linear predictor
+    uint32_t order = (type & 0x1F) + 1;
+    if (order > block_size) {
+      return FLACDecoderResult::ERROR_BAD_HEADER;
+    }
+    for (uint32_t i = 0; i < order; ++i) {
+      samples[i] = reader.read_signed_bits(bits_per_sample);
+    }
+
+    uint32_t precision = reader.read_bits(4) + 1;
+    int32_t shift = reader.read_signed_bits(5);
+    if ((precision > 15) || (shift < 0)) {
+      return FLACDecoderResult::ERROR_BAD_HEADER;
+    }
+
+    int32_t coefficients[MAX_LPC_ORDER];
+    for (uint32_t i = 0; i < order; ++i) {
+      coefficients[i] = reader.read_signed_bits(precision);
+    }
+
+    FLACDecoderResult result = this->decode_residual_(reader, block_size, order, samples);
+    if (result != FLACDecoderResult::SUCCESS) {
+      return result;
+    }
+
+    if (bits_per_sample + precision + floor_log2(order) <= 32) {
+      // The prediction can't overflow a 32 bit accumulator
+      if (order <= MAX_UNROLLED_LPC_ORDER) {
+        UNROLLED_LPC_KERNELS[order](samples, block_size, coefficients, shift);
+      } else {
+        restore_lpc_32(samples, block_size, coefficients, order, shift);
+      }
+    } else {
+      restore_lpc_64(samples, block_size, coefficients, order, shift);
+    }
+  } else {
+    // Reserved subframe type
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+
+  if (reader.is_out_of_data()) {
+    return FLACDecoderResult::OUT_OF_DATA;
+  }
+
+  if (wasted_bits > 0) {
+    for (uint32_t i = 0; i < block_size; ++i) {
+      samples[i] *= (1 << wasted_bits);
+    }
+  }
+
+  return FLACDecoderResult::SUCCESS;
+}
+
+FLACDecoderResult FLACDecoder::decode_residual_(FLACBitReader &reader, uint32_t block_size, uint32_t order,
+                                                int32_t *samples) {
+  uint32_t method = reader.read_bits(2);
+  if (method > 1) {
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+  uint32_t parameter_bits = (method == 0) ? 4 : 5;
+  uint32_t escape_parameter = (method == 0) ? 0x0F : 0x1F;
+
+  uint32_t partition_order = reader.read_bits(4);
+  uint32_t partitions = 1 << partition_order;
+  uint32_t partition_samples = block_size >> partition_order;
+
+  if (((partition_samples << partition_order) != block_size) || (partition_samples < order)) {
+    return FLACDecoderResult::ERROR_BAD_HEADER;
+  }
+
+  int32_t *residuals = samples + order;
+  for (uint32_t partition = 0; partition < partitions; ++partition) {
+    // The first partition doesn't include the warm-up samples
+    uint32_t count = (partition == 0) ? partition_samples - order : partition_samples;
+
+    uint32_t parameter = reader.read_bits(parameter_bits);
+    if (parameter == escape_parameter) {
+      // Unencoded residuals with a fixed bit width
+      uint32_t bits = reader.read_bits(5);
+      for (uint32_t i = 0; i < count; ++i) {
+        residuals[i] = reader.read_signed_bits(bits);
+      }
+    } else if (!reader.read_rice_signed_block(residuals, count, parameter)) {
+      return FLACDecoderResult::OUT_OF_DATA;
+    }
+
+    if (reader.is_out_of_data()) {
+      return FLACDecoderResult::OUT_OF_DATA;
+    }
+    residuals += count;
+  }
+
+  return FLACDecoderResult::SUCCESS;
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esphome {
+namespace nabu {
+
+enum class FLACDecoderResult : uint8_t {
+  SUCCESS = 0,
+  END_OF_STREAM,  // The frame was decoded and it was the last one
+  OUT_OF_DATA,    // The header or frame continues past the provided data
+  ERROR_BAD_MAGIC_NUMBER,
+  ERROR_BAD_HEADER,
+  ERROR_CRC_MISMATCH,
+  ERROR_UNSUPPORTED,
+  ERROR_MEMORY_ALLOCATION,
+};
+
+// Size of a stream header holding only the marker and the STREAMINFO block
+static const size_t FLAC_MINIMAL_HEADER_SIZE = 4 + 4 + 34;
+
+class FLACBitReader;
+
+// FLAC decoder that works on data in the caller's buffer. The caller passes whatever data it has on every call, and
+// the decoder reports how many bytes it consumed, so the caller's buffer can move between calls.
+//
+// The prediction and channel decorrelation loops dominate decoding time, so they use specialized kernels:
+//  - Fixed predictors keep the previous samples in registers
+//  - LPC predictors up to order 12 are instantiated per order, so the compiler fully unrolls the dot product. They
+//    accumulate in 32 bits whenever the sample depth and coefficient precision guarantee no overflow. Higher orders and
+//    wide samples use the portable generic loops.
+//  - Stereo decorrelation is fused with interleaving the output samples, instantiated for 16 bit and 32 bit output
+class FLACDecoder {
+ public:
+  ~FLACDecoder();
+
+  /// @brief Reads the stream marker and metadata blocks. Large metadata blocks (e.g., pictures) are skipped as they
+  /// arrive, so the whole header doesn't need to fit in the caller's buffer.
+  /// @param data pointer to the unconsumed stream data
+  /// @param length number of bytes available at data
+  /// @param bytes_consumed set to the number of bytes consumed from data
+  /// @return SUCCESS once the header is complete, OUT_OF_DATA if more data is needed, or an error
+  FLACDecoderResult read_header(const uint8_t *data, size_t length, size_t *bytes_consumed);
+
+  /// @brief Decodes the frame at the start of data. Any bytes before the next frame sync code are skipped.
+  /// @param data pointer to the unconsumed stream data
+  /// @param length number of bytes available at data
+  /// @param output buffer for the interleaved samples, scaled to the size of T (int16_t or int32_t) whatever the
+  /// stream's sample depth. Must hold get_output_buffer_size() samples.
+  /// @param bytes_consumed set to the number of bytes consumed from data
+  /// @param output_samples set to the number of samples (across all channels) written to output
+  /// @return SUCCESS or END_OF_STREAM if a frame was decoded, OUT_OF_DATA if the frame is incomplete, or an error
+  template<typename T>
+  FLACDecoderResult decode_frame(const uint8_t *data, size_t length, T *output, size_t *bytes_consumed,
+                                 uint32_t *output_samples);
+
+  /// @brief Sets a callback that receives each point of the stream's SEEKTABLE while the header is read
+  /// @param callback called with the sample number and the byte offset of the point's frame, relative to the first
+  /// frame
+  void set_seek_point_callback(std::function<void(uint64_t, uint64_t)> &&callback) {
+    this->seek_point_callback_ = std::move(callback);
+  }
+
+  /// @brief Writes a stream header with only the STREAMINFO block. Decoding frames from the middle of the stream after
+  /// a new decoder reads this header works the same as continuing the original stream.
+  /// @param header buffer of at least FLAC_MINIMAL_HEADER_SIZE bytes
+  void get_minimal_header(uint8_t *header) const;
+
+  uint32_t get_sample_rate() const { return this->sample_rate_; }
+  uint32_t get_sample_depth() const { return this->sample_depth_; }
+  uint32_t get_num_channels() const { return this->num_channels_; }
+  uint32_t get_max_block_size() const { return this->max_block_size_; }
+  /// @brief The largest frame in the stream in bytes, or 0 if unknown
+  uint32_t get_max_frame_size() const { return this->max_frame_size_; }
+  uint64_t get_total_samples() const { return this->total_samples_; }
+
+  /// @brief Number of samples (across all channels) the output buffer passed to decode_frame must hold
+  uint32_t get_output_buffer_size() const { return this->max_block_size_ * this->num_channels_; }
+
+ protected:
+  struct FrameInfo {
+    uint32_t channel_assignment;
+    uint32_t channels;
+    uint32_t bits_per_sample;
+    uint32_t block_size;
+  };
+
+  /// @brief Decodes the header and subframes of the frame at the start of data into block_samples_. Shared by the
+  /// decode_frame instantiations, which only differ in how they interleave the samples.
+  FLACDecoderResult decode_subframes_(const uint8_t *data, size_t length, size_t *bytes_consumed,
+                                      FrameInfo &frame_info);
+  FLACDecoderResult decode_subframe_(FLACBitReader &reader, uint32_t block_size, uint32_t bits_per_sample,
+                                     int32_t *samples);
+  FLACDecoderResult decode_residual_(FLACBitReader &reader, uint32_t block_size, uint32_t order, int32_t *samples);
+
+  void free_buffers_();
+
+  // Header parsing state
+  bool header_marker_read_{false};
+  bool last_metadata_block_{false};
+  uint32_t metadata_bytes_to_skip_{0};
+  uint32_t seek_table_bytes_left_{0};
+
+  std::function<void(uint64_t, uint64_t)> seek_point_callback_;
+
+  uint8_t stream_info_block_[34];  // Copy of the STREAMINFO block for get_minimal_header()
+
+  uint32_t sample_rate_{0};
+  uint32_t sample_depth_{0};
+  uint32_t num_channels_{0};
+  uint32_t min_block_size_{0};
+  uint32_t max_block_size_{0};
+  uint32_t max_frame_size_{0};
+  uint64_t total_samples_{0};
+
+  uint64_t samples_decoded_{0};
+
+  // Decoded samples for each channel of the current frame, one block after another
+  int32_t *block_samples_{nullptr};
+  size_t block_samples_size_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,222 @@
+#ifdef USE_ESP_IDF
+
+#include "http_connection_pool.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <iterator>
+
+namespace esphome {
+namespace nabu {
+
+// One idle connection per pipeline covers an announcement interrupting media from the same server
+static const size_t MAX_IDLE_CONNECTIONS = 2;
+
+// Disconnected clients kept for their TLS session, e.g., for the TTS server and a media server. Servers usually accept
+// session tickets for several hours, but the voice assistant typically reconnects within minutes.
+static const size_t MAX_TLS_SESSIONS = 2;
+static const uint32_t TLS_SESSION_LIFETIME_MS = 30 * 60 * 1000;
+
+static const size_t MAX_URL_LENGTH = 500;
+
+static const char *const TAG = "nabu_media_player.http_pool";
+
+static bool can_resume_tls_session(const std::string &host_key) {
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  return host_key.rfind("https://", 0) == 0;
+#else
+  return false;
+#endif
+}
+
+HTTPConnectionPool::~HTTPConnectionPool() {
+  LockGuard guard(this->lock_);
+  for (auto &connection : this->idle_connections_) {
+    close_client_(connection.client);
+  }
+  this->idle_connections_.clear();
+}
+
+esp_http_client_handle_t HTTPConnectionPool::acquire(const std::string &url, PooledClientType &type) {
+  type = PooledClientType::NONE;
+
+  std::string host_key = get_host_key(url);
+  if (host_key.empty()) {
+    return nullptr;
+  }
+
+  LockGuard guard(this->lock_);
+  this->evict_expired_locked_();
+
+  // Search from the most recently released entry, as it is the least likely to have been closed by the server. A
+  // connected client is preferred over a saved TLS session.
+  auto match = this->idle_connections_.rend();
+  for (auto it = this->idle_connections_.rbegin(); it != this->idle_connections_.rend(); ++it) {
+    if (it->host_key == host_key) {
+      if (it->connected) {
+        match = it;
+        break;
+      }
+      if (match == this->idle_connections_.rend()) {
+        match = it;
+      }
+    }
+  }
+
+  if (match == this->idle_connections_.rend()) {
+    return nullptr;
+  }
+
+  esp_http_client_handle_t client = match->client;
+  bool connected = match->connected;
+  this->idle_connections_.erase(std::next(match).base());
+
+  if (esp_http_client_set_url(client, url.c_str()) != ESP_OK) {
+    close_client_(client);
+    return nullptr;
+  }
+
+  if (connected) {
+    type = PooledClientType::CONNECTION;
+    ESP_LOGD(TAG, "Reusing idle connection to %s", host_key.c_str());
+  } else {
+    type = PooledClientType::TLS_SESSION;
+  }
+  return client;
+}
+
+void HTTPConnectionPool::release(esp_http_client_handle_t client, bool keep_connection) {
+  char url[MAX_URL_LENGTH];
+  if ((this->idle_timeout_ms_ == 0) || (esp_http_client_get_url(client, url, MAX_URL_LENGTH) != ESP_OK)) {
+    close_client_(client);
+    return;
+  }
+
+  std::string host_key = get_host_key(url);
+  if (host_key.empty()) {
+    close_client_(client);
+    return;
+  }
+
+  if (!keep_connection) {
+    // The rest of the response is unread, so the connection can't be reused
+    esp_http_client_close(client);
+  }
+
+  LockGuard guard(this->lock_);
+  this->evict_expired_locked_();
+  this->insert_locked_(host_key, client, keep_connection);
+}
+
+void HTTPConnectionPool::evict_expired() {
+  LockGuard guard(this->lock_);
+  this->evict_expired_locked_();
+}
+
+void HTTPConnectionPool::record_open_time(uint32_t open_time_ms, PooledClientType type, const std::string &url) {
+  LockGuard guard(this->lock_);
+  if (type != PooledClientType::NONE) {
+    if (type == PooledClientType::CONNECTION) {
+      ++this->reused_count_;
+    } else {
+      ++this->resumed_count_;
+      ESP_LOGD(TAG, "Resumed TLS session with %s in %" PRIu32 " ms (full handshakes average %" PRIu32 " ms)",
+               get_host_key(url).c_str(), open_time_ms, this->average_handshake_ms_);
+    }
+    if (this->average_handshake_ms_ > open_time_ms) {
+      uint32_t saved_ms = this->average_handshake_ms_ - open_time_ms;
+      this->handshake_time_saved_ms_ += saved_ms;
+      ESP_LOGD(TAG, "Reused connection saved about %" PRIu32 " ms (%" PRIu32 " ms over %" PRIu32 " requests)",
+               saved_ms, this->handshake_time_saved_ms_, this->reused_count_ + this->resumed_count_);
+    }
+  } else if (this->average_handshake_ms_ == 0) {
+    this->average_handshake_ms_ = open_time_ms;
+  } else {
+    // Exponential moving average, weighting the newest handshake by 1/4
+    this->average_handshake_ms_ = (3 * this->average_handshake_ms_ + open_time_ms) / 4;
+  }
+}
+
+std::string HTTPConnectionPool::get_host_key(const std::string &url) {
+  size_t host_start = url.find("://");
+  if (host_start == std::string::npos) {
+    return "";
+  }
+  host_start += 3;
+
+  size_t host_end = url.find_first_of("/?#", host_start);
+  if (host_end == std::string::npos) {
+    host_end = url.length();
+  }
+
+  return str_lower_case(url.substr(0, host_end));
+}
+
+void HTTPConnectionPool::close_client_(esp_http_client_handle_t client) {
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+}
+
+void HTTPConnectionPool::insert_locked_(const std::string &host_key, esp_http_client_handle_t client, bool connected) {
+  if (!connected && !can_resume_tls_session(host_key)) {
+    close_client_(client);
+    return;
+  }
+
+  size_t limit = connected ? MAX_IDLE_CONNECTIONS : MAX_TLS_SESSIONS;
+  size_t count = 0;
+  for (const auto &connection : this->idle_connections_) {
+    if (connection.connected == connected) {
+      ++count;
+    }
+  }
+
+  if (count >= limit) {
+    for (auto it = this->idle_connections_.begin(); it != this->idle_connections_.end(); ++it) {
+      if (it->connected == connected) {
+        IdleConnection oldest = *it;
+        this->idle_connections_.erase(it);
+        if (connected) {
+          // Keep the retired connection's TLS session
+          esp_http_client_close(oldest.client);
+          this->insert_locked_(oldest.host_key, oldest.client, false);
+        } else {
+          close_client_(oldest.client);
+        }
+        break;
+      }
+    }
+  }
+
+  this->idle_connections_.push_back({host_key, client, millis(), connected});
+}
+
+void HTTPConnectionPool::evict_expired_locked_() {
+  uint32_t now = millis();
+  std::vector<IdleConnection> expired_connections;
+
+  auto it = this->idle_connections_.begin();
+  while (it != this->idle_connections_.end()) {
+    if (it->connected && (now - it->released_ms >= this->idle_timeout_ms_)) {
+      expired_connections.push_back(*it);
+      it = this->idle_connections_.erase(it);
+    } else if (!it->connected && (now - it->released_ms >= TLS_SESSION_LIFETIME_MS)) {
+      close_client_(it->client);
+      it = this->idle_connections_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (auto &connection : expired_connections) {
+    // The server has likely closed the connection by now, but its TLS session may still be resumed
+    esp_http_client_close(connection.client);
+    this->insert_locked_(connection.host_key, connection.client, false);
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,98 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "esphome/core/helpers.h"
+
+#include <esp_http_client.h>
+
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+enum class PooledClientType : uint8_t {
+  NONE = 0,     // Not from the pool; a new client
+  CONNECTION,   // An idle client that is still connected
+  TLS_SESSION,  // A disconnected client that resumes its saved TLS session when it reconnects
+};
+
+// Keeps HTTP clients whose response was completely read connected, so the next request to the same host skips the
+// TCP and TLS handshakes. Once an HTTPS connection closes, its client is kept a while longer as a TLS session cache
+// entry; reconnecting it sends the saved session ticket or ID, which resumes the session with an abbreviated
+// handshake. Shared by the reader tasks of both pipelines, so every method is thread safe.
+class HTTPConnectionPool {
+ public:
+  /// @param idle_timeout_ms how long a connection stays idle before it is closed
+  explicit HTTPConnectionPool(uint32_t idle_timeout_ms) : idle_timeout_ms_(idle_timeout_ms) {}
+  ~HTTPConnectionPool();
+
+  /// @brief Takes a client for the url's scheme, host, and port out of the pool and points it at the url. Idle
+  /// connections are preferred over saved TLS sessions.
+  /// @param url the url to request next
+  /// @param type set to the kind of client returned
+  /// @return the client, or nullptr if the pool has nothing for the host
+  esp_http_client_handle_t acquire(const std::string &url, PooledClientType &type);
+
+  /// @brief Returns a client to the pool. If the pool is full, the least recently used entry is retired.
+  /// @param client the client to return
+  /// @param keep_connection true if the client's last response was completely read, so the connection can be reused;
+  /// otherwise the connection is closed and only an HTTPS client's TLS session is kept
+  void release(esp_http_client_handle_t client, bool keep_connection);
+
+  /// @brief Closes connections that have been idle longer than the timeout and drops expired TLS sessions
+  void evict_expired();
+
+  /// @brief Records how long opening a request took. New connections update the average handshake time; reused
+  /// connections and resumed TLS sessions count the difference as time saved.
+  /// @param open_time_ms milliseconds esp_http_client_open took
+  /// @param type the kind of client the request was sent with
+  /// @param url the requested url, for logging
+  void record_open_time(uint32_t open_time_ms, PooledClientType type, const std::string &url);
+
+  /// @brief Extracts the scheme, host, and port of a url, e.g., "https://example.com:8123"
+  static std::string get_host_key(const std::string &url);
+
+  /// @brief Number of requests sent on a reused connection
+  uint32_t get_reused_count() const { return this->reused_count_; }
+  /// @brief Number of connections opened with a saved TLS session
+  uint32_t get_resumed_count() const { return this->resumed_count_; }
+  /// @brief Estimated milliseconds of connection setup saved by reusing connections
+  uint32_t get_handshake_time_saved_ms() const { return this->handshake_time_saved_ms_; }
+
+ protected:
+  struct IdleConnection {
+    std::string host_key;
+    esp_http_client_handle_t client;
+    uint32_t released_ms;
+    bool connected;  // False if only the client's TLS session is kept
+  };
+
+  static void close_client_(esp_http_client_handle_t client);
+
+  /// @brief Adds a client to the pool, retiring the least recently used entry of the same kind if there are too many.
+  /// Disconnected clients are only kept if they can resume a TLS session. The lock must be held.
+  void insert_locked_(const std::string &host_key, esp_http_client_handle_t client, bool connected);
+
+  /// @brief Closes expired connections, keeping their TLS sessions, and drops expired sessions. The lock must be
+  /// held.
+  void evict_expired_locked_();
+
+  Mutex lock_;
+
+  // Least recently released first
+  std::vector<IdleConnection> idle_connections_;
+
+  uint32_t idle_timeout_ms_;
+
+  uint32_t average_handshake_ms_{0};
+  uint32_t reused_count_{0};
+  uint32_t resumed_count_{0};
+  uint32_t handshake_time_saved_ms_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,199 @@
+#ifdef USE_ESP_IDF
+
+#include "latency_tracer.h"
+
+#ifdef USE_NABU_LATENCY_TRACING
+
+#include "esphome/core/log.h"
+
+#include <esp_timer.h>
+
+#include <cinttypes>
+
+namespace esphome {
+namespace nabu {
+
+static const char *const TAG = "nabu_media_player.latency";
+
+// The origin stage tags at most one chunk in this interval
+static const uint32_t TAG_INTERVAL_US = 50 * 1000;
+
+static const char *const STAGE_NAMES[] = {"reader", "decoder", "resampler", "mixer"};
+
+void LatencyHistogram::add(uint32_t latency_us) {
+  uint32_t latency_ms = latency_us / 1000;
+  size_t bucket = 0;
+  while ((bucket < BUCKET_COUNT - 1) && (latency_ms >= (1u << bucket))) {
+    ++bucket;
+  }
+  ++this->buckets[bucket];
+  ++this->count;
+  this->total_us += latency_us;
+  if (latency_us > this->max_us) {
+    this->max_us = latency_us;
+  }
+}
+
+uint32_t LatencyHistogram::percentile_ms(uint8_t percentile) const {
+  uint32_t target = (static_cast<uint64_t>(this->count) * percentile + 99) / 100;
+  uint32_t seen = 0;
+  for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+    seen += this->buckets[bucket];
+    if (seen >= target) {
+      return (bucket < BUCKET_COUNT - 1) ? (1u << bucket) : (this->max_us / 1000 + 1);
+    }
+  }
+  return this->max_us / 1000 + 1;
+}
+
+bool LatencyTracer::TagQueue::push(const Tag &tag) {
+  uint8_t tail = this->tail.load(std::memory_order_relaxed);
+  uint8_t next = (tail + 1) % CAPACITY;
+  if (next == this->head.load(std::memory_order_acquire)) {
+    return false;
+  }
+  this->tags[tail] = tag;
+  this->tail.store(next, std::memory_order_release);
+  return true;
+}
+
+bool LatencyTracer::TagQueue::peek(Tag &tag) const {
+  uint8_t head = this->head.load(std::memory_order_relaxed);
+  if (head == this->tail.load(std::memory_order_acquire)) {
+    return false;
+  }
+  tag = this->tags[head];
+  return true;
+}
+
+void LatencyTracer::TagQueue::pop() {
+  uint8_t head = this->head.load(std::memory_order_relaxed);
+  this->head.store((head + 1) % CAPACITY, std::memory_order_release);
+}
+
+void LatencyTracer::start_stream(TraceStage origin, bool skip_to_mixer) {
+  this->origin_ = origin;
+  this->skip_to_mixer_ = skip_to_mixer;
+
+  for (size_t i = 0; i < static_cast<size_t>(TraceStage::COUNT); ++i) {
+    this->queues_[i].clear();
+    this->pending_[i].count = 0;
+    this->input_positions_[i] = 0;
+    this->output_positions_[i] = 0;
+  }
+
+  this->stream_start_us_ = now_us_();
+  this->last_tag_us_ = this->stream_start_us_ - TAG_INTERVAL_US;
+  this->first_sample_pending_ = true;
+}
+
+void LatencyTracer::on_input(TraceStage stage, size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+
+  size_t index = static_cast<size_t>(stage);
+  this->input_positions_[index] += bytes;
+
+  TagQueue &queue = this->queues_[index];
+  PendingTags &pending = this->pending_[index];
+  Tag tag;
+  while (queue.peek(tag) && (static_cast<int32_t>(this->input_positions_[index] - tag.end_position) >= 0)) {
+    queue.pop();
+    if (pending.count < PendingTags::CAPACITY) {
+      pending.tags[pending.count++] = tag;
+    } else {
+      ++this->dropped_tags_;
+    }
+  }
+}
+
+void LatencyTracer::on_output(TraceStage stage, size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+
+  size_t index = static_cast<size_t>(stage);
+  uint32_t now = now_us_();
+  this->output_positions_[index] += bytes;
+
+  PendingTags &pending = this->pending_[index];
+  if ((stage == this->origin_) && (now - this->last_tag_us_ >= TAG_INTERVAL_US) &&
+      (pending.count < PendingTags::CAPACITY)) {
+    pending.tags[pending.count++] = {this->next_sequence_++, now, now, 0};
+    this->last_tag_us_ = now;
+  }
+
+  for (uint8_t i = 0; i < pending.count; ++i) {
+    Tag &tag = pending.tags[i];
+    if (stage != this->origin_) {
+      this->dwell_[index].add(now - tag.forwarded_us);
+    }
+
+    if (stage == TraceStage::MIXER) {
+      this->end_to_end_.add(now - tag.origin_us);
+    } else {
+      tag.forwarded_us = now;
+      tag.end_position = this->output_positions_[index];
+      if (!this->queues_[static_cast<size_t>(this->next_stage_(stage))].push(tag)) {
+        ++this->dropped_tags_;
+      }
+    }
+  }
+  pending.count = 0;
+
+  if ((stage == TraceStage::MIXER) && this->first_sample_pending_) {
+    this->first_sample_pending_ = false;
+    this->last_time_to_first_sample_us_ = now - this->stream_start_us_;
+    this->time_to_first_sample_.add(this->last_time_to_first_sample_us_);
+  }
+}
+
+void LatencyTracer::log_report(const char *name) const {
+  const LatencyHistogram &first_sample = this->time_to_first_sample_;
+  if (first_sample.count > 0) {
+    ESP_LOGI(TAG, "%s stream: first sample after %" PRIu32 " ms (average %" PRIu32 " ms over %" PRIu32 " streams)",
+             name, this->last_time_to_first_sample_us_ / 1000,
+             static_cast<uint32_t>(first_sample.total_us / first_sample.count / 1000), first_sample.count);
+  }
+
+  auto log_histogram = [name](const char *label, const LatencyHistogram &histogram) {
+    if (histogram.count == 0) {
+      return;
+    }
+    ESP_LOGI(TAG, "%s %s: %" PRIu32 " chunks, average %" PRIu32 " ms, p50 < %" PRIu32 " ms, p95 < %" PRIu32
+                  " ms, max %" PRIu32 " ms",
+             name, label, histogram.count, static_cast<uint32_t>(histogram.total_us / histogram.count / 1000),
+             histogram.percentile_ms(50), histogram.percentile_ms(95), histogram.max_us / 1000);
+    ESP_LOGV(TAG, "  buckets (<1, <2, <4, ... ms): %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32
+                  " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32,
+             histogram.buckets[0], histogram.buckets[1], histogram.buckets[2], histogram.buckets[3],
+             histogram.buckets[4], histogram.buckets[5], histogram.buckets[6], histogram.buckets[7],
+             histogram.buckets[8], histogram.buckets[9], histogram.buckets[10], histogram.buckets[11]);
+  };
+
+  for (size_t i = static_cast<size_t>(TraceStage::DECODER); i < static_cast<size_t>(TraceStage::COUNT); ++i) {
+    log_histogram(STAGE_NAMES[i], this->dwell_[i]);
+  }
+  log_histogram("end to end", this->end_to_end_);
+
+  if (this->dropped_tags_ > 0) {
+    ESP_LOGD(TAG, "%s: %" PRIu32 " tags dropped", name, this->dropped_tags_);
+  }
+}
+
+TraceStage LatencyTracer::next_stage_(TraceStage stage) const {
+  if (this->skip_to_mixer_ || (stage == TraceStage::RESAMPLER)) {
+    return TraceStage::MIXER;
+  }
+  return static_cast<TraceStage>(static_cast<uint8_t>(stage) + 1);
+}
+
+uint32_t LatencyTracer::now_us_() { return static_cast<uint32_t>(esp_timer_get_time()); }
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
+
+#endif
@@ -0,0 +1,137 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nabu {
+
+// Calls a LatencyTracer method if a tracer is set. Without ``latency_tracing`` enabled, the call and its arguments
+// compile to nothing.
+#ifdef USE_NABU_LATENCY_TRACING
+#define NABU_LATENCY_TRACE(tracer, call) \
+  do { \
+    if ((tracer) != nullptr) \
+      (tracer)->call; \
+  } while (false)
+#else
+#define NABU_LATENCY_TRACE(tracer, call)
+#endif
+
+#ifdef USE_NABU_LATENCY_TRACING
+
+enum class TraceStage : uint8_t {
+  READER = 0,
+  DECODER,
+  RESAMPLER,
+  MIXER,  // Its output is the audio handed to the speaker
+  COUNT,
+};
+
+// Latency distribution in power of two millisecond buckets: < 1 ms, < 2 ms, < 4 ms, ..., >= 1024 ms
+struct LatencyHistogram {
+  static const size_t BUCKET_COUNT = 12;
+
+  std::array<uint32_t, BUCKET_COUNT> buckets{};
+  uint32_t count{0};
+  uint32_t max_us{0};
+  uint64_t total_us{0};
+
+  void add(uint32_t latency_us);
+  void reset() { *this = LatencyHistogram(); }
+  /// @brief Upper bound of the bucket holding the percentile, in milliseconds
+  uint32_t percentile_ms(uint8_t percentile) const;
+};
+
+// Traces how long chunks of one stream take to pass through a pipeline and the mixer. The stage that produces the
+// stream's data tags a chunk with a sequence number and a monotonic timestamp, at most every few tens of milliseconds.
+// The ring buffers between the stages only carry bytes, so a tag travels by byte position: it is queued with the
+// position at the end of its chunk in the producing stage's output, the next stage picks it up once it has read past
+// that position, and passes it on with its next write. Each stage's dwell time runs from the previous stage's write
+// to its own, so it includes the time the chunk waited in the stage's input ring buffer.
+//
+// Every stage runs in a single task, and each tag queue has one producer and one consumer, so the stages don't lock.
+// The statistics are only for diagnostics; a report read while a stream plays may mix old and new values.
+class LatencyTracer {
+ public:
+  /// @brief Starts tracing a new stream, discarding tags from the previous one. Only call while the pipeline's stages
+  /// are stopped.
+  /// @param origin the first stage that handles the stream's data; later stages forward its tags
+  /// @param skip_to_mixer true if the origin writes mixer-ready audio directly to the mixer
+  void start_stream(TraceStage origin, bool skip_to_mixer = false);
+
+  /// @brief Records bytes a stage read from its input ring buffer
+  void on_input(TraceStage stage, size_t bytes);
+  /// @brief Records bytes a stage wrote to its output; the mixer's output is what it handed to the speaker
+  void on_output(TraceStage stage, size_t bytes);
+
+  /// @brief Logs the time to the latest stream's first sample, and the dwell time of each stage and the end-to-end
+  /// latency accumulated over every stream since boot
+  /// @param name the traced pipeline's name
+  void log_report(const char *name) const;
+
+ protected:
+  struct Tag {
+    uint32_t sequence;
+    uint32_t origin_us;      // When the producing stage wrote the chunk
+    uint32_t forwarded_us;   // When the previous stage wrote the chunk
+    uint32_t end_position;   // Output position of the previous stage at the end of the chunk
+  };
+
+  // Single producer, single consumer queue of tags between two stages. Tags that don't fit are dropped.
+  struct TagQueue {
+    static const uint8_t CAPACITY = 16;
+    std::array<Tag, CAPACITY> tags;
+    std::atomic<uint8_t> head{0};  // Next tag to read; written by the consumer
+    std::atomic<uint8_t> tail{0};  // Next free slot; written by the producer
+
+    bool push(const Tag &tag);
+    bool peek(Tag &tag) const;
+    void pop();
+    void clear() { this->head.store(this->tail.load()); }
+  };
+
+  // A stage's tags that were read but not yet written to its output
+  struct PendingTags {
+    static const uint8_t CAPACITY = 16;
+    std::array<Tag, CAPACITY> tags;
+    uint8_t count{0};
+  };
+
+  /// @brief The stage that reads the given stage's output
+  TraceStage next_stage_(TraceStage stage) const;
+
+  static uint32_t now_us_();
+
+  TraceStage origin_{TraceStage::READER};
+  bool skip_to_mixer_{false};
+
+  // Indexed by stage; a stage's queue holds the tags waiting for it to read past their position
+  std::array<TagQueue, static_cast<size_t>(TraceStage::COUNT)> queues_;
+  std::array<PendingTags, static_cast<size_t>(TraceStage::COUNT)> pending_;
+  std::array<uint32_t, static_cast<size_t>(TraceStage::COUNT)> input_positions_{};
+  std::array<uint32_t, static_cast<size_t>(TraceStage::COUNT)> output_positions_{};
+
+  uint32_t next_sequence_{0};
+  uint32_t last_tag_us_{0};
+
+  uint32_t stream_start_us_{0};
+  bool first_sample_pending_{false};
+
+  std::array<LatencyHistogram, static_cast<size_t>(TraceStage::COUNT)> dwell_;
+  LatencyHistogram end_to_end_;
+  LatencyHistogram time_to_first_sample_;
+  uint32_t last_time_to_first_sample_us_{0};
+  uint32_t dropped_tags_{0};
+};
+
+#endif
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,509 @@
+#ifdef USE_ESP_IDF
+
+#include "m4a_demuxer.h"
+
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+static const size_t BOX_HEADER_SIZE = 8;
+static const size_t LARGE_BOX_HEADER_SIZE = 16;
+
+// Boxes that are parsed as a whole must fit in the caller's buffer
+static const size_t MAX_PARSED_BOX_SIZE = 4096;
+
+// Version/flags and entry count; the entries are read as they arrive
+static const size_t CHUNK_OFFSETS_PARSED_SIZE = BOX_HEADER_SIZE + 8;
+// Version/flags and entry count, followed by entries of first chunk, samples per chunk, and sample description index
+static const size_t STSC_PARSED_SIZE = BOX_HEADER_SIZE + 8;
+static const size_t STSC_ENTRY_SIZE = 12;
+// Version/flags, sample size, and sample count
+static const size_t STSZ_PARSED_SIZE = BOX_HEADER_SIZE + 12;
+// Far larger than any AAC access unit, which is at most 768 bytes per channel; sizes are stored as 16 bit values
+static const uint32_t MAX_SAMPLE_SIZE = UINT16_MAX;
+
+// Size of an mp4a sample entry before its child boxes
+static const size_t MP4A_ENTRY_SIZE = BOX_HEADER_SIZE + 28;
+
+static const uint8_t ES_DESCRIPTOR_TAG = 0x03;
+static const uint8_t DECODER_CONFIG_DESCRIPTOR_TAG = 0x04;
+static const uint8_t DECODER_SPECIFIC_INFO_TAG = 0x05;
+
+static const uint8_t AUDIO_OBJECT_TYPE_AAC_LC = 2;
+static const uint8_t AUDIO_OBJECT_TYPE_SBR = 5;
+static const uint8_t AUDIO_OBJECT_TYPE_PS = 29;
+
+static const uint32_t SAMPLING_FREQUENCIES[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+                                                22050, 16000, 12000, 11025, 8000,  7350};
+
+static uint32_t read_u32(const uint8_t *data) {
+  return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static uint64_t read_u64(const uint8_t *data) {
+  return (static_cast<uint64_t>(read_u32(data)) << 32) | read_u32(data + 4);
+}
+
+static bool is_box_type(const uint8_t *box, const char *type) { return std::memcmp(box + 4, type, 4) == 0; }
+
+// Reads an MPEG-4 descriptor header. Returns the length of its payload, or -1 if the tag doesn't match.
+static int32_t read_descriptor(const uint8_t *data, size_t length, size_t *index, uint8_t tag) {
+  if ((*index >= length) || (data[*index] != tag)) {
+    return -1;
+  }
+  ++(*index);
+
+  // The payload length is stored in up to four bytes, seven bits at a time
+  int32_t descriptor_length = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (*index >= length) {
+      return -1;
+    }
+    uint8_t byte = data[(*index)++];
+    descriptor_length = (descriptor_length << 7) | (byte & 0x7F);
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+
+  return descriptor_length;
+}
+
+M4ADemuxer::~M4ADemuxer() {
+  if (this->sample_sizes_ != nullptr) {
+    ExternalRAMAllocator<uint16_t> allocator(ExternalRAMAllocator<uint16_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->sample_sizes_, this->sample_count_);
+    this->sample_sizes_ = nullptr;
+  }
+}
+
+size_t M4ADemuxer::get_sample_size() const { return this->get_sample_size_(this->sample_index_); }
+
+size_t M4ADemuxer::get_sample_size_(uint32_t sample_index) const {
+  if (this->sample_sizes_ != nullptr) {
+    return this->sample_sizes_[sample_index];
+  }
+  return this->constant_sample_size_;
+}
+
+void M4ADemuxer::sample_consumed() {
+  this->position_ += this->get_sample_size();
+  ++this->sample_index_;
+}
+
+void M4ADemuxer::consume_(size_t bytes, size_t *bytes_consumed) {
+  this->position_ += bytes;
+  *bytes_consumed += bytes;
+}
+
+void M4ADemuxer::skip_(uint64_t bytes) {
+  this->skip_bytes_left_ = bytes;
+  this->state_ = M4ADemuxerState::SKIP_BOX;
+}
+
+M4ADemuxerResult M4ADemuxer::parse(const uint8_t *data, size_t length, size_t *bytes_consumed) {
+  *bytes_consumed = 0;
+
+  switch (this->state_) {
+    case M4ADemuxerState::BOX_HEADER:
+      return this->parse_box_header_(data, length, bytes_consumed);
+    case M4ADemuxerState::SKIP_BOX: {
+      size_t bytes_to_skip = std::min<uint64_t>(length, this->skip_bytes_left_);
+      this->consume_(bytes_to_skip, bytes_consumed);
+      this->skip_bytes_left_ -= bytes_to_skip;
+
+      if (this->skip_bytes_left_ == 0) {
+        this->state_ = M4ADemuxerState::BOX_HEADER;
+        return M4ADemuxerResult::CONTINUE;
+      }
+      return (bytes_to_skip > 0) ? M4ADemuxerResult::CONTINUE : M4ADemuxerResult::NEED_MORE_DATA;
+    }
+    case M4ADemuxerState::SAMPLE_SIZES: {
+      // The sample size table can be much larger than the caller's buffer, so it is read as it arrives
+      size_t entries = std::min<size_t>(length / sizeof(uint32_t), this->sample_count_ - this->sample_sizes_read_);
+      for (size_t i = 0; i < entries; ++i) {
+        uint32_t sample_size = read_u32(data + i * sizeof(uint32_t));
+        if (sample_size > MAX_SAMPLE_SIZE) {
+          return M4ADemuxerResult::FAILED;
+        }
+        this->sample_sizes_[this->sample_sizes_read_++] = sample_size;
+      }
+      this->consume_(entries * sizeof(uint32_t), bytes_consumed);
+
+      if (this->sample_sizes_read_ == this->sample_count_) {
+        this->state_ = M4ADemuxerState::BOX_HEADER;
+        return M4ADemuxerResult::CONTINUE;
+      }
+      return (entries > 0) ? M4ADemuxerResult::CONTINUE : M4ADemuxerResult::NEED_MORE_DATA;
+    }
+    case M4ADemuxerState::CHUNK_OFFSETS: {
+      // Like the sample sizes, the chunk offset table is checked as it arrives
+      size_t entry_size = this->chunk_offsets_64_bit_ ? sizeof(uint64_t) : sizeof(uint32_t);
+      size_t entries = std::min<size_t>(length / entry_size, this->chunk_count_ - this->chunk_offsets_read_);
+      for (size_t i = 0; i < entries; ++i) {
+        const uint8_t *entry = data + i * entry_size;
+        if (!this->check_chunk_offset_(this->chunk_offsets_64_bit_ ? read_u64(entry) : read_u32(entry))) {
+          return M4ADemuxerResult::FAILED;
+        }
+      }
+      this->consume_(entries * entry_size, bytes_consumed);
+
+      if (this->chunk_offsets_read_ == this->chunk_count_) {
+        if (this->chunk_first_sample_ < this->sample_count_) {
+          // Some samples aren't in any chunk
+          return M4ADemuxerResult::FAILED;
+        }
+        this->chunk_runs_.clear();
+        this->chunk_runs_.shrink_to_fit();
+        this->state_ = M4ADemuxerState::BOX_HEADER;
+        return M4ADemuxerResult::CONTINUE;
+      }
+      return (entries > 0) ? M4ADemuxerResult::CONTINUE : M4ADemuxerResult::NEED_MORE_DATA;
+    }
+    case M4ADemuxerState::MEDIA_DATA: {
+      if (this->position_ < this->first_chunk_offset_) {
+        // Skip anything in the media data before the audio track's first chunk
+        size_t bytes_to_skip = std::min<uint64_t>(length, this->first_chunk_offset_ - this->position_);
+        this->consume_(bytes_to_skip, bytes_consumed);
+        return (bytes_to_skip > 0) ? M4ADemuxerResult::CONTINUE : M4ADemuxerResult::NEED_MORE_DATA;
+      }
+
+      if (this->sample_index_ >= this->sample_count_) {
+        return M4ADemuxerResult::END_OF_STREAM;
+      }
+
+      if (length < this->get_sample_size()) {
+        return M4ADemuxerResult::NEED_MORE_DATA;
+      }
+
+      return M4ADemuxerResult::SAMPLE_READY;
+    }
+  }
+
+  return M4ADemuxerResult::FAILED;
+}
+
+M4ADemuxerResult M4ADemuxer::parse_box_header_(const uint8_t *data, size_t length, size_t *bytes_consumed) {
+  if (length < BOX_HEADER_SIZE) {
+    return M4ADemuxerResult::NEED_MORE_DATA;
+  }
+
+  uint64_t box_size = read_u32(data);
+  size_t header_size = BOX_HEADER_SIZE;
+
+  if (box_size == 1) {
+    // 64 bit box size follows the type
+    if (length < LARGE_BOX_HEADER_SIZE) {
+      return M4ADemuxerResult::NEED_MORE_DATA;
+    }
+    box_size = read_u64(data + BOX_HEADER_SIZE);
+    header_size = LARGE_BOX_HEADER_SIZE;
+  } else if (box_size == 0) {
+    // The box extends to the end of the file
+    box_size = UINT64_MAX;
+  }
+
+  if (box_size < header_size) {
+    return M4ADemuxerResult::FAILED;
+  }
+
+  if ((this->position_ == 0) && !is_box_type(data, "ftyp")) {
+    // Not an MP4 file
+    return M4ADemuxerResult::FAILED;
+  }
+
+  if (is_box_type(data, "moov") || is_box_type(data, "mdia") || is_box_type(data, "minf") ||
+      is_box_type(data, "stbl")) {
+    // Descend into the container; its children are parsed next
+    this->consume_(header_size, bytes_consumed);
+    return M4ADemuxerResult::CONTINUE;
+  }
+
+  if (is_box_type(data, "trak")) {
+    if (this->has_sample_table_()) {
+      // Already found the audio track
+      this->skip_(box_size);
+    } else {
+      this->trak_end_ = this->position_ + box_size;
+      this->consume_(header_size, bytes_consumed);
+    }
+    return M4ADemuxerResult::CONTINUE;
+  }
+
+  if (is_box_type(data, "mdat")) {
+    if (!this->has_sample_table_() || !this->first_chunk_offset_found_) {
+      // The sample table is at the end of the file. Streaming it would require seeking, so only fast start files are
+      // supported.
+      return M4ADemuxerResult::FAILED;
+    }
+    this->consume_(header_size, bytes_consumed);
+    this->state_ = M4ADemuxerState::MEDIA_DATA;
+    return M4ADemuxerResult::CONTINUE;
+  }
+
+  if (is_box_type(data, "stsd")) {
+    if (box_size > MAX_PARSED_BOX_SIZE) {
+      return M4ADemuxerResult::FAILED;
+    }
+    if (length < box_size) {
+      return M4ADemuxerResult::NEED_MORE_DATA;
+    }
+
+    if (!this->audio_track_found_ && this->parse_stsd_(data + header_size, box_size - header_size)) {
+      this->audio_track_found_ = true;
+      this->skip_(box_size);
+    } else if (!this->audio_track_found_ && (this->trak_end_ > this->position_)) {
+      // Not an AAC track, skip the rest of it
+      this->skip_(this->trak_end_ - this->position_);
+    } else {
+      this->skip_(box_size);
+    }
+    return M4ADemuxerResult::CONTINUE;
+  }
+
+  if (this->audio_track_found_ && this->chunk_runs_.empty() && !this->first_chunk_offset_found_ &&
+      is_box_type(data, "stsc")) {
+    if (box_size > MAX_PARSED_BOX_SIZE) {
+      return M4ADemuxerResult::FAILED;
+    }
+    if (length < box_size) {
+      return M4ADemuxerResult::NEED_MORE_DATA;
+    }
+    if (!this->parse_stsc_(data + header_size, box_size - header_size)) {
+      return M4ADemuxerResult::FAILED;
+    }
+    this->skip_(box_size);
+    return M4ADemuxerResult::CONTINUE;
+  }
+
+  if (this->audio_track_found_ && !this->first_chunk_offset_found_ &&
+      (is_box_type(data, "stco") || is_box_type(data, "co64"))) {
+    if (!this->has_sample_table_() || this->chunk_runs_.empty()) {
+      // The chunk offsets can't be checked without the sample sizes and the samples per chunk
+      return M4ADemuxerResult::FAILED;
+    }
+    if (box_size < CHUNK_OFFSETS_PARSED_SIZE) {
+      return M4ADemuxerResult::FAILED;
+    }
+    if (length < CHUNK_OFFSETS_PARSED_SIZE) {
+      return M4ADemuxerResult::NEED_MORE_DATA;
+    }
+
+    this->chunk_offsets_64_bit_ = is_box_type(data, "co64");
+    this->chunk_count_ = read_u32(data + BOX_HEADER_SIZE + 4);
+    size_t entry_size = this->chunk_offsets_64_bit_ ? sizeof(uint64_t) : sizeof(uint32_t);
+    if ((this->chunk_count_ == 0) ||
+        (box_size < CHUNK_OFFSETS_PARSED_SIZE + static_cast<uint64_t>(this->chunk_count_) * entry_size)) {
+      return M4ADemuxerResult::FAILED;
+    }
+
+    this->consume_(CHUNK_OFFSETS_PARSED_SIZE, bytes_consumed);
+    this->state_ = M4ADemuxerState::CHUNK_OFFSETS;
+    return M4ADemuxerResult::CONTINUE;
+  }
+
+  if (this->audio_track_found_ && !this->has_sample_table_() && is_box_type(data, "stsz")) {
+    if (box_size < STSZ_PARSED_SIZE) {
+      return M4ADemuxerResult::FAILED;
+    }
+    if (length < STSZ_PARSED_SIZE) {
+      return M4ADemuxerResult::NEED_MORE_DATA;
+    }
+
+    uint32_t constant_sample_size = read_u32(data + BOX_HEADER_SIZE + 4);
+    uint32_t sample_count = read_u32(data + BOX_HEADER_SIZE + 8);
+
+    if ((sample_count == 0) || (constant_sample_size > MAX_SAMPLE_SIZE)) {
+      return M4ADemuxerResult::FAILED;
+    }
+
+    this->sample_count_ = sample_count;
+    if (constant_sample_size > 0) {
+      this->constant_sample_size_ = constant_sample_size;
+      this->skip_(box_size);
+      return M4ADemuxerResult::CONTINUE;
+    }
+
+    if (box_size < STSZ_PARSED_SIZE + static_cast<uint64_t>(sample_count) * sizeof(uint32_t)) {
+      return M4ADemuxerResult::FAILED;
+    }
+
+    // Store the sizes as 16 bit values to halve the table's memory use
+    ExternalRAMAllocator<uint16_t> allocator(ExternalRAMAllocator<uint16_t>::ALLOW_FAILURE);
+    this->sample_sizes_ = allocator.allocate(sample_count);
+    if (this->sample_sizes_ == nullptr) {
+      return M4ADemuxerResult::FAILED;
+    }
+
+    this->consume_(STSZ_PARSED_SIZE, bytes_consumed);
+    this->state_ = M4ADemuxerState::SAMPLE_SIZES;
+    return M4ADemuxerResult::CONTINUE;
+  }
+
+  // Not needed, skip the whole box
+  this->skip_(box_size);
+  return M4ADemuxerResult::CONTINUE;
+}
+
+bool M4ADemuxer::parse_stsc_(const uint8_t *data, size_t length) {
+  if (length < STSC_PARSED_SIZE - BOX_HEADER_SIZE) {
+    return false;
+  }
+
+  uint32_t entry_count = read_u32(data + 4);
+  if ((entry_count == 0) || (entry_count > (length - 8) / STSC_ENTRY_SIZE)) {
+    return false;
+  }
+
+  this->chunk_runs_.reserve(entry_count);
+  for (uint32_t i = 0; i < entry_count; ++i) {
+    const uint8_t *entry = data + 8 + i * STSC_ENTRY_SIZE;
+    ChunkRun run{read_u32(entry), read_u32(entry + 4)};
+    // The runs must start at the first chunk and be in order
+    bool in_order = this->chunk_runs_.empty() ? (run.first_chunk == 1)
+                                              : (run.first_chunk > this->chunk_runs_.back().first_chunk);
+    if (!in_order || (run.samples_per_chunk == 0)) {
+      this->chunk_runs_.clear();
+      return false;
+    }
+    this->chunk_runs_.push_back(run);
+  }
+
+  return true;
+}
+
+bool M4ADemuxer::check_chunk_offset_(uint64_t chunk_offset) {
+  if (this->chunk_offsets_read_ == 0) {
+    this->first_chunk_offset_ = chunk_offset;
+    this->first_chunk_offset_found_ = true;
+  } else if (chunk_offset != this->next_chunk_offset_) {
+    // A gap or an overlap; the data between the samples would be decoded as audio
+    return false;
+  }
+
+  uint32_t chunk = ++this->chunk_offsets_read_;
+  while ((this->chunk_run_index_ + 1 < this->chunk_runs_.size()) &&
+         (this->chunk_runs_[this->chunk_run_index_ + 1].first_chunk <= chunk)) {
+    ++this->chunk_run_index_;
+  }
+
+  uint32_t samples = std::min(this->chunk_runs_[this->chunk_run_index_].samples_per_chunk,
+                              this->sample_count_ - this->chunk_first_sample_);
+  this->next_chunk_offset_ = chunk_offset;
+  for (uint32_t i = 0; i < samples; ++i) {
+    this->next_chunk_offset_ += this->get_sample_size_(this->chunk_first_sample_ + i);
+  }
+  this->chunk_first_sample_ += samples;
+
+  return true;
+}
+
+bool M4ADemuxer::parse_stsd_(const uint8_t *data, size_t length) {
+  // Skip the version, flags, and entry count
+  size_t index = 8;
+
+  if (index + MP4A_ENTRY_SIZE > length) {
+    return false;
+  }
+
+  const uint8_t *entry = data + index;
+  size_t entry_size = std::min<size_t>(read_u32(entry), length - index);
+  if (!is_box_type(entry, "mp4a") || (entry_size < MP4A_ENTRY_SIZE)) {
+    return false;
+  }
+
+  // Use the sample entry's values if the decoder configuration can't be parsed
+  this->channels_ = (entry[24] << 8) | entry[25];
+  this->sample_rate_ = (entry[32] << 8) | entry[33];  // 16.16 fixed point
+
+  // Look for the esds box among the sample entry's children
+  size_t child_index = MP4A_ENTRY_SIZE;
+  while (child_index + BOX_HEADER_SIZE <= entry_size) {
+    const uint8_t *child = entry + child_index;
+    size_t child_size = read_u32(child);
+    if ((child_size < BOX_HEADER_SIZE) || (child_index + child_size > entry_size)) {
+      break;
+    }
+    if (is_box_type(child, "esds")) {
+      return this->parse_esds_(child + BOX_HEADER_SIZE, child_size - BOX_HEADER_SIZE);
+    }
+    child_index += child_size;
+  }
+
+  return (this->channels_ > 0) && (this->sample_rate_ > 0);
+}
+
+bool M4ADemuxer::parse_esds_(const uint8_t *data, size_t length) {
+  size_t index = 4;  // Skip the version and flags
+
+  if (read_descriptor(data, length, &index, ES_DESCRIPTOR_TAG) < 0) {
+    return false;
+  }
+  if (index + 3 > length) {
+    return false;
+  }
+  index += 2;  // ES_ID
+  uint8_t flags = data[index++];
+  if (flags & 0x80) {
+    index += 2;  // Depends on ES_ID
+  }
+  if ((flags & 0x40) && (index < length)) {
+    index += 1 + data[index];  // URL
+  }
+  if (flags & 0x20) {
+    index += 2;  // OCR ES_ID
+  }
+
+  if (read_descriptor(data, length, &index, DECODER_CONFIG_DESCRIPTOR_TAG) < 0) {
+    return false;
+  }
+  // Object type, stream type, buffer size, and bitrates
+  index += 13;
+
+  int32_t config_length = read_descriptor(data, length, &index, DECODER_SPECIFIC_INFO_TAG);
+  if ((config_length < 0) || (index + config_length > length)) {
+    return false;
+  }
+
+  return this->parse_audio_specific_config_(data + index, config_length);
+}
+
+bool M4ADemuxer::parse_audio_specific_config_(const uint8_t *data, size_t length) {
+  if (length < 2) {
+    return false;
+  }
+
+  uint8_t audio_object_type = data[0] >> 3;
+  if ((audio_object_type != AUDIO_OBJECT_TYPE_AAC_LC) && (audio_object_type != AUDIO_OBJECT_TYPE_SBR) &&
+      (audio_object_type != AUDIO_OBJECT_TYPE_PS)) {
+    // Only AAC-LC and HE-AAC (which has an AAC-LC core) are supported
+    return false;
+  }
+
+  uint8_t sampling_frequency_index = ((data[0] & 0x07) << 1) | (data[1] >> 7);
+  if (sampling_frequency_index == 0x0F) {
+    // Explicit 24 bit sample rate
+    if (length < 5) {
+      return false;
+    }
+    this->sample_rate_ = ((data[1] & 0x7F) << 17) | (data[2] << 9) | (data[3] << 1) | (data[4] >> 7);
+    this->channels_ = (data[4] >> 3) & 0x0F;
+  } else if (sampling_frequency_index < sizeof(SAMPLING_FREQUENCIES) / sizeof(SAMPLING_FREQUENCIES[0])) {
+    // For HE-AAC, this is the sample rate of the AAC-LC core
+    this->sample_rate_ = SAMPLING_FREQUENCIES[sampling_frequency_index];
+    this->channels_ = (data[1] >> 3) & 0x0F;
+  } else {
+    return false;
+  }
+
+  return this->channels_ > 0;
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,111 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+enum class M4ADemuxerResult : uint8_t {
+  NEED_MORE_DATA,  // Nothing more can be parsed from the provided data
+  CONTINUE,        // Container data was processed; call parse again
+  SAMPLE_READY,    // An AAC access unit of ``get_sample_size()`` bytes starts at the beginning of the data
+  END_OF_STREAM,
+  FAILED,  // Not an AAC audio file, its sample table isn't before the media data, or its samples aren't contiguous
+};
+
+// Only used within the M4ADemuxer class
+enum class M4ADemuxerState : uint8_t {
+  BOX_HEADER,
+  SKIP_BOX,
+  SAMPLE_SIZES,
+  CHUNK_OFFSETS,
+  MEDIA_DATA,
+};
+
+// Streaming demuxer for the AAC track in an MP4/M4A file. It never buffers the stream itself; the caller passes the
+// data it has, and ``parse`` reports how many bytes it consumed.
+//  - Only "fast start" files are supported; the ``moov`` box with the sample table must come before ``mdat``
+//  - Uses the first AAC track. Its samples must be stored contiguously, starting at the first chunk offset, which is
+//    how single track audio files are written in practice. Every chunk offset is checked against the sizes of the
+//    samples before it, so other files fail instead of playing the wrong data. This needs the ``stsc`` and ``stsz``
+//    boxes before ``stco``/``co64``, the order muxers write them in.
+//  - Interleaving with other tracks is only allowed before the first chunk
+class M4ADemuxer {
+ public:
+  ~M4ADemuxer();
+
+  /// @brief Parses the container until the next AAC access unit starts at the beginning of data
+  /// @param data pointer to the unconsumed stream data
+  /// @param length number of bytes available at data
+  /// @param bytes_consumed set to the number of bytes consumed from data
+  /// @return M4ADemuxerResult describing what the caller should do next
+  M4ADemuxerResult parse(const uint8_t *data, size_t length, size_t *bytes_consumed);
+
+  /// @brief Size of the access unit reported by the last SAMPLE_READY result
+  size_t get_sample_size() const;
+
+  /// @brief Moves on to the next access unit. The caller must also consume ``get_sample_size()`` bytes.
+  void sample_consumed();
+
+  uint8_t get_channels() const { return this->channels_; }
+  uint32_t get_sample_rate() const { return this->sample_rate_; }
+
+ protected:
+  M4ADemuxerResult parse_box_header_(const uint8_t *data, size_t length, size_t *bytes_consumed);
+  bool parse_stsd_(const uint8_t *data, size_t length);
+  bool parse_esds_(const uint8_t *data, size_t length);
+  bool parse_audio_specific_config_(const uint8_t *data, size_t length);
+  bool parse_stsc_(const uint8_t *data, size_t length);
+
+  /// @brief Checks the next chunk offset against where the previous chunk's samples end
+  /// @return false if the chunk doesn't start right after the previous one
+  bool check_chunk_offset_(uint64_t chunk_offset);
+
+  size_t get_sample_size_(uint32_t sample_index) const;
+
+  void consume_(size_t bytes, size_t *bytes_consumed);
+  void skip_(uint64_t bytes);
+
+  bool has_sample_table_() const { return this->sample_sizes_ != nullptr || this->constant_sample_size_ > 0; }
+
+  M4ADemuxerState state_{M4ADemuxerState::BOX_HEADER};
+
+  uint64_t position_{0};  // Number of bytes of the file consumed so far
+  uint64_t skip_bytes_left_{0};
+  uint64_t trak_end_{0};
+
+  bool audio_track_found_{false};
+  uint8_t channels_{0};
+  uint32_t sample_rate_{0};
+
+  uint64_t first_chunk_offset_{0};
+  bool first_chunk_offset_found_{false};
+
+  // A run of chunks with the same number of samples, from the stsc box
+  struct ChunkRun {
+    uint32_t first_chunk;  // 1 based index of the run's first chunk
+    uint32_t samples_per_chunk;
+  };
+  std::vector<ChunkRun> chunk_runs_;
+  size_t chunk_run_index_{0};
+  bool chunk_offsets_64_bit_{false};
+  uint32_t chunk_count_{0};
+  uint32_t chunk_offsets_read_{0};
+  uint32_t chunk_first_sample_{0};  // First sample of the next chunk
+  uint64_t next_chunk_offset_{0};   // Where the next chunk starts if the samples are contiguous
+
+  uint16_t *sample_sizes_{nullptr};
+  uint32_t constant_sample_size_{0};
+  uint32_t sample_count_{0};
+  uint32_t sample_sizes_read_{0};
+  uint32_t sample_index_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -2,14 +2,19 @@
 
 import hashlib
 import logging
+import struct
+import sys
+import zlib
 from pathlib import Path
 
 from esphome import automation, external_files
 import esphome.codegen as cg
 from esphome.components import audio_dac, media_player, speaker
+from esphome.components.esp32 import add_idf_sdkconfig_option
 from esphome.components.media_player import MEDIA_FILE_TYPE_ENUM, MediaFile
 import esphome.config_validation as cv
 from esphome.const import (
+    CONF_BITS_PER_SAMPLE,
     CONF_DURATION,
     CONF_FILE,
     CONF_FILES,
@@ -35,11 +40,31 @@ DOMAIN = "file"
 TYPE_LOCAL = "local"
 TYPE_WEB = "web"
 
+# Keep in sync with DEFAULT_DECODE_BATCH_SIZE in audio_decoder.h
+DEFAULT_DECODE_BATCH_SIZE = 8192
+
 CONF_DECIBEL_REDUCTION = "decibel_reduction"
 
+CONF_AAC_SUPPORT = "aac_support"
 CONF_AUDIO_DAC = "audio_dac"
 CONF_ANNOUNCEMENT = "announcement"
+CONF_ANNOUNCEMENT_CACHE_SIZE = "announcement_cache_size"
+CONF_ANNOUNCEMENT_BUFFERING = "announcement_buffering"
+CONF_BUFFER_RELEASE_TIMEOUT = "buffer_release_timeout"
+CONF_DECODE_BATCH_SIZE = "decode_batch_size"
+CONF_FUSED_DECODE_RESAMPLE = "fused_decode_resample"
+CONF_HTTP_KEEP_ALIVE_TIMEOUT = "http_keep_alive_timeout"
+CONF_LATENCY_TRACING = "latency_tracing"
+CONF_MEDIA_BUFFERING = "media_buffering"
 CONF_MEDIA_FILE = "media_file"
+CONF_POSITION = "position"
+CONF_PRERENDER = "prerender"
+CONF_RESUME_WATERMARK = "resume_watermark"
+CONF_PARTITION = "partition"
+CONF_PIPELINE_TASK_MODE = "pipeline_task_mode"
+CONF_SOUND = "sound"
+CONF_SOUND_PACK = "sound_pack"
+CONF_START_WATERMARK = "start_watermark"
 CONF_VOLUME_INCREMENT = "volume_increment"
 CONF_VOLUME_MIN = "volume_min"
 CONF_VOLUME_MAX = "volume_max"
@@ -47,6 +72,7 @@ CONF_VOLUME_MAX = "volume_max"
 CONF_ON_MUTE = "on_mute"
 CONF_ON_UNMUTE = "on_unmute"
 CONF_ON_VOLUME = "on_volume"
+CONF_ON_STREAM_TITLE = "on_stream_title"
 
 nabu_ns = cg.esphome_ns.namespace("nabu")
 NabuMediaPlayer = nabu_ns.class_("NabuMediaPlayer")
@@ -63,6 +89,38 @@ DuckingSetAction = nabu_ns.class_(
 PlayLocalMediaAction = nabu_ns.class_(
     "PlayLocalMediaAction", automation.Action, cg.Parented.template(NabuMediaPlayer)
 )
+SeekAction = nabu_ns.class_(
+    "SeekAction", automation.Action, cg.Parented.template(NabuMediaPlayer)
+)
+EnqueueAction = nabu_ns.class_(
+    "EnqueueAction", automation.Action, cg.Parented.template(NabuMediaPlayer)
+)
+PlaySoundPackSoundAction = nabu_ns.class_(
+    "PlaySoundPackSoundAction",
+    automation.Action,
+    cg.Parented.template(NabuMediaPlayer),
+)
+AudioPipelineTaskMode = nabu_ns.enum("AudioPipelineTaskMode", is_class=True)
+PIPELINE_TASK_MODES = {
+    "three_tasks": AudioPipelineTaskMode.THREE_TASKS,
+    "cooperative": AudioPipelineTaskMode.COOPERATIVE,
+}
+
+UpdateSoundPackAction = nabu_ns.class_(
+    "UpdateSoundPackAction", automation.Action, cg.Parented.template(NabuMediaPlayer)
+)
+WarmUpAnnouncementAction = nabu_ns.class_(
+    "WarmUpAnnouncementAction",
+    automation.Action,
+    cg.Parented.template(NabuMediaPlayer),
+)
+
+# Must match the pack format documented in sound_pack.h
+SOUND_PACK_MAGIC = b"NSPK"
+SOUND_PACK_VERSION = 1
+SOUND_PACK_HEADER_SIZE = 16
+SOUND_PACK_INDEX_ENTRY_SIZE = 12
+SOUND_PACK_ALIGNMENT = 4
 
 
 def _compute_local_file_path(value: dict) -> Path:
@@ -141,24 +199,83 @@ MEDIA_FILE_TYPE_SCHEMA = cv.Schema(
     {
         cv.Required(CONF_ID): cv.declare_id(MediaFile),
         cv.Required(CONF_FILE): _file_schema,
+        cv.Optional(CONF_PRERENDER, default=False): cv.boolean,
         cv.GenerateID(CONF_RAW_DATA_ID): cv.declare_id(cg.uint8),
     }
 )
 
 
+SOUND_PACK_FILE_SCHEMA = cv.Schema(
+    {
+        cv.Required(CONF_ID): cv.declare_id(cg.uint16),
+        cv.Required(CONF_FILE): _file_schema,
+        cv.Optional(CONF_PRERENDER, default=False): cv.boolean,
+    }
+)
+
+SOUND_PACK_SCHEMA = cv.Schema(
+    {
+        cv.Required(CONF_PARTITION): cv.string_strict,
+        cv.Optional(CONF_FILES): cv.ensure_list(SOUND_PACK_FILE_SCHEMA),
+    }
+)
+
+
+def _buffering_schema(start_watermark, resume_watermark):
+    return cv.Schema(
+        {
+            cv.Optional(
+                CONF_START_WATERMARK, default=start_watermark
+            ): cv.positive_time_period_milliseconds,
+            cv.Optional(
+                CONF_RESUME_WATERMARK, default=resume_watermark
+            ): cv.positive_time_period_milliseconds,
+        }
+    )
+
+
 CONFIG_SCHEMA = media_player.MEDIA_PLAYER_SCHEMA.extend(
     {
         cv.GenerateID(): cv.declare_id(NabuMediaPlayer),
         cv.Required(CONF_SPEAKER): cv.use_id(speaker.Speaker),
         cv.Optional(CONF_AUDIO_DAC): cv.use_id(audio_dac.AudioDac),
         cv.Optional(CONF_SAMPLE_RATE, default=16000): cv.int_range(min=1),
+        # 32 keeps the precision of hi-res streams for DACs that support it
+        cv.Optional(CONF_BITS_PER_SAMPLE, default=16): cv.one_of(16, 32, int=True),
+        cv.Optional(CONF_AAC_SUPPORT, default=False): cv.boolean,
+        cv.Optional(
+            CONF_DECODE_BATCH_SIZE, default=DEFAULT_DECODE_BATCH_SIZE
+        ): cv.int_range(min=0, max=32768),
+        cv.Optional(CONF_ANNOUNCEMENT_CACHE_SIZE, default=524288): cv.int_range(
+            min=0, max=4194304
+        ),
+        cv.Optional(
+            CONF_HTTP_KEEP_ALIVE_TIMEOUT, default="30s"
+        ): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_PIPELINE_TASK_MODE, default="three_tasks"): cv.enum(
+            PIPELINE_TASK_MODES, lower=True
+        ),
+        # Runs the resampler in the decoder's task without the decoded ring buffer
+        cv.Optional(CONF_FUSED_DECODE_RESAMPLE, default=False): cv.boolean,
+        cv.Optional(
+            CONF_BUFFER_RELEASE_TIMEOUT, default="30s"
+        ): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_LATENCY_TRACING, default=False): cv.boolean,
+        cv.Optional(CONF_MEDIA_BUFFERING, default={}): _buffering_schema(
+            "500ms", "1s"
+        ),
+        cv.Optional(CONF_ANNOUNCEMENT_BUFFERING, default={}): _buffering_schema(
+            "200ms", "500ms"
+        ),
         cv.Optional(CONF_VOLUME_INCREMENT, default=0.05): cv.percentage,
         cv.Optional(CONF_VOLUME_MAX, default=1.0): cv.percentage,
         cv.Optional(CONF_VOLUME_MIN, default=0.0): cv.percentage,
         cv.Optional(CONF_FILES): cv.ensure_list(MEDIA_FILE_TYPE_SCHEMA),
+        cv.Optional(CONF_SOUND_PACK): SOUND_PACK_SCHEMA,
         cv.Optional(CONF_ON_MUTE): automation.validate_automation(single=True),
         cv.Optional(CONF_ON_UNMUTE): automation.validate_automation(single=True),
         cv.Optional(CONF_ON_VOLUME): automation.validate_automation(single=True),
+        cv.Optional(CONF_ON_STREAM_TITLE): automation.validate_automation(single=True),
     }
 )
 
@@ -198,16 +315,91 @@ def _read_audio_file_and_type(file_config):
         media_file_type = MEDIA_FILE_TYPE_ENUM["MP3"]
     elif file_type in ("flac"):
         media_file_type = MEDIA_FILE_TYPE_ENUM["FLAC"]
+    elif file_type in ("aac", "adts", "m4a"):
+        media_file_type = MEDIA_FILE_TYPE_ENUM["AAC"]
 
     return data, media_file_type
 
 
+def _prerender_audio_file(data, media_file_type, sample_rate, bits_per_sample):
+    """Decodes and resamples a media file into the mixer's format.
+
+    The result is stereo PCM at the output sample rate and bits per sample.
+    Pre-rendering is optional, so without miniaudio the file is embedded as it is.
+    """
+    try:
+        import miniaudio
+    except ImportError:
+        _LOGGER.warning(
+            "Install miniaudio to pre-render media files; embedding them undecoded"
+        )
+        return data, media_file_type
+
+    try:
+        decoded = miniaudio.decode(
+            data,
+            output_format=(
+                miniaudio.SampleFormat.SIGNED32
+                if bits_per_sample == 32
+                else miniaudio.SampleFormat.SIGNED16
+            ),
+            nchannels=2,
+            sample_rate=sample_rate,
+        )
+    except miniaudio.DecodeError as exc:
+        raise cv.Invalid(f"Unable to pre-render media file: {exc}") from exc
+
+    samples = decoded.samples
+    if sys.byteorder != "little":
+        samples.byteswap()
+    return samples.tobytes(), MEDIA_FILE_TYPE_ENUM["PCM"]
+
+
+def _build_sound_pack(sounds):
+    """Packs (data, media_file_type) tuples into a sound pack; IDs are indexes."""
+    type_values = [str(file_type) for file_type in MEDIA_FILE_TYPE_ENUM.values()]
+
+    index = b""
+    payloads = b""
+    offset = SOUND_PACK_HEADER_SIZE + SOUND_PACK_INDEX_ENTRY_SIZE * len(sounds)
+    for data, media_file_type in sounds:
+        padding = -len(payloads) % SOUND_PACK_ALIGNMENT
+        payloads += b"\0" * padding
+        offset += padding
+        index += struct.pack(
+            "<IIB3x", offset, len(data), type_values.index(str(media_file_type))
+        )
+        payloads += data
+        offset += len(data)
+
+    body = index + payloads
+    header = struct.pack(
+        "<4sHHII",
+        SOUND_PACK_MAGIC,
+        SOUND_PACK_VERSION,
+        len(sounds),
+        len(body),
+        zlib.crc32(body),
+    )
+    return header + body
+
+
 def _supported_local_file_validate(config):
-    if files_list := config.get(CONF_FILES):
+    files_list = config.get(CONF_FILES, []) + config.get(CONF_SOUND_PACK, {}).get(
+        CONF_FILES, []
+    )
+    if files_list:
         for file_config in files_list:
             _, media_file_type = _read_audio_file_and_type(file_config)
             if str(media_file_type) == str(MEDIA_FILE_TYPE_ENUM["NONE"]):
                 raise cv.Invalid("Unsupported local media file.")
+            if (
+                str(media_file_type) == str(MEDIA_FILE_TYPE_ENUM["AAC"])
+                and not config[CONF_AAC_SUPPORT]
+            ):
+                raise cv.Invalid(
+                    f"AAC local media files require '{CONF_AAC_SUPPORT}' to be enabled."
+                )
 
 
 FINAL_VALIDATE_SCHEMA = _supported_local_file_validate
@@ -216,6 +408,17 @@ FINAL_VALIDATE_SCHEMA = _supported_local_file_validate
 async def to_code(config):
     cg.add_library("esphome/esp-audio-libs", "1.0.0")
 
+    if config[CONF_AAC_SUPPORT]:
+        # esp-audio-libs doesn't include an AAC decoder, so use the libhelix one. Only
+        # its C decoders are used, not its Arduino wrappers. Keep the version in sync
+        # with tests/aac_decoder/run.sh.
+        cg.add_library("pschatzmann/arduino-libhelix", "0.8.6")
+        cg.add_define("USE_AUDIO_AAC_SUPPORT")
+
+    if config[CONF_LATENCY_TRACING]:
+        # Logs per stage latency statistics after each stream; compiled out otherwise
+        cg.add_define("USE_NABU_LATENCY_TRACING")
+
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
     await media_player.register_media_player(var, config)
@@ -223,6 +426,40 @@ async def to_code(config):
     cg.add_define("USE_OTA_STATE_CALLBACK")
 
     cg.add(var.set_sample_rate(config[CONF_SAMPLE_RATE]))
+    cg.add(var.set_bits_per_sample(config[CONF_BITS_PER_SAMPLE]))
+    cg.add(var.set_decode_batch_size(config[CONF_DECODE_BATCH_SIZE]))
+    cg.add(var.set_announcement_cache_size(config[CONF_ANNOUNCEMENT_CACHE_SIZE]))
+    cg.add(
+        var.set_http_keep_alive_timeout(
+            config[CONF_HTTP_KEEP_ALIVE_TIMEOUT].total_milliseconds
+        )
+    )
+    if config[CONF_HTTP_KEEP_ALIVE_TIMEOUT].total_milliseconds > 0:
+        # Lets the connection pool resume TLS sessions after HTTPS connections close
+        add_idf_sdkconfig_option("CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS", True)
+
+    cg.add(var.set_pipeline_task_mode(config[CONF_PIPELINE_TASK_MODE]))
+    cg.add(var.set_fused_decode_resample(config[CONF_FUSED_DECODE_RESAMPLE]))
+    cg.add(
+        var.set_buffer_release_timeout(
+            config[CONF_BUFFER_RELEASE_TIMEOUT].total_milliseconds
+        )
+    )
+
+    media_buffering = config[CONF_MEDIA_BUFFERING]
+    cg.add(
+        var.set_media_buffer_watermarks(
+            media_buffering[CONF_START_WATERMARK].total_milliseconds,
+            media_buffering[CONF_RESUME_WATERMARK].total_milliseconds,
+        )
+    )
+    announcement_buffering = config[CONF_ANNOUNCEMENT_BUFFERING]
+    cg.add(
+        var.set_announcement_buffer_watermarks(
+            announcement_buffering[CONF_START_WATERMARK].total_milliseconds,
+            announcement_buffering[CONF_RESUME_WATERMARK].total_milliseconds,
+        )
+    )
 
     cg.add(var.set_volume_increment(config[CONF_VOLUME_INCREMENT]))
     cg.add(var.set_volume_max(config[CONF_VOLUME_MAX]))
@@ -249,6 +486,12 @@ async def to_code(config):
             [(cg.float_, "x")],
             on_volume,
         )
+    if on_stream_title := config.get(CONF_ON_STREAM_TITLE):
+        await automation.build_automation(
+            var.get_stream_title_trigger(),
+            [(cg.std_string, "x")],
+            on_stream_title,
+        )
 
     if audio_dac_config := config.get(CONF_AUDIO_DAC):
         aud_dac = await cg.get_variable(audio_dac_config)
@@ -258,6 +501,15 @@ async def to_code(config):
         for file_config in files_list:
             data, media_file_type = _read_audio_file_and_type(file_config)
 
+            if file_config[CONF_PRERENDER]:
+                # Played directly by the mixer without running the pipeline tasks
+                data, media_file_type = _prerender_audio_file(
+                    data,
+                    media_file_type,
+                    config[CONF_SAMPLE_RATE],
+                    config[CONF_BITS_PER_SAMPLE],
+                )
+
             rhs = [HexInt(x) for x in data]
             prog_arr = cg.progmem_array(file_config[CONF_RAW_DATA_ID], rhs)
 
@@ -282,6 +534,32 @@ async def to_code(config):
                 media_files_struct,
             )
 
+    if sound_pack_config := config.get(CONF_SOUND_PACK):
+        cg.add(var.set_sound_pack_partition(sound_pack_config[CONF_PARTITION]))
+
+        sounds = []
+        files_list = sound_pack_config.get(CONF_FILES, [])
+        for sound_id, file_config in enumerate(files_list):
+            data, media_file_type = _read_audio_file_and_type(file_config)
+            if file_config[CONF_PRERENDER]:
+                data, media_file_type = _prerender_audio_file(
+                    data,
+                    media_file_type,
+                    config[CONF_SAMPLE_RATE],
+                    config[CONF_BITS_PER_SAMPLE],
+                )
+            sounds.append((data, media_file_type))
+            cg.new_variable(file_config[CONF_ID], sound_id)
+
+        if sounds:
+            # Not part of the firmware; flash it to the partition or serve it to the
+            # nabu.update_sound_pack action
+            pack_path = Path(CORE.relative_build_path("sound_pack.bin"))
+            pack_path.write_bytes(_build_sound_pack(sounds))
+            _LOGGER.info(
+                "Wrote a sound pack with %d sounds to %s", len(sounds), pack_path
+            )
+
 
 DUCKING_SET_SCHEMA = cv.Schema(
     {
@@ -328,3 +606,102 @@ async def ducking_set_to_code(config, action_id, template_arg, args):
     duration = await cg.templatable(config[CONF_DURATION], args, cg.float_)
     cg.add(var.set_duration(duration))
     return var
+
+
+@automation.register_action(
+    "nabu.seek",
+    SeekAction,
+    cv.maybe_simple_value(
+        {
+            cv.GenerateID(): cv.use_id(NabuMediaPlayer),
+            cv.Required(CONF_POSITION): cv.templatable(
+                cv.positive_time_period_milliseconds
+            ),
+        },
+        key=CONF_POSITION,
+    ),
+)
+async def seek_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    position = await cg.templatable(config[CONF_POSITION], args, cg.uint32)
+    cg.add(var.set_position(position))
+    return var
+
+
+@automation.register_action(
+    "nabu.enqueue",
+    EnqueueAction,
+    cv.maybe_simple_value(
+        {
+            cv.GenerateID(): cv.use_id(NabuMediaPlayer),
+            cv.Required(CONF_URL): cv.templatable(cv.url),
+        },
+        key=CONF_URL,
+    ),
+)
+async def enqueue_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    url = await cg.templatable(config[CONF_URL], args, cg.std_string)
+    cg.add(var.set_url(url))
+    return var
+
+
+@automation.register_action(
+    "nabu.play_sound_pack_sound",
+    PlaySoundPackSoundAction,
+    cv.maybe_simple_value(
+        {
+            cv.GenerateID(): cv.use_id(NabuMediaPlayer),
+            cv.Required(CONF_SOUND): cv.use_id(cg.uint16),
+            cv.Optional(CONF_ANNOUNCEMENT, default=False): cv.boolean,
+        },
+        key=CONF_SOUND,
+    ),
+)
+async def play_sound_pack_sound_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    sound_id = await cg.get_variable(config[CONF_SOUND])
+    cg.add(var.set_sound_id(sound_id))
+    cg.add(var.set_announcement(config[CONF_ANNOUNCEMENT]))
+    return var
+
+
+@automation.register_action(
+    "nabu.update_sound_pack",
+    UpdateSoundPackAction,
+    cv.maybe_simple_value(
+        {
+            cv.GenerateID(): cv.use_id(NabuMediaPlayer),
+            cv.Required(CONF_URL): cv.templatable(cv.url),
+        },
+        key=CONF_URL,
+    ),
+)
+async def update_sound_pack_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    url = await cg.templatable(config[CONF_URL], args, cg.std_string)
+    cg.add(var.set_url(url))
+    return var
+
+
+@automation.register_action(
+    "nabu.warm_up_announcement",
+    WarmUpAnnouncementAction,
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.use_id(NabuMediaPlayer),
+            cv.Optional(CONF_URL): cv.templatable(cv.url),
+        }
+    ),
+)
+async def warm_up_announcement_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    if CONF_URL in config:
+        url = await cg.templatable(config[CONF_URL], args, cg.std_string)
+        cg.add(var.set_url(url))
+    return var
@@ -19,35 +19,73 @@ namespace nabu {
 //    - If played together, they are mixed with the announcement stream staying at full volume
 //    - The media audio is scaled, if necessary, to avoid clipping when mixing an announcement stream
 //    - The media audio can be further ducked via the ``set_ducking_reduction`` function
-//  - Each stream is handled by an ``AudioPipeline`` object with three parts/tasks
+//  - Each stream is handled by an ``AudioPipeline`` object: an ``AudioGraph`` with three stages connected by ports
 //    - ``AudioReader`` handles reading from an HTTP source or from a PROGMEM flash set at compile time
-//    - ``AudioDecoder`` handles decoding the audio file. All formats are limited to two channels and 16 bits per sample
+//      - URL streams buffer before playing. If the buffer runs low, the mixer fades the stream out and holds it until
+//        the pipeline has rebuffered, then fades it back in
+//      - Completely read HTTP connections are kept open in a shared ``HTTPConnectionPool`` and reused for the next
+//        url from the same server until they are idle for ``http_keep_alive_timeout``
+//      - Once an HTTPS connection closes, the pool keeps its client a while longer so reconnecting to the same server
+//        resumes the TLS session instead of performing a full handshake
+//      - Endless internet radio streams are detected by Content-Type or their first bytes. ICY metadata is stripped
+//        between writes to the raw file port, and title changes fire the ``on_stream_title`` trigger
+//    - ``AudioDecoder`` handles decoding the audio file. All formats are limited to two channels. They are decoded to
+//      16 bits per sample, or to 32 bits if the stream is deeper and ``bits_per_sample`` is 32
+//      - Local files are decoded in place from the flash mapping; the reader only passes along their type
 //      - FLAC
-//      - WAV
+//      - WAV (8, 16, 24, or 32 bit integer PCM and 32 bit float PCM)
+//        - PCM already at the decoded sample size bypasses the decoder. After parsing the header, the decoder splices
+//          the reader's port onto its output, so the resampler reads the audio directly from the reader's ring buffer
 //      - MP3 (based on the libhelix decoder - a random mp3 file may be incompatible)
-//    - ``AudioResampler`` handles converting the sample rate to the configured output sample rate and converting mono
-//      to stereo
+//      - AAC (optional; based on the libhelix decoder) in ADTS streams or fast start M4A files
+//    - ``AudioResampler`` handles converting the sample rate to the configured output sample rate, converting mono
+//      to stereo, and converting the sample size to the configured ``bits_per_sample``
 //      - The quality is not good, and it is slow! Please use audio at the configured sample rate to avoid these issues
-//    - Each task will always run once started, but they will not doing anything until they are needed
-//    - FreeRTOS Event Groups make up the inter-task communication
-//    - The ``AudioPipeline`` sets up an output ring buffer for the Reader and Decoder parts. The next part/task
-//      automatically pulls from the previous ring buffer
-//  - The streams are mixed together in the ``AudioMixer`` task
-//    - Each stream has a corresponding input buffer that the ``AudioResampler`` feeds directly
+//    - Each port's writer negotiates the stream's format against the constraint its reader sets, which starts the
+//      reader: the decoder starts once the file type is known, and the resampler once the audio format is
+//    - Ports never block. A stage that can't move data returns, and its task sleeps until a port it uses moves data;
+//      a FreeRTOS Event Group per graph carries these wake ups along with the start, stop, and finish messages
+//    - By default each stage runs in its own task. With ``pipeline_task_mode: cooperative``, one task per pipeline
+//      steps the reader, decoder, and resampler in turn instead. A blocking network read holds up the other stages,
+//      so the mixer's buffer has to cover network stalls
+//    - With ``fused_decode_resample``, the resampler shares the decoder's task and the decoded port is a direct
+//      handoff: the resampler reads each decoded batch in place, so there is no decoded ring buffer or resampler task.
+//      Streams already at the output sample rate in stereo are passed straight through to the mixer's port
+//    - The ports' ring buffers are only allocated for the sources and formats that need them. URL streams get the full
+//      raw buffer, local files a small one only when seeking writes a header first, and the decoded port holds a fixed
+//      duration of the stream's format. Only resampled streams allocate the resampler's float buffers
+//  - The streams are mixed together by the ``AudioMixer``, a single stage in its own graph and task
+//    - Each stream has a corresponding input port that the pipeline's last stage writes to directly
 //    - Pausing the media stream is done here
 //    - Media stream ducking is done here
 //    - The output ring buffer feeds the configured speaker the audio directly
 //  - Media player commands are received by the ``control`` function. The commands are added to the
 //    ``media_control_command_queue_`` to be processed in the component's loop
 //    - Starting a stream intializes the appropriate pipeline or stops it if it is already running
+//    - Enqueued media urls play gaplessly. Once the current stream has been read completely, a second media pipeline
+//      fetches, decodes, and resamples the queued url into the mixer's other media input. The mixer switches inputs
+//      right after the current stream's last sample
 //    - Volume and mute commands are achieved by the ``mute``, ``unmute``, ``set_volume`` functions. Volume changes use
 //      an ``audio_dac`` component if configured. If one isn't, software volume control is used.
 //      - Volume commands are ignored if the media control queue is full to avoid crashing when the track wheel is spun
 //      fast
 //    - Pausing is sent to the ``AudioMixer`` task. It only effects the media stream.
+//    - ``warm_up_announcement`` prepares the announcement pipeline while the voice assistant processes the intent. It
+//      restarts the mixer, creates the tasks, allocates the url stream's ring buffer, and has the reader task open a
+//      connection to the last announcement's server for the connection pool, so only the audio is fetched once the
+//      TTS url arrives
+//    - Announcement urls that played to the end are cached in PSRAM as mixer-ready audio. Playing a cached url again
+//      writes it directly to the mixer, skipping the reader, decoder, and resampler
+//    - Pre-rendered (PCM) announcement files skip the pipeline entirely. The mixer reads them directly from flash
+//    - Sounds in the optional ``SoundPack`` partition play like local files from its memory mapping. The pack can be
+//      replaced over HTTP without an OTA update; sounds from the pack are stopped before the partition is rewritten
+//    - Seeking restarts the media pipeline at the byte offset found in the seek index the decoder builds from the
+//      stream's header. URL streams are reopened with an HTTP Range request
 //  - The components main loop performs housekeeping:
 //    - It reads the media control queue and processes it directly
 //    - It watches the state of speaker and mixer tasks
+//    - Once the media player has been idle for ``buffer_release_timeout``, the mixer task stops and the mixer and
+//      pipelines free their buffers. The next stream allocates them again
 //    - It determines the overall state of the media player by considering the state of each pipeline
 //      - announcement playback takes highest priority
 
@@ -61,6 +99,9 @@ static const UBaseType_t MIXER_TASK_PRIORITY = 10;
 
 static const size_t TASK_DELAY_MS = 10;
 
+// How long starting a stream waits for the mixer to finish releasing its buffers
+static const uint32_t MIXER_STOP_TIMEOUT_MS = 500;
+
 static const float FIRST_BOOT_DEFAULT_VOLUME = 0.5f;
 
 static const char *const TAG = "nabu_media_player";
@@ -91,6 +132,9 @@ void NabuMediaPlayer::setup() {
           if (this->media_pipeline_ != nullptr) {
             this->media_pipeline_->suspend_tasks();
           }
+          if (this->next_media_pipeline_ != nullptr) {
+            this->next_media_pipeline_->suspend_tasks();
+          }
           if (this->announcement_pipeline_ != nullptr) {
             this->announcement_pipeline_->suspend_tasks();
           }
@@ -101,6 +145,9 @@ void NabuMediaPlayer::setup() {
           if (this->media_pipeline_ != nullptr) {
             this->media_pipeline_->resume_tasks();
           }
+          if (this->next_media_pipeline_ != nullptr) {
+            this->next_media_pipeline_->resume_tasks();
+          }
           if (this->announcement_pipeline_ != nullptr) {
             this->announcement_pipeline_->resume_tasks();
           }
@@ -108,16 +155,26 @@ void NabuMediaPlayer::setup() {
       });
 #endif
 
+  if (this->http_keep_alive_timeout_ms_ > 0) {
+    this->connection_pool_ = make_unique<HTTPConnectionPool>(this->http_keep_alive_timeout_ms_);
+  }
+
+  if (!this->sound_pack_partition_.empty()) {
+    this->sound_pack_ = make_unique<SoundPack>(this->sound_pack_partition_);
+    esp_err_t err = this->sound_pack_->load();
+    if (err != ESP_OK) {
+      ESP_LOGW(TAG, "Sound pack unavailable: %s", esp_err_to_name(err));
+    }
+  }
+
   ESP_LOGI(TAG, "Set up nabu media player");
 }
 
-esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
-  esp_err_t err = ESP_OK;
-
+esp_err_t NabuMediaPlayer::start_mixer_() {
   if (this->speaker_ != nullptr) {
     audio::AudioStreamInfo audio_stream_info;
     audio_stream_info.channels = 2;
-    audio_stream_info.bits_per_sample = 16;
+    audio_stream_info.bits_per_sample = this->bits_per_sample_;
     audio_stream_info.sample_rate = this->sample_rate_;
 
     this->speaker_->set_audio_stream_info(audio_stream_info);
@@ -125,15 +182,49 @@ esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
 
   if (this->audio_mixer_ == nullptr) {
     this->audio_mixer_ = make_unique<AudioMixer>();
-    err = this->audio_mixer_->start(this->speaker_, "mixer", MIXER_TASK_PRIORITY);
+    this->audio_mixer_->set_sample_rate(this->sample_rate_);
+    this->audio_mixer_->set_bits_per_sample(this->bits_per_sample_);
+  }
+
+  TaskEvent event;
+  while (this->mixer_stopping_ && this->audio_mixer_->read_event(&event, pdMS_TO_TICKS(MIXER_STOP_TIMEOUT_MS))) {
+    this->handle_mixer_event_(event);
+  }
+  if (this->mixer_stopping_) {
+    return ESP_ERR_TIMEOUT;
+  }
+
+  if (!this->audio_mixer_->is_running()) {
+    esp_err_t err = this->audio_mixer_->start(this->speaker_, "mixer", MIXER_TASK_PRIORITY);
     if (err != ESP_OK) {
       return err;
     }
+    if (this->ducking_decibel_reduction_ > 0) {
+      // The new mixer task starts without any ducking
+      CommandEvent command_event;
+      command_event.command = CommandEventType::DUCK;
+      command_event.decibel_reduction = this->ducking_decibel_reduction_;
+      this->audio_mixer_->send_command(&command_event);
+    }
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
   }
 
   if (type == AudioPipelineType::MEDIA) {
     if (this->media_pipeline_ == nullptr) {
-      this->media_pipeline_ = make_unique<AudioPipeline>(this->audio_mixer_.get(), type);
+      this->media_pipeline_ = this->create_media_pipeline_(0);
+    }
+    // After a queued stream played, the pipeline may write to the second input, which the mixer only allocates on use
+    err = this->audio_mixer_->allocate_media_input(this->media_pipeline_->get_media_input());
+    if (err != ESP_OK) {
+      return err;
     }
 
     if (url) {
@@ -144,6 +235,12 @@ esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
                                          MEDIA_PIPELINE_TASK_PRIORITY);
     }
 
+    // The mixer may still be playing the other input, or may have restarted on the first one
+    CommandEvent start_command_event;
+    start_command_event.command = CommandEventType::START_MEDIA_INPUT;
+    start_command_event.media_input = this->media_pipeline_->get_media_input();
+    this->audio_mixer_->send_command(&start_command_event);
+
     if (this->is_paused_) {
       CommandEvent command_event;
       command_event.command = CommandEventType::RESUME_MEDIA;
@@ -152,10 +249,12 @@ esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
     this->is_paused_ = false;
   } else if (type == AudioPipelineType::ANNOUNCEMENT) {
     if (this->announcement_pipeline_ == nullptr) {
-      this->announcement_pipeline_ = make_unique<AudioPipeline>(this->audio_mixer_.get(), type);
+      this->create_announcement_pipeline_();
     }
 
     if (url) {
+      // Remembered so the next warm up can connect to the same server
+      this->announcement_host_ = HTTPConnectionPool::get_host_key(this->announcement_url_.value());
       err = this->announcement_pipeline_->start(this->announcement_url_.value(), this->sample_rate_, "ann",
                                                 ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
     } else {
@@ -167,6 +266,107 @@ esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
   return err;
 }
 
+std::unique_ptr<AudioPipeline> NabuMediaPlayer::create_media_pipeline_(uint8_t media_input) {
+  auto media_pipeline = make_unique<AudioPipeline>(this->audio_mixer_.get(), AudioPipelineType::MEDIA, media_input);
+  media_pipeline->set_decode_batch_size(this->decode_batch_size_);
+  media_pipeline->set_task_mode(this->pipeline_task_mode_);
+  media_pipeline->set_fused_decode_resample(this->fused_decode_resample_);
+  media_pipeline->set_connection_pool(this->connection_pool_.get());
+  media_pipeline->set_buffer_watermarks(this->media_buffer_start_ms_, this->media_buffer_resume_ms_);
+  return media_pipeline;
+}
+
+esp_err_t NabuMediaPlayer::start_next_media_pipeline_() {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  uint8_t media_input = (this->media_pipeline_->get_media_input() + 1) % MEDIA_INPUT_COUNT;
+  err = this->audio_mixer_->allocate_media_input(media_input);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  // After a switch, the next pipeline is the previous stream's, which already writes to the other input
+  if (this->next_media_pipeline_ == nullptr) {
+    this->next_media_pipeline_ = this->create_media_pipeline_(media_input);
+  }
+
+  err = this->next_media_pipeline_->start(this->next_media_url_.value(), this->sample_rate_, "media",
+                                          MEDIA_PIPELINE_TASK_PRIORITY);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  CommandEvent command_event;
+  command_event.command = CommandEventType::QUEUE_MEDIA_INPUT;
+  command_event.media_input = media_input;
+  this->audio_mixer_->send_command(&command_event);
+
+  return ESP_OK;
+}
+
+void NabuMediaPlayer::clear_next_media_() {
+  if (this->next_media_started_ && (this->next_media_pipeline_ != nullptr)) {
+    // Also removes its input from the mixer's queue
+    this->next_media_pipeline_->stop();
+  }
+  this->next_media_started_ = false;
+  this->next_media_url_.reset();
+}
+
+void NabuMediaPlayer::promote_next_media_() {
+  std::swap(this->media_pipeline_, this->next_media_pipeline_);
+  std::swap(this->media_pipeline_state_, this->next_media_pipeline_state_);
+  this->media_url_ = this->next_media_url_;
+  this->media_file_.reset();
+  this->next_media_url_.reset();
+  this->next_media_started_ = false;
+}
+
+void NabuMediaPlayer::create_announcement_pipeline_() {
+  this->announcement_pipeline_ = make_unique<AudioPipeline>(this->audio_mixer_.get(), AudioPipelineType::ANNOUNCEMENT);
+  this->announcement_pipeline_->set_decode_batch_size(this->decode_batch_size_);
+  this->announcement_pipeline_->set_task_mode(this->pipeline_task_mode_);
+  this->announcement_pipeline_->set_fused_decode_resample(this->fused_decode_resample_);
+  this->announcement_pipeline_->set_connection_pool(this->connection_pool_.get());
+  this->announcement_pipeline_->set_buffer_watermarks(this->announcement_buffer_start_ms_,
+                                                      this->announcement_buffer_resume_ms_);
+
+  if (this->announcement_cache_size_ > 0) {
+    this->announcement_cache_ = make_unique<AnnouncementCache>(this->announcement_cache_size_);
+    this->announcement_pipeline_->set_announcement_cache(this->announcement_cache_.get());
+  }
+}
+
+void NabuMediaPlayer::warm_up_announcement(const std::string &url) {
+  if (!this->is_ready() || (this->announcement_pipeline_state_ != AudioPipelineState::STOPPED)) {
+    return;
+  }
+
+  // Restarts the mixer if it released its buffers while idle
+  esp_err_t err = this->start_mixer_();
+  if (err == ESP_OK) {
+    if (this->announcement_pipeline_ == nullptr) {
+      this->create_announcement_pipeline_();
+    }
+
+    std::string preconnect_url = url;
+    if (preconnect_url.empty() && !this->announcement_host_.empty()) {
+      preconnect_url = this->announcement_host_ + "/";
+    }
+    err = this->announcement_pipeline_->warm_up(preconnect_url, "ann", ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
+  }
+
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Unable to warm up the announcement pipeline: %s", esp_err_to_name(err));
+  }
+
+  // Restart the idle timeout so the buffers are still there when the announcement arrives
+  this->idle_start_ms_.reset();
+}
+
 void NabuMediaPlayer::watch_media_commands_() {
   if (!this->is_ready()) {
     return;
@@ -180,15 +380,31 @@ void NabuMediaPlayer::watch_media_commands_() {
     if (media_command.new_url.has_value() && media_command.new_url.value()) {
       if (media_command.announce.has_value() && media_command.announce.value()) {
         err = this->start_pipeline_(AudioPipelineType::ANNOUNCEMENT, true);
+      } else if (media_command.enqueue.has_value() && media_command.enqueue.value()) {
+        this->clear_next_media_();
+        if (this->media_pipeline_state_ == AudioPipelineState::STOPPED) {
+          this->media_url_ = this->enqueued_media_url_;
+          this->media_file_.reset();
+          err = this->start_pipeline_(AudioPipelineType::MEDIA, true);
+        } else {
+          // Prefetched by the loop once the current stream has been read completely
+          this->next_media_url_ = this->enqueued_media_url_;
+        }
       } else {
+        this->clear_next_media_();
         err = this->start_pipeline_(AudioPipelineType::MEDIA, true);
       }
     }
 
     if (media_command.new_file.has_value() && media_command.new_file.value()) {
       if (media_command.announce.has_value() && media_command.announce.value()) {
-        err = this->start_pipeline_(AudioPipelineType::ANNOUNCEMENT, false);
+        if (this->announcement_file_.value()->file_type == media_player::MediaFileType::PCM) {
+          err = this->play_announcement_file_(this->announcement_file_.value());
+        } else {
+          err = this->start_pipeline_(AudioPipelineType::ANNOUNCEMENT, false);
+        }
       } else {
+        this->clear_next_media_();
         err = this->start_pipeline_(AudioPipelineType::MEDIA, false);
       }
     }
@@ -200,6 +416,13 @@ void NabuMediaPlayer::watch_media_commands_() {
       this->status_clear_error();
     }
 
+    if (media_command.seek_position_ms.has_value() && (this->media_pipeline_ != nullptr)) {
+      esp_err_t seek_err = this->media_pipeline_->seek(media_command.seek_position_ms.value());
+      if (seek_err != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to seek the media stream: %s", esp_err_to_name(seek_err));
+      }
+    }
+
     if (media_command.volume.has_value()) {
       this->set_volume_(media_command.volume.value());
       this->publish_state();
@@ -227,7 +450,12 @@ void NabuMediaPlayer::watch_media_commands_() {
             if (this->announcement_pipeline_ != nullptr) {
               this->announcement_pipeline_->stop();
             }
+            if ((this->audio_mixer_ != nullptr) && (this->pending_announcement_files_ > 0)) {
+              command_event.command = CommandEventType::CLEAR_ANNOUNCEMENT;
+              this->audio_mixer_->send_command(&command_event);
+            }
           } else {
+            this->clear_next_media_();
             if (this->media_pipeline_ != nullptr) {
               this->media_pipeline_->stop();
             }
@@ -269,30 +497,140 @@ void NabuMediaPlayer::watch_media_commands_() {
   }
 }
 
+esp_err_t NabuMediaPlayer::play_announcement_file_(media_player::MediaFile *media_file) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  if (this->announcement_pipeline_ != nullptr) {
+    // A running announcement stream would otherwise keep writing to the mixer
+    err = this->announcement_pipeline_->stop();
+  }
+
+  CommandEvent command_event;
+  command_event.command = CommandEventType::PLAY_ANNOUNCEMENT_FILE;
+  command_event.media_file = media_file;
+  this->audio_mixer_->send_command(&command_event);
+  ++this->pending_announcement_files_;
+
+  return err;
+}
+
 void NabuMediaPlayer::watch_mixer_() {
   TaskEvent event;
   if (this->audio_mixer_ != nullptr) {
     while (this->audio_mixer_->read_event(&event))
-      if (event.type == EventType::WARNING) {
-        ESP_LOGD(TAG, "Mixer encountered an error: %s", esp_err_to_name(event.err));
-        this->status_set_error();
-      }
+      this->handle_mixer_event_(event);
   }
 }
 
+void NabuMediaPlayer::handle_mixer_event_(const TaskEvent &event) {
+  if (event.type == EventType::WARNING) {
+    ESP_LOGD(TAG, "Mixer encountered an error: %s", esp_err_to_name(event.err));
+    this->status_set_error();
+  } else if ((event.type == EventType::ANNOUNCEMENT_FILE_FINISHED) && (this->pending_announcement_files_ > 0)) {
+    --this->pending_announcement_files_;
+  } else if ((event.type == EventType::MEDIA_INPUT_SWITCHED) && this->next_media_started_) {
+    // The mixer went on to the prefetched stream, so its pipeline becomes the media pipeline
+    ESP_LOGD(TAG, "Playing the queued media stream");
+    this->promote_next_media_();
+  } else if ((event.type == EventType::STOPPED) && this->mixer_stopping_) {
+    // The task freed its work buffers and is waiting to be deleted
+    this->audio_mixer_->stop();
+    this->audio_mixer_->release_buffers();
+    this->mixer_stopping_ = false;
+    ESP_LOGD(TAG, "Released the idle audio buffers, %zu bytes remain allocated", this->get_audio_memory_usage());
+  }
+}
+
+void NabuMediaPlayer::release_idle_buffers_() {
+  if ((this->state != media_player::MEDIA_PLAYER_STATE_IDLE) || (this->buffer_release_timeout_ms_ == 0)) {
+    this->idle_start_ms_.reset();
+    return;
+  }
+  if (this->mixer_stopping_ || (this->audio_mixer_ == nullptr) || !this->audio_mixer_->is_running()) {
+    // Already released
+    return;
+  }
+
+  uint32_t now = millis();
+  if (!this->idle_start_ms_.has_value()) {
+    this->idle_start_ms_ = now;
+    return;
+  }
+  if (now - this->idle_start_ms_.value() < this->buffer_release_timeout_ms_) {
+    return;
+  }
+  this->idle_start_ms_.reset();
+
+  if (this->media_pipeline_ != nullptr)
+    this->media_pipeline_->release_buffers();
+  if (this->next_media_pipeline_ != nullptr)
+    this->next_media_pipeline_->release_buffers();
+  if (this->announcement_pipeline_ != nullptr)
+    this->announcement_pipeline_->release_buffers();
+
+  // The mixer frees its work buffers when it stops; the rest are freed once it reports STOPPED
+  CommandEvent command_event;
+  command_event.command = CommandEventType::STOP;
+  this->audio_mixer_->send_command(&command_event);
+  this->mixer_stopping_ = true;
+}
+
+size_t NabuMediaPlayer::get_audio_memory_usage() const {
+  size_t bytes = 0;
+  if (this->audio_mixer_ != nullptr)
+    bytes += this->audio_mixer_->get_memory_usage();
+  if (this->media_pipeline_ != nullptr)
+    bytes += this->media_pipeline_->get_memory_usage();
+  if (this->next_media_pipeline_ != nullptr)
+    bytes += this->next_media_pipeline_->get_memory_usage();
+  if (this->announcement_pipeline_ != nullptr)
+    bytes += this->announcement_pipeline_->get_memory_usage();
+  if (this->announcement_cache_ != nullptr)
+    bytes += this->announcement_cache_->get_size();
+  return bytes;
+}
+
 void NabuMediaPlayer::loop() {
   this->watch_media_commands_();
   this->watch_mixer_();
 
+  if (this->connection_pool_ != nullptr)
+    this->connection_pool_->evict_expired();
+
+  if (this->sound_pack_ != nullptr)
+    this->sound_pack_->loop();
+
+  if (this->sound_pack_update_url_.has_value() && !this->is_playing_sound_pack_file_()) {
+    esp_err_t err = this->sound_pack_->start_update(this->sound_pack_update_url_.value());
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Unable to update the sound pack: %s", esp_err_to_name(err));
+    }
+    this->sound_pack_update_url_.reset();
+  }
+
   // Determine state of the media player
   media_player::MediaPlayerState old_state = this->state;
 
   if (this->announcement_pipeline_ != nullptr)
     this->announcement_pipeline_state_ = this->announcement_pipeline_->get_state();
 
-  if (this->media_pipeline_ != nullptr)
+  if (this->media_pipeline_ != nullptr) {
     this->media_pipeline_state_ = this->media_pipeline_->get_state();
 
+    std::string stream_title;
+    if (this->media_pipeline_->get_new_stream_title(stream_title)) {
+      // The media player state sent to Home Assistant has no title, so automations publish it instead
+      this->stream_title_trigger_->trigger(stream_title);
+    }
+  }
+  if (this->next_media_pipeline_ != nullptr) {
+    // Also processes its info queue, which blocks its tasks if it fills up
+    this->next_media_pipeline_state_ = this->next_media_pipeline_->get_state();
+  }
+
   if (this->media_pipeline_state_ == AudioPipelineState::ERROR_READING) {
     ESP_LOGE(TAG, "The media pipeline's file reader encountered an error.");
   } else if (this->media_pipeline_state_ == AudioPipelineState::ERROR_DECODING) {
@@ -301,6 +639,42 @@ void NabuMediaPlayer::loop() {
     ESP_LOGE(TAG, "The media pipeline's audio resampler encountered an error.");
   }
 
+  if (this->next_media_started_) {
+    if ((this->next_media_pipeline_state_ == AudioPipelineState::ERROR_READING) ||
+        (this->next_media_pipeline_state_ == AudioPipelineState::ERROR_DECODING) ||
+        (this->next_media_pipeline_state_ == AudioPipelineState::ERROR_RESAMPLING)) {
+      ESP_LOGE(TAG, "The queued media stream encountered an error.");
+      this->clear_next_media_();
+    } else if ((this->media_pipeline_state_ == AudioPipelineState::ERROR_READING) ||
+               (this->media_pipeline_state_ == AudioPipelineState::ERROR_DECODING) ||
+               (this->media_pipeline_state_ == AudioPipelineState::ERROR_RESAMPLING)) {
+      // The failed stream never marks its end in the mixer, so switch to the prefetched stream now
+      CommandEvent command_event;
+      command_event.command = CommandEventType::START_MEDIA_INPUT;
+      command_event.media_input = this->next_media_pipeline_->get_media_input();
+      this->audio_mixer_->send_command(&command_event);
+      this->promote_next_media_();
+    }
+  } else if (this->next_media_url_.has_value()) {
+    esp_err_t err = ESP_OK;
+    if ((this->media_pipeline_state_ == AudioPipelineState::PLAYING) && this->media_pipeline_->is_read_complete()) {
+      // Only the current stream's buffered audio is left, so fetch and decode the next one into the other input
+      err = this->start_next_media_pipeline_();
+      this->next_media_started_ = (err == ESP_OK);
+    } else if (this->media_pipeline_state_ == AudioPipelineState::STOPPED) {
+      // The current stream ended before the next one was prefetched
+      this->media_url_ = this->next_media_url_;
+      this->media_file_.reset();
+      this->next_media_url_.reset();
+      err = this->start_pipeline_(AudioPipelineType::MEDIA, true);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Error starting the queued media stream: %s", esp_err_to_name(err));
+      this->status_set_error();
+      this->next_media_url_.reset();
+    }
+  }
+
   if (this->announcement_pipeline_state_ == AudioPipelineState::ERROR_READING) {
     ESP_LOGE(TAG, "The announcement pipeline's file reader encountered an error.");
   } else if (this->announcement_pipeline_state_ == AudioPipelineState::ERROR_DECODING) {
@@ -309,10 +683,11 @@ void NabuMediaPlayer::loop() {
     ESP_LOGE(TAG, "The announcement pipeline's audio resampler encountered an error.");
   }
 
-  if (this->announcement_pipeline_state_ != AudioPipelineState::STOPPED) {
+  if ((this->announcement_pipeline_state_ != AudioPipelineState::STOPPED) || (this->pending_announcement_files_ > 0)) {
     this->state = media_player::MEDIA_PLAYER_STATE_ANNOUNCING;
   } else {
-    if (this->media_pipeline_state_ == AudioPipelineState::STOPPED) {
+    if ((this->media_pipeline_state_ == AudioPipelineState::STOPPED) && !this->next_media_started_) {
+      // While prefetched, the next stream keeps the player busy between the end of the current stream and the switch
       this->state = media_player::MEDIA_PLAYER_STATE_IDLE;
     } else if (this->is_paused_) {
       this->state = media_player::MEDIA_PLAYER_STATE_PAUSED;
@@ -324,10 +699,51 @@ void NabuMediaPlayer::loop() {
   if (this->state != old_state) {
     this->publish_state();
   }
+
+  this->release_idle_buffers_();
+}
+
+void NabuMediaPlayer::update_sound_pack(const std::string &url) {
+  if (this->sound_pack_ == nullptr) {
+    ESP_LOGW(TAG, "No sound pack partition is configured");
+    return;
+  }
+  if (this->sound_pack_->get_state() == SoundPackState::UPDATING) {
+    ESP_LOGW(TAG, "The sound pack is already being updated");
+    return;
+  }
+
+  // The update erases the sounds, so stop any that are playing; the update starts once they have stopped
+  if (this->announcement_file_.has_value() && this->sound_pack_->contains(this->announcement_file_.value())) {
+    if (this->announcement_pipeline_ != nullptr) {
+      this->announcement_pipeline_->stop();
+    }
+    if ((this->audio_mixer_ != nullptr) && (this->pending_announcement_files_ > 0)) {
+      CommandEvent command_event;
+      command_event.command = CommandEventType::CLEAR_ANNOUNCEMENT;
+      this->audio_mixer_->send_command(&command_event);
+    }
+  }
+  if (this->media_file_.has_value() && this->sound_pack_->contains(this->media_file_.value()) &&
+      (this->media_pipeline_ != nullptr)) {
+    this->media_pipeline_->stop();
+  }
+
+  this->sound_pack_update_url_ = url;
+}
+
+bool NabuMediaPlayer::is_playing_sound_pack_file_() const {
+  if (this->announcement_file_.has_value() && this->sound_pack_->contains(this->announcement_file_.value())) {
+    if ((this->announcement_pipeline_state_ != AudioPipelineState::STOPPED) || (this->pending_announcement_files_ > 0))
+      return true;
+  }
+  return this->media_file_.has_value() && this->sound_pack_->contains(this->media_file_.value()) &&
+         (this->media_pipeline_state_ != AudioPipelineState::STOPPED);
 }
 
 void NabuMediaPlayer::set_ducking_reduction(uint8_t decibel_reduction, float duration) {
-  if (this->audio_mixer_ != nullptr) {
+  this->ducking_decibel_reduction_ = decibel_reduction;
+  if ((this->audio_mixer_ != nullptr) && this->audio_mixer_->is_running()) {
     CommandEvent command_event;
     command_event.command = CommandEventType::DUCK;
     command_event.decibel_reduction = decibel_reduction;
@@ -338,6 +754,43 @@ void NabuMediaPlayer::set_ducking_reduction(uint8_t decibel_reduction, float dur
   }
 }
 
+uint32_t NabuMediaPlayer::get_rebuffer_count() const {
+  uint32_t count = 0;
+  if (this->media_pipeline_ != nullptr)
+    count += this->media_pipeline_->get_rebuffer_count();
+  if (this->announcement_pipeline_ != nullptr)
+    count += this->announcement_pipeline_->get_rebuffer_count();
+  return count;
+}
+
+uint32_t NabuMediaPlayer::get_rebuffer_duration_ms() const {
+  uint32_t duration_ms = 0;
+  if (this->media_pipeline_ != nullptr)
+    duration_ms += this->media_pipeline_->get_rebuffer_duration_ms();
+  if (this->announcement_pipeline_ != nullptr)
+    duration_ms += this->announcement_pipeline_->get_rebuffer_duration_ms();
+  return duration_ms;
+}
+
+void NabuMediaPlayer::seek(uint32_t position_ms) {
+  MediaCallCommand media_command;
+  media_command.seek_position_ms = position_ms;
+  xQueueSend(this->media_control_command_queue_, &media_command, portMAX_DELAY);
+}
+
+void NabuMediaPlayer::enqueue(const std::string &url) {
+  if (!this->is_ready()) {
+    return;
+  }
+
+  MediaCallCommand media_command;
+  media_command.announce = false;
+  media_command.new_url = true;
+  media_command.enqueue = true;
+  this->enqueued_media_url_ = url;
+  xQueueSend(this->media_control_command_queue_, &media_command, portMAX_DELAY);
+}
+
 void NabuMediaPlayer::control(const media_player::MediaPlayerCall &call) {
   if (!this->is_ready()) {
     return;
@@ -357,14 +810,21 @@ void NabuMediaPlayer::control(const media_player::MediaPlayerCall &call) {
     media_command.new_url = true;
     if (call.get_announcement().has_value() && call.get_announcement().value()) {
       this->announcement_url_ = new_uri;
+      this->announcement_file_.reset();
     } else {
       this->media_url_ = new_uri;
+      this->media_file_.reset();
     }
     xQueueSend(this->media_control_command_queue_, &media_command, portMAX_DELAY);
     return;
   }
 
   if (call.get_local_media_file().has_value()) {
+    if (call.get_local_media_file().value() == nullptr) {
+      // E.g., a sound pack sound that is missing or being updated
+      ESP_LOGW(TAG, "Unable to play a missing media file");
+      return;
+    }
     if (call.get_announcement().has_value() && call.get_announcement().value()) {
       this->announcement_file_ = call.get_local_media_file().value();
     } else {
@@ -4,6 +4,7 @@
 
 #include "audio_mixer.h"
 #include "audio_pipeline.h"
+#include "sound_pack.h"
 
 #ifdef USE_AUDIO_DAC
 #include "esphome/components/audio_dac/audio_dac.h"
@@ -29,6 +30,8 @@ struct MediaCallCommand {
   optional<bool> announce;
   optional<bool> new_url;
   optional<bool> new_file;
+  optional<bool> enqueue;  // Plays new_url after the current media stream instead of replacing it
+  optional<uint32_t> seek_position_ms;
 };
 
 struct VolumeRestoreState {
@@ -51,8 +54,111 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
   /// @param duration (float) The duration (in seconds) for transitioning to the new ducking level
   void set_ducking_reduction(uint8_t decibel_reduction, float duration);
 
+  /// @brief Moves the media stream's playback position. Only streams whose length is known (and, for URLs, hosted on a
+  /// server that supports range requests) can seek efficiently; AAC streams can't seek.
+  /// @param position_ms (uint32_t) The new playback position in milliseconds
+  void seek(uint32_t position_ms);
+
   void set_sample_rate(uint32_t sample_rate) { this->sample_rate_ = sample_rate; }
 
+  // Bits per sample of the mixed audio sent to the speaker; 32 keeps the precision of hi-res streams
+  void set_bits_per_sample(uint8_t bits_per_sample) { this->bits_per_sample_ = bits_per_sample; }
+
+  // Bytes of decoded audio each pipeline's decoder accumulates before writing it to the next stage
+  void set_decode_batch_size(size_t decode_batch_size) { this->decode_batch_size_ = decode_batch_size; }
+
+  // Bytes of PSRAM used to cache the audio of announcement urls; 0 disables the cache
+  void set_announcement_cache_size(size_t announcement_cache_size) {
+    this->announcement_cache_size_ = announcement_cache_size;
+  }
+
+  /// @brief Number of announcement urls played from the cache
+  uint32_t get_announcement_cache_hits() const {
+    return (this->announcement_cache_ != nullptr) ? this->announcement_cache_->get_hits() : 0;
+  }
+  /// @brief Number of announcement urls that weren't cached and went through the whole pipeline
+  uint32_t get_announcement_cache_misses() const {
+    return (this->announcement_cache_ != nullptr) ? this->announcement_cache_->get_misses() : 0;
+  }
+
+  // Milliseconds of audio each pipeline's url streams buffer before starting and before resuming after a stall; a start
+  // watermark of 0 disables buffering
+  void set_media_buffer_watermarks(uint32_t start_ms, uint32_t resume_ms) {
+    this->media_buffer_start_ms_ = start_ms;
+    this->media_buffer_resume_ms_ = resume_ms;
+  }
+  void set_announcement_buffer_watermarks(uint32_t start_ms, uint32_t resume_ms) {
+    this->announcement_buffer_start_ms_ = start_ms;
+    this->announcement_buffer_resume_ms_ = resume_ms;
+  }
+
+  /// @brief Number of times a url stream stalled and rebuffered, across both pipelines
+  uint32_t get_rebuffer_count() const;
+  /// @brief Total milliseconds url streams spent rebuffering after a stall, across both pipelines
+  uint32_t get_rebuffer_duration_ms() const;
+
+  // Milliseconds the media player stays idle before the mixer and pipelines free their buffers; 0 keeps them
+  void set_buffer_release_timeout(uint32_t buffer_release_timeout_ms) {
+    this->buffer_release_timeout_ms_ = buffer_release_timeout_ms;
+  }
+
+  /// @brief Bytes currently allocated for the mixer, both pipelines, and the announcement cache
+  size_t get_audio_memory_usage() const;
+
+  // Whether each pipeline runs its reader, decoder, and resampler in three tasks or cooperatively in one task
+  void set_pipeline_task_mode(AudioPipelineTaskMode pipeline_task_mode) {
+    this->pipeline_task_mode_ = pipeline_task_mode;
+  }
+
+  // Whether each pipeline's decoder hands its batches straight to the resampler instead of a decoded ring buffer
+  void set_fused_decode_resample(bool fused_decode_resample) { this->fused_decode_resample_ = fused_decode_resample; }
+
+  // Milliseconds an http connection stays open after a stream finishes, so the next url from the same server skips
+  // the TCP and TLS handshakes; 0 closes connections immediately
+  void set_http_keep_alive_timeout(uint32_t http_keep_alive_timeout_ms) {
+    this->http_keep_alive_timeout_ms_ = http_keep_alive_timeout_ms;
+  }
+
+  /// @brief Number of url streams that reused an idle http connection
+  uint32_t get_http_connections_reused() const {
+    return (this->connection_pool_ != nullptr) ? this->connection_pool_->get_reused_count() : 0;
+  }
+  /// @brief Number of url streams that connected by resuming a saved TLS session
+  uint32_t get_tls_sessions_resumed() const {
+    return (this->connection_pool_ != nullptr) ? this->connection_pool_->get_resumed_count() : 0;
+  }
+  /// @brief Estimated milliseconds of connection setup saved by reusing idle http connections and TLS sessions
+  uint32_t get_http_handshake_time_saved_ms() const {
+    return (this->connection_pool_ != nullptr) ? this->connection_pool_->get_handshake_time_saved_ms() : 0;
+  }
+
+  /// @brief Sets the label of the data partition that holds the sound pack; empty disables it
+  void set_sound_pack_partition(const std::string &partition_label) {
+    this->sound_pack_partition_ = partition_label;
+  }
+
+  /// @brief Gets a sound from the sound pack partition. The result can be played like a compiled in media file.
+  /// @param sound_id the sound's ID
+  /// @return pointer to the media file, or nullptr if the pack doesn't have the sound or is being updated
+  media_player::MediaFile *get_sound_pack_file(uint16_t sound_id) {
+    return (this->sound_pack_ != nullptr) ? this->sound_pack_->get_file(sound_id) : nullptr;
+  }
+
+  /// @brief Plays a media url after the current media stream ends, without a gap. The next stream is fetched and
+  /// decoded once the current one has been read completely. Replaces a url queued earlier; plays right away if no
+  /// media is playing.
+  /// @param url media url to queue
+  void enqueue(const std::string &url);
+
+  /// @brief Prepares the announcement pipeline for an announcement that is expected soon, e.g., a TTS response once the
+  /// voice assistant starts processing the intent. Does nothing while an announcement is playing.
+  /// @param url url to open a connection with; if empty, the server of the last announcement url is used
+  void warm_up_announcement(const std::string &url);
+
+  /// @brief Downloads a new sound pack into its partition. Stops any sound from the pack that is playing first.
+  /// @param url location of the new pack
+  void update_sound_pack(const std::string &url);
+
   // Percentage to increase or decrease the volume for volume up or volume down commands
   void set_volume_increment(float volume_increment) { this->volume_increment_ = volume_increment; }
 
@@ -68,6 +174,9 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
   Trigger<> *get_mute_trigger() const { return this->mute_trigger_; }
   Trigger<> *get_unmute_trigger() const { return this->unmute_trigger_; }
   Trigger<float> *get_volume_trigger() const { return this->volume_trigger_; }
+  /// @brief Fires with an internet radio stream's title when its ICY metadata changes it, and with an empty string
+  /// when the next stream starts
+  Trigger<std::string> *get_stream_title_trigger() const { return this->stream_title_trigger_; }
 
  protected:
   // Receives commands from HA or from the voice assistant component
@@ -89,22 +198,62 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
   void watch_media_commands_();
 
   std::unique_ptr<AudioPipeline> media_pipeline_;
+  std::unique_ptr<AudioPipeline> next_media_pipeline_;  // Prefetches the queued url into the other mixer media input
   std::unique_ptr<AudioPipeline> announcement_pipeline_;
   std::unique_ptr<AudioMixer> audio_mixer_;
+  std::unique_ptr<AnnouncementCache> announcement_cache_;
+  std::unique_ptr<HTTPConnectionPool> connection_pool_;
+  std::unique_ptr<SoundPack> sound_pack_;
 
   speaker::Speaker *speaker_{nullptr};
 
   // Monitors the mixer task
   void watch_mixer_();
+  void handle_mixer_event_(const TaskEvent &event);
+
+  // Sets the speaker's stream info and starts the mixer task if necessary. Waits for the mixer to finish releasing its
+  // buffers first.
+  esp_err_t start_mixer_();
+
+  // Stops the mixer task and frees the pipelines' ring buffers once the media player has been idle for
+  // ``buffer_release_timeout_ms_``
+  void release_idle_buffers_();
 
   // Starts the ``type`` pipeline with a ``url`` or file. Starts the mixer, pipeline, and speaker tasks if necessary.
   // Unpauses if starting media in paused state
   esp_err_t start_pipeline_(AudioPipelineType type, bool url);
 
+  // Sends a pre-rendered announcement file directly to the mixer, stopping the announcement pipeline if it is running
+  esp_err_t play_announcement_file_(media_player::MediaFile *media_file);
+
+  void create_announcement_pipeline_();
+
+  // Creates a media pipeline that writes to the mixer's ``media_input``
+  std::unique_ptr<AudioPipeline> create_media_pipeline_(uint8_t media_input);
+
+  // Starts the next media pipeline on the queued url and has the mixer play it once the current stream ends
+  esp_err_t start_next_media_pipeline_();
+
+  // Stops the next media pipeline and forgets the queued url
+  void clear_next_media_();
+
+  // Makes the next media pipeline and its url the current ones once the mixer plays its input
+  void promote_next_media_();
+
+  // Whether a pipeline or the mixer may still be reading a sound from the sound pack
+  bool is_playing_sound_pack_file_() const;
+
   AudioPipelineState media_pipeline_state_{AudioPipelineState::STOPPED};
+  AudioPipelineState next_media_pipeline_state_{AudioPipelineState::STOPPED};
   AudioPipelineState announcement_pipeline_state_{AudioPipelineState::STOPPED};
 
-  optional<std::string> media_url_{};                        // only modified by control function
+  // Number of announcement files sent to the mixer that haven't finished yet
+  uint32_t pending_announcement_files_{0};
+
+  optional<std::string> media_url_{};                        // modified by control function and when a queue advances
+  optional<std::string> enqueued_media_url_{};               // only modified by enqueue function
+  optional<std::string> next_media_url_{};                   // Queued url; plays after the current media stream
+  bool next_media_started_{false};                           // The next media pipeline is prefetching next_media_url_
   optional<std::string> announcement_url_{};                 // only modified by control function
   optional<media_player::MediaFile *> media_file_{};         // only modified by control fucntion
   optional<media_player::MediaFile *> announcement_file_{};  // only modified by control fucntion
@@ -112,6 +261,25 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
   QueueHandle_t media_control_command_queue_;
 
   uint32_t sample_rate_;
+  uint8_t bits_per_sample_{16};
+  size_t decode_batch_size_;
+  size_t announcement_cache_size_{0};
+  uint32_t http_keep_alive_timeout_ms_{0};
+  AudioPipelineTaskMode pipeline_task_mode_{AudioPipelineTaskMode::THREE_TASKS};
+  bool fused_decode_resample_{false};
+  std::string sound_pack_partition_{};
+  optional<std::string> sound_pack_update_url_{};  // Set until the pack's sounds have stopped and the update starts
+  std::string announcement_host_{};                 // Scheme, host, and port of the last announcement url
+
+  uint32_t buffer_release_timeout_ms_{0};
+  optional<uint32_t> idle_start_ms_{};  // Set while the media player is idle and the buffers are still allocated
+  bool mixer_stopping_{false};          // A STOP command was sent and the mixer hasn't reported STOPPED yet
+  uint8_t ducking_decibel_reduction_{0};  // Sent again when the mixer restarts
+
+  uint32_t media_buffer_start_ms_{0};
+  uint32_t media_buffer_resume_ms_{0};
+  uint32_t announcement_buffer_start_ms_{0};
+  uint32_t announcement_buffer_resume_ms_{0};
 
   bool is_paused_{false};
   bool is_muted_{false};
@@ -132,6 +300,7 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
   Trigger<> *mute_trigger_ = new Trigger<>();
   Trigger<> *unmute_trigger_ = new Trigger<>();
   Trigger<float> *volume_trigger_ = new Trigger<float>();
+  Trigger<std::string> *stream_title_trigger_ = new Trigger<std::string>();
 };
 
 template<typename... Ts> class DuckingSetAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
@@ -142,6 +311,39 @@ template<typename... Ts> class DuckingSetAction : public Action<Ts...>, public P
   }
 };
 
+template<typename... Ts> class SeekAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
+  TEMPLATABLE_VALUE(uint32_t, position)
+  void play(Ts... x) override { this->parent_->seek(this->position_.value(x...)); }
+};
+
+template<typename... Ts> class PlaySoundPackSoundAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
+  TEMPLATABLE_VALUE(uint16_t, sound_id)
+  TEMPLATABLE_VALUE(bool, announcement)
+  void play(Ts... x) override {
+    this->parent_->make_call()
+        .set_announcement(this->announcement_.value(x...))
+        .set_local_media_file(this->parent_->get_sound_pack_file(this->sound_id_.value(x...)))
+        .perform();
+  }
+};
+
+template<typename... Ts> class WarmUpAnnouncementAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
+  TEMPLATABLE_VALUE(std::string, url)
+  void play(Ts... x) override {
+    this->parent_->warm_up_announcement(this->url_.has_value() ? this->url_.value(x...) : std::string());
+  }
+};
+
+template<typename... Ts> class EnqueueAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
+  TEMPLATABLE_VALUE(std::string, url)
+  void play(Ts... x) override { this->parent_->enqueue(this->url_.value(x...)); }
+};
+
+template<typename... Ts> class UpdateSoundPackAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
+  TEMPLATABLE_VALUE(std::string, url)
+  void play(Ts... x) override { this->parent_->update_sound_pack(this->url_.value(x...)); }
+};
+
 template<typename... Ts> class PlayLocalMediaAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
   TEMPLATABLE_VALUE(media_player::MediaFile *, media_file)
   TEMPLATABLE_VALUE(bool, announcement)
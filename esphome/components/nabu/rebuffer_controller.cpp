@@ -0,0 +1,162 @@
+#ifdef USE_ESP_IDF
+
+#include "rebuffer_controller.h"
+
+#include <algorithm>
+
+namespace esphome {
+namespace nabu {
+
+// Bit rate assumed if playback started before one was known, i.e., because the buffer filled first; a 128 kbps MP3
+// stream
+static const uint32_t DEFAULT_BYTE_RATE = 16000;
+
+// Playback fades out once less than this much audio (or the start watermark, if lower) is buffered
+static const uint32_t LOW_WATERMARK_MS = 200;
+
+static const uint32_t RATE_WINDOW_MS = 1000;
+
+// The adapted resume watermark never exceeds this, and it shrinks back towards the base after this long without a stall
+static const uint32_t MAX_RESUME_MS = 10000;
+static const uint32_t STABLE_PLAYBACK_MS = 60000;
+
+// If the source delivers slower than the stream plays, resuming waits until the buffer lasts at least this long
+static const uint32_t RESUME_PLAY_TARGET_MS = 10000;
+
+static uint32_t update_average(uint32_t average, uint32_t sample) {
+  if (average == 0) {
+    return sample;
+  }
+  // Exponential moving average, weighting the newest sample by 1/4
+  return (3 * average + sample) / 4;
+}
+
+void RebufferController::set_watermarks(uint32_t start_ms, uint32_t resume_ms) {
+  this->start_ms_ = start_ms;
+  this->base_resume_ms_ = resume_ms;
+  this->resume_ms_ = resume_ms;
+}
+
+void RebufferController::start(size_t capacity, uint32_t now_ms) {
+  this->state_ = BufferingState::PREBUFFERING;
+  this->capacity_ = capacity;
+
+  this->stream_byte_rate_ = 0;
+  this->consume_rate_ = 0;
+  this->receive_rate_ = 0;
+
+  this->window_start_ms_ = now_ms;
+  this->window_received_bytes_ = 0;
+  this->window_consumed_bytes_ = 0;
+}
+
+BufferingEvent RebufferController::update(size_t buffered_bytes, size_t received_bytes, bool input_finished,
+                                          uint32_t now_ms) {
+  this->update_rates_(buffered_bytes, received_bytes, input_finished, now_ms);
+
+  switch (this->state_) {
+    case BufferingState::PREBUFFERING: {
+      // Without a bit rate the start watermark can't be converted to bytes, so wait for one unless the buffer is full
+      size_t start_bytes = (this->get_byte_rate_() > 0) ? this->ms_to_bytes_(this->start_ms_)
+                                                        : this->get_max_watermark_bytes_();
+      if (input_finished || (this->start_ms_ == 0) || (buffered_bytes >= start_bytes)) {
+        this->state_ = BufferingState::PLAYING;
+        this->stable_since_ms_ = now_ms;
+        return BufferingEvent::START;
+      }
+      break;
+    }
+    case BufferingState::PLAYING:
+      if (!input_finished && (buffered_bytes < this->ms_to_bytes_(std::min(LOW_WATERMARK_MS, this->start_ms_)))) {
+        this->state_ = BufferingState::REBUFFERING;
+        this->rebuffer_start_ms_ = now_ms;
+        ++this->rebuffer_count_;
+        this->resume_ms_ = std::min(this->resume_ms_ * 3 / 2, MAX_RESUME_MS);
+        return BufferingEvent::STALL;
+      }
+      if ((now_ms - this->stable_since_ms_ >= STABLE_PLAYBACK_MS) && (this->resume_ms_ > this->base_resume_ms_)) {
+        this->resume_ms_ = std::max(this->base_resume_ms_, this->resume_ms_ * 3 / 4);
+        this->stable_since_ms_ = now_ms;
+      }
+      break;
+    case BufferingState::REBUFFERING:
+      if (input_finished || (buffered_bytes >= this->get_resume_bytes_())) {
+        this->state_ = BufferingState::PLAYING;
+        this->rebuffer_duration_ms_ += now_ms - this->rebuffer_start_ms_;
+        this->stable_since_ms_ = now_ms;
+        return BufferingEvent::RESUME;
+      }
+      break;
+  }
+
+  return BufferingEvent::NONE;
+}
+
+uint32_t RebufferController::get_rebuffer_duration_ms(uint32_t now_ms) const {
+  if (this->state_ == BufferingState::REBUFFERING) {
+    return this->rebuffer_duration_ms_ + (now_ms - this->rebuffer_start_ms_);
+  }
+  return this->rebuffer_duration_ms_;
+}
+
+uint32_t RebufferController::get_byte_rate_() const {
+  // The decoder's rate covers the whole stream so far, while the measured one also sees the pipeline's buffers fill
+  return (this->stream_byte_rate_ > 0) ? this->stream_byte_rate_ : this->consume_rate_;
+}
+
+size_t RebufferController::ms_to_bytes_(uint32_t ms) const {
+  uint32_t byte_rate = this->get_byte_rate_();
+  if (byte_rate == 0) {
+    byte_rate = DEFAULT_BYTE_RATE;
+  }
+  uint64_t bytes = static_cast<uint64_t>(ms) * byte_rate / 1000;
+  return std::min<uint64_t>(bytes, this->get_max_watermark_bytes_());
+}
+
+size_t RebufferController::get_resume_bytes_() const {
+  size_t resume_bytes = this->ms_to_bytes_(this->resume_ms_);
+
+  uint32_t byte_rate = this->get_byte_rate_();
+  if ((this->receive_rate_ > 0) && (this->receive_rate_ < byte_rate)) {
+    // The buffer drains at the difference of the rates, so buffer enough to play for a while before the next stall
+    uint64_t shortfall_bytes = static_cast<uint64_t>(byte_rate - this->receive_rate_) * RESUME_PLAY_TARGET_MS / 1000;
+    resume_bytes =
+        std::max<size_t>(resume_bytes, std::min<uint64_t>(shortfall_bytes, this->get_max_watermark_bytes_()));
+  }
+
+  return resume_bytes;
+}
+
+void RebufferController::update_rates_(size_t buffered_bytes, size_t received_bytes, bool input_finished,
+                                       uint32_t now_ms) {
+  uint32_t elapsed_ms = now_ms - this->window_start_ms_;
+  if (elapsed_ms < RATE_WINDOW_MS) {
+    return;
+  }
+
+  size_t consumed_bytes = (received_bytes > buffered_bytes) ? received_bytes - buffered_bytes : 0;
+  size_t window_received = received_bytes - this->window_received_bytes_;
+  size_t window_consumed =
+      (consumed_bytes > this->window_consumed_bytes_) ? consumed_bytes - this->window_consumed_bytes_ : 0;
+
+  // Only measure the bit rate while the stream plays; it doesn't drain while held or paused
+  if ((this->state_ == BufferingState::PLAYING) && (window_consumed > 0)) {
+    this->consume_rate_ =
+        update_average(this->consume_rate_, static_cast<uint64_t>(window_consumed) * 1000 / elapsed_ms);
+  }
+
+  // Only measure the source's throughput while a full buffer isn't holding it back
+  if (!input_finished && (buffered_bytes < this->capacity_ / 2)) {
+    this->receive_rate_ =
+        update_average(this->receive_rate_, static_cast<uint64_t>(window_received) * 1000 / elapsed_ms);
+  }
+
+  this->window_start_ms_ = now_ms;
+  this->window_received_bytes_ = received_bytes;
+  this->window_consumed_bytes_ = consumed_bytes;
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nabu {
+
+enum class BufferingState : uint8_t {
+  PREBUFFERING = 0,  // Playback is held until the start watermark is buffered
+  PLAYING,
+  REBUFFERING,  // The buffer ran low, so playback faded out until the resume watermark is buffered
+};
+
+enum class BufferingEvent : uint8_t {
+  NONE = 0,
+  START,   // Prebuffering finished; start playback
+  STALL,   // The buffer ran low; fade playback out
+  RESUME,  // Rebuffering finished; fade playback back in
+};
+
+// Decides when a network stream plays and when it waits for its encoded input to refill. Watermarks are set in
+// milliseconds of audio and converted to bytes with the stream's bit rate: the one the decoder derives from the audio
+// it decoded, or else the one measured while the stream plays. The resume watermark adapts to the observed throughput:
+// it grows after every stall, covers the shortfall when the source delivers slower than the stream plays, and shrinks
+// back after a stretch of stable playback.
+class RebufferController {
+ public:
+  /// @brief Sets the base watermarks
+  /// @param start_ms audio to buffer before a stream starts playing; 0 plays immediately and never rebuffers
+  /// @param resume_ms audio to buffer before playback resumes after a stall
+  void set_watermarks(uint32_t start_ms, uint32_t resume_ms);
+
+  /// @brief Starts monitoring a new stream in the PREBUFFERING state. Clears the bit rate measurements, but keeps the
+  /// adapted resume watermark, as network conditions usually outlast a stream.
+  /// @param capacity bytes of encoded audio the pipeline can buffer; watermarks are limited to 3/4 of it
+  /// @param now_ms current time in milliseconds
+  void start(size_t capacity, uint32_t now_ms);
+
+  /// @brief Sets the stream's bit rate in bytes per second, as derived by the decoder. Prebuffering continues until a
+  /// bit rate is known, so the start watermark is never converted with a guess.
+  /// @param byte_rate encoded bytes per second of audio, or 0 if not known yet
+  void set_stream_byte_rate(uint32_t byte_rate) { this->stream_byte_rate_ = byte_rate; }
+
+  /// @brief Updates the throughput measurements and the buffering state
+  /// @param buffered_bytes encoded bytes received but not yet decoded
+  /// @param received_bytes total encoded bytes received since the stream started
+  /// @param input_finished whether the source has been completely read
+  /// @param now_ms current time in milliseconds
+  /// @return the event the pipeline should act on, if the state changed
+  BufferingEvent update(size_t buffered_bytes, size_t received_bytes, bool input_finished, uint32_t now_ms);
+
+  BufferingState get_state() const { return this->state_; }
+
+  /// @brief Number of times playback stalled and rebuffered
+  uint32_t get_rebuffer_count() const { return this->rebuffer_count_; }
+  /// @brief Total milliseconds spent rebuffering, including a stall still in progress
+  uint32_t get_rebuffer_duration_ms(uint32_t now_ms) const;
+
+ protected:
+  /// @brief Bytes per second of the stream; the decoder's rate if known, otherwise the measured rate, or 0
+  uint32_t get_byte_rate_() const;
+
+  /// @brief Largest watermark in bytes; 3/4 of the capacity
+  size_t get_max_watermark_bytes_() const { return this->capacity_ * 3 / 4; }
+
+  /// @brief Converts milliseconds of audio to encoded bytes, limited to the largest watermark
+  size_t ms_to_bytes_(uint32_t ms) const;
+
+  /// @brief Bytes to buffer before resuming; enough for the resume watermark and to play for a while even if the source
+  /// keeps delivering slower than the stream plays
+  size_t get_resume_bytes_() const;
+
+  void update_rates_(size_t buffered_bytes, size_t received_bytes, bool input_finished, uint32_t now_ms);
+
+  BufferingState state_{BufferingState::PLAYING};
+
+  size_t capacity_{0};
+
+  uint32_t start_ms_{0};
+  uint32_t base_resume_ms_{0};
+  uint32_t resume_ms_{0};  // Adapted resume watermark
+
+  // The stream's bit rate from the decoder, in bytes per second; 0 until known
+  uint32_t stream_byte_rate_{0};
+
+  // Measured bytes per second the decoder consumes (the stream's bit rate) and the source delivers; 0 until measured
+  uint32_t consume_rate_{0};
+  uint32_t receive_rate_{0};
+
+  uint32_t window_start_ms_{0};
+  size_t window_received_bytes_{0};
+  size_t window_consumed_bytes_{0};
+
+  uint32_t stable_since_ms_{0};
+  uint32_t rebuffer_start_ms_{0};
+
+  uint32_t rebuffer_count_{0};
+  uint32_t rebuffer_duration_ms_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
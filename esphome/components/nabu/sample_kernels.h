@@ -0,0 +1,167 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <dsp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+namespace esphome {
+namespace nabu {
+
+// Gain, mixing, and conversion kernels for the sample formats a stage can work in: 16 bit PCM, 32 bit PCM (Q31), and
+// float in [-1.0, 1.0]. The kernel for a format is picked at compile time through SampleTraits, so the loops have no
+// per sample branches on the format. Gains are Q15 fixed point for every format, so the ducking table and the fades
+// are shared.
+
+// Q15 gain that leaves the samples unchanged
+static const int16_t Q15_UNITY_GAIN = INT16_MAX;
+
+template<typename T> struct SampleTraits;
+
+template<> struct SampleTraits<int16_t> {
+  using Wide = int32_t;  // Holds the sum of two samples and a sample multiplied by a Q15 gain
+  static constexpr Wide MAX = INT16_MAX;
+  static constexpr Wide MIN = INT16_MIN;
+  static constexpr uint8_t BITS_PER_SAMPLE = 16;
+
+  static int16_t apply_gain(int16_t sample, int32_t q15_gain) {
+    return static_cast<int16_t>((static_cast<Wide>(sample) * q15_gain) >> 15);
+  }
+  static float to_float(int16_t sample) { return static_cast<float>(sample) / 32768.0f; }
+  static int16_t from_float(float sample) {
+    return static_cast<int16_t>(std::min(std::max(sample * 32768.0f, -32768.0f), 32767.0f));
+  }
+};
+
+template<> struct SampleTraits<int32_t> {
+  using Wide = int64_t;
+  static constexpr Wide MAX = INT32_MAX;
+  static constexpr Wide MIN = INT32_MIN;
+  static constexpr uint8_t BITS_PER_SAMPLE = 32;
+
+  static int32_t apply_gain(int32_t sample, int32_t q15_gain) {
+    return static_cast<int32_t>((static_cast<Wide>(sample) * q15_gain) >> 15);
+  }
+  static float to_float(int32_t sample) { return static_cast<float>(sample) / 2147483648.0f; }
+  static int32_t from_float(float sample) {
+    // 1.0 * 2^31 doesn't fit, so clamp in the wider type before converting
+    return static_cast<int32_t>(std::min<Wide>(std::max<Wide>(std::llround(sample * 2147483648.0f), MIN), MAX));
+  }
+};
+
+template<> struct SampleTraits<float> {
+  using Wide = float;
+  static constexpr Wide MAX = 1.0f;
+  static constexpr Wide MIN = -1.0f;
+  static constexpr uint8_t BITS_PER_SAMPLE = 32;
+
+  static float apply_gain(float sample, int32_t q15_gain) { return sample * (static_cast<float>(q15_gain) / 32768.0f); }
+  static float to_float(float sample) { return sample; }
+  static float from_float(float sample) { return sample; }
+};
+
+// Converts a single sample between formats. Integer formats convert by shifting, so widening is exact and narrowing
+// truncates like the WAV converters do.
+template<typename In, typename Out> struct SampleConverter {
+  static Out convert(In sample) { return SampleTraits<Out>::from_float(SampleTraits<In>::to_float(sample)); }
+};
+
+template<typename T> struct SampleConverter<T, T> {
+  static T convert(T sample) { return sample; }
+};
+
+template<> struct SampleConverter<int16_t, int32_t> {
+  static int32_t convert(int16_t sample) { return static_cast<int32_t>(static_cast<uint32_t>(sample) << 16); }
+};
+
+template<> struct SampleConverter<int32_t, int16_t> {
+  static int16_t convert(int32_t sample) { return static_cast<int16_t>(sample >> 16); }
+};
+
+/// @brief Converts samples from one format to another. The buffers must not overlap.
+template<typename In, typename Out> void convert_samples(const In *input, Out *output, size_t samples) {
+  for (size_t i = 0; i < samples; ++i) {
+    output[i] = SampleConverter<In, Out>::convert(input[i]);
+  }
+}
+
+/// @brief Duplicates mono samples into stereo frames in place. The buffer must hold twice as many samples.
+template<typename T> void mono_to_stereo(T *samples, size_t frames) {
+  for (size_t i = frames; i > 0; --i) {
+    samples[2 * i - 1] = samples[i - 1];
+    samples[2 * i - 2] = samples[i - 1];
+  }
+}
+
+/// @brief Scales samples by a Q15 gain. Scales in place when input == output.
+template<typename T> void scale_samples(const T *input, T *output, int16_t q15_gain, size_t samples) {
+  for (size_t i = 0; i < samples; ++i) {
+    output[i] = SampleTraits<T>::apply_gain(input[i], q15_gain);
+  }
+}
+
+template<> inline void scale_samples<int16_t>(const int16_t *input, int16_t *output, int16_t q15_gain, size_t samples) {
+  dsps_mulc_s16(input, output, samples, q15_gain, 1, 1);
+}
+
+/// @brief Adds two buffers of samples that are known not to clip
+template<typename T> void add_samples(const T *input_a, const T *input_b, T *output, size_t samples) {
+  for (size_t i = 0; i < samples; ++i) {
+    output[i] = input_a[i] + input_b[i];
+  }
+}
+
+template<> inline void add_samples<int16_t>(const int16_t *input_a, const int16_t *input_b, int16_t *output,
+                                            size_t samples) {
+  // (buffer 1, buffer 2, output buffer, number of samples, buffer 1 step, buffer 2 step, output buffer step, bitshift)
+  dsps_add_s16(input_a, input_b, output, samples, 1, 1, 1, 0);
+}
+
+/// @brief Mixes the media and announcement samples. If the sum clips anywhere, the media samples are scaled down by the
+/// smallest factor that avoids it, so the announcement keeps its volume and the media volume is consistent within the
+/// batch.
+/// @param media_buffer media samples; scaled in place if the sum would clip
+/// @param announcement_buffer announcement samples
+/// @param combination_buffer receives the mixed samples
+/// @param samples number of samples in each buffer
+template<typename T>
+void mix_samples_without_clipping(T *media_buffer, const T *announcement_buffer, T *combination_buffer,
+                                  size_t samples) {
+  using Wide = typename SampleTraits<T>::Wide;
+
+  int16_t q15_scaling_factor = Q15_UNITY_GAIN;
+
+  for (size_t i = 0; i < samples; ++i) {
+    Wide added_sample = static_cast<Wide>(media_buffer[i]) + static_cast<Wide>(announcement_buffer[i]);
+
+    if ((added_sample > SampleTraits<T>::MAX) || (added_sample < SampleTraits<T>::MIN)) {
+      // The largest magnitude the media sample can have without clipping, divided by its actual magnitude as a Q15
+      // factor. Reference: https://sestevenson.wordpress.com/2010/09/20/fixed-point-division-2/ (accessed August 15,
+      // 2024)
+      Wide media_sample_safe_max = -SampleTraits<T>::MIN - std::abs(static_cast<Wide>(announcement_buffer[i]));
+      Wide media_sample_value = std::abs(static_cast<Wide>(media_buffer[i]));
+      int16_t necessary_q15_factor =
+          static_cast<int16_t>(media_sample_safe_max * static_cast<Wide>(1 << 15) / media_sample_value);
+      // Take the minimum scaling factor (the smaller the factor, the more it needs to be scaled down)
+      q15_scaling_factor = std::min(necessary_q15_factor, q15_scaling_factor);
+    } else {
+      // If no sample needs scaling, the samples are already mixed
+      combination_buffer[i] = static_cast<T>(added_sample);
+    }
+  }
+
+  if (q15_scaling_factor < Q15_UNITY_GAIN) {
+    scale_samples(media_buffer, media_buffer, q15_scaling_factor, samples);
+    add_samples(media_buffer, announcement_buffer, combination_buffer, samples);
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,105 @@
+#ifdef USE_ESP_IDF
+
+#include "seek_index.h"
+
+#include <algorithm>
+
+namespace esphome {
+namespace nabu {
+
+// Limits the memory used by long seek tables; an hour long stream still has a point every 18 seconds
+static const size_t MAX_SEEK_POINTS = 200;
+
+void SeekIndex::add_point(uint32_t time_ms, uint64_t offset) {
+  if (!this->points_.empty()) {
+    const SeekPoint &last = this->points_.back();
+    if ((time_ms <= last.time_ms) || (time_ms - last.time_ms < this->min_point_spacing_ms_) ||
+        (offset < last.offset)) {
+      return;
+    }
+  }
+
+  if (this->points_.size() >= MAX_SEEK_POINTS) {
+    // Keep every other point and only accept new points that are at least as far apart
+    size_t kept = 0;
+    for (size_t i = 0; i < this->points_.size(); i += 2) {
+      this->points_[kept++] = this->points_[i];
+    }
+    this->points_.resize(kept);
+    this->min_point_spacing_ms_ = (this->points_.back().time_ms - this->points_.front().time_ms) / (kept - 1);
+
+    if (time_ms - this->points_.back().time_ms < this->min_point_spacing_ms_) {
+      return;
+    }
+  }
+
+  this->points_.push_back({time_ms, offset});
+}
+
+void SeekIndex::set_audio_data(uint64_t audio_start, uint64_t audio_length, uint32_t duration_ms) {
+  this->audio_start_ = audio_start;
+  this->audio_length_ = audio_length;
+  this->duration_ms_ = duration_ms;
+}
+
+void SeekIndex::set_header(const uint8_t *header, size_t length, size_t data_size_field_offset) {
+  this->header_.assign(header, header + length);
+  this->data_size_field_offset_ = data_size_field_offset;
+}
+
+bool SeekIndex::find(uint32_t time_ms, SeekTarget &target) const {
+  if ((this->duration_ms_ == 0) || (this->audio_length_ == 0)) {
+    return false;
+  }
+
+  time_ms = std::min(time_ms, this->duration_ms_);
+
+  // Find the known points on either side of the time; the start and end of the audio data are implicit points
+  SeekPoint before{0, 0};
+  SeekPoint after{this->duration_ms_, this->audio_length_};
+  for (const SeekPoint &point : this->points_) {
+    if (point.time_ms <= time_ms) {
+      before = point;
+    } else {
+      after = point;
+      break;
+    }
+  }
+
+  uint64_t offset = before.offset;
+  if ((after.time_ms > before.time_ms) && (after.offset > before.offset)) {
+    double fraction = static_cast<double>(time_ms - before.time_ms) / (after.time_ms - before.time_ms);
+    offset += static_cast<uint64_t>(fraction * (after.offset - before.offset));
+  }
+
+  offset -= offset % this->alignment_;
+  offset = std::min(offset, this->audio_length_);
+
+  target.byte_offset = this->audio_start_ + offset;
+  target.time_ms = time_ms;
+  return true;
+}
+
+std::vector<uint8_t> SeekIndex::create_header(const SeekTarget &target) const {
+  std::vector<uint8_t> header = this->header_;
+
+  size_t field = this->data_size_field_offset_;
+  if ((field > 0) && (field + 4 <= header.size())) {
+    uint32_t data_size = header[field] | (header[field + 1] << 8) | (header[field + 2] << 16) |
+                         (static_cast<uint32_t>(header[field + 3]) << 24);
+    uint64_t bytes_skipped = target.byte_offset - this->audio_start_;
+    data_size = (data_size > bytes_skipped) ? data_size - bytes_skipped : 0;
+
+    header[field] = data_size & 0xFF;
+    header[field + 1] = (data_size >> 8) & 0xFF;
+    header[field + 2] = (data_size >> 16) & 0xFF;
+    header[field + 3] = (data_size >> 24) & 0xFF;
+  }
+
+  return header;
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
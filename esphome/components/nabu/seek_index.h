@@ -0,0 +1,81 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+struct SeekPoint {
+  uint32_t time_ms;
+  uint64_t offset;  // Relative to the start of the audio data
+};
+
+struct SeekTarget {
+  uint64_t byte_offset;  // Position in the stream to resume reading from
+  uint32_t time_ms;      // Approximate playback time at byte_offset
+};
+
+// Maps playback times to byte offsets in an encoded stream. The decoder builds it from the container's index (FLAC
+// SEEKTABLE, MP3 Xing/VBRI TOC) or from a constant bit rate, and the pipeline uses it to restart the stream at a
+// different position.
+//  - Offsets between two known points are linearly interpolated. A seek may therefore start in the middle of a frame;
+//    the decoders resync to the next frame header.
+//  - Decoders need the stream header to decode data from the middle of a stream. The index keeps a minimal header that
+//    is fed to the decoder ahead of the data read from the seek target.
+class SeekIndex {
+ public:
+  /// @brief Adds a known point. Points must be added in increasing time order. Large tables are thinned out to limit
+  /// memory use.
+  /// @param time_ms playback time of the point
+  /// @param offset byte offset of the point, relative to the start of the audio data
+  void add_point(uint32_t time_ms, uint64_t offset);
+
+  /// @brief Sets the position and extent of the audio data in the stream
+  /// @param audio_start byte offset of the first audio frame in the stream
+  /// @param audio_length number of bytes of audio data
+  /// @param duration_ms playback time of the whole stream
+  void set_audio_data(uint64_t audio_start, uint64_t audio_length, uint32_t duration_ms);
+
+  /// @brief Seek targets are rounded down to a multiple of this many bytes after the audio start. Used for PCM, where
+  /// there are no frame headers to resync to.
+  void set_alignment(uint32_t alignment) { this->alignment_ = alignment; }
+
+  /// @brief Sets the header that a decoder needs before it can decode data from the middle of the stream
+  /// @param header pointer to the header bytes
+  /// @param length number of header bytes
+  /// @param data_size_field_offset if non-zero, the header holds the 32 bit little endian size of the audio data at
+  /// this offset; it is reduced by the bytes skipped by a seek
+  void set_header(const uint8_t *header, size_t length, size_t data_size_field_offset = 0);
+
+  /// @brief Finds where to resume reading the stream to play from a given time
+  /// @param time_ms desired playback time; limited to the stream's duration
+  /// @param target set to the byte offset and the approximate time at that offset
+  /// @return true if the stream is seekable, false if its duration or length is unknown
+  bool find(uint32_t time_ms, SeekTarget &target) const;
+
+  /// @brief Creates the header to feed the decoder before the data starting at target
+  std::vector<uint8_t> create_header(const SeekTarget &target) const;
+
+  uint32_t get_duration_ms() const { return this->duration_ms_; }
+
+ protected:
+  std::vector<SeekPoint> points_;
+  uint32_t min_point_spacing_ms_{0};
+
+  uint64_t audio_start_{0};
+  uint64_t audio_length_{0};
+  uint32_t duration_ms_{0};
+  uint32_t alignment_{1};
+
+  std::vector<uint8_t> header_;
+  size_t data_size_field_offset_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,287 @@
+#ifdef USE_ESP_IDF
+
+#include "sound_pack.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+
+#include <esp_http_client.h>
+#include <esp_rom_crc.h>
+
+#include <freertos/task.h>
+
+#include <cstring>
+
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+
+namespace esphome {
+namespace nabu {
+
+static const char *const TAG = "nabu_media_player.sound_pack";
+
+static const uint8_t PACK_MAGIC[4] = {'N', 'S', 'P', 'K'};
+static const uint16_t PACK_VERSION = 1;
+static const size_t HEADER_SIZE = 16;
+static const size_t INDEX_ENTRY_SIZE = 12;
+
+static const size_t FLASH_SECTOR_SIZE = 4096;
+static const size_t DOWNLOAD_BUFFER_SIZE = 4096;
+static const uint32_t NO_DATA_READ_TIMEOUT_MS = 10000;
+
+// esp_http_client and TLS need a large stack; the task only exists while an update runs
+static const uint32_t UPDATE_TASK_STACK_SIZE = 8192;
+static const UBaseType_t UPDATE_TASK_PRIORITY = 1;
+
+static uint16_t read_u16(const uint8_t *data) { return data[0] | (data[1] << 8); }
+static uint32_t read_u32(const uint8_t *data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+SoundPack::~SoundPack() { this->unload_(); }
+
+esp_err_t SoundPack::load() {
+  this->unload_();
+
+  if (this->partition_ == nullptr) {
+    this->partition_ =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, this->partition_label_.c_str());
+    if (this->partition_ == nullptr) {
+      return ESP_ERR_NOT_FOUND;
+    }
+  }
+
+  esp_err_t err = this->map_(this->pack_);
+  if (err == ESP_OK) {
+    this->state_ = SoundPackState::READY;
+  }
+  return err;
+}
+
+void SoundPack::loop() {
+  if (!this->update_finished_.load(std::memory_order_acquire)) {
+    return;
+  }
+  this->update_finished_.store(false, std::memory_order_relaxed);
+  // The task deletes itself right after finishing
+  this->update_task_handle_ = nullptr;
+
+  if (this->update_result_ == ESP_OK) {
+    this->pack_ = std::move(this->updated_pack_);
+    this->updated_pack_ = MappedPack();
+    this->state_ = SoundPackState::READY;
+    ESP_LOGI(TAG, "Updated the sound pack");
+  } else {
+    // An interrupted download leaves an invalid pack, so the pack is unavailable until the next successful update
+    ESP_LOGE(TAG, "Failed to update the sound pack: %s", esp_err_to_name(this->update_result_));
+    this->state_ = SoundPackState::UNAVAILABLE;
+  }
+}
+
+esp_err_t SoundPack::map_(MappedPack &pack) const {
+  const void *mapped_data = nullptr;
+  esp_err_t err = esp_partition_mmap(this->partition_, 0, this->partition_->size, ESP_PARTITION_MMAP_DATA,
+                                     &mapped_data, &pack.mmap_handle);
+  if (err != ESP_OK) {
+    return err;
+  }
+  pack.data = static_cast<const uint8_t *>(mapped_data);
+
+  const uint8_t *header = pack.data;
+  if ((this->partition_->size < HEADER_SIZE) || (std::memcmp(header, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0)) {
+    unmap_(pack);
+    return ESP_ERR_INVALID_CRC;
+  }
+  if (read_u16(header + 4) != PACK_VERSION) {
+    unmap_(pack);
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  uint16_t count = read_u16(header + 6);
+  uint32_t body_length = read_u32(header + 8);
+  uint32_t crc = read_u32(header + 12);
+
+  if ((body_length > this->partition_->size - HEADER_SIZE) || (count * INDEX_ENTRY_SIZE > body_length) ||
+      (esp_rom_crc32_le(0, pack.data + HEADER_SIZE, body_length) != crc)) {
+    unmap_(pack);
+    return ESP_ERR_INVALID_CRC;
+  }
+
+  size_t pack_length = HEADER_SIZE + body_length;
+  pack.files.reserve(count);
+  for (uint16_t i = 0; i < count; ++i) {
+    const uint8_t *entry = pack.data + HEADER_SIZE + i * INDEX_ENTRY_SIZE;
+    uint32_t offset = read_u32(entry);
+    uint32_t length = read_u32(entry + 4);
+    uint8_t file_type = entry[8];
+
+    if ((offset > pack_length) || (length > pack_length - offset) ||
+        (file_type > static_cast<uint8_t>(media_player::MediaFileType::PCM))) {
+      unmap_(pack);
+      return ESP_ERR_INVALID_CRC;
+    }
+
+    pack.files.push_back({pack.data + offset, length, static_cast<media_player::MediaFileType>(file_type)});
+  }
+
+  ESP_LOGD(TAG, "Mapped %u sounds (%zu bytes) from the '%s' partition", count, pack_length,
+           this->partition_label_.c_str());
+
+  return ESP_OK;
+}
+
+void SoundPack::unmap_(MappedPack &pack) {
+  pack.files.clear();
+  if (pack.data != nullptr) {
+    esp_partition_munmap(pack.mmap_handle);
+    pack.data = nullptr;
+  }
+}
+
+media_player::MediaFile *SoundPack::get_file(uint16_t sound_id) {
+  if ((this->state_ != SoundPackState::READY) || (sound_id >= this->pack_.files.size())) {
+    return nullptr;
+  }
+  return &this->pack_.files[sound_id];
+}
+
+bool SoundPack::contains(const media_player::MediaFile *media_file) const {
+  if (this->state_ != SoundPackState::READY) {
+    return false;
+  }
+  const auto &files = this->pack_.files;
+  return (media_file >= files.data()) && (media_file < files.data() + files.size());
+}
+
+esp_err_t SoundPack::start_update(const std::string &url) {
+  if (this->state_ == SoundPackState::UPDATING) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (this->partition_ == nullptr) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  this->unload_();
+  this->state_ = SoundPackState::UPDATING;
+  this->update_url_ = url;
+
+  if (xTaskCreate(SoundPack::update_task_, "sound_pack", UPDATE_TASK_STACK_SIZE, (void *) this, UPDATE_TASK_PRIORITY,
+                  &this->update_task_handle_) != pdPASS) {
+    this->update_task_handle_ = nullptr;
+    this->state_ = SoundPackState::UNAVAILABLE;
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+void SoundPack::unload_() {
+  unmap_(this->pack_);
+  if (this->state_ == SoundPackState::READY) {
+    this->state_ = SoundPackState::UNAVAILABLE;
+  }
+}
+
+esp_err_t SoundPack::download_(const std::string &url) {
+  esp_http_client_config_t client_config = {};
+  client_config.url = url.c_str();
+  client_config.max_redirection_count = 10;
+  client_config.timeout_ms = 5000;
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+  if (url.find("https:") != std::string::npos) {
+    client_config.crt_bundle_attach = esp_crt_bundle_attach;
+  }
+#endif
+
+  esp_http_client_handle_t client = esp_http_client_init(&client_config);
+  if (client == nullptr) {
+    return ESP_FAIL;
+  }
+
+  esp_err_t err = esp_http_client_open(client, 0);
+  if (err != ESP_OK) {
+    esp_http_client_cleanup(client);
+    return err;
+  }
+
+  int64_t content_length = esp_http_client_fetch_headers(client);
+  if (esp_http_client_get_status_code(client) != 200) {
+    err = ESP_ERR_INVALID_RESPONSE;
+  } else if (content_length > static_cast<int64_t>(this->partition_->size)) {
+    err = ESP_ERR_INVALID_SIZE;
+  }
+
+  std::vector<uint8_t> buffer;
+  if (err == ESP_OK) {
+    buffer.resize(DOWNLOAD_BUFFER_SIZE);
+  }
+
+  size_t bytes_written = 0;
+  size_t bytes_erased = 0;
+  uint32_t last_data_read_ms = millis();
+
+  while (err == ESP_OK) {
+    int received_len = esp_http_client_read(client, (char *) buffer.data(), buffer.size());
+    if (received_len < 0) {
+      err = ESP_FAIL;
+      break;
+    } else if (received_len == 0) {
+      if (esp_http_client_is_complete_data_received(client)) {
+        break;
+      }
+      if (millis() - last_data_read_ms >= NO_DATA_READ_TIMEOUT_MS) {
+        err = ESP_ERR_TIMEOUT;
+      }
+      continue;
+    }
+    last_data_read_ms = millis();
+
+    if (bytes_written + received_len > this->partition_->size) {
+      err = ESP_ERR_INVALID_SIZE;
+      break;
+    }
+
+    while ((err == ESP_OK) && (bytes_erased < bytes_written + received_len)) {
+      err = esp_partition_erase_range(this->partition_, bytes_erased, FLASH_SECTOR_SIZE);
+      bytes_erased += FLASH_SECTOR_SIZE;
+    }
+    if (err == ESP_OK) {
+      err = esp_partition_write(this->partition_, bytes_written, buffer.data(), received_len);
+      bytes_written += received_len;
+    }
+  }
+
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+
+  if ((err == ESP_OK) && (bytes_written == 0)) {
+    err = ESP_ERR_INVALID_SIZE;
+  }
+  if (err == ESP_OK) {
+    ESP_LOGD(TAG, "Wrote a %zu byte sound pack", bytes_written);
+  }
+
+  return err;
+}
+
+void SoundPack::update_task_(void *params) {
+  SoundPack *this_pack = (SoundPack *) params;
+
+  esp_err_t err = this_pack->download_(this_pack->update_url_);
+  if (err == ESP_OK) {
+    err = this_pack->map_(this_pack->updated_pack_);
+  }
+
+  // Hand the mapped pack to the main loop, which installs it
+  this_pack->update_result_ = err;
+  this_pack->update_finished_.store(true, std::memory_order_release);
+
+  vTaskDelete(nullptr);
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
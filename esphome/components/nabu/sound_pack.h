@@ -0,0 +1,114 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "esphome/components/media_player/media_player.h"
+
+#include <esp_partition.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+enum class SoundPackState : uint8_t {
+  UNAVAILABLE = 0,  // The partition is missing or doesn't hold a valid pack
+  READY,
+  UPDATING,
+};
+
+// Sounds stored in a dedicated data partition instead of the application image, so they can be changed without an OTA
+// update. The partition is memory-mapped, and the sounds play straight from the flash mapping without a RAM copy.
+//
+// Pack format (little endian):
+//  - Header (16 bytes): magic "NSPK", uint16 version, uint16 sound count, uint32 length of the index and payloads,
+//    uint32 CRC32 of the index and payloads
+//  - Index: a 12 byte entry per sound, ordered by sound ID: uint32 payload offset from the start of the pack, uint32
+//    payload length, uint8 MediaFileType, and 3 reserved bytes
+//  - Payloads: FLAC, MP3, WAV, or pre-rendered PCM files, each starting on a 4 byte boundary
+//
+// Updates download and validate the new pack in a task. The task never touches the installed pack; it hands over a
+// mapped and validated pack that ``loop`` installs on the main loop, where the sounds are looked up.
+class SoundPack {
+ public:
+  explicit SoundPack(const std::string &partition_label) : partition_label_(partition_label) {}
+  ~SoundPack();
+
+  /// @brief Maps the partition and validates the pack in it
+  /// @return ESP_OK if the pack is ready, ESP_ERR_NOT_FOUND if there is no partition with the label,
+  /// ESP_ERR_INVALID_CRC or ESP_ERR_INVALID_VERSION if the partition doesn't hold a valid pack, or an error mapping it
+  esp_err_t load();
+
+  /// @brief Installs the new pack once an update task finishes. Call it from the main loop.
+  void loop();
+
+  /// @brief Gets a sound by its ID, which is its position in the pack's index
+  /// @param sound_id the sound's ID
+  /// @return pointer to the sound's media file, or nullptr if the pack isn't ready or doesn't have the ID
+  media_player::MediaFile *get_file(uint16_t sound_id);
+
+  /// @brief Whether a media file points at a sound in the currently mapped pack
+  bool contains(const media_player::MediaFile *media_file) const;
+
+  /// @brief Unmaps the pack and starts a task that downloads a new pack into the partition. The task validates and
+  /// maps the new pack, and ``loop`` installs it. None of the pack's sounds may be playing.
+  /// @param url location of the new pack
+  /// @return ESP_OK if the update started, ESP_ERR_INVALID_STATE if an update is already running, ESP_ERR_NOT_FOUND if
+  /// there is no partition, or ESP_ERR_NO_MEM if the task couldn't be created
+  esp_err_t start_update(const std::string &url);
+
+  SoundPackState get_state() const { return this->state_; }
+
+  /// @brief Number of sounds in the pack; 0 unless it is ready
+  size_t get_count() const { return (this->state_ == SoundPackState::READY) ? this->pack_.files.size() : 0; }
+
+ protected:
+  struct MappedPack {
+    esp_partition_mmap_handle_t mmap_handle{};
+    const uint8_t *data{nullptr};
+    // Indexed by sound ID; each points into the flash mapping
+    std::vector<media_player::MediaFile> files;
+  };
+
+  /// @brief Maps the partition and validates the pack in it. Only reads the partition, so the update task can use it.
+  /// @param pack set to the mapped pack if successful; left unmapped otherwise
+  /// @return ESP_OK if successful, an esp_err_t error code as described for ``load`` otherwise
+  esp_err_t map_(MappedPack &pack) const;
+
+  /// @brief Unmaps a pack and forgets its sounds
+  static void unmap_(MappedPack &pack);
+
+  /// @brief Unmaps the installed pack
+  void unload_();
+
+  /// @brief Downloads a pack into the partition, erasing each sector just before it is written
+  /// @param url location of the pack
+  /// @return ESP_OK if the whole pack was written, an esp_err_t error code otherwise
+  esp_err_t download_(const std::string &url);
+
+  static void update_task_(void *params);
+
+  std::string partition_label_;
+  const esp_partition_t *partition_{nullptr};
+
+  // Only used on the main loop
+  MappedPack pack_;
+  SoundPackState state_{SoundPackState::UNAVAILABLE};
+
+  std::string update_url_{};
+  TaskHandle_t update_task_handle_{nullptr};
+
+  // Written by the update task before it sets update_finished_, and read by loop after seeing it set
+  MappedPack updated_pack_;
+  esp_err_t update_result_{ESP_OK};
+  std::atomic<bool> update_finished_{false};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
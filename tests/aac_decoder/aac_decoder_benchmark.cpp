@@ -0,0 +1,223 @@
+// Host benchmark for the nabu AAC path. Demuxes and decodes each ADTS (.aac) and M4A (.m4a) stream in the given
+// directories the way AudioDecoder::decode_aac_ does, and reports the CPU time spent per second of audio.
+//
+// Usage: aac_decoder_benchmark <directory>...
+
+#include "esphome/components/nabu/m4a_demuxer.cpp"
+
+#include <libhelix-aac/aacdec.h>
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using esphome::nabu::M4ADemuxer;
+using esphome::nabu::M4ADemuxerResult;
+
+namespace {
+
+static const size_t ADTS_HEADER_SIZE = 7;
+// An AAC frame decodes to 1024 samples per channel, doubled when HE-AAC's spectral band replication is used
+static const size_t MAX_AAC_FRAME_OUTPUT_SAMPLES = 2048 * 2;
+
+struct DecodeOutcome {
+  bool ok{false};
+  std::string error;
+  uint64_t samples{0};  // Decoded samples across all channels
+  uint32_t channels{0};
+  uint32_t sample_rate{0};
+  uint32_t corrupt_frames{0};
+};
+
+// Decodes the whole stream from memory. The decoder reads the frames in place, like it does from the input buffer.
+DecodeOutcome decode(std::vector<uint8_t> &data, bool m4a) {
+  DecodeOutcome outcome;
+  HAACDecoder decoder = AACInitDecoder();
+  if (decoder == nullptr) {
+    outcome.error = "can't allocate the decoder";
+    return outcome;
+  }
+
+  M4ADemuxer demuxer;
+  bool raw_block_params_set = false;
+  int16_t output[MAX_AAC_FRAME_OUTPUT_SAMPLES];
+  size_t position = 0;
+
+  while (position < data.size()) {
+    size_t available = data.size() - position;
+    size_t frame_length = 0;
+
+    if (m4a) {
+      size_t bytes_consumed = 0;
+      M4ADemuxerResult result = demuxer.parse(data.data() + position, available, &bytes_consumed);
+      position += bytes_consumed;
+      if (result == M4ADemuxerResult::CONTINUE) {
+        continue;
+      }
+      if (result == M4ADemuxerResult::END_OF_STREAM) {
+        break;
+      }
+      if (result == M4ADemuxerResult::NEED_MORE_DATA) {
+        outcome.error = "the file ends inside a box";
+        break;
+      }
+      if (result != M4ADemuxerResult::SAMPLE_READY) {
+        outcome.error = "the demuxer failed at byte " + std::to_string(position);
+        break;
+      }
+      if (!raw_block_params_set) {
+        // MP4 stores raw AAC blocks without ADTS headers, so the decoder needs the track's configuration
+        AACFrameInfo frame_info{};
+        frame_info.nChans = demuxer.get_channels();
+        frame_info.sampRateCore = demuxer.get_sample_rate();
+        frame_info.profile = AAC_PROFILE_LC;
+        if (AACSetRawBlockParams(decoder, 0, &frame_info) != 0) {
+          outcome.error = "the track's configuration was rejected";
+          break;
+        }
+        raw_block_params_set = true;
+      }
+      frame_length = demuxer.get_sample_size();
+    } else {
+      int offset = AACFindSyncWord(data.data() + position, static_cast<int>(available));
+      if (offset < 0) {
+        break;
+      }
+      position += offset;
+      if (data.size() - position < ADTS_HEADER_SIZE) {
+        break;
+      }
+      const uint8_t *header = data.data() + position;
+      frame_length = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+      if (frame_length < ADTS_HEADER_SIZE) {
+        ++position;
+        continue;
+      }
+    }
+
+    if (data.size() - position < frame_length) {
+      // A truncated last frame
+      break;
+    }
+
+    uint8_t *input = data.data() + position;
+    int bytes_left = static_cast<int>(frame_length);
+    int err = AACDecode(decoder, &input, &bytes_left, output);
+    position += frame_length;
+    if (m4a) {
+      demuxer.sample_consumed();
+    }
+    if (err) {
+      ++outcome.corrupt_frames;
+      continue;
+    }
+
+    AACFrameInfo frame_info;
+    AACGetLastFrameInfo(decoder, &frame_info);
+    outcome.samples += frame_info.outputSamps;
+    outcome.channels = frame_info.nChans;
+    outcome.sample_rate = frame_info.sampRateOut;
+  }
+
+  AACFreeDecoder(decoder);
+  if (outcome.error.empty()) {
+    if (outcome.samples == 0) {
+      outcome.error = "no audio was decoded";
+    } else {
+      outcome.ok = true;
+    }
+  }
+  return outcome;
+}
+
+bool read_file(const std::string &path, std::vector<uint8_t> &data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+bool has_extension(const std::string &name, const char *extension) {
+  size_t length = strlen(extension);
+  return (name.size() > length) && (name.compare(name.size() - length, length, extension) == 0);
+}
+
+std::vector<std::string> list_streams(const std::string &directory) {
+  std::vector<std::string> names;
+  if (DIR *dir = opendir(directory.c_str())) {
+    while (dirent *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (has_extension(name, ".aac") || has_extension(name, ".m4a")) {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <directory>...\n", argv[0]);
+    return 2;
+  }
+
+  int failures = 0;
+  int streams = 0;
+  double total_cpu_seconds = 0.0;
+  double total_audio_seconds = 0.0;
+  for (int i = 1; i < argc; ++i) {
+    std::string directory = argv[i];
+    for (const auto &name : list_streams(directory)) {
+      std::vector<uint8_t> data;
+      if (!read_file(directory + "/" + name, data)) {
+        printf("FAIL %s: can't read the file\n", name.c_str());
+        ++failures;
+        continue;
+      }
+      ++streams;
+      bool m4a = has_extension(name, ".m4a");
+
+      const int repetitions = 20;
+      DecodeOutcome outcome;
+      double cpu_seconds = 0.0;
+      for (int repetition = 0; repetition < repetitions; ++repetition) {
+        auto start = std::chrono::steady_clock::now();
+        outcome = decode(data, m4a);
+        cpu_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!outcome.ok) {
+          break;
+        }
+      }
+      if (!outcome.ok) {
+        printf("FAIL %s: %s\n", name.c_str(), outcome.error.c_str());
+        ++failures;
+        continue;
+      }
+
+      cpu_seconds /= repetitions;
+      double audio_seconds = static_cast<double>(outcome.samples) / outcome.channels / outcome.sample_rate;
+      total_cpu_seconds += cpu_seconds;
+      total_audio_seconds += audio_seconds;
+      printf("%-36s %7.1f ms audio, %6.2f ms CPU per second of audio, %4u corrupt frames\n", name.c_str(),
+             1000.0 * audio_seconds, 1000.0 * cpu_seconds / audio_seconds, outcome.corrupt_frames);
+    }
+  }
+
+  if (total_audio_seconds > 0.0) {
+    printf("%d streams, %.2f ms CPU per second of audio overall\n", streams - failures,
+           1000.0 * total_cpu_seconds / total_audio_seconds);
+  }
+  return ((failures > 0) || (streams == 0)) ? 1 : 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Builds the AAC decoding host benchmark against the libhelix AAC sources and runs it on the given directories of .aac
+# and .m4a streams. Without arguments, it encodes the device's sounds with ffmpeg and benchmarks those.
+#
+# The libhelix sources come from the arduino-libhelix version the component pins. Set LIBHELIX_DIR to use an existing
+# checkout instead of cloning it.
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+ROOT="$(cd "$HERE/../.." && pwd)"
+BUILD="${BUILD_DIR:-$HERE/build}"
+# Keep in sync with the version in esphome/components/nabu/media_player.py
+LIBHELIX_VERSION="0.8.6"
+
+mkdir -p "$BUILD"
+if [ -z "$LIBHELIX_DIR" ]; then
+  LIBHELIX_DIR="$BUILD/arduino-libhelix-$LIBHELIX_VERSION"
+  if [ ! -d "$LIBHELIX_DIR" ]; then
+    git clone --quiet --depth 1 --branch "v$LIBHELIX_VERSION" https://github.com/pschatzmann/arduino-libhelix \
+      "$LIBHELIX_DIR"
+  fi
+fi
+
+# The benchmark only needs the AAC decoder from the library
+mkdir -p "$BUILD/libhelix-aac"
+for source in "$LIBHELIX_DIR"/src/libhelix-aac/*.c; do
+  ${CC:-gcc} -O2 -w -I"$LIBHELIX_DIR/src" -I"$LIBHELIX_DIR/src/libhelix-aac" -c "$source" \
+    -o "$BUILD/libhelix-aac/$(basename "${source%.c}").o"
+done
+${CXX:-g++} -std=gnu++17 -O2 -Wall -DUSE_ESP_IDF -I"$HERE/stubs" -I"$ROOT" -I"$LIBHELIX_DIR/src" \
+  "$HERE/aac_decoder_benchmark.cpp" "$BUILD"/libhelix-aac/*.o -o "$BUILD/aac_decoder_benchmark"
+
+if [ $# -eq 0 ]; then
+  mkdir -p "$BUILD/vectors"
+  for sound in "$ROOT"/sounds/*.flac "$ROOT"/sounds/*.mp3; do
+    name="$(basename "${sound%.*}")"
+    ffmpeg -loglevel error -y -i "$sound" -c:a aac -b:a 128k "$BUILD/vectors/$name.aac"
+    ffmpeg -loglevel error -y -i "$sound" -c:a aac -b:a 128k -movflags +faststart "$BUILD/vectors/$name.m4a"
+  done
+  set -- "$BUILD/vectors"
+fi
+"$BUILD/aac_decoder_benchmark" "$@"
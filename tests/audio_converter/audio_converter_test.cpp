@@ -0,0 +1,183 @@
+// Host test for the nabu WAV sample format converters. Compares each unrolled converter, to 16 or 32 bit output, against
+// a one sample at a time reference on edge values and random samples, for every length that exercises the tail loop
+// and for unaligned input.
+//
+// Usage: audio_converter_test
+
+#include "esphome/components/nabu/audio_converter.cpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+using esphome::nabu::convert_f32_to_s16;
+using esphome::nabu::convert_f32_to_s32;
+using esphome::nabu::convert_s24_to_s16;
+using esphome::nabu::convert_s24_to_s32;
+using esphome::nabu::convert_s32_to_s16;
+using esphome::nabu::convert_u8_to_s16;
+
+namespace {
+
+template<typename T> using Converter = void (*)(const uint8_t *, T *, size_t);
+template<typename T> using Reference = T (*)(const uint8_t *);
+
+int16_t reference_u8(const uint8_t *sample) { return static_cast<int16_t>((sample[0] - 128) * 256); }
+
+int16_t reference_s24(const uint8_t *sample) {
+  int32_t value = sample[0] | (sample[1] << 8) | (static_cast<int8_t>(sample[2]) * 65536);
+  return static_cast<int16_t>(value >> 8);
+}
+
+int16_t reference_s32(const uint8_t *sample) {
+  int32_t value;
+  std::memcpy(&value, sample, sizeof(value));
+  return static_cast<int16_t>(value >> 16);
+}
+
+int16_t reference_f32(const uint8_t *sample) {
+  float value;
+  std::memcpy(&value, sample, sizeof(value));
+  if (std::isnan(value)) {
+    return 0;
+  }
+  double scaled = static_cast<double>(value) * 32768.0;
+  if (scaled >= 32767.0) {
+    return 32767;
+  }
+  if (scaled <= -32768.0) {
+    return -32768;
+  }
+  return static_cast<int16_t>(std::trunc(scaled));
+}
+
+int32_t reference_s24_to_s32(const uint8_t *sample) {
+  int32_t value = sample[0] | (sample[1] << 8) | (static_cast<int8_t>(sample[2]) * 65536);
+  return value * 256;
+}
+
+int32_t reference_f32_to_s32(const uint8_t *sample) {
+  float value;
+  std::memcpy(&value, sample, sizeof(value));
+  if (std::isnan(value)) {
+    return 0;
+  }
+  double scaled = static_cast<double>(value) * 2147483648.0;
+  if (scaled >= 2147483647.0) {
+    return INT32_MAX;
+  }
+  if (scaled <= -2147483648.0) {
+    return INT32_MIN;
+  }
+  return static_cast<int32_t>(std::trunc(scaled));
+}
+
+void append_bytes(std::vector<uint8_t> &samples, const void *value, size_t bytes_per_sample) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(value);
+  samples.insert(samples.end(), bytes, bytes + bytes_per_sample);
+}
+
+// Edge values for each format, followed by random samples
+std::vector<uint8_t> make_samples(const std::string &format, size_t bytes_per_sample, size_t count) {
+  std::vector<uint8_t> samples;
+  if (format == "u8") {
+    for (uint8_t value : {0x00, 0x01, 0x7F, 0x80, 0x81, 0xFE, 0xFF}) {
+      append_bytes(samples, &value, 1);
+    }
+  } else if (format == "s24" || format == "s32") {
+    for (int64_t value : {INT32_MIN, INT32_MIN + 1, -65536, -65535, -1, 0, 1, 65535, 65536, INT32_MAX - 1, INT32_MAX}) {
+      // Little endian, so the 24 bit formats take the value's low three bytes
+      int32_t word = static_cast<int32_t>(value);
+      if (format == "s24") {
+        word = static_cast<int32_t>(value >> 8);
+      }
+      append_bytes(samples, &word, bytes_per_sample);
+    }
+  } else {
+    const float infinity = std::numeric_limits<float>::infinity();
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const float signaling_nan = std::numeric_limits<float>::signaling_NaN();
+    const float denormal = std::numeric_limits<float>::denorm_min();
+    for (float value : {-1.0f, 1.0f, 0.0f, -0.0f, 0.99997f, -0.99997f, 1.5f, -1.5f, 1e30f, -1e30f, infinity, -infinity,
+                        nan, -nan, signaling_nan, denormal, 1.0f / 32768.0f, -1.0f / 32768.0f, 32767.0f / 32768.0f,
+                        32767.5f / 32768.0f}) {
+      append_bytes(samples, &value, sizeof(value));
+    }
+  }
+
+  std::mt19937 generator(12345);
+  while (samples.size() < count * bytes_per_sample) {
+    if (format == "f32") {
+      // Mostly in range, some out of range
+      float value = std::uniform_real_distribution<float>(-1.25f, 1.25f)(generator);
+      append_bytes(samples, &value, sizeof(value));
+    } else {
+      samples.push_back(static_cast<uint8_t>(generator()));
+    }
+  }
+  samples.resize(count * bytes_per_sample);
+  return samples;
+}
+
+template<typename T>
+int check(const char *name, const char *format, Converter<T> converter, Reference<T> reference,
+          size_t bytes_per_sample) {
+  static const size_t MAX_SAMPLES = 1024;
+  std::vector<uint8_t> samples = make_samples(format, bytes_per_sample, MAX_SAMPLES);
+
+  int failures = 0;
+  // Every length up to a few unrolled iterations, then one long run; each at every input alignment
+  std::vector<size_t> lengths;
+  for (size_t length = 0; length <= 13; ++length) {
+    lengths.push_back(length);
+  }
+  lengths.push_back(MAX_SAMPLES - 3);
+
+  for (size_t length : lengths) {
+    for (size_t offset = 0; offset < 4; ++offset) {
+      for (size_t start = 0; start + length <= MAX_SAMPLES; start += (length > 0) ? length : MAX_SAMPLES) {
+        std::vector<uint8_t> input(offset + length * bytes_per_sample + 1);
+        std::memcpy(input.data() + offset, samples.data() + start * bytes_per_sample, length * bytes_per_sample);
+
+        // The guard sample after the output must stay untouched
+        std::vector<T> output(length + 1, 0x5A5A);
+        converter(input.data() + offset, output.data(), length);
+
+        for (size_t i = 0; i < length; ++i) {
+          T expected = reference(input.data() + offset + i * bytes_per_sample);
+          if (output[i] != expected) {
+            if (failures < 10) {
+              printf("FAIL %s: sample %zu of %zu (offset %zu) is %ld, expected %ld\n", name, start + i, length,
+                     offset, static_cast<long>(output[i]), static_cast<long>(expected));
+            }
+            ++failures;
+          }
+        }
+        if (output[length] != 0x5A5A) {
+          printf("FAIL %s: wrote past %zu samples\n", name, length);
+          ++failures;
+        }
+      }
+    }
+  }
+
+  printf("%s %s\n", (failures == 0) ? "ok  " : "FAIL", name);
+  return failures;
+}
+
+}  // namespace
+
+int main() {
+  int failures = 0;
+  failures += check("u8", "u8", convert_u8_to_s16, reference_u8, 1);
+  failures += check("s24", "s24", convert_s24_to_s16, reference_s24, 3);
+  failures += check("s32", "s32", convert_s32_to_s16, reference_s32, 4);
+  failures += check("f32", "f32", convert_f32_to_s16, reference_f32, 4);
+  failures += check("s24 to s32", "s24", convert_s24_to_s32, reference_s24_to_s32, 3);
+  failures += check("f32 to s32", "f32", convert_f32_to_s32, reference_f32_to_s32, 4);
+  return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+# Builds the WAV sample format converter host test and runs it. The undefined behaviour sanitizer turns invalid float
+# to integer conversions, such as NaN samples, into failures.
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+ROOT="$(cd "$HERE/../.." && pwd)"
+BUILD="${BUILD_DIR:-$HERE/build}"
+
+mkdir -p "$BUILD"
+${CXX:-g++} -std=gnu++17 -O2 -Wall -fsanitize=undefined,float-cast-overflow -fno-sanitize-recover=all \
+  -DUSE_ESP_IDF -I"$ROOT" \
+  "$HERE/audio_converter_test.cpp" -o "$BUILD/audio_converter_test"
+"$BUILD/audio_converter_test"
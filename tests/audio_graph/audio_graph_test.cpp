@@ -0,0 +1,385 @@
+// Host test and benchmark for the nabu audio graph. Runs a source, a chain of gain stages, and a sink over the same
+// audio with all the stages in one task, with each stage in its own task, and with direct ports in one task. Checks
+// that each produces exactly what a plain loop does, that a format the reader doesn't accept fails the writer, and
+// reports the time per sample against the plain loop along with how often the stages were stepped.
+//
+// Usage: audio_graph_test
+
+#include "esphome/components/nabu/audio_graph.cpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+using esphome::audio::AudioStreamInfo;
+using esphome::nabu::AudioGraph;
+using esphome::nabu::AudioPort;
+using esphome::nabu::AudioStage;
+using esphome::nabu::FormatMismatch;
+using esphome::nabu::PortConstraint;
+using esphome::nabu::PortFormat;
+using esphome::nabu::StageAwait;
+
+namespace {
+
+static const uint32_t SAMPLE_RATE = 48000;
+static const uint8_t CHANNELS = 2;
+static const size_t GAIN_STAGES = 2;
+static const size_t BLOCK_SAMPLES = 512;
+static const size_t BLOCK_BYTES = BLOCK_SAMPLES * sizeof(int16_t);
+static const size_t PORT_BUFFER_SIZE = 8192;
+// Gains in Q15, one per gain stage
+static const std::array<int32_t, GAIN_STAGES> GAINS = {26214, 19661};
+
+enum class Layout : uint8_t {
+  ONE_TASK,
+  TASK_PER_STAGE,
+  DIRECT,
+};
+
+const char *layout_to_string(Layout layout) {
+  switch (layout) {
+    case Layout::ONE_TASK:
+      return "one task";
+    case Layout::TASK_PER_STAGE:
+      return "task per stage";
+    case Layout::DIRECT:
+      return "direct ports";
+  }
+  return "unknown";
+}
+
+PortFormat stereo_format(uint32_t sample_rate) {
+  AudioStreamInfo stream_info;
+  stream_info.bits_per_sample = 16;
+  stream_info.channels = CHANNELS;
+  stream_info.sample_rate = sample_rate;
+  return PortFormat::pcm(stream_info);
+}
+
+int16_t apply_gain(int16_t sample, int32_t gain) { return static_cast<int16_t>((sample * gain) >> 15); }
+
+// Steps of every stage, to compare how often each layout resumes its stages
+std::atomic<uint64_t> step_count{0};
+
+// Writes what is left of a block, the way the pipeline's stages do, and waits for room for the rest. On a direct port,
+// the first write offers the block and the following ones report how much of it the reader took.
+StageAwait write_pending(AudioPort *port, const uint8_t *&data, size_t &length) {
+  size_t bytes_written = port->write(data, length);
+  data += bytes_written;
+  length -= bytes_written;
+  return (length > 0) ? StageAwait::output(0, length) : StageAwait::ready();
+}
+
+class SourceStage : public AudioStage {
+ public:
+  SourceStage(const std::vector<int16_t> *samples, uint32_t sample_rate)
+      : samples_(samples), sample_rate_(sample_rate) {}
+
+  esp_err_t start() override {
+    this->position_ = 0;
+    this->pending_length_ = 0;
+    return this->set_output_format_(0, stereo_format(this->sample_rate_));
+  }
+
+  StageAwait step() override {
+    step_count.fetch_add(1, std::memory_order_relaxed);
+    if (this->pending_length_ == 0) {
+      if (this->position_ == this->samples_->size()) {
+        return StageAwait::finished();
+      }
+      size_t samples = std::min(BLOCK_SAMPLES, this->samples_->size() - this->position_);
+      this->pending_data_ = reinterpret_cast<const uint8_t *>(this->samples_->data() + this->position_);
+      this->pending_length_ = samples * sizeof(int16_t);
+      this->position_ += samples;
+    }
+    return write_pending(this->get_output(0), this->pending_data_, this->pending_length_);
+  }
+
+ protected:
+  const std::vector<int16_t> *samples_;
+  uint32_t sample_rate_;
+  size_t position_{0};
+  const uint8_t *pending_data_{nullptr};
+  size_t pending_length_{0};
+};
+
+class GainStage : public AudioStage {
+ public:
+  void set_gain(int32_t gain) { this->gain_ = gain; }
+  FormatMismatch get_mismatch() const { return this->mismatch_; }
+
+  esp_err_t start() override {
+    this->pending_length_ = 0;
+    return this->set_output_format_(0, this->get_input(0)->get_format(), &this->mismatch_);
+  }
+
+  StageAwait step() override {
+    step_count.fetch_add(1, std::memory_order_relaxed);
+    AudioPort *input = this->get_input(0);
+
+    if (this->pending_length_ > 0) {
+      return write_pending(this->get_output(0), this->pending_data_, this->pending_length_);
+    }
+    if (input->is_finished()) {
+      return StageAwait::finished();
+    }
+
+    const size_t frame_size = input->get_format().get_frame_size();
+    size_t bytes = std::min(input->available(), sizeof(this->buffer_));
+    bytes = input->read(this->buffer_.data(), bytes - bytes % frame_size);
+    if (bytes == 0) {
+      return StageAwait::input(0, BLOCK_BYTES);
+    }
+
+    for (size_t i = 0; i < bytes / sizeof(int16_t); ++i) {
+      this->buffer_[i] = apply_gain(this->buffer_[i], this->gain_);
+    }
+    this->pending_data_ = reinterpret_cast<const uint8_t *>(this->buffer_.data());
+    this->pending_length_ = bytes;
+    return write_pending(this->get_output(0), this->pending_data_, this->pending_length_);
+  }
+
+ protected:
+  int32_t gain_{32768};
+  FormatMismatch mismatch_{FormatMismatch::NONE};
+  std::array<int16_t, BLOCK_SAMPLES> buffer_;
+  const uint8_t *pending_data_{nullptr};
+  size_t pending_length_{0};
+};
+
+class SinkStage : public AudioStage {
+ public:
+  const std::vector<int16_t> &get_samples() const { return this->samples_; }
+
+  void reserve(size_t samples) { this->samples_.reserve(samples); }
+
+  esp_err_t start() override {
+    this->samples_.clear();
+    return ESP_OK;
+  }
+
+  StageAwait step() override {
+    step_count.fetch_add(1, std::memory_order_relaxed);
+    AudioPort *input = this->get_input(0);
+    if (input->is_finished()) {
+      return StageAwait::finished();
+    }
+
+    // A direct port's data is used in place
+    size_t length = 0;
+    const uint8_t *data = input->peek(length);
+    if (data != nullptr) {
+      this->append_(data, length);
+      input->consume(length);
+      return StageAwait::ready();
+    }
+
+    std::array<uint8_t, PORT_BUFFER_SIZE> buffer;
+    length = std::min(input->available(), buffer.size());
+    length = input->read(buffer.data(), length - length % input->get_format().get_frame_size());
+    if (length == 0) {
+      return StageAwait::input(0, BLOCK_BYTES);
+    }
+    this->append_(buffer.data(), length);
+    return StageAwait::ready();
+  }
+
+ protected:
+  void append_(const uint8_t *data, size_t length) {
+    size_t position = this->samples_.size();
+    this->samples_.resize(position + length / sizeof(int16_t));
+    std::memcpy(this->samples_.data() + position, data, length);
+  }
+
+  std::vector<int16_t> samples_;
+};
+
+// A source, the gain stages, and a sink connected in a line. The graph's tasks can't be deleted on the host, so a
+// chain stays allocated until the test exits.
+struct Chain {
+  Chain(const std::vector<int16_t> *samples, uint32_t sample_rate) : source(samples, sample_rate) {}
+
+  AudioGraph graph;
+  SourceStage source;
+  std::array<GainStage, GAIN_STAGES> gains;
+  SinkStage sink;
+  std::array<AudioPort, GAIN_STAGES + 1> ports;
+};
+
+Chain *build_chain(Layout layout, const std::vector<int16_t> *samples, uint32_t source_sample_rate) {
+  Chain *chain = new Chain(samples, source_sample_rate);
+  AudioGraph &graph = chain->graph;
+
+  const size_t task_count = (layout == Layout::TASK_PER_STAGE) ? (GAIN_STAGES + 2) : 1;
+  for (size_t i = 0; i < task_count; ++i) {
+    graph.add_task("", 4096);
+  }
+
+  std::array<AudioStage *, GAIN_STAGES + 2> stages;
+  stages[0] = &chain->source;
+  for (size_t i = 0; i < GAIN_STAGES; ++i) {
+    chain->gains[i].set_gain(GAINS[i]);
+    stages[i + 1] = &chain->gains[i];
+  }
+  stages[GAIN_STAGES + 1] = &chain->sink;
+  for (size_t i = 0; i < stages.size(); ++i) {
+    graph.add_stage(stages[i], (layout == Layout::TASK_PER_STAGE) ? i : 0);
+  }
+
+  for (size_t i = 0; i < chain->ports.size(); ++i) {
+    AudioPort &port = chain->ports[i];
+    // Only the sink needs a particular sample rate
+    const uint32_t sample_rate = (i + 1 == chain->ports.size()) ? SAMPLE_RATE : 0;
+    port.set_constraint(PortConstraint::pcm(16, CHANNELS, CHANNELS, sample_rate));
+    if (layout == Layout::DIRECT) {
+      port.set_direct(true);
+    } else if (port.allocate(PORT_BUFFER_SIZE) != ESP_OK) {
+      return nullptr;
+    }
+    graph.connect_output(stages[i], 0, &port);
+    graph.connect_input(stages[i + 1], 0, &port);
+  }
+
+  chain->sink.reserve(samples->size());
+  if (graph.create_tasks("graph", 1) != ESP_OK) {
+    return nullptr;
+  }
+  return chain;
+}
+
+// Runs the chain once and waits until every stage finished
+bool run_chain(Chain *chain) {
+  if (chain->graph.start() != ESP_OK) {
+    return false;
+  }
+  while (!chain->graph.is_idle()) {
+    std::this_thread::sleep_for(std::chrono::microseconds(20));
+  }
+  // Resets the ports' streams for the next run
+  return chain->graph.stop(1000) == ESP_OK;
+}
+
+std::vector<int16_t> plain_loop(const std::vector<int16_t> &input) {
+  std::vector<int16_t> output(input.size());
+  for (size_t i = 0; i < input.size(); ++i) {
+    int16_t sample = input[i];
+    for (int32_t gain : GAINS) {
+      sample = apply_gain(sample, gain);
+    }
+    output[i] = sample;
+  }
+  return output;
+}
+
+template<typename Function> double min_seconds(int repetitions, Function function) {
+  double best = 0.0;
+  for (int repetition = 0; repetition < repetitions; ++repetition) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if ((repetition == 0) || (seconds < best)) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+int failures = 0;
+
+void check(bool condition, const char *name) {
+  printf("%s %s\n", condition ? "ok  " : "FAIL", name);
+  if (!condition) {
+    ++failures;
+  }
+}
+
+}  // namespace
+
+int main() {
+  // Ten seconds of stereo noise, plus a few frames so the last block is a partial one
+  std::vector<int16_t> input((10 * SAMPLE_RATE + 3) * CHANNELS);
+  std::mt19937 generator(1);
+  std::uniform_int_distribution<int> distribution(INT16_MIN, INT16_MAX);
+  for (auto &sample : input) {
+    sample = static_cast<int16_t>(distribution(generator));
+  }
+
+  const int repetitions = 5;
+  std::vector<int16_t> expected;
+  double loop_seconds = min_seconds(repetitions, [&]() { expected = plain_loop(input); });
+
+  struct Timing {
+    Layout layout;
+    double seconds;
+    double steps_per_block;
+  };
+  std::vector<Timing> timings;
+  const double blocks = static_cast<double>(input.size()) / BLOCK_SAMPLES;
+  for (Layout layout : {Layout::ONE_TASK, Layout::TASK_PER_STAGE, Layout::DIRECT}) {
+    std::string name = std::string(layout_to_string(layout)) + ": output matches the plain loop";
+    Chain *chain = build_chain(layout, &input, SAMPLE_RATE);
+    if (chain == nullptr) {
+      check(false, name.c_str());
+      continue;
+    }
+
+    bool ran = true;
+    step_count.store(0, std::memory_order_relaxed);
+    double seconds = min_seconds(repetitions, [&]() { ran = run_chain(chain) && ran; });
+    check(ran && (chain->sink.get_samples() == expected), name.c_str());
+    const double steps = static_cast<double>(step_count.load(std::memory_order_relaxed)) / repetitions;
+    timings.push_back({layout, seconds, steps / blocks});
+  }
+
+  // The last port only accepts SAMPLE_RATE, so the last gain stage must refuse the source's rate and stop the graph
+  // before the sink starts
+  Chain *mismatched = build_chain(Layout::ONE_TASK, &input, SAMPLE_RATE / 2);
+  if (mismatched == nullptr) {
+    check(false, "a rejected format fails the writer");
+  } else {
+    const GainStage &last_gain = mismatched->gains[GAIN_STAGES - 1];
+    bool started = mismatched->graph.start() == ESP_OK;
+    while (started && !mismatched->graph.is_idle()) {
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+    check(started && mismatched->graph.has_stage_failed(&last_gain) &&
+              (last_gain.get_mismatch() == FormatMismatch::SAMPLE_RATE) &&
+              !mismatched->graph.has_stage_failed(&mismatched->sink) && mismatched->sink.get_samples().empty(),
+          "a rejected format fails the writer");
+    check((mismatched->graph.stop(1000) == ESP_OK) && !mismatched->graph.has_stage_failed(&last_gain),
+          "stopping clears the failure");
+  }
+
+  // A reader that also takes higher precision audio accepts either sample size but no other, and has no fixed format
+  PortConstraint wide = PortConstraint::pcm(16, CHANNELS, CHANNELS, SAMPLE_RATE);
+  wide.wide_bits_per_sample = 32;
+  auto format_with_bits = [](uint8_t bits_per_sample) {
+    AudioStreamInfo stream_info;
+    stream_info.bits_per_sample = bits_per_sample;
+    stream_info.channels = CHANNELS;
+    stream_info.sample_rate = SAMPLE_RATE;
+    return PortFormat::pcm(stream_info);
+  };
+  PortFormat fixed;
+  check((wide.check(format_with_bits(16)) == FormatMismatch::NONE) &&
+            (wide.check(format_with_bits(32)) == FormatMismatch::NONE) &&
+            (wide.check(format_with_bits(24)) == FormatMismatch::BITS_PER_SAMPLE) && !wide.get_fixed_format(fixed),
+        "a wide constraint accepts both sample sizes");
+
+  const double samples = static_cast<double>(input.size());
+  printf("%-16s %8.2f ms, %6.2f ns per sample\n", "plain loop", 1000.0 * loop_seconds, 1e9 * loop_seconds / samples);
+  for (const Timing &timing : timings) {
+    printf("%-16s %8.2f ms, %6.2f ns per sample, %5.1fx the plain loop, %5.2f steps per block\n",
+           layout_to_string(timing.layout), 1000.0 * timing.seconds, 1e9 * timing.seconds / samples,
+           timing.seconds / loop_seconds, timing.steps_per_block);
+  }
+
+  return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+# Builds the audio graph host test and benchmark and runs it. The FreeRTOS tasks and event groups are stood in for by
+# threads and condition variables.
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+ROOT="$(cd "$HERE/../.." && pwd)"
+BUILD="${BUILD_DIR:-$HERE/build}"
+
+mkdir -p "$BUILD"
+${CXX:-g++} -std=gnu++17 -O2 -Wall -pthread -DUSE_ESP_IDF -I"$HERE/stubs" -I"$ROOT" \
+  "$HERE/audio_graph_test.cpp" -o "$BUILD/audio_graph_test"
+"$BUILD/audio_graph_test"
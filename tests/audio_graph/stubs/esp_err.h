@@ -0,0 +1,14 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF error codes the audio graph returns
+
+#include <cstdint>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_NOT_SUPPORTED 0x106
+#define ESP_ERR_TIMEOUT 0x107
@@ -0,0 +1,20 @@
+#pragma once
+
+// Host stand-in for the part of ESPHome's audio component the audio graph uses
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace audio {
+
+struct AudioStreamInfo {
+  size_t get_bytes_per_sample() const { return this->bits_per_sample / 8; }
+
+  uint8_t bits_per_sample = 16;
+  uint8_t channels = 1;
+  uint32_t sample_rate = 16000;
+};
+
+}  // namespace audio
+}  // namespace esphome
@@ -0,0 +1,20 @@
+#pragma once
+
+// Host stand-in for the part of the media player component the audio graph uses
+
+#include <cstdint>
+
+namespace esphome {
+namespace media_player {
+
+enum class MediaFileType : uint8_t {
+  NONE = 0,
+  WAV,
+  MP3,
+  FLAC,
+  AAC,
+  PCM,
+};
+
+}  // namespace media_player
+}  // namespace esphome
@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stand-in for the part of ESPHome's helpers.h the audio graph uses
+
+#include <algorithm>
+
+namespace esphome {
+
+template<typename T> T clamp(const T &value, const T &min, const T &max) { return std::max(min, std::min(value, max)); }
+
+}  // namespace esphome
@@ -0,0 +1,77 @@
+#pragma once
+
+// Host stand-in for ESPHome's ring buffer. A single reader and a single writer may use it from different threads, like
+// the FreeRTOS byte buffer it wraps on the device.
+
+#include "freertos/FreeRTOS.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace esphome {
+
+class RingBuffer {
+ public:
+  static std::unique_ptr<RingBuffer> create(size_t len) {
+    std::unique_ptr<RingBuffer> ring_buffer(new RingBuffer);
+    ring_buffer->storage_.resize(len);
+    return ring_buffer;
+  }
+
+  size_t read(void *data, size_t len, TickType_t ticks_to_wait = 0) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    len = std::min(len, this->available_);
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    for (size_t copied = 0; copied < len;) {
+      size_t chunk = std::min(len - copied, this->storage_.size() - this->read_);
+      std::memcpy(bytes + copied, this->storage_.data() + this->read_, chunk);
+      this->read_ = (this->read_ + chunk) % this->storage_.size();
+      copied += chunk;
+    }
+    this->available_ -= len;
+    return len;
+  }
+
+  size_t write_without_replacement(const void *data, size_t len, TickType_t ticks_to_wait = 0) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    len = std::min(len, this->storage_.size() - this->available_);
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    size_t write = (this->read_ + this->available_) % this->storage_.size();
+    for (size_t copied = 0; copied < len;) {
+      size_t chunk = std::min(len - copied, this->storage_.size() - write);
+      std::memcpy(this->storage_.data() + write, bytes + copied, chunk);
+      write = (write + chunk) % this->storage_.size();
+      copied += chunk;
+    }
+    this->available_ += len;
+    return len;
+  }
+
+  size_t available() const {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->available_;
+  }
+
+  size_t free() const {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->storage_.size() - this->available_;
+  }
+
+  BaseType_t reset() {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->read_ = 0;
+    this->available_ = 0;
+    return pdPASS;
+  }
+
+ protected:
+  mutable std::mutex mutex_;
+  std::vector<uint8_t> storage_;
+  size_t read_{0};
+  size_t available_{0};
+};
+
+}  // namespace esphome
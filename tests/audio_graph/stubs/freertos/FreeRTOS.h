@@ -0,0 +1,19 @@
+#pragma once
+
+// Host stand-in for the FreeRTOS types the audio graph uses. A tick is a millisecond.
+
+#include "esp_err.h"
+
+#include <cstddef>
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define portMAX_DELAY UINT32_MAX
+#define pdMS_TO_TICKS(ms) (static_cast<TickType_t>(ms))
@@ -0,0 +1,57 @@
+#pragma once
+
+// Host stand-in for FreeRTOS event groups, built on a mutex and a condition variable
+
+#include "freertos/FreeRTOS.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+typedef uint32_t EventBits_t;
+
+struct EventGroupDef_t {
+  std::mutex mutex;
+  std::condition_variable changed;
+  EventBits_t bits{0};
+};
+typedef EventGroupDef_t *EventGroupHandle_t;
+
+inline EventGroupHandle_t xEventGroupCreate() { return new EventGroupDef_t; }
+
+inline void vEventGroupDelete(EventGroupHandle_t group) { delete group; }
+
+inline EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+  std::lock_guard<std::mutex> lock(group->mutex);
+  return group->bits;
+}
+
+inline EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+  std::lock_guard<std::mutex> lock(group->mutex);
+  group->bits |= bits;
+  group->changed.notify_all();
+  return group->bits;
+}
+
+inline EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+  std::lock_guard<std::mutex> lock(group->mutex);
+  EventBits_t previous = group->bits;
+  group->bits &= ~bits;
+  return previous;
+}
+
+inline EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                       BaseType_t wait_for_all, TickType_t ticks_to_wait) {
+  std::unique_lock<std::mutex> lock(group->mutex);
+  auto satisfied = [&]() { return wait_for_all ? ((group->bits & bits) == bits) : ((group->bits & bits) != 0); };
+  if (ticks_to_wait == portMAX_DELAY) {
+    group->changed.wait(lock, satisfied);
+  } else {
+    group->changed.wait_for(lock, std::chrono::milliseconds(ticks_to_wait), satisfied);
+  }
+  EventBits_t result = group->bits;
+  if (clear_on_exit && satisfied()) {
+    group->bits &= ~bits;
+  }
+  return result;
+}
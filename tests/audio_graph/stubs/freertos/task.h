@@ -0,0 +1,32 @@
+#pragma once
+
+// Host stand-in for the FreeRTOS task functions the audio graph uses. Tasks are detached threads; they can't be
+// deleted or suspended, so the host test keeps its tasks until it exits.
+
+#include "freertos/FreeRTOS.h"
+
+#include <chrono>
+#include <thread>
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct StaticTask_t {
+  int unused;
+} StaticTask_t;
+typedef StaticTask_t *TaskHandle_t;
+
+inline TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char *name, uint32_t stack_size, void *params,
+                                      UBaseType_t priority, StackType_t *stack, StaticTask_t *tcb) {
+  std::thread(function, params).detach();
+  return tcb;
+}
+
+inline void vTaskDelete(TaskHandle_t task) {}
+inline void vTaskSuspend(TaskHandle_t task) {}
+inline void vTaskResume(TaskHandle_t task) {}
+
+// Milliseconds since an arbitrary start, matching pdMS_TO_TICKS
+inline TickType_t xTaskGetTickCount() {
+  return static_cast<TickType_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
@@ -0,0 +1,330 @@
+// Host test for the nabu FLAC decoder. Decodes every stream in the given directories while feeding the data in chunks
+// of several sizes, and compares the MD5 of the 16 bit output against the reference: the STREAMINFO MD5 for 16 bit
+// streams, or the stream's line in the directory's expected.txt (written by generate_vectors.py). Each stream is also
+// decoded to 32 bit output, which must narrow to the same 16 bit samples.
+//
+// Usage: flac_decoder_test [--benchmark] <directory>...
+
+#include "esphome/components/nabu/flac_decoder.cpp"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+using esphome::nabu::FLAC_MINIMAL_HEADER_SIZE;
+using esphome::nabu::FLACDecoder;
+using esphome::nabu::FLACDecoderResult;
+
+namespace {
+
+// Compact MD5 (RFC 1321), so the test needs nothing beyond the standard library
+class MD5 {
+ public:
+  void update(const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+      this->block_[this->length_++ % 64] = data[i];
+      if (this->length_ % 64 == 0) {
+        this->transform_();
+      }
+    }
+  }
+
+  std::string hex_digest() {
+    uint64_t bit_length = this->length_ * 8;
+    uint8_t padding = 0x80;
+    this->update(&padding, 1);
+    padding = 0;
+    while (this->length_ % 64 != 56) {
+      this->update(&padding, 1);
+    }
+    for (int i = 0; i < 8; ++i) {
+      uint8_t byte = static_cast<uint8_t>(bit_length >> (8 * i));
+      this->update(&byte, 1);
+    }
+    char hex[33];
+    for (int i = 0; i < 16; ++i) {
+      snprintf(hex + 2 * i, 3, "%02x", static_cast<unsigned>((this->state_[i / 4] >> (8 * (i % 4))) & 0xff));
+    }
+    return std::string(hex, 32);
+  }
+
+ private:
+  void transform_() {
+    static const uint32_t SHIFTS[64] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+                                        5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+                                        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+                                        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+    uint32_t words[16];
+    for (int i = 0; i < 16; ++i) {
+      words[i] = this->block_[4 * i] | (this->block_[4 * i + 1] << 8) | (this->block_[4 * i + 2] << 16) |
+                 (static_cast<uint32_t>(this->block_[4 * i + 3]) << 24);
+    }
+    uint32_t a = this->state_[0], b = this->state_[1], c = this->state_[2], d = this->state_[3];
+    for (uint32_t i = 0; i < 64; ++i) {
+      uint32_t f, g;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      uint32_t constant = static_cast<uint32_t>(std::fabs(std::sin(i + 1.0)) * 4294967296.0);
+      uint32_t sum = a + f + constant + words[g];
+      a = d;
+      d = c;
+      c = b;
+      b += (sum << SHIFTS[i]) | (sum >> (32 - SHIFTS[i]));
+    }
+    this->state_[0] += a;
+    this->state_[1] += b;
+    this->state_[2] += c;
+    this->state_[3] += d;
+  }
+
+  uint32_t state_[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  uint8_t block_[64];
+  uint64_t length_ = 0;
+};
+
+struct DecodeOutcome {
+  bool ok{false};
+  std::string error;
+  std::string md5;
+  std::string streaminfo_md5;
+  uint32_t sample_depth{0};
+  uint32_t sample_rate{0};
+  uint64_t frames{0};
+};
+
+// Decodes data as if it arrived chunk_size bytes at a time. The decoder always sees everything that has arrived but
+// not yet been consumed, like the unconsumed region of the pipeline's input buffer. The MD5 is of the output narrowed
+// to 16 bits.
+template<typename T>
+DecodeOutcome decode(const std::vector<uint8_t> &data, size_t chunk_size, bool hash_output = true) {
+  DecodeOutcome outcome;
+  FLACDecoder decoder;
+  size_t position = 0;
+  size_t available = std::min(chunk_size, data.size());
+
+  auto arrive = [&]() {
+    if (available == data.size()) {
+      return false;
+    }
+    available = std::min(available + chunk_size, data.size());
+    return true;
+  };
+
+  while (true) {
+    size_t consumed = 0;
+    FLACDecoderResult result = decoder.read_header(data.data() + position, available - position, &consumed);
+    position += consumed;
+    if (result == FLACDecoderResult::SUCCESS) {
+      break;
+    }
+    if ((result != FLACDecoderResult::OUT_OF_DATA) || !arrive()) {
+      outcome.error = "header failed with result " + std::to_string(static_cast<int>(result));
+      return outcome;
+    }
+  }
+
+  uint8_t header[FLAC_MINIMAL_HEADER_SIZE];
+  decoder.get_minimal_header(header);
+  char hex[33];
+  for (int i = 0; i < 16; ++i) {
+    snprintf(hex + 2 * i, 3, "%02x", header[8 + 18 + i]);
+  }
+  outcome.streaminfo_md5 = std::string(hex, 32);
+  outcome.sample_depth = decoder.get_sample_depth();
+  outcome.sample_rate = decoder.get_sample_rate();
+
+  std::vector<T> output(decoder.get_output_buffer_size());
+  std::vector<int16_t> narrowed(output.size());
+  MD5 md5;
+  uint64_t samples_decoded = 0;
+
+  while (true) {
+    size_t consumed = 0;
+    uint32_t output_samples = 0;
+    FLACDecoderResult result =
+        decoder.decode_frame(data.data() + position, available - position, output.data(), &consumed, &output_samples);
+    position += consumed;
+
+    if ((result == FLACDecoderResult::SUCCESS) || (result == FLACDecoderResult::END_OF_STREAM)) {
+      if (hash_output) {
+        for (uint32_t i = 0; i < output_samples; ++i) {
+          narrowed[i] = static_cast<int16_t>(output[i] >> (8 * (sizeof(T) - sizeof(int16_t))));
+        }
+        md5.update(reinterpret_cast<const uint8_t *>(narrowed.data()), output_samples * sizeof(int16_t));
+      }
+      samples_decoded += output_samples;
+      if (result == FLACDecoderResult::END_OF_STREAM) {
+        break;
+      }
+    } else if ((result != FLACDecoderResult::OUT_OF_DATA) || !arrive()) {
+      outcome.error = "frame at byte " + std::to_string(position) + " failed with result " +
+                      std::to_string(static_cast<int>(result));
+      return outcome;
+    }
+  }
+
+  uint64_t expected_samples = decoder.get_total_samples() * decoder.get_num_channels();
+  if (samples_decoded != expected_samples) {
+    outcome.error = "decoded " + std::to_string(samples_decoded) + " samples instead of " +
+                    std::to_string(expected_samples);
+    return outcome;
+  }
+
+  outcome.ok = true;
+  outcome.md5 = md5.hex_digest();
+  outcome.frames = decoder.get_total_samples();
+  return outcome;
+}
+
+bool read_file(const std::string &path, std::vector<uint8_t> &data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+std::map<std::string, std::string> read_expected(const std::string &directory) {
+  std::map<std::string, std::string> expected;
+  std::ifstream file(directory + "/expected.txt");
+  std::string name, md5;
+  while (file >> name >> md5) {
+    expected[name] = md5;
+  }
+  return expected;
+}
+
+std::vector<std::string> list_streams(const std::string &directory) {
+  std::vector<std::string> names;
+  if (DIR *dir = opendir(directory.c_str())) {
+    while (dirent *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if ((name.size() > 5) && (name.compare(name.size() - 5, 5, ".flac") == 0)) {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  bool benchmark = false;
+  std::vector<std::string> directories;
+  for (int i = 1; i < argc; ++i) {
+    std::string argument = argv[i];
+    if (argument == "--benchmark") {
+      benchmark = true;
+    } else {
+      directories.push_back(argument);
+    }
+  }
+  if (directories.empty()) {
+    fprintf(stderr, "Usage: %s [--benchmark] <directory>...\n", argv[0]);
+    return 2;
+  }
+
+  static const size_t CHUNK_SIZES[] = {SIZE_MAX, 4096, 1000, 113, 7};
+
+  int failures = 0;
+  int streams = 0;
+  for (const auto &directory : directories) {
+    auto expected = read_expected(directory);
+    for (const auto &name : list_streams(directory)) {
+      std::vector<uint8_t> data;
+      if (!read_file(directory + "/" + name, data)) {
+        printf("FAIL %s: can't read the file\n", name.c_str());
+        ++failures;
+        continue;
+      }
+      ++streams;
+
+      if (benchmark) {
+        const int repetitions = 20;
+        auto start = std::chrono::steady_clock::now();
+        DecodeOutcome outcome;
+        for (int i = 0; i < repetitions; ++i) {
+          outcome = decode<int16_t>(data, SIZE_MAX, false);
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double audio_seconds = repetitions * static_cast<double>(outcome.frames) / outcome.sample_rate;
+        printf("%-32s %6.1f ms audio, %8.1fx realtime\n", name.c_str(), 1000.0 * audio_seconds / repetitions,
+               audio_seconds / elapsed);
+        continue;
+      }
+
+      std::string reference;
+      auto line = expected.find(name);
+      if (line != expected.end()) {
+        reference = line->second;
+      }
+
+      bool passed = true;
+      for (bool wide : {false, true}) {
+        // Decode to 16 bits in every chunk size, then to 32 bits
+        for (size_t chunk_size : CHUNK_SIZES) {
+          DecodeOutcome outcome = wide ? decode<int32_t>(data, chunk_size) : decode<int16_t>(data, chunk_size);
+          std::string chunk = (chunk_size == SIZE_MAX) ? "whole file" : std::to_string(chunk_size) + " byte chunks";
+          if (wide) {
+            chunk += ", 32 bit output";
+          }
+          if (!outcome.ok) {
+            printf("FAIL %s (%s): %s\n", name.c_str(), chunk.c_str(), outcome.error.c_str());
+            passed = false;
+            break;
+          }
+          if (reference.empty()) {
+            if (outcome.sample_depth != 16) {
+              printf("FAIL %s: no expected.txt entry for a %u bit stream\n", name.c_str(), outcome.sample_depth);
+              passed = false;
+              break;
+            }
+            // The output of a 16 bit stream is the original samples, which STREAMINFO has the MD5 of
+            reference = outcome.streaminfo_md5;
+          }
+          if (outcome.md5 != reference) {
+            printf("FAIL %s (%s): output MD5 %s, expected %s\n", name.c_str(), chunk.c_str(), outcome.md5.c_str(),
+                   reference.c_str());
+            passed = false;
+            break;
+          }
+        }
+        if (!passed) {
+          break;
+        }
+      }
+      if (passed) {
+        printf("ok   %s\n", name.c_str());
+      } else {
+        ++failures;
+      }
+    }
+  }
+
+  if (!benchmark) {
+    printf("%d of %d streams passed\n", streams - failures, streams);
+  }
+  return ((failures > 0) || (streams == 0)) ? 1 : 0;
+}
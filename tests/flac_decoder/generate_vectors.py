@@ -0,0 +1,538 @@
+"""Generates the FLAC reference vectors for the nabu FLAC decoder's host test.
+
+Each vector is a short synthetic signal encoded with a small FLAC encoder that
+can force every subframe type, channel assignment, sample depth, and residual
+coding the decoder has a separate code path for. ``vectors/expected.txt`` lists
+the MD5 of the 16 bit interleaved samples the decoder must produce for each
+vector. The encoder is deterministic, so running this again reproduces the
+committed files.
+"""
+
+import hashlib
+import math
+import os
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+VECTOR_DIR = os.path.join(HERE, "vectors")
+
+SAMPLE_RATE = 48000
+
+CHANNELS_INDEPENDENT = None
+CHANNELS_LEFT_SIDE = 8
+CHANNELS_SIDE_RIGHT = 9
+CHANNELS_MID_SIDE = 10
+
+SAMPLE_SIZE_CODES = {8: 1, 12: 2, 16: 4, 20: 5, 24: 6}
+
+
+class BitWriter:
+    def __init__(self):
+        self.data = bytearray()
+        self.accumulator = 0
+        self.bits = 0
+
+    def write(self, value, bits):
+        if bits == 0:
+            return
+        self.accumulator = (self.accumulator << bits) | (value & ((1 << bits) - 1))
+        self.bits += bits
+        while self.bits >= 8:
+            self.bits -= 8
+            self.data.append((self.accumulator >> self.bits) & 0xFF)
+        self.accumulator &= (1 << self.bits) - 1
+
+    def write_signed(self, value, bits):
+        assert -(1 << (bits - 1)) <= value < (1 << (bits - 1)), (value, bits)
+        self.write(value, bits)
+
+    def write_unary(self, zeros):
+        for _ in range(zeros // 32):
+            self.write(0, 32)
+        self.write(1, zeros % 32 + 1)
+
+    def align(self):
+        if self.bits > 0:
+            self.write(0, 8 - self.bits)
+
+
+def crc8(data):
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc << 1) ^ 0x07 if crc & 0x80 else crc << 1
+            crc &= 0xFF
+    return crc
+
+
+def crc16(data):
+    crc = 0
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = (crc << 1) ^ 0x8005 if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def utf8_number(value):
+    if value < 0x80:
+        return bytes([value])
+    extra = 1
+    while value >= 1 << (6 + 5 * extra):
+        extra += 1
+    out = [0x80 | (value >> (6 * i) & 0x3F) for i in range(extra)][::-1]
+    first = ((0xFF00 >> (extra + 1)) & 0xFF) | (value >> (6 * extra))
+    return bytes([first] + out)
+
+
+class Random:
+    """Linear congruential generator, so the vectors don't depend on Python's
+    random module"""
+
+    def __init__(self, seed):
+        self.state = seed
+
+    def next(self):
+        self.state = (self.state * 1103515245 + 12345) & 0x7FFFFFFF
+        return self.state
+
+    def uniform(self):
+        return self.next() / 0x7FFFFFFF * 2.0 - 1.0
+
+
+def make_signal(frames, channels, bits, seed, wasted_bits=0):
+    random = Random(seed)
+    peak = (1 << (bits - 1)) - 1
+    signal = []
+    for channel in range(channels):
+        samples = []
+        frequency = 220.0 * (channel + 1)
+        for i in range(frames):
+            t = i / SAMPLE_RATE
+            value = 0.6 * math.sin(2 * math.pi * frequency * t * (1 + t))
+            value += 0.2 * math.sin(2 * math.pi * 3 * frequency * t)
+            value += 0.05 * random.uniform()
+            sample = max(-peak - 1, min(peak, int(round(value * peak))))
+            samples.append((sample >> wasted_bits) << wasted_bits)
+        signal.append(samples)
+    return signal
+
+
+def zigzag(value):
+    return (value << 1) if value >= 0 else ((-value) << 1) - 1
+
+
+def rice_parameter(residuals, limit):
+    if not residuals:
+        return 0
+    mean = sum(zigzag(r) for r in residuals) / len(residuals)
+    parameter = 0
+    while parameter < limit and (1 << (parameter + 1)) <= mean + 1:
+        parameter += 1
+    return parameter
+
+
+def write_residual(writer, residuals, block_size, order, spec):
+    method = spec.get("method", 0)
+    parameter_bits = 4 if method == 0 else 5
+    escape = (1 << parameter_bits) - 1
+    partition_order = spec.get("partition_order", 0)
+    while partition_order > 0 and (
+        block_size % (1 << partition_order) or (block_size >> partition_order) < order
+    ):
+        partition_order -= 1
+
+    writer.write(method, 2)
+    writer.write(partition_order, 4)
+    partition_samples = block_size >> partition_order
+    position = 0
+    for partition in range(1 << partition_order):
+        count = partition_samples - order if partition == 0 else partition_samples
+        values = residuals[position : position + count]
+        position += count
+        if spec.get("escape") and partition % 2 == 1:
+            bits = max(max((abs(v) for v in values), default=0).bit_length() + 1, 1)
+            writer.write(escape, parameter_bits)
+            writer.write(bits, 5)
+            for value in values:
+                writer.write_signed(value, bits)
+            continue
+        parameter = rice_parameter(values, escape - 1)
+        writer.write(parameter, parameter_bits)
+        for value in values:
+            folded = zigzag(value)
+            writer.write_unary(folded >> parameter)
+            writer.write(folded & ((1 << parameter) - 1), parameter)
+
+
+def fixed_residuals(samples, order):
+    residuals = []
+    for i in range(order, len(samples)):
+        s = samples
+        prediction = [
+            0,
+            s[i - 1],
+            2 * s[i - 1] - s[i - 2],
+            3 * s[i - 1] - 3 * s[i - 2] + s[i - 3],
+            4 * s[i - 1] - 6 * s[i - 2] + 4 * s[i - 3] - s[i - 4],
+        ][order]
+        residuals.append(s[i] - prediction)
+    return residuals
+
+
+def lpc_coefficients(samples, order, precision):
+    """Quantized LPC coefficients from the autocorrelation (Levinson-Durbin), as a
+    real encoder computes them"""
+    autocorrelation = [
+        sum(samples[i] * samples[i - lag] for i in range(lag, len(samples)))
+        for lag in range(order + 1)
+    ]
+    autocorrelation[0] = autocorrelation[0] * 1.0001 + 1
+    coefficients = [0.0] * order
+    error = autocorrelation[0]
+    for i in range(order):
+        reflection = autocorrelation[i + 1] - sum(
+            coefficients[j] * autocorrelation[i - j] for j in range(i)
+        )
+        reflection /= error
+        new = coefficients[:]
+        new[i] = reflection
+        for j in range(i):
+            new[j] = coefficients[j] - reflection * coefficients[i - 1 - j]
+        coefficients = new
+        error *= 1 - reflection * reflection
+
+    limit = (1 << (precision - 1)) - 1
+    largest = max(abs(c) for c in coefficients) or 1.0
+    shift = 0
+    while shift < 15 and largest * (1 << (shift + 1)) <= limit:
+        shift += 1
+    quantized = [
+        max(-limit - 1, min(limit, int(round(c * (1 << shift))))) for c in coefficients
+    ]
+    return quantized, shift
+
+
+def lpc_residuals(samples, coefficients, shift):
+    order = len(coefficients)
+    residuals = []
+    for i in range(order, len(samples)):
+        prediction = sum(coefficients[j] * samples[i - 1 - j] for j in range(order))
+        residuals.append(samples[i] - (prediction >> shift))
+    return residuals
+
+
+def write_subframe(writer, samples, bits, spec):
+    kind = spec["type"]
+    wasted = spec.get("wasted_bits", 0)
+    if wasted:
+        assert all(s % (1 << wasted) == 0 for s in samples)
+        samples = [s >> wasted for s in samples]
+        bits -= wasted
+
+    type_codes = {"constant": 0, "verbatim": 1}
+    if kind == "fixed":
+        type_code = 8 + spec["order"]
+    elif kind == "lpc":
+        type_code = 32 + spec["order"] - 1
+    else:
+        type_code = type_codes[kind]
+
+    writer.write(0, 1)
+    writer.write(type_code, 6)
+    if wasted:
+        writer.write(1, 1)
+        writer.write_unary(wasted - 1)
+    else:
+        writer.write(0, 1)
+
+    if kind == "constant":
+        assert all(s == samples[0] for s in samples)
+        writer.write_signed(samples[0], bits)
+    elif kind == "verbatim":
+        for sample in samples:
+            writer.write_signed(sample, bits)
+    elif kind == "fixed":
+        order = spec["order"]
+        for sample in samples[:order]:
+            writer.write_signed(sample, bits)
+        residuals = fixed_residuals(samples, order)
+        write_residual(writer, residuals, len(samples), order, spec)
+    else:
+        order = spec["order"]
+        precision = spec.get("precision", 12)
+        coefficients, shift = lpc_coefficients(samples, order, precision)
+        for sample in samples[:order]:
+            writer.write_signed(sample, bits)
+        writer.write(precision - 1, 4)
+        writer.write_signed(shift, 5)
+        for coefficient in coefficients:
+            writer.write_signed(coefficient, precision)
+        residuals = lpc_residuals(samples, coefficients, shift)
+        write_residual(writer, residuals, len(samples), order, spec)
+
+
+def encode_frame(
+    frame_number, channels, bits, assignment, subframe_specs, explicit_sample_size
+):
+    block_size = len(channels[0])
+    if assignment is None:
+        coded = channels
+        channel_code = len(channels) - 1
+        side_channel = None
+    else:
+        left, right = channels
+        side = [l - r for l, r in zip(left, right)]
+        if assignment == CHANNELS_LEFT_SIDE:
+            coded, side_channel = [left, side], 1
+        elif assignment == CHANNELS_SIDE_RIGHT:
+            coded, side_channel = [side, right], 0
+        else:
+            coded, side_channel = [[(l + r) >> 1 for l, r in zip(left, right)], side], 1
+        channel_code = assignment
+
+    header = BitWriter()
+    header.write(0xFFF8, 16)
+    header.write(7, 4)  # 16 bit block size at the end of the header
+    header.write(0, 4)  # Sample rate from STREAMINFO
+    header.write(channel_code, 4)
+    header.write(SAMPLE_SIZE_CODES[bits] if explicit_sample_size else 0, 3)
+    header.write(0, 1)
+    for byte in utf8_number(frame_number):
+        header.write(byte, 8)
+    header.write(block_size - 1, 16)
+    header.write(crc8(header.data), 8)
+
+    writer = header
+    for index, samples in enumerate(coded):
+        channel_bits = bits + 1 if index == side_channel else bits
+        spec = dict(subframe_specs[index % len(subframe_specs)])
+        if spec["type"] == "constant" and any(s != samples[0] for s in samples):
+            spec = {"type": "verbatim"}
+        write_subframe(writer, samples, channel_bits, spec)
+    writer.align()
+    writer.write(crc16(writer.data), 16)
+    return bytes(writer.data)
+
+
+def stream_info(block_size, channels, bits, total_samples, md5):
+    writer = BitWriter()
+    writer.write(block_size, 16)
+    writer.write(block_size, 16)
+    writer.write(0, 24)
+    writer.write(0, 24)
+    writer.write(SAMPLE_RATE, 20)
+    writer.write(channels - 1, 3)
+    writer.write(bits - 1, 5)
+    writer.write(total_samples, 36)
+    return bytes(writer.data) + md5
+
+
+def original_md5(signal, bits):
+    """MD5 of the samples at their own depth, as stored in STREAMINFO"""
+    bytes_per_sample = (bits + 7) // 8
+    data = bytearray()
+    for i in range(len(signal[0])):
+        for channel in signal:
+            sample = channel[i] & ((1 << (8 * bytes_per_sample)) - 1)
+            data += sample.to_bytes(bytes_per_sample, "little")
+    return hashlib.md5(data).digest()
+
+
+def expected_output_md5(signal, bits):
+    """MD5 of the interleaved 16 bit samples the decoder outputs"""
+    data = bytearray()
+    shift = bits - 16
+    for i in range(len(signal[0])):
+        for channel in signal:
+            sample = channel[i] >> shift if shift >= 0 else channel[i] << -shift
+            data += (sample & 0xFFFF).to_bytes(2, "little")
+    return hashlib.md5(data).hexdigest()
+
+
+def encode_vector(spec):
+    channels = spec["channels"]
+    bits = spec["bits"]
+    block_size = spec.get("block_size", 1024)
+    frames = spec.get("frames", 3 * block_size + block_size // 2)
+    wasted_bits = spec.get("wasted_bits", 0)
+    signal = make_signal(frames, channels, bits, spec["seed"], wasted_bits)
+    if spec.get("silent_block"):
+        for channel in signal:
+            channel[:block_size] = [0] * block_size
+
+    data = bytearray(b"fLaC")
+    info = stream_info(block_size, channels, bits, frames, original_md5(signal, bits))
+    if spec.get("extra_metadata"):
+        data += bytes([0, 0, 0, len(info)]) + info
+        # PADDING and APPLICATION blocks the decoder has to skip
+        data += bytes([1, 0, 0, 40]) + bytes(40)
+        data += bytes([0x82, 0, 0, 12]) + b"test" + bytes(range(8))
+    else:
+        data += bytes([0x80, 0, 0, len(info)]) + info
+
+    subframe_rotation = spec["subframes"]
+    for frame_number, start in enumerate(range(0, frames, block_size)):
+        block = [channel[start : start + block_size] for channel in signal]
+        specs = subframe_rotation[frame_number % len(subframe_rotation)]
+        data += encode_frame(
+            frame_number,
+            block,
+            bits,
+            spec.get("assignment"),
+            specs,
+            spec.get("explicit_sample_size", False),
+        )
+    return bytes(data), expected_output_md5(signal, bits)
+
+
+def lpc(order, **extra):
+    return {"type": "lpc", "order": order, **extra}
+
+
+def fixed(order, **extra):
+    return {"type": "fixed", "order": order, **extra}
+
+
+VECTORS = {
+    "mono16_fixed": {
+        "channels": 1,
+        "bits": 16,
+        "seed": 1,
+        "silent_block": True,
+        "subframes": [
+            [{"type": "constant"}],
+            [{"type": "verbatim"}],
+            [fixed(0)],
+            [fixed(1)],
+            [fixed(2)],
+            [fixed(3)],
+            [fixed(4)],
+        ],
+        "frames": 7 * 1024 - 100,
+    },
+    "mono16_lpc_unrolled": {
+        "channels": 1,
+        "bits": 16,
+        "seed": 2,
+        "block_size": 576,
+        "subframes": [[lpc(order, partition_order=2)] for order in range(1, 13)],
+        "frames": 12 * 576,
+    },
+    "mono16_lpc_generic": {
+        "channels": 1,
+        "bits": 16,
+        "seed": 3,
+        "subframes": [
+            [lpc(order, partition_order=3)] for order in (13, 16, 20, 24, 28, 32)
+        ],
+        "frames": 6 * 1024,
+    },
+    "mono24_lpc_wide": {
+        "channels": 1,
+        "bits": 24,
+        "seed": 4,
+        "subframes": [[lpc(order, precision=15)] for order in (4, 8, 12, 32)],
+    },
+    "mono16_residual_coding": {
+        "channels": 1,
+        "bits": 16,
+        "seed": 5,
+        "subframes": [
+            [fixed(2, partition_order=4, escape=True)],
+            [lpc(8, method=1, partition_order=3)],
+            [fixed(1, method=1, partition_order=5, escape=True)],
+        ],
+    },
+    "mono16_wasted_bits": {
+        "channels": 1,
+        "bits": 16,
+        "seed": 6,
+        "wasted_bits": 3,
+        "subframes": [
+            [fixed(2, wasted_bits=3)],
+            [lpc(6, wasted_bits=3)],
+            [{"type": "verbatim", "wasted_bits": 3}],
+        ],
+    },
+    "mono8": {"channels": 1, "bits": 8, "seed": 7, "subframes": [[fixed(2)], [lpc(4)]]},
+    "mono12_explicit_size": {
+        "channels": 1,
+        "bits": 12,
+        "seed": 8,
+        "explicit_sample_size": True,
+        "extra_metadata": True,
+        "subframes": [[lpc(5)], [fixed(3)]],
+    },
+    "stereo16_independent": {
+        "channels": 2,
+        "bits": 16,
+        "seed": 9,
+        "subframes": [[lpc(8), fixed(2)], [fixed(1), lpc(10)]],
+    },
+    "stereo16_left_side": {
+        "channels": 2,
+        "bits": 16,
+        "seed": 10,
+        "assignment": CHANNELS_LEFT_SIDE,
+        "subframes": [[lpc(8), lpc(8)], [fixed(2), {"type": "verbatim"}]],
+    },
+    "stereo16_side_right": {
+        "channels": 2,
+        "bits": 16,
+        "seed": 11,
+        "assignment": CHANNELS_SIDE_RIGHT,
+        "subframes": [[lpc(12), fixed(3)], [lpc(16), lpc(2)]],
+    },
+    "stereo16_mid_side": {
+        "channels": 2,
+        "bits": 16,
+        "seed": 12,
+        "assignment": CHANNELS_MID_SIDE,
+        "subframes": [[lpc(8), lpc(8)], [fixed(4), lpc(32)]],
+    },
+    "stereo20_mid_side": {
+        "channels": 2,
+        "bits": 20,
+        "seed": 13,
+        "assignment": CHANNELS_MID_SIDE,
+        "explicit_sample_size": True,
+        "subframes": [[lpc(8, precision=14), lpc(8)], [fixed(2), fixed(2)]],
+    },
+    "stereo24_left_side": {
+        "channels": 2,
+        "bits": 24,
+        "seed": 14,
+        "assignment": CHANNELS_LEFT_SIDE,
+        "subframes": [
+            [lpc(12, precision=15), lpc(12, precision=15)],
+            [fixed(3), lpc(24)],
+        ],
+    },
+    "surround6_16": {
+        "channels": 6,
+        "bits": 16,
+        "seed": 15,
+        "block_size": 256,
+        "subframes": [
+            [fixed(0), fixed(1), fixed(2), lpc(3), lpc(7), {"type": "verbatim"}]
+        ],
+    },
+}
+
+
+def main():
+    os.makedirs(VECTOR_DIR, exist_ok=True)
+    lines = []
+    for name, spec in VECTORS.items():
+        data, md5 = encode_vector(spec)
+        with open(os.path.join(VECTOR_DIR, name + ".flac"), "wb") as file:
+            file.write(data)
+        lines.append(f"{name}.flac {md5}")
+    with open(os.path.join(VECTOR_DIR, "expected.txt"), "w") as file:
+        file.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
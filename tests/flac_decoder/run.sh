@@ -0,0 +1,13 @@
+#!/bin/bash
+# Builds the FLAC decoder host test and runs it on the reference vectors and the device's sounds.
+# Pass --benchmark to report the decoding speed instead.
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+ROOT="$(cd "$HERE/../.." && pwd)"
+BUILD="${BUILD_DIR:-$HERE/build}"
+
+mkdir -p "$BUILD"
+${CXX:-g++} -std=gnu++17 -O2 -Wall -DUSE_ESP_IDF -I"$HERE/stubs" -I"$ROOT" \
+  "$HERE/flac_decoder_test.cpp" -o "$BUILD/flac_decoder_test"
+"$BUILD/flac_decoder_test" "$@" "$HERE/vectors" "$ROOT/sounds"
@@ -0,0 +1,25 @@
+#pragma once
+
+// Host stand-in for the part of ESPHome's helpers.h the FLAC decoder uses
+
+#include <cstddef>
+#include <cstdlib>
+
+namespace esphome {
+
+template<class T> class ExternalRAMAllocator {
+ public:
+  enum Flags {
+    NONE = 0,
+    REFUSE_INTERNAL = 1 << 0,
+    ALLOW_FAILURE = 1 << 1,
+  };
+
+  ExternalRAMAllocator() = default;
+  ExternalRAMAllocator(Flags flags) {}
+
+  T *allocate(size_t n) { return static_cast<T *>(malloc(n * sizeof(T))); }
+  void deallocate(T *p, size_t n) { free(p); }
+};
+
+}  // namespace esphome
@@ -0,0 +1,12 @@
+#!/bin/bash
+# Builds the sample kernel host test and runs it. The esp-dsp functions are stood in for by plain loops.
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+ROOT="$(cd "$HERE/../.." && pwd)"
+BUILD="${BUILD_DIR:-$HERE/build}"
+
+mkdir -p "$BUILD"
+${CXX:-g++} -std=gnu++17 -O2 -Wall -DUSE_ESP_IDF -I"$HERE/stubs" -I"$ROOT" \
+  "$HERE/sample_kernels_test.cpp" -o "$BUILD/sample_kernels_test"
+"$BUILD/sample_kernels_test"
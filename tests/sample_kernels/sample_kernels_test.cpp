@@ -0,0 +1,160 @@
+// Host test for the nabu sample kernels. Runs the gain and mixing kernels on the same audio as 16 bit, 32 bit, and
+// float samples and checks that they agree, that mixing never wraps around, and that the format conversions round trip
+// and saturate.
+//
+// Usage: sample_kernels_test
+
+#include "esphome/components/nabu/sample_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using esphome::nabu::convert_samples;
+using esphome::nabu::mix_samples_without_clipping;
+using esphome::nabu::mono_to_stereo;
+using esphome::nabu::SampleTraits;
+using esphome::nabu::scale_samples;
+
+namespace {
+
+static const size_t SAMPLES = 4096;
+
+int failures = 0;
+
+void check(bool condition, const char *name) {
+  printf("%s %s\n", condition ? "ok  " : "FAIL", name);
+  if (!condition) {
+    ++failures;
+  }
+}
+
+// Random 16 bit samples; loud ones make mixing clip, so the media has to be scaled
+std::vector<int16_t> make_samples(uint32_t seed, int amplitude) {
+  std::mt19937 generator(seed);
+  std::uniform_int_distribution<int> distribution(-amplitude, amplitude);
+  std::vector<int16_t> samples(SAMPLES);
+  for (auto &sample : samples) {
+    sample = static_cast<int16_t>(distribution(generator));
+  }
+  return samples;
+}
+
+template<typename T> std::vector<T> convert(const std::vector<int16_t> &samples) {
+  std::vector<T> converted(samples.size());
+  convert_samples(samples.data(), converted.data(), samples.size());
+  return converted;
+}
+
+// Largest difference between the 16 bit samples and the other format's samples narrowed to 16 bits
+template<typename T> int max_difference(const std::vector<int16_t> &reference, const std::vector<T> &samples) {
+  std::vector<int16_t> narrowed(samples.size());
+  convert_samples(samples.data(), narrowed.data(), samples.size());
+  int difference = 0;
+  for (size_t i = 0; i < reference.size(); ++i) {
+    difference = std::max(difference, std::abs(static_cast<int>(reference[i]) - narrowed[i]));
+  }
+  return difference;
+}
+
+// Mixes the samples in format T and checks that no sample wrapped around: scaling the media down only ever moves the
+// mix towards the announcement, so each mixed sample is within the media sample's magnitude of the announcement
+template<typename T>
+bool mix_without_wrapping(const std::vector<int16_t> &media, const std::vector<int16_t> &announcement,
+                          std::vector<T> &mixed) {
+  std::vector<T> media_samples = convert<T>(media);
+  std::vector<T> announcement_samples = convert<T>(announcement);
+  const std::vector<T> original_media = media_samples;
+  mixed.assign(media.size(), 0);
+  mix_samples_without_clipping(media_samples.data(), announcement_samples.data(), mixed.data(), mixed.size());
+
+  using Wide = typename SampleTraits<T>::Wide;
+  for (size_t i = 0; i < mixed.size(); ++i) {
+    Wide offset = static_cast<Wide>(mixed[i]) - static_cast<Wide>(announcement_samples[i]);
+    if ((std::abs(offset) > std::abs(static_cast<Wide>(original_media[i]))) ||
+        (static_cast<Wide>(mixed[i]) > SampleTraits<T>::MAX) || (static_cast<Wide>(mixed[i]) < SampleTraits<T>::MIN)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main() {
+  const std::vector<int16_t> quiet = make_samples(1, 8000);
+  const std::vector<int16_t> loud = make_samples(2, INT16_MAX);
+  const std::vector<int16_t> announcement = make_samples(3, 30000);
+
+  // Conversions
+  check(max_difference(quiet, convert<int32_t>(quiet)) == 0, "16 bit samples round trip through 32 bit samples");
+  check(max_difference(loud, convert<float>(loud)) == 0, "16 bit samples round trip through float samples");
+  {
+    std::vector<int32_t> wide(SAMPLES);
+    std::mt19937 generator(4);
+    for (auto &sample : wide) {
+      sample = static_cast<int32_t>(generator());
+    }
+    std::vector<float> floats(SAMPLES);
+    std::vector<int32_t> round_trip(SAMPLES);
+    convert_samples(wide.data(), floats.data(), SAMPLES);
+    convert_samples(floats.data(), round_trip.data(), SAMPLES);
+    bool close = true;
+    for (size_t i = 0; i < SAMPLES; ++i) {
+      // A float holds 24 bits of the sample
+      close = close && (std::llabs(static_cast<int64_t>(wide[i]) - round_trip[i]) <= 128);
+    }
+    check(close, "32 bit samples round trip through float samples to 24 bits");
+  }
+  {
+    const float out_of_range[] = {1.0f, 1.5f, -1.0f, -1.5f};
+    int16_t narrow[4];
+    int32_t wide[4];
+    convert_samples(out_of_range, narrow, 4);
+    convert_samples(out_of_range, wide, 4);
+    check((narrow[0] == INT16_MAX) && (narrow[1] == INT16_MAX) && (narrow[2] == INT16_MIN) &&
+              (narrow[3] == INT16_MIN) && (wide[0] == INT32_MAX) && (wide[1] == INT32_MAX) &&
+              (wide[2] == INT32_MIN) && (wide[3] == INT32_MIN),
+          "float samples saturate when narrowed");
+  }
+  {
+    std::vector<int32_t> samples = {1, -2, 3, 0, 0, 0};
+    mono_to_stereo(samples.data(), 3);
+    check(samples == std::vector<int32_t>({1, 1, -2, -2, 3, 3}), "mono samples are duplicated into stereo frames");
+  }
+
+  // Gains; Q15 gains are shared by every format
+  for (int16_t gain : {static_cast<int16_t>(32767), static_cast<int16_t>(20665), static_cast<int16_t>(103)}) {
+    std::vector<int16_t> narrow = loud;
+    std::vector<int32_t> wide = convert<int32_t>(loud);
+    std::vector<float> floats = convert<float>(loud);
+    scale_samples(narrow.data(), narrow.data(), gain, SAMPLES);
+    scale_samples(wide.data(), wide.data(), gain, SAMPLES);
+    scale_samples(floats.data(), floats.data(), gain, SAMPLES);
+    // The wider formats round down once instead of truncating the 16 bit product
+    check((max_difference(narrow, wide) <= 1) && (max_difference(narrow, floats) <= 1),
+          "a Q15 gain scales every format alike");
+  }
+
+  // Mixing
+  for (const auto *media : {&quiet, &loud}) {
+    const char *level = (media == &quiet) ? "quiet" : "loud";
+    std::vector<int16_t> narrow;
+    std::vector<int32_t> wide;
+    std::vector<float> floats;
+    bool wrapped = !mix_without_wrapping(*media, announcement, narrow) ||
+                   !mix_without_wrapping(*media, announcement, wide) ||
+                   !mix_without_wrapping(*media, announcement, floats);
+    std::string name = std::string("mixing ") + level + " media never wraps around";
+    check(!wrapped, name.c_str());
+    // The formats pick the same scaling factor up to rounding at the clipping threshold
+    name = std::string("mixing ") + level + " media agrees across formats";
+    check((max_difference(narrow, wide) <= 2) && (max_difference(narrow, floats) <= 2), name.c_str());
+  }
+
+  return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// Host versions of the esp-dsp functions the sample kernels use, with the same fixed point rounding as the ANSI C
+// implementations
+
+#include <cstdint>
+
+inline int dsps_mulc_s16(const int16_t *input, int16_t *output, int len, int16_t C, int step_in, int step_out) {
+  for (int i = 0; i < len; ++i) {
+    int32_t product = static_cast<int32_t>(input[i * step_in]) * C;
+    output[i * step_out] = static_cast<int16_t>(product >> 15);
+  }
+  return 0;
+}
+
+inline int dsps_add_s16(const int16_t *input1, const int16_t *input2, int16_t *output, int len, int step1, int step2,
+                        int step_out, int shift) {
+  for (int i = 0; i < len; ++i) {
+    int32_t sum = static_cast<int32_t>(input1[i * step1]) + static_cast<int32_t>(input2[i * step2]);
+    output[i * step_out] = static_cast<int16_t>(sum >> shift);
+  }
+  return 0;
+}